@@ -0,0 +1,107 @@
+#!/bin/sh
+#
+# Settings and functions shared by the benchmark scripts, see bench/run.sh.
+# This file is sourced, not executed.
+#
+# All the scripts emit CSV rows with the following columns:
+#
+#   version       pg_anonymize version or git commit being benchmarked
+#   server        server_version_num of the benchmarked server
+#   scenario      benchmark scenario, i.e. the script name
+#   params        scenario parameters, as semicolon separated key=value pairs
+#   mode          unloaded, not_anonymized, disabled or anonymized
+#   clients       number of concurrent clients
+#   tps           transactions (or COPY) per second
+#   latency_ms    average latency in milliseconds
+#   rows_per_sec  rows emitted per second, for COPY only
+
+set -e
+
+DURATION=${1:-${BENCH_DURATION:-10}}
+CLIENTS=${2:-${BENCH_CLIENTS:-1}}
+PSQL=${PSQL:-psql}
+PGBENCH=${PGBENCH:-pgbench}
+
+if [ -z "$PGAN_VERSION" ]; then
+    PGAN_VERSION=$(git -C "$(dirname "$0")" describe --always --dirty \
+        2>/dev/null || echo "unknown")
+fi
+
+WORKDIR=$(mktemp -d)
+trap 'rm -rf "$WORKDIR"' EXIT
+
+bench_psql() {
+    $PSQL -X -q -v ON_ERROR_STOP=1 "$@"
+}
+
+SERVER_VERSION=$(bench_psql -A -t -c "SHOW server_version_num")
+
+# Print the CSV header, unless the driver already did.
+bench_header() {
+    if [ -z "$PGAN_BENCH_NOHEADER" ]; then
+        echo "version,server,scenario,params,mode,clients,tps,latency_ms,rows_per_sec"
+    fi
+}
+
+# Create the roles used by the benchmarks: pgan_bench is anonymized and
+# pgan_bench_plain isn't.
+bench_create_roles() {
+    bench_psql <<EOSQL
+LOAD 'pg_anonymize';
+DROP ROLE IF EXISTS pgan_bench;
+DROP ROLE IF EXISTS pgan_bench_plain;
+CREATE ROLE pgan_bench;
+CREATE ROLE pgan_bench_plain;
+SECURITY LABEL FOR pg_anonymize ON ROLE pgan_bench IS 'anonymize';
+EOSQL
+}
+
+bench_drop_roles() {
+    bench_psql <<EOSQL
+DROP ROLE pgan_bench;
+DROP ROLE pgan_bench_plain;
+EOSQL
+}
+
+# Print the PGOPTIONS to use for the given mode:
+#   unloaded         pg_anonymize isn't loaded
+#   not_anonymized   pg_anonymize is loaded, the role isn't anonymized
+#   disabled         the role is anonymized, but pg_anonymize.enabled is off
+#   anonymized       the role is anonymized
+bench_options() {
+    case "$1" in
+        unloaded)
+            echo "-c role=pgan_bench_plain";;
+        not_anonymized)
+            echo "-c session_preload_libraries=pg_anonymize -c role=pgan_bench_plain";;
+        disabled)
+            echo "-c session_preload_libraries=pg_anonymize -c role=pgan_bench -c pg_anonymize.enabled=off";;
+        anonymized)
+            echo "-c session_preload_libraries=pg_anonymize -c role=pgan_bench";;
+        *)
+            echo "unknown mode $1" >&2
+            exit 1;;
+    esac
+}
+
+# Run the given pgbench script and emit the CSV row.
+#
+# Usage: bench_pgbench <scenario> <params> <mode> <script> [pgbench options]
+bench_pgbench() {
+    scenario=$1
+    params=$2
+    mode=$3
+    script=$4
+    shift 4
+
+    if ! out=$(PGOPTIONS="$(bench_options "$mode")" \
+        $PGBENCH -n -M simple -c "$CLIENTS" -j "$CLIENTS" -T "$DURATION" \
+        "$@" -f "$script" 2>&1); then
+        echo "$out" >&2
+        exit 1
+    fi
+
+    latency=$(echo "$out" | sed -n 's/^latency average = \([0-9.]*\) ms$/\1/p')
+    tps=$(echo "$out" | sed -n 's/^tps = \([0-9.]*\) .*$/\1/p' | head -n 1)
+    echo "$PGAN_VERSION,$SERVER_VERSION,$scenario,$params,$mode,$CLIENTS,$tps,$latency,"
+}
@@ -0,0 +1,141 @@
+#!/bin/sh
+#
+# Measure the throughput of anonymized COPY TO, for a table having cheap
+# security labels and for a table having expensive ones (regular expressions
+# on wide text columns).  The COPY of the first table by a role that isn't
+# anonymized is measured too for reference.  As of PostgreSQL 14, the COPY of
+# the anonymization query, used when pg_anonymize.copy_direct is disabled, is
+# also measured.
+#
+# Usage: bench/copy.sh
+#
+# Each measure runs BENCH_COPY_LOOPS (default 10) COPY TO STDOUT of a table
+# having BENCH_COPY_ROWS (default 100000) rows in a single session, discarding
+# the output.
+#
+# If BENCH_EXPORT_DIR is set to a directory writable by the server, the
+# parallel export of the expensive table with pg_anonymize_export() is
+# measured too, with each number of workers of BENCH_EXPORT_WORKERS (default
+# "1 2 4").  The exported files are left in that directory.
+#
+# The usual libpq environment variables (PGHOST, PGPORT, PGDATABASE...) are
+# used to connect, and the connecting role must be a superuser.
+
+. "$(dirname "$0")/common.sh"
+
+ROWS=${BENCH_COPY_ROWS:-100000}
+LOOPS=${BENCH_COPY_LOOPS:-10}
+EXPORT_WORKERS=${BENCH_EXPORT_WORKERS:-"1 2 4"}
+
+bench_create_roles
+
+bench_psql <<EOF
+LOAD 'pg_anonymize';
+DROP TABLE IF EXISTS public.pgan_bench_copy_cheap;
+DROP TABLE IF EXISTS public.pgan_bench_copy_expensive;
+CREATE TABLE public.pgan_bench_copy_cheap(id integer, first_name text,
+    last_name text, payload text);
+INSERT INTO public.pgan_bench_copy_cheap
+    SELECT i, 'first ' || i, 'last ' || i, repeat(md5(i::text), 8)
+    FROM generate_series(1, $ROWS) i;
+CREATE TABLE public.pgan_bench_copy_expensive
+    AS SELECT * FROM public.pgan_bench_copy_cheap;
+VACUUM ANALYZE public.pgan_bench_copy_cheap;
+VACUUM ANALYZE public.pgan_bench_copy_expensive;
+SECURITY LABEL FOR pg_anonymize
+    ON COLUMN public.pgan_bench_copy_cheap.last_name IS \$l\$'*****'::text\$l\$;
+SECURITY LABEL FOR pg_anonymize
+    ON COLUMN public.pgan_bench_copy_cheap.payload IS \$l\$'x'::text\$l\$;
+SECURITY LABEL FOR pg_anonymize
+    ON COLUMN public.pgan_bench_copy_expensive.last_name
+    IS \$l\$regexp_replace(last_name, '[a-z]', 'x', 'g')\$l\$;
+SECURITY LABEL FOR pg_anonymize
+    ON COLUMN public.pgan_bench_copy_expensive.payload
+    IS \$l\$regexp_replace(payload, '[0-9]', '#', 'g')\$l\$;
+GRANT SELECT ON public.pgan_bench_copy_cheap TO pgan_bench, pgan_bench_plain;
+GRANT SELECT ON public.pgan_bench_copy_expensive TO pgan_bench;
+EOF
+
+# Run LOOPS COPY of the given table in a single session and emit the CSV row.
+#
+# Usage: bench_copy <label> <mode> <table> [extra options]
+bench_copy() {
+    script="$WORKDIR/copy.sql"
+    : > "$script"
+    i=0
+    while [ $i -lt "$LOOPS" ]; do
+        echo "COPY public.$3 TO STDOUT;" >> "$script"
+        i=$((i + 1))
+    done
+
+    start=$(date +%s.%N)
+    PGOPTIONS="$(bench_options "$2") $4" bench_psql -f "$script" > /dev/null
+    end=$(date +%s.%N)
+
+    awk -v start="$start" -v end="$end" -v loops="$LOOPS" -v rows="$ROWS" \
+        -v prefix="$PGAN_VERSION,$SERVER_VERSION,copy,label=$1;rows=$ROWS,$2,1" \
+        'BEGIN {
+            elapsed = end - start
+            printf "%s,%f,%f,%f\n", prefix, loops / elapsed,
+                elapsed * 1000 / loops, loops * rows / elapsed
+        }'
+}
+
+# Run LOOPS parallel exports of the given table in a single session and emit
+# the CSV row.
+#
+# Usage: bench_export <label> <workers> <table>
+bench_export() {
+    script="$WORKDIR/export.sql"
+    : > "$script"
+    i=0
+    while [ $i -lt "$LOOPS" ]; do
+        echo "SELECT count(*) FROM public.pg_anonymize_export('public.$3', '$BENCH_EXPORT_DIR/$3', $2);" >> "$script"
+        i=$((i + 1))
+    done
+
+    start=$(date +%s.%N)
+    bench_psql -f "$script" > /dev/null
+    end=$(date +%s.%N)
+
+    awk -v start="$start" -v end="$end" -v loops="$LOOPS" -v rows="$ROWS" \
+        -v prefix="$PGAN_VERSION,$SERVER_VERSION,copy,label=$1;rows=$ROWS;export_workers=$2,anonymized,1" \
+        'BEGIN {
+            elapsed = end - start
+            printf "%s,%f,%f,%f\n", prefix, loops / elapsed,
+                elapsed * 1000 / loops, loops * rows / elapsed
+        }'
+}
+
+bench_header
+
+bench_copy cheap not_anonymized pgan_bench_copy_cheap
+bench_copy cheap anonymized pgan_bench_copy_cheap
+bench_copy expensive anonymized pgan_bench_copy_expensive
+if [ "$SERVER_VERSION" -ge 140000 ]; then
+    bench_copy "cheap;copy_direct=off" anonymized pgan_bench_copy_cheap \
+        "-c pg_anonymize.copy_direct=off"
+    bench_copy "expensive;copy_direct=off" anonymized \
+        pgan_bench_copy_expensive "-c pg_anonymize.copy_direct=off"
+fi
+
+if [ -n "$BENCH_EXPORT_DIR" ]; then
+    has_pgan=$(bench_psql -A -t -c "SELECT count(*) FROM pg_extension
+        WHERE extname = 'pg_anonymize'")
+    bench_psql -c "CREATE EXTENSION IF NOT EXISTS pg_anonymize"
+
+    for workers in $EXPORT_WORKERS; do
+        bench_export expensive "$workers" pgan_bench_copy_expensive
+    done
+
+    if [ "$has_pgan" = "0" ]; then
+        bench_psql -c "DROP EXTENSION pg_anonymize"
+    fi
+fi
+
+bench_psql <<EOF
+DROP TABLE public.pgan_bench_copy_cheap;
+DROP TABLE public.pgan_bench_copy_expensive;
+EOF
+
+bench_drop_roles
@@ -0,0 +1,42 @@
+#!/bin/sh
+#
+# Measure the overhead of pg_anonymize for roles that aren't anonymized, which
+# should only pay for a cache lookup per query, compared to pg_anonymize not
+# being loaded at all.  The anonymized case is measured too for reference.
+#
+# Usage: bench/fastpath.sh [duration in seconds] [clients]
+#
+# The usual libpq environment variables (PGHOST, PGPORT, PGDATABASE...) are
+# used to connect, and the connecting role must be a superuser.
+
+. "$(dirname "$0")/common.sh"
+
+bench_create_roles
+
+bench_psql <<EOF2
+LOAD 'pg_anonymize';
+DROP TABLE IF EXISTS public.pgan_bench_fastpath;
+CREATE TABLE public.pgan_bench_fastpath(id integer PRIMARY KEY,
+    first_name text, last_name text, phone text);
+INSERT INTO public.pgan_bench_fastpath
+    SELECT i, 'first ' || i, 'last ' || i, '+886 1234 ' || i
+    FROM generate_series(1, 10000) i;
+VACUUM ANALYZE public.pgan_bench_fastpath;
+SECURITY LABEL FOR pg_anonymize ON COLUMN public.pgan_bench_fastpath.last_name
+    IS \$l\$substr(last_name, 1, 1) || '*****'\$l\$;
+GRANT SELECT ON public.pgan_bench_fastpath TO pgan_bench, pgan_bench_plain;
+EOF2
+
+cat > "$WORKDIR/fastpath.sql" <<EOF2
+\\set id random(1, 10000)
+SELECT * FROM public.pgan_bench_fastpath WHERE id = :id;
+EOF2
+
+bench_header
+
+for mode in unloaded not_anonymized anonymized; do
+    bench_pgbench fastpath "tables=1" "$mode" "$WORKDIR/fastpath.sql"
+done
+
+bench_psql -c "DROP TABLE public.pgan_bench_fastpath"
+bench_drop_roles
@@ -0,0 +1,125 @@
+#!/bin/sh
+#
+# Measure the throughput of the pseudonymization, fake data and
+# format-preserving encryption functions compared to the SQL-level
+# alternatives they replace, evaluated on a column of formatted card numbers.
+# The plain column is measured too for reference.  The pgcrypto alternatives
+# are only measured if pgcrypto is available, and the format-preserving
+# encryption only if pg_anonymize was built with OpenSSL.
+#
+# Usage: bench/functions.sh
+#
+# Each measure runs BENCH_FUNCTIONS_LOOPS (default 5) queries evaluating the
+# function on all the BENCH_FUNCTIONS_ROWS (default 1000000) rows of a table
+# in a single session.
+#
+# The usual libpq environment variables (PGHOST, PGPORT, PGDATABASE...) are
+# used to connect, and the connecting role must be a superuser.  The
+# pg_anonymize extension, and pgcrypto if available, are created if needed
+# and dropped afterwards.
+
+. "$(dirname "$0")/common.sh"
+
+ROWS=${BENCH_FUNCTIONS_ROWS:-1000000}
+LOOPS=${BENCH_FUNCTIONS_LOOPS:-5}
+
+OPTIONS="-c session_preload_libraries=pg_anonymize"
+OPTIONS="$OPTIONS -c pg_anonymize.pseudonym_key=000102030405060708090a0b0c0d0e0f"
+OPTIONS="$OPTIONS -c pg_anonymize.encryption_key=2b7e151628aed2a6abf7158809cf4f3c"
+
+has_pgan=$(bench_psql -A -t -c "SELECT count(*) FROM pg_extension
+    WHERE extname = 'pg_anonymize'")
+has_pgcrypto=$(bench_psql -A -t -c "SELECT count(*) FROM pg_extension
+    WHERE extname = 'pgcrypto'")
+avail_pgcrypto=$(bench_psql -A -t -c "SELECT count(*)
+    FROM pg_available_extensions WHERE name = 'pgcrypto'")
+
+bench_psql <<EOF
+CREATE EXTENSION IF NOT EXISTS pg_anonymize;
+DROP TABLE IF EXISTS public.pgan_bench_functions;
+CREATE TABLE public.pgan_bench_functions(id bigint, card text);
+INSERT INTO public.pgan_bench_functions
+    SELECT i, rtrim(regexp_replace('4' || lpad(i::text, 15, '0'),
+        '(\\d{4})', '\\1 ', 'g'))
+    FROM generate_series(1, $ROWS) i;
+DROP TABLE IF EXISTS public.pgan_bench_names;
+CREATE TABLE public.pgan_bench_names(id integer PRIMARY KEY, name text);
+INSERT INTO public.pgan_bench_names
+    SELECT i, 'name ' || i FROM generate_series(0, 199) i;
+VACUUM ANALYZE public.pgan_bench_functions, public.pgan_bench_names;
+EOF
+
+if [ "$has_pgcrypto" = "0" ] && [ "$avail_pgcrypto" != "0" ]; then
+    bench_psql -c "CREATE EXTENSION pgcrypto"
+fi
+
+# Run LOOPS queries evaluating the given expression and emit the CSV row.
+#
+# Usage: bench_function <label> <expression>
+bench_function() {
+    script="$WORKDIR/functions.sql"
+    : > "$script"
+    i=0
+    while [ $i -lt "$LOOPS" ]; do
+        printf 'SELECT count(%s) FROM public.pgan_bench_functions;\n' "$2" \
+            >> "$script"
+        i=$((i + 1))
+    done
+
+    start=$(date +%s.%N)
+    PGOPTIONS="$OPTIONS" bench_psql -f "$script" > /dev/null
+    end=$(date +%s.%N)
+
+    awk -v start="$start" -v end="$end" -v loops="$LOOPS" -v rows="$ROWS" \
+        -v prefix="$PGAN_VERSION,$SERVER_VERSION,functions,function=$1;rows=$ROWS,not_anonymized,1" \
+        'BEGIN {
+            elapsed = end - start
+            printf "%s,%f,%f,%f\n", prefix, loops / elapsed,
+                elapsed * 1000 / loops, loops * rows / elapsed
+        }'
+}
+
+# Check whether the given expression can be evaluated.
+bench_can_eval() {
+    PGOPTIONS="$OPTIONS" bench_psql -c "SELECT $1" > /dev/null 2>&1
+}
+
+bench_header
+
+bench_function none "card"
+
+# Pseudonymization
+bench_function pseudonym "public.pg_anonymize_pseudonym(card)"
+bench_function pseudonym_text "public.pg_anonymize_pseudonym_text(card)"
+bench_function sql_md5 "md5('secret' || card)"
+if bench_can_eval "sha256('')"; then
+    bench_function sql_sha256 \
+        "encode(sha256(convert_to('secret' || card, 'UTF8')), 'hex')"
+fi
+if bench_can_eval "public.hmac('', '', 'sha256')"; then
+    bench_function pgcrypto_hmac \
+        "encode(public.hmac(card, 'secret', 'sha256'), 'hex')"
+fi
+
+# Fake data, the alternative being a lookup in a dictionary table
+bench_function fake_first_name "public.pg_anonymize_fake_first_name(card)"
+bench_function sql_dictionary \
+    "(SELECT name FROM public.pgan_bench_names WHERE id = abs(hashtext(card) % 200))"
+
+# Format-preserving encryption
+if bench_can_eval "public.pg_anonymize_fpe_encrypt('123456')"; then
+    bench_function fpe_encrypt "public.pg_anonymize_fpe_encrypt(card)"
+fi
+bench_function sql_translate "translate(card, '0123456789', '7294031865')"
+if bench_can_eval "public.encrypt('', '', 'aes')"; then
+    bench_function pgcrypto_aes \
+        "encode(public.encrypt(convert_to(card, 'UTF8'), '\\x2b7e151628aed2a6abf7158809cf4f3c', 'aes'), 'hex')"
+fi
+
+bench_psql -c "DROP TABLE public.pgan_bench_functions, public.pgan_bench_names"
+if [ "$has_pgcrypto" = "0" ] && [ "$avail_pgcrypto" != "0" ]; then
+    bench_psql -c "DROP EXTENSION pgcrypto"
+fi
+if [ "$has_pgan" = "0" ]; then
+    bench_psql -c "DROP EXTENSION pg_anonymize"
+fi
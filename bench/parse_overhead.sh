@@ -0,0 +1,75 @@
+#!/bin/sh
+#
+# Measure the latency that pg_anonymize adds to parse and analysis, for queries
+# referencing 1, 10 and 100 anonymized tables.
+#
+# Usage: bench/parse_overhead.sh [duration in seconds] [clients]
+#
+# The usual libpq environment variables (PGHOST, PGPORT, PGDATABASE...) are
+# used to connect, and the connecting role must be a superuser.  pgbench runs
+# in simple query protocol mode so that every execution is parsed and
+# analyzed again.
+
+. "$(dirname "$0")/common.sh"
+
+NBTABLES=100
+
+bench_create_roles
+
+bench_psql <<EOF
+LOAD 'pg_anonymize';
+DO \$\$
+BEGIN
+    FOR i IN 1..$NBTABLES LOOP
+        EXECUTE format('DROP TABLE IF EXISTS public.pgan_bench_%s', i);
+        EXECUTE format('CREATE TABLE public.pgan_bench_%s(id integer,
+                        first_name text, last_name text, phone text)', i);
+        EXECUTE format('INSERT INTO public.pgan_bench_%s
+                        SELECT i, ''first '' || i, ''last '' || i,
+                            ''+886 1234 '' || i
+                        FROM generate_series(1, 100) i', i);
+        EXECUTE format('SECURITY LABEL FOR pg_anonymize
+                        ON COLUMN public.pgan_bench_%s.last_name
+                        IS \$l\$substr(last_name, 1, 1) || ''*****''\$l\$', i);
+        EXECUTE format('SECURITY LABEL FOR pg_anonymize
+                        ON COLUMN public.pgan_bench_%s.phone
+                        IS \$l\$regexp_replace(phone, ''\\d'', ''X'', ''g'')\$l\$', i);
+        EXECUTE format('GRANT SELECT ON public.pgan_bench_%s
+                        TO pgan_bench, pgan_bench_plain', i);
+    END LOOP;
+END;
+\$\$;
+EOF
+
+bench_header
+
+for nb in 1 10 100; do
+    script="$WORKDIR/query_$nb.sql"
+    i=1
+    : > "$script"
+    while [ $i -le $nb ]; do
+        if [ $i -gt 1 ]; then
+            printf " UNION ALL " >> "$script"
+        fi
+        printf "SELECT id, last_name FROM public.pgan_bench_%s WHERE id = 1" \
+            "$i" >> "$script"
+        i=$((i + 1))
+    done
+    echo ";" >> "$script"
+
+    for mode in not_anonymized disabled anonymized; do
+        bench_pgbench parse_overhead "tables=$nb" "$mode" "$script"
+    done
+done
+
+bench_psql <<EOF
+DO \$\$
+BEGIN
+    FOR i IN 1..$NBTABLES LOOP
+        EXECUTE format('DROP TABLE public.pgan_bench_%s', i);
+    END LOOP;
+END;
+\$\$;
+EOF
+
+bench_drop_roles
@@ -0,0 +1,116 @@
+#!/bin/sh
+#
+# Measure the latency of queries on partitioning trees of increasing depth and
+# width having security labels declared at every level, with and without
+# pg_anonymize, both with a warm cache (persistent connections) and a cold one
+# (a new connection per transaction, so all the security labels have to be
+# resolved again).
+#
+# Usage: bench/partitions.sh [duration in seconds] [clients]
+#
+# The trees to benchmark are set with the BENCH_TREES environment variable, as
+# a space separated list of <depth>x<width>, each non-leaf partition having
+# <width> partitions.  The default is "1x10 1x100 2x10 2x30 3x10", the biggest
+# tree having 1000 leaf partitions.
+#
+# The usual libpq environment variables (PGHOST, PGPORT, PGDATABASE...) are
+# used to connect, and the connecting role must be a superuser.  Querying the
+# root partitioned table with a cold cache locks all the partitions in a
+# single transaction, so max_locks_per_transaction may need to be raised
+# (e.g. 128 with the default max_connections and the biggest default tree).
+
+. "$(dirname "$0")/common.sh"
+
+TREES=${BENCH_TREES:-"1x10 1x100 2x10 2x30 3x10"}
+
+bench_create_roles
+
+bench_header
+
+for tree in $TREES; do
+    depth=${tree%x*}
+    width=${tree#*x}
+    nbleaves=1
+    i=0
+    while [ $i -lt "$depth" ]; do
+        nbleaves=$((nbleaves * width))
+        i=$((i + 1))
+    done
+
+    # Generate the tree, one partition per transaction to avoid exhausting
+    # the lock table.  The root and every intermediate level have their own
+    # security labels, and each leaf partition holds a single id.
+    ddl="$WORKDIR/ddl.sql"
+    cat > "$ddl" <<EOF
+LOAD 'pg_anonymize';
+DROP TABLE IF EXISTS public.pgan_bench_root;
+CREATE TABLE public.pgan_bench_root(id integer, first_name text,
+    last_name text, phone text) PARTITION BY RANGE (id);
+GRANT SELECT ON public.pgan_bench_root TO pgan_bench;
+SECURITY LABEL FOR pg_anonymize ON COLUMN public.pgan_bench_root.last_name
+    IS \$l\$substr(last_name, 1, 1) || '*****'\$l\$;
+EOF
+
+    awk -v depth="$depth" -v width="$width" -v nbleaves="$nbleaves" '
+    function gen(parent, lvl, lo, span,    i, clo, cspan, child) {
+        cspan = span / width
+        for (i = 0; i < width; i++) {
+            clo = lo + i * cspan
+            if (lvl == depth) {
+                child = "pgan_bench_leaf_" clo
+                printf "CREATE TABLE public.%s PARTITION OF public.%s\n", child, parent
+                printf "    FOR VALUES FROM (%d) TO (%d);\n", clo, clo + cspan
+                printf "GRANT SELECT ON public.%s TO pgan_bench;\n", child
+            } else {
+                child = "pgan_bench_p" lvl "_" clo
+                printf "CREATE TABLE public.%s PARTITION OF public.%s\n", child, parent
+                printf "    FOR VALUES FROM (%d) TO (%d) PARTITION BY RANGE (id);\n", clo, clo + cspan
+                if (lvl % 2 == 1)
+                    printf "SECURITY LABEL FOR pg_anonymize ON COLUMN public.%s.phone\n    IS $l$regexp_replace(phone, %s, %s, %s)$l$;\n", child, "'\''\\d'\''", "'\''X'\''", "'\''g'\''"
+                else
+                    printf "SECURITY LABEL FOR pg_anonymize ON COLUMN public.%s.first_name\n    IS $l$%s || id$l$;\n", child, "'\''first '\''"
+                gen(child, lvl + 1, clo, cspan)
+            }
+        }
+    }
+    BEGIN { gen("pgan_bench_root", 1, 0, nbleaves) }' >> "$ddl"
+
+    cat >> "$ddl" <<EOF
+INSERT INTO public.pgan_bench_root
+    SELECT i % $nbleaves, 'first ' || i, 'last ' || i, '+886 1234 ' || i
+    FROM generate_series(1, $((nbleaves * 10))) i;
+VACUUM ANALYZE public.pgan_bench_root;
+EOF
+
+    bench_psql -f "$ddl"
+
+    cat > "$WORKDIR/leaf.sql" <<EOF
+\\set p random(0, $((nbleaves - 1)))
+SELECT * FROM public.pgan_bench_leaf_:p;
+EOF
+
+    cat > "$WORKDIR/root.sql" <<EOF
+\\set p random(0, $((nbleaves - 1)))
+SELECT * FROM public.pgan_bench_root WHERE id = :p;
+EOF
+
+    for query in leaf root; do
+        for cache in warm cold; do
+            if [ "$cache" = "cold" ]; then
+                connect="-C"
+            else
+                connect=""
+            fi
+
+            for mode in disabled anonymized; do
+                bench_pgbench partitions \
+                    "depth=$depth;width=$width;query=$query;cache=$cache" \
+                    "$mode" "$WORKDIR/$query.sql" $connect
+            done
+        done
+    done
+
+    bench_psql -c "DROP TABLE public.pgan_bench_root"
+done
+
+bench_drop_roles
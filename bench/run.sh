@@ -0,0 +1,28 @@
+#!/bin/sh
+#
+# Run all the benchmark scenarios and emit their results as CSV on stdout, see
+# bench/common.sh for the columns.  This is what "make bench" runs.
+#
+# Usage: bench/run.sh [duration in seconds] [clients]
+#
+# The scenarios to run can be set with the BENCH_SCENARIOS environment
+# variable, as a space separated list of script names in the bench directory.
+# The default is "fastpath parse_overhead partitions copy functions".
+#
+# The usual libpq environment variables (PGHOST, PGPORT, PGDATABASE...) are
+# used to connect, and the connecting role must be a superuser.  pg_anonymize
+# must be installed on the server.
+
+set -e
+
+BENCHDIR=$(dirname "$0")
+SCENARIOS=${BENCH_SCENARIOS:-"fastpath parse_overhead partitions copy functions"}
+
+echo "version,server,scenario,params,mode,clients,tps,latency_ms,rows_per_sec"
+
+PGAN_BENCH_NOHEADER=1
+export PGAN_BENCH_NOHEADER
+
+for scenario in $SCENARIOS; do
+    "$BENCHDIR/$scenario.sh" "$@"
+done
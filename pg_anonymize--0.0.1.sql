@@ -0,0 +1,345 @@
+-- This program is free software: you can redistribute it and/or modify
+-- it under the terms of the GNU General Public License as published by
+-- the Free Software Foundation, either version 3 of the License, or
+-- (at your option) any later version.
+--
+-- This program is distributed in the hope that it will be useful,
+-- but WITHOUT ANY WARRANTY; without even the implied warranty of
+-- MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+-- GNU General Public License for more details.
+--
+-- You should have received a copy of the GNU General Public License
+-- along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "CREATE EXTENSION pg_anonymize" to load this file. \quit
+
+CREATE FUNCTION pg_anonymize_label_indexes(
+    OUT relid regclass,
+    OUT attname name,
+    OUT label text,
+    OUT index_eligible boolean,
+    OUT reason text,
+    OUT index_name regclass)
+RETURNS SETOF record
+LANGUAGE C STRICT VOLATILE
+AS 'MODULE_PATHNAME', 'pg_anonymize_label_indexes';
+REVOKE ALL ON FUNCTION pg_anonymize_label_indexes() FROM PUBLIC;
+
+CREATE FUNCTION pg_anonymize_stats(
+    OUT dbid oid,
+    OUT userid oid,
+    OUT relid oid,
+    OUT rewrites bigint,
+    OUT copy_rewrites bigint,
+    OUT cache_hits bigint,
+    OUT cache_misses bigint,
+    OUT shared_cache_hits bigint,
+    OUT validations bigint,
+    OUT lookups bigint,
+    OUT total_lookup_time double precision,
+    OUT max_lookup_time double precision,
+    OUT generations bigint,
+    OUT total_generate_time double precision,
+    OUT max_generate_time double precision,
+    OUT parses bigint,
+    OUT total_parse_time double precision,
+    OUT max_parse_time double precision)
+RETURNS SETOF record
+LANGUAGE C STRICT VOLATILE
+AS 'MODULE_PATHNAME', 'pg_anonymize_stats';
+REVOKE ALL ON FUNCTION pg_anonymize_stats() FROM PUBLIC;
+GRANT EXECUTE ON FUNCTION pg_anonymize_stats() TO pg_read_all_stats;
+
+CREATE FUNCTION pg_anonymize_stats_reset()
+RETURNS void
+LANGUAGE C STRICT VOLATILE
+AS 'MODULE_PATHNAME', 'pg_anonymize_stats_reset';
+REVOKE ALL ON FUNCTION pg_anonymize_stats_reset() FROM PUBLIC;
+
+CREATE FUNCTION pg_anonymize_export(relid regclass, path text,
+    workers integer DEFAULT 4, format text DEFAULT 'text',
+    OUT part integer,
+    OUT filename text,
+    OUT rows bigint)
+RETURNS SETOF record
+LANGUAGE C STRICT VOLATILE
+AS 'MODULE_PATHNAME', 'pg_anonymize_export';
+REVOKE ALL ON FUNCTION pg_anonymize_export(regclass, text, integer, text) FROM PUBLIC;
+
+CREATE TABLE pg_anonymize_deleted(
+    relid oid NOT NULL,
+    key jsonb,
+    xid bigint NOT NULL DEFAULT pg_catalog.txid_current()
+);
+CREATE INDEX ON pg_anonymize_deleted (relid, xid);
+SELECT pg_catalog.pg_extension_config_dump('pg_anonymize_deleted', '');
+REVOKE ALL ON TABLE pg_anonymize_deleted FROM PUBLIC;
+
+CREATE FUNCTION pg_anonymize_log_deleted()
+RETURNS trigger
+LANGUAGE C VOLATILE
+AS 'MODULE_PATHNAME', 'pg_anonymize_log_deleted';
+REVOKE ALL ON FUNCTION pg_anonymize_log_deleted() FROM PUBLIC;
+
+CREATE FUNCTION pg_anonymize_shadow_sync()
+RETURNS trigger
+LANGUAGE C VOLATILE
+AS 'MODULE_PATHNAME', 'pg_anonymize_shadow_sync';
+
+CREATE FUNCTION pg_anonymize_shadow_create(relid regclass)
+RETURNS regclass
+LANGUAGE C STRICT VOLATILE
+AS 'MODULE_PATHNAME', 'pg_anonymize_shadow_create';
+
+CREATE FUNCTION pg_anonymize_shadow_refresh(relid regclass)
+RETURNS bigint
+LANGUAGE C STRICT VOLATILE
+AS 'MODULE_PATHNAME', 'pg_anonymize_shadow_refresh';
+
+CREATE FUNCTION pg_anonymize_shadow_drop(relid regclass)
+RETURNS void
+LANGUAGE C STRICT VOLATILE
+AS 'MODULE_PATHNAME', 'pg_anonymize_shadow_drop';
+
+CREATE VIEW pg_anonymize_stats AS
+    SELECT * FROM pg_anonymize_stats();
+
+CREATE VIEW pg_anonymize_stats_database AS
+    SELECT dbid, d.datname,
+        sum(rewrites)::bigint AS rewrites,
+        sum(copy_rewrites)::bigint AS copy_rewrites,
+        sum(cache_hits)::bigint AS cache_hits,
+        sum(cache_misses)::bigint AS cache_misses,
+        sum(shared_cache_hits)::bigint AS shared_cache_hits,
+        sum(validations)::bigint AS validations,
+        sum(lookups)::bigint AS lookups,
+        sum(total_lookup_time) AS total_lookup_time,
+        max(max_lookup_time) AS max_lookup_time,
+        sum(generations)::bigint AS generations,
+        sum(total_generate_time) AS total_generate_time,
+        max(max_generate_time) AS max_generate_time,
+        sum(parses)::bigint AS parses,
+        sum(total_parse_time) AS total_parse_time,
+        max(max_parse_time) AS max_parse_time
+    FROM pg_anonymize_stats() s
+    LEFT JOIN pg_catalog.pg_database d ON d.oid = s.dbid
+    GROUP BY dbid, d.datname;
+GRANT SELECT ON pg_anonymize_stats, pg_anonymize_stats_database
+    TO pg_read_all_stats;
+
+CREATE FUNCTION pg_anonymize_mask_digits(value text, mask text DEFAULT 'X')
+RETURNS text
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+AS 'MODULE_PATHNAME', 'pg_anonymize_mask_digits';
+
+CREATE FUNCTION pg_anonymize_mask_letters(value text, mask text DEFAULT 'X')
+RETURNS text
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+AS 'MODULE_PATHNAME', 'pg_anonymize_mask_letters';
+
+CREATE FUNCTION pg_anonymize_mask_all_but_last(value text, keep integer,
+    mask text DEFAULT 'X')
+RETURNS text
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+AS 'MODULE_PATHNAME', 'pg_anonymize_mask_all_but_last';
+
+CREATE FUNCTION pg_anonymize_partial(value text, prefix integer,
+    padding text, suffix integer)
+RETURNS text
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+AS 'MODULE_PATHNAME', 'pg_anonymize_partial';
+
+CREATE FUNCTION pg_anonymize_mask_email(value text, mask text DEFAULT '*')
+RETURNS text
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+AS 'MODULE_PATHNAME', 'pg_anonymize_mask_email';
+
+CREATE FUNCTION pg_anonymize_mask_phone(value text, keep integer DEFAULT 2,
+    mask text DEFAULT 'X')
+RETURNS text
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+AS 'MODULE_PATHNAME', 'pg_anonymize_mask_phone';
+
+CREATE FUNCTION pg_anonymize_redact(value text, width integer DEFAULT 8,
+    mask text DEFAULT '*')
+RETURNS text
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+AS 'MODULE_PATHNAME', 'pg_anonymize_redact';
+
+CREATE FUNCTION pg_anonymize_replace_chars(value text, chars text,
+    replacement text, invert boolean DEFAULT false)
+RETURNS text
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+AS 'MODULE_PATHNAME', 'pg_anonymize_replace_chars';
+
+CREATE FUNCTION pg_anonymize_prefix(value text, keep integer, suffix text)
+RETURNS text
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+AS 'MODULE_PATHNAME', 'pg_anonymize_prefix';
+
+CREATE FUNCTION pg_anonymize_date_trunc(unit text, value date)
+RETURNS date
+LANGUAGE C STRICT STABLE PARALLEL SAFE
+AS 'MODULE_PATHNAME', 'pg_anonymize_date_trunc';
+
+CREATE FUNCTION pg_anonymize_pseudonym(value text)
+RETURNS bigint
+LANGUAGE C STRICT STABLE PARALLEL SAFE
+AS 'MODULE_PATHNAME', 'pg_anonymize_pseudonym';
+
+CREATE FUNCTION pg_anonymize_pseudonym(value bytea)
+RETURNS bigint
+LANGUAGE C STRICT STABLE PARALLEL SAFE
+AS 'MODULE_PATHNAME', 'pg_anonymize_pseudonym';
+
+CREATE FUNCTION pg_anonymize_pseudonym(value bigint)
+RETURNS bigint
+LANGUAGE C STRICT STABLE PARALLEL SAFE
+AS 'MODULE_PATHNAME', 'pg_anonymize_pseudonym';
+
+CREATE FUNCTION pg_anonymize_pseudonym(value uuid)
+RETURNS bigint
+LANGUAGE C STRICT STABLE PARALLEL SAFE
+AS 'MODULE_PATHNAME', 'pg_anonymize_pseudonym';
+
+CREATE FUNCTION pg_anonymize_pseudonym_uuid(value text)
+RETURNS uuid
+LANGUAGE C STRICT STABLE PARALLEL SAFE
+AS 'MODULE_PATHNAME', 'pg_anonymize_pseudonym_uuid';
+
+CREATE FUNCTION pg_anonymize_pseudonym_uuid(value bytea)
+RETURNS uuid
+LANGUAGE C STRICT STABLE PARALLEL SAFE
+AS 'MODULE_PATHNAME', 'pg_anonymize_pseudonym_uuid';
+
+CREATE FUNCTION pg_anonymize_pseudonym_uuid(value bigint)
+RETURNS uuid
+LANGUAGE C STRICT STABLE PARALLEL SAFE
+AS 'MODULE_PATHNAME', 'pg_anonymize_pseudonym_uuid';
+
+CREATE FUNCTION pg_anonymize_pseudonym_uuid(value uuid)
+RETURNS uuid
+LANGUAGE C STRICT STABLE PARALLEL SAFE
+AS 'MODULE_PATHNAME', 'pg_anonymize_pseudonym_uuid';
+
+CREATE FUNCTION pg_anonymize_pseudonym_text(value text,
+    length integer DEFAULT 16,
+    alphabet text DEFAULT '0123456789abcdefghijklmnopqrstuvwxyz')
+RETURNS text
+LANGUAGE C STRICT STABLE PARALLEL SAFE
+AS 'MODULE_PATHNAME', 'pg_anonymize_pseudonym_text';
+
+CREATE FUNCTION pg_anonymize_pseudonym_text(value bytea,
+    length integer DEFAULT 16,
+    alphabet text DEFAULT '0123456789abcdefghijklmnopqrstuvwxyz')
+RETURNS text
+LANGUAGE C STRICT STABLE PARALLEL SAFE
+AS 'MODULE_PATHNAME', 'pg_anonymize_pseudonym_text';
+
+CREATE FUNCTION pg_anonymize_pseudonym_text(value bigint,
+    length integer DEFAULT 16,
+    alphabet text DEFAULT '0123456789abcdefghijklmnopqrstuvwxyz')
+RETURNS text
+LANGUAGE C STRICT STABLE PARALLEL SAFE
+AS 'MODULE_PATHNAME', 'pg_anonymize_pseudonym_text';
+
+CREATE FUNCTION pg_anonymize_pseudonym_text(value uuid,
+    length integer DEFAULT 16,
+    alphabet text DEFAULT '0123456789abcdefghijklmnopqrstuvwxyz')
+RETURNS text
+LANGUAGE C STRICT STABLE PARALLEL SAFE
+AS 'MODULE_PATHNAME', 'pg_anonymize_pseudonym_text';
+
+CREATE FUNCTION pg_anonymize_fpe_encrypt(value text,
+    alphabet text DEFAULT '0123456789', tweak bytea DEFAULT '')
+RETURNS text
+LANGUAGE C STRICT STABLE PARALLEL SAFE
+AS 'MODULE_PATHNAME', 'pg_anonymize_fpe_encrypt';
+
+CREATE FUNCTION pg_anonymize_fpe_decrypt(value text,
+    alphabet text DEFAULT '0123456789', tweak bytea DEFAULT '')
+RETURNS text
+LANGUAGE C STRICT STABLE PARALLEL SAFE
+AS 'MODULE_PATHNAME', 'pg_anonymize_fpe_decrypt';
+REVOKE ALL ON FUNCTION pg_anonymize_fpe_decrypt(text, text, bytea) FROM PUBLIC;
+
+CREATE FUNCTION pg_anonymize_fake_first_name(value text)
+RETURNS text
+LANGUAGE C STRICT STABLE PARALLEL SAFE
+AS 'MODULE_PATHNAME', 'pg_anonymize_fake_first_name';
+
+CREATE FUNCTION pg_anonymize_fake_first_name(value bytea)
+RETURNS text
+LANGUAGE C STRICT STABLE PARALLEL SAFE
+AS 'MODULE_PATHNAME', 'pg_anonymize_fake_first_name';
+
+CREATE FUNCTION pg_anonymize_fake_first_name(value bigint)
+RETURNS text
+LANGUAGE C STRICT STABLE PARALLEL SAFE
+AS 'MODULE_PATHNAME', 'pg_anonymize_fake_first_name';
+
+CREATE FUNCTION pg_anonymize_fake_first_name(value uuid)
+RETURNS text
+LANGUAGE C STRICT STABLE PARALLEL SAFE
+AS 'MODULE_PATHNAME', 'pg_anonymize_fake_first_name';
+
+CREATE FUNCTION pg_anonymize_fake_last_name(value text)
+RETURNS text
+LANGUAGE C STRICT STABLE PARALLEL SAFE
+AS 'MODULE_PATHNAME', 'pg_anonymize_fake_last_name';
+
+CREATE FUNCTION pg_anonymize_fake_last_name(value bytea)
+RETURNS text
+LANGUAGE C STRICT STABLE PARALLEL SAFE
+AS 'MODULE_PATHNAME', 'pg_anonymize_fake_last_name';
+
+CREATE FUNCTION pg_anonymize_fake_last_name(value bigint)
+RETURNS text
+LANGUAGE C STRICT STABLE PARALLEL SAFE
+AS 'MODULE_PATHNAME', 'pg_anonymize_fake_last_name';
+
+CREATE FUNCTION pg_anonymize_fake_last_name(value uuid)
+RETURNS text
+LANGUAGE C STRICT STABLE PARALLEL SAFE
+AS 'MODULE_PATHNAME', 'pg_anonymize_fake_last_name';
+
+CREATE FUNCTION pg_anonymize_fake_city(value text)
+RETURNS text
+LANGUAGE C STRICT STABLE PARALLEL SAFE
+AS 'MODULE_PATHNAME', 'pg_anonymize_fake_city';
+
+CREATE FUNCTION pg_anonymize_fake_city(value bytea)
+RETURNS text
+LANGUAGE C STRICT STABLE PARALLEL SAFE
+AS 'MODULE_PATHNAME', 'pg_anonymize_fake_city';
+
+CREATE FUNCTION pg_anonymize_fake_city(value bigint)
+RETURNS text
+LANGUAGE C STRICT STABLE PARALLEL SAFE
+AS 'MODULE_PATHNAME', 'pg_anonymize_fake_city';
+
+CREATE FUNCTION pg_anonymize_fake_city(value uuid)
+RETURNS text
+LANGUAGE C STRICT STABLE PARALLEL SAFE
+AS 'MODULE_PATHNAME', 'pg_anonymize_fake_city';
+
+CREATE FUNCTION pg_anonymize_fake_street(value text)
+RETURNS text
+LANGUAGE C STRICT STABLE PARALLEL SAFE
+AS 'MODULE_PATHNAME', 'pg_anonymize_fake_street';
+
+CREATE FUNCTION pg_anonymize_fake_street(value bytea)
+RETURNS text
+LANGUAGE C STRICT STABLE PARALLEL SAFE
+AS 'MODULE_PATHNAME', 'pg_anonymize_fake_street';
+
+CREATE FUNCTION pg_anonymize_fake_street(value bigint)
+RETURNS text
+LANGUAGE C STRICT STABLE PARALLEL SAFE
+AS 'MODULE_PATHNAME', 'pg_anonymize_fake_street';
+
+CREATE FUNCTION pg_anonymize_fake_street(value uuid)
+RETURNS text
+LANGUAGE C STRICT STABLE PARALLEL SAFE
+AS 'MODULE_PATHNAME', 'pg_anonymize_fake_street';
@@ -25,6 +25,8 @@
 #include "postgres.h"
 
 #include "access/genam.h"
+#include "access/sysattr.h"
+#include "access/transam.h"
 #if PG_VERSION_NUM >= 120000
 #include "access/relation.h"
 #include "access/table.h"
@@ -32,50 +34,131 @@
 #include "access/heapam.h"
 #include "access/htup_details.h"
 #endif
+#include "access/parallel.h"
 #include "access/xact.h"
+#if PG_VERSION_NUM < 120000
+#include "access/xlog.h"
+#endif
+#include "catalog/dependency.h"
 #if PG_VERSION_NUM < 140000
 #include "catalog/indexing.h"
 #endif
 #include "catalog/namespace.h"
+#include "catalog/pg_am.h"
 #include "catalog/pg_authid.h"
+#include "catalog/pg_collation.h"
+#include "catalog/pg_database.h"
 #include "catalog/pg_inherits.h"
 #if PG_VERSION_NUM >= 110000
+#include "catalog/pg_operator_d.h"
+#else
+#include "catalog/pg_operator.h"
+#endif
+#if PG_VERSION_NUM >= 110000
 #include "catalog/pg_namespace_d.h"
 #else
 #include "catalog/pg_namespace.h"
 #endif
+#include "catalog/pg_proc.h"
 #include "catalog/pg_seclabel.h"
+#include "catalog/pg_subscription_rel.h"
+#include "catalog/pg_trigger.h"
 #include "catalog/pg_type.h"
 #include "commands/copy.h"
+#include "commands/defrem.h"
+#include "commands/explain.h"
+#include "commands/extension.h"
+#if PG_VERSION_NUM >= 180000
+#include "commands/explain_format.h"
+#include "commands/explain_state.h"
+#endif
 #include "commands/seclabel.h"
+#include "commands/trigger.h"
+#include "executor/executor.h"
 #include "executor/spi.h"
+#include "funcapi.h"
+#if PG_VERSION_NUM >= 110000
+#include "lib/dshash.h"
+#endif
 #include "miscadmin.h"
+#include "portability/instr_time.h"
 #include "nodes/makefuncs.h"
 #include "nodes/nodeFuncs.h"
+#include "optimizer/clauses.h"
+#if PG_VERSION_NUM >= 120000
+#include "optimizer/optimizer.h"
+#else
+#include "optimizer/var.h"
+#endif
 #include "optimizer/plancat.h"
 #include "parser/analyze.h"
+#include "parser/parse_func.h"
+#include "parser/parse_relation.h"
+#include "parser/parser.h"
+#include "parser/parsetree.h"
 #include "rewrite/rewriteHandler.h"
+#include "rewrite/rewriteManip.h"
+#include "storage/bufmgr.h"
+#include "storage/ipc.h"
+#include "storage/lmgr.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "tcop/tcopprot.h"
 #include "tcop/utility.h"
+#include "utils/acl.h"
 #include "utils/builtins.h"
+#include "utils/array.h"
+#include "utils/dsa.h"
 #include "utils/fmgroids.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
 #include "utils/lsyscache.h"
 #include "utils/memutils.h"
 #include "utils/rel.h"
+#include "utils/resowner.h"
+#include "utils/rls.h"
+#include "utils/ruleutils.h"
+#include "utils/snapmgr.h"
 #include "utils/syscache.h"
+#include "utils/tuplestore.h"
 #include "utils/varlena.h"
 
+#include "pgan_copy.h"
+#include "pgan_decode.h"
+#include "pgan_fpe.h"
+#include "pgan_pseudo.h"
+
 
 PG_MODULE_MAGIC;
 
 #define PGAN_PROVIDER	"pg_anonymize"
 #define PGAN_ROLE_ANONYMIZED "anonymize"
 
+/* Column of the shadow tables holding the original key of the rows */
+#define PGAN_SHADOW_KEY	"pg_anonymize_key"
+
+/* Maximum number of parts of pg_anonymize_export() */
+#define PGAN_EXPORT_MAX_PARTS	1024
+
+/* Keys of the parallel export shared memory, see pg_anonymize_export() */
+#define PGAN_EXPORT_KEY_SHARED	UINT64CONST(0xA40A000000000001)
+#define PGAN_EXPORT_KEY_QUERY	UINT64CONST(0xA40A000000000002)
+
 /* Backward compatibility macros */
 #if PG_VERSION_NUM < 120000
 #define table_open(r, l) heap_open(r, l)
 #define table_close(r, l) heap_close(r, l)
 #endif
 
+#if PG_VERSION_NUM < 110000
+#define OidEqualOperator 607
+/* Not exported before pg11, so only text plans are annotated there. */
+#define ExplainOpenGroup(o, l, b, es) ((void) 0)
+#define ExplainCloseGroup(o, l, b, es) ((void) 0)
+#endif
+
 #if PG_VERSION_NUM < 150000
 #define parse_analyze_fixedparams(r, s, p, n, e) parse_analyze(r, s, p, n, e)
 #define MarkGUCPrefixReserved(c) EmitWarningsOnPlaceholders(c)
@@ -126,32 +209,396 @@ free_attrmap(AttrMap *attrMap)
 }
 #endif
 
+/*
+ * Reimplement standard_ExplainOneQuery(), only exported since pg17, so that
+ * pgan_ExplainOneQuery() can fall back to it.
+ */
+#if PG_VERSION_NUM < 170000
+static void
+standard_ExplainOneQuery(Query *query, int cursorOptions, IntoClause *into,
+						 ExplainState *es, const char *queryString,
+						 ParamListInfo params, QueryEnvironment *queryEnv)
+{
+	PlannedStmt *plan;
+	instr_time	planstart,
+				planduration;
+#if PG_VERSION_NUM >= 130000
+	BufferUsage bufusage_start,
+				bufusage;
+
+	if (es->buffers)
+		bufusage_start = pgBufferUsage;
+#endif
+
+	INSTR_TIME_SET_CURRENT(planstart);
+
+	/* plan the query */
+	plan = pg_plan_query(query,
+#if PG_VERSION_NUM >= 130000
+						 queryString,
+#endif
+						 cursorOptions, params);
+
+	INSTR_TIME_SET_CURRENT(planduration);
+	INSTR_TIME_SUBTRACT(planduration, planstart);
+
+#if PG_VERSION_NUM >= 130000
+	/* calc differences of buffer counters. */
+	if (es->buffers)
+	{
+		memset(&bufusage, 0, sizeof(BufferUsage));
+		BufferUsageAccumDiff(&bufusage, &pgBufferUsage, &bufusage_start);
+	}
+#endif
+
+	/* run it (if needed) and produce output */
+	ExplainOnePlan(plan, into, es, queryString, params, queryEnv,
+				   &planduration
+#if PG_VERSION_NUM >= 130000
+				   , (es->buffers ? &bufusage : NULL)
+#endif
+				   );
+}
+#endif
+
 /* Used for pgan_get_rel_seclabels_worker() */
 typedef struct pganWalkerContext
 {
-	Relation secRel;		/* Cached pg_seclabel relation */
-	Relation inhRel;		/* Cached pg_inherits relation */
 	char  **seclabels;		/* The array of found security labels */
 	int		nb_labels;		/* # of columns for which we found a seclabel */
-	TupleDesc tupdesc;		/* The original relation tupledesc */
+	List   *ancestors;		/* Oids of all the ancestors we looked at */
 } pganWalkerContext;
 
+/* A pg_seclabel row, see pgan_get_rel_seclabels_worker() */
+typedef struct pganSeclabelRow
+{
+	Oid		objoid;			/* Relation having the security label */
+	int		attnum;			/* Attribute number in that relation */
+	char   *seclabel;		/* The security label */
+} pganSeclabelRow;
+
+/*
+ * Entry of the backend-local cache of resolved security labels, see
+ * pgan_get_rel_labels_entry().
+ */
+typedef struct pganRelLabels
+{
+	Oid		relid;			/* hash key, must be first */
+	MemoryContext cxt;		/* Memory context holding all the entry data */
+	bool	inherit;		/* pg_anonymize.inherit_labels when cached */
+	uint64	generation;		/* shared cache generation when built */
+	int		natts;			/* # of attributes of the relation */
+	char  **seclabels;		/* NULL if no SECURITY LABEL found */
+	int		nb_ancestors;	/* # of ancestors looked at */
+	Oid	   *ancestors;		/* ancestors looked at, for invalidation */
+	Node  **exprs;			/* analyzed security labels, if built */
+	bool	tree_done;		/* has tree_exprs been built */
+	Node  **tree_exprs;		/* analyzed security labels for the whole tree */
+	int		nb_descendants;	/* # of descendants looked at */
+	Oid	   *descendants;	/* descendants looked at, for invalidation */
+	bool	shadow_done;	/* has shadowid been looked up */
+	Oid		shadowid;		/* shadow table to read, see pgan_get_shadow() */
+} pganRelLabels;
+
+/* A member of an inheritance tree, see pgan_get_tree_exprs() */
+typedef struct pganTreeMember
+{
+	Oid		relid;			/* Oid of the member */
+	bool	leaf;			/* Can the member have rows to anonymize */
+	AttrNumber *c2p;		/* Member to tree root attribute number map */
+	char  **seclabels;		/* Own security labels, by root attribute number */
+	List   *parents;		/* Intermediate parents, as pganTreeMember */
+} pganTreeMember;
+
+/* Hash entry used to find the members of an inheritance tree */
+typedef struct pganTreeMemberEntry
+{
+	Oid		relid;			/* hash key, must be first */
+	pganTreeMember *member;
+} pganTreeMemberEntry;
+
+/* A distinct security label of some descendants, see pgan_get_tree_exprs() */
+typedef struct pganTreeBranch
+{
+	char   *seclabel;		/* Security label */
+	Node   *expr;			/* Security label, mapped to the root attnums */
+	List   *relids;			/* Oids of the descendants using it */
+} pganTreeBranch;
+
+/* Used for pgan_labeled_var_walker() */
+typedef struct pganLabeledVarContext
+{
+	Index	varno;			/* Range table index of the relation */
+	Node  **exprs;			/* The relation analyzed security labels */
+	int		sublevels_up;	/* Current query level */
+} pganLabeledVarContext;
+
+/* Used for pgan_defer_expand_mutator() and pgan_defer_replace_mutator() */
+typedef struct pganDeferContext
+{
+	Node ***exprs;			/* Analyzed security labels, per rtindex */
+	List   *passthrough;	/* Vars passed through the inner query */
+	int		first_resno;	/* resno of the first passthrough Var */
+} pganDeferContext;
+
+/*
+ * Functions used by pgan_optimize_label(), see pgan_get_opt_funcs().  The
+ * builtin ones are the recognized expression shapes, the other ones are their
+ * specialized implementations, provided by the extension.
+ */
+typedef struct pganOptFuncs
+{
+	bool	valid;			/* Have the functions been looked up */
+	Oid		regexp_replace;	/* regexp_replace(text, text, text, text) */
+	Oid		substr;			/* substr(text, int, int) */
+	Oid		substring;		/* substring(text, int, int) */
+	Oid		left;			/* left(text, int) */
+	Oid		textcat;		/* text || text */
+	Oid		date_tstz;		/* date::timestamptz */
+	Oid		trunc_tstz;		/* date_trunc(text, timestamptz) */
+	Oid		tstz_date;		/* timestamptz::date */
+	Oid		replace_chars;	/* pg_anonymize_replace_chars() */
+	Oid		prefix;			/* pg_anonymize_prefix() */
+	Oid		date_trunc;		/* pg_anonymize_date_trunc() */
+} pganOptFuncs;
+
+/* Used for pgan_optimize_mutator() */
+typedef struct pganOptimizeContext
+{
+	pganOptFuncs funcs;		/* Copy of pgan_opt_funcs */
+	Relation rel;			/* Relation of the label, if any */
+	AttrNumber attnum;		/* Column of the label */
+	int		allowed;		/* Can the label be optimized, -1 if unknown */
+} pganOptimizeContext;
+
+/* Entry of the backend-local cache of role anonymization status */
+typedef struct pganRoleEntry
+{
+	Oid		roleid;			/* hash key, must be first */
+	bool	anonymized;		/* is the role declared as anonymized */
+} pganRoleEntry;
+
+/* An anonymized relation referenced by an explained query */
+typedef struct pganExplainRel
+{
+	Oid		relid;			/* Anonymized relation */
+	bool	deferred;		/* Labels evaluated by the deferral wrapper */
+	char   *nspname;		/* Schema of the relation */
+	char   *relname;		/* Name of the relation */
+	Node  **exprs;			/* Copy of the analyzed security labels */
+	Bitmapset *attnums;		/* Anonymized columns computed by the query */
+	List   *relids;			/* Relation and descendants scanned for it */
+	double	rows;			/* # of anonymized rows, with ANALYZE */
+} pganExplainRel;
+
+/* State of the query being explained, see pgan_ExplainOneQuery() */
+typedef struct pganExplainState
+{
+	ExplainState *es;
+	const char *queryString;	/* Identifies the explained QueryDesc */
+	List   *rels;			/* Referenced anonymized relations */
+	List   *rtable;			/* Range table of the explained plan */
+	bool	done;			/* Have we already annotated the plan */
+} pganExplainState;
+
+#if PG_VERSION_NUM >= 110000
+/* Key of the shared cache of resolved security labels */
+typedef struct pganSharedKey
+{
+	Oid		dbid;			/* Database of the relation */
+	Oid		relid;			/* The relation */
+} pganSharedKey;
+
+/* Entry of the shared cache of resolved security labels */
+typedef struct pganSharedEntry
+{
+	pganSharedKey key;		/* hash key, must be first */
+	uint64	generation;		/* Shared generation when the entry was built */
+	bool	has_exprs;		/* Does data contain the analyzed expressions */
+	dsa_pointer data;		/* Serialized data, see pgan_shared_store() */
+	Size	len;			/* Size of the serialized data */
+} pganSharedEntry;
+
+/*
+ * Header of the serialized data of a shared cache entry.  The relation's
+ * pg_class xmin and tuple descriptor hash are used to detect that the entry
+ * was built for a different version of the relation.
+ */
+typedef struct pganSharedData
+{
+	TransactionId xmin;		/* xmin of the relation's pg_class row */
+	uint32	tupdesc_hash;	/* hashTupleDesc() of the relation */
+	int		natts;			/* # of attributes of the relation */
+	bool	inherit;		/* pg_anonymize.inherit_labels when built */
+	bool	has_exprs;		/* Are the analyzed expressions included */
+	int		nb_ancestors;	/* # of ancestors */
+} pganSharedData;
+
+#endif
+
+/* Key of the shared statistics, see pgan_stats_count() */
+typedef struct pganStatsKey
+{
+	Oid		dbid;			/* Database of the relation */
+	Oid		userid;			/* User executing the query */
+	Oid		relid;			/* The relation */
+} pganStatsKey;
+
+/* Kind of event counted in the shared statistics */
+typedef enum pganStatsKind
+{
+	PGAN_STATS_REWRITE,			/* relation rewritten in a query */
+	PGAN_STATS_COPY_REWRITE,	/* relation rewritten in a COPY */
+	PGAN_STATS_CACHE_HIT,		/* security labels found in the local cache */
+	PGAN_STATS_CACHE_MISS,		/* security labels not in the local cache */
+	PGAN_STATS_SHARED_CACHE_HIT,	/* and found in the shared cache */
+	PGAN_STATS_VALIDATION,		/* security label validation query */
+	PGAN_STATS_LOOKUP_TIME,		/* time to resolve the security labels */
+	PGAN_STATS_GENERATE_TIME,	/* time to generate a SQL query */
+	PGAN_STATS_PARSE_TIME		/* time to parse and analyze a SQL query */
+} pganStatsKind;
+
+#define PGAN_STATS_NB_COUNTERS	(PGAN_STATS_VALIDATION + 1)
+#define PGAN_STATS_NB_TIMINGS	(PGAN_STATS_PARSE_TIME - PGAN_STATS_VALIDATION)
+
+/* Entry of the shared statistics */
+typedef struct pganStatsEntry
+{
+	pganStatsKey key;		/* hash key, must be first */
+	slock_t	mutex;			/* protects the counters */
+	int64	counters[PGAN_STATS_NB_COUNTERS];
+	int64	calls[PGAN_STATS_NB_TIMINGS];	/* # of timed events */
+	double	total_time[PGAN_STATS_NB_TIMINGS];	/* in msec */
+	double	max_time[PGAN_STATS_NB_TIMINGS];	/* in msec */
+} pganStatsEntry;
+
+/*
+ * Shared state of a parallel export.  The relation is split into nparts
+ * ranges of blocks, each exported by a single participant in its own file.
+ */
+typedef struct pganExportShared
+{
+	BlockNumber	nblocks;		/* # of blocks of the relation */
+	int			nparts;			/* # of parts */
+	char		path[MAXPGPATH];	/* prefix of the file names */
+	char		format[8];		/* COPY format */
+	pg_atomic_uint32 next_part;	/* next part to export */
+	uint64		rows[FLEXIBLE_ARRAY_MEMBER];	/* # of rows of each part */
+} pganExportShared;
+
+/* Shared memory state */
+typedef struct pganSharedState
+{
+	LWLock	   *lock;			/* Protects the area and hash creation */
+	LWLock	   *stats_lock;		/* Protects the statistics hash table */
+#if PG_VERSION_NUM >= 110000
+	int			tranche_id;		/* Tranche of the area and hash locks */
+	bool		initialized;	/* Have the area and hash been created */
+	dsa_handle	area;			/* DSA area holding the cache */
+	dshash_table_handle hash;	/* The cache */
+	pg_atomic_uint64 generation;	/* Bumped when security labels change */
+	pg_atomic_uint32 nb_entries;	/* # of entries in the cache */
+#endif
+} pganSharedState;
+
 /*---- Local variables ----*/
 
 static bool pgan_toplevel = true;
 
+/* The query currently being explained, if it references anonymized data */
+static pganExplainState *pgan_explain = NULL;
+
+/* Is the query of a rewritten COPY TO about to be analyzed */
+static bool pgan_copy_pending = false;
+
+/* Functions used to optimize the security labels, reset on pg_proc changes */
+static pganOptFuncs pgan_opt_funcs = {false};
+static uint64 pgan_proc_inval_count = 0;
+
+/* Trigger function maintaining the shadow tables, reset on pg_proc changes */
+static Oid	pgan_shadow_func = InvalidOid;
+static bool pgan_shadow_func_valid = false;
+
+/* Backend-local cache of resolved security labels, keyed by relid */
+static MemoryContext pgan_label_cxt = NULL;
+static HTAB *pgan_rel_labels = NULL;
+
+/*
+ * Number of invalidations received, used to detect that an entry was
+ * invalidated while being built.
+ */
+static uint64 pgan_label_inval_count = 0;
+
+/* Backend-local cache of role anonymization status, keyed by roleid */
+static HTAB *pgan_roles = NULL;
+static uint64 pgan_role_inval_count = 0;
+
+/* Shared state, only available if loaded in shared_preload_libraries */
+static pganSharedState *pgan_shared = NULL;
+
+/* Shared statistics, keyed by dbid, userid and relid */
+static HTAB *pgan_stats = NULL;
+
+#if PG_VERSION_NUM >= 110000
+/* Shared cache of resolved security labels, keyed by dbid and relid */
+static dsa_area *pgan_shared_area = NULL;
+static dshash_table *pgan_shared_hash = NULL;
+
+/* Has the current transaction changed any security label on a relation */
+static bool pgan_shared_relabeled = false;
+
+static dshash_parameters pgan_shared_params = {
+	sizeof(pganSharedKey),
+	sizeof(pganSharedEntry),
+	dshash_memcmp,
+	dshash_memhash,
+#if PG_VERSION_NUM >= 170000
+	dshash_memcpy,
+#endif
+	0						/* tranche_id, set in pgan_shared_attach() */
+};
+#endif
+
 /*---- GUC variables ----*/
 
 static bool pgan_check_labels = true;
 static bool pgan_inherit_labels = true;
 static bool pgan_enabled = true;
+static bool pgan_defer_evaluation = true;
+static bool pgan_label_indexes = false;
+static bool pgan_optimize_labels = true;
+static char *pgan_copy_since = NULL;
+static char *pgan_copy_tablesample = NULL;
+static int	pgan_shared_cache_entries = 1024;
+static int	pgan_stats_max = 5000;
+#if PG_VERSION_NUM >= 140000
+static bool pgan_copy_direct = true;
+static bool pgan_label_statistics = false;
+#endif
 
 /*---- Function declarations ----*/
 
 void		_PG_init(void);
+PGDLLEXPORT void pgan_export_worker_main(dsm_segment *seg, shm_toc *toc);
+
+PG_FUNCTION_INFO_V1(pg_anonymize_export);
+PG_FUNCTION_INFO_V1(pg_anonymize_label_indexes);
+PG_FUNCTION_INFO_V1(pg_anonymize_log_deleted);
+PG_FUNCTION_INFO_V1(pg_anonymize_shadow_create);
+PG_FUNCTION_INFO_V1(pg_anonymize_shadow_drop);
+PG_FUNCTION_INFO_V1(pg_anonymize_shadow_refresh);
+PG_FUNCTION_INFO_V1(pg_anonymize_shadow_sync);
+PG_FUNCTION_INFO_V1(pg_anonymize_stats);
+PG_FUNCTION_INFO_V1(pg_anonymize_stats_reset);
 
 static ProcessUtility_hook_type prev_ProcessUtility = NULL;
 static post_parse_analyze_hook_type prev_post_parse_analyze_hook = NULL;
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+static ExplainOneQuery_hook_type prev_ExplainOneQuery = NULL;
+static ExecutorEnd_hook_type prev_ExecutorEnd = NULL;
 
 static void pgan_post_parse_analyze(ParseState *pstate, Query *query
 #if PG_VERSION_NUM >= 140000
@@ -171,26 +618,129 @@ static void pgan_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
 								char *completionTag
 #endif
 								);
+static void pgan_ExplainOneQuery(Query *query, int cursorOptions,
+								 IntoClause *into, ExplainState *es,
+								 const char *queryString, ParamListInfo params,
+								 QueryEnvironment *queryEnv);
+static void pgan_ExecutorEnd(QueryDesc *queryDesc);
 
 static void pgan_check_injection(Relation rel,
 								const ObjectAddress *object,
 								const char *seclabel);
+static const char *pgan_label_ineligible_reason(Relation rel,
+												const char *seclabel,
+												bool for_index);
+static void pgan_sync_label_objects(Relation rel, AttrNumber attnum,
+									const char *seclabel);
 static void pgan_check_expression_valid(Relation rel,
 										const ObjectAddress *object,
 										const char *seclabel);
 static void pgan_check_preload_lib(char *libnames, char *kind, bool missing_ok);
+static bool pgan_check_copy_since(char **newval, void **extra,
+								  GucSource source);
+static TransactionId pgan_get_copy_since(void);
+static bool pgan_check_copy_tablesample(char **newval, void **extra,
+										GucSource source);
 static List *pgan_get_attnums(TupleDesc tupDesc, Relation rel,
 							  List *attnamelist, bool is_copy);
+static uint64 pgan_export_part(const pganExportShared *shared,
+							   const char *sql, int part);
+#if PG_VERSION_NUM >= 140000
+static bool pgan_try_copy_direct(Relation rel, CopyStmt *stmt,
+								 const char *queryString, QueryCompletion *qc);
+#endif
 static char *pgan_get_query_for_relid(Relation rel, List *attlist,
-									  bool is_copy);
-static char **pgan_get_rel_seclabels(Relation rel);
+									  bool is_copy, bool force);
+static pganRelLabels *pgan_get_rel_labels_entry(Relation rel);
+static List *pgan_get_ancestors(Oid relid);
 static void pgan_get_rel_seclabels_worker(Relation rel,
 										  pganWalkerContext *context);
+static Query *pgan_build_subquery(Relation rel, Node **exprs,
+								  Bitmapset *attrs_used, bool all_attrs,
+								  bool inh);
+static Node **pgan_get_exprs_for_rel(Relation rel);
+static Node **pgan_get_tree_exprs(Relation rel);
+static char *pgan_get_tree_member_seclabel(pganTreeMember *member,
+										   AttrNumber attnum);
+static Node *pgan_analyze_tree_seclabel(Relation rel, pganTreeMember *member,
+										const char *seclabel);
+static Node *pgan_map_child_expr(Relation rel, Relation child, Node *expr,
+								 AttrNumber *c2p);
+static Query *pgan_get_subquery_for_rel(Relation rel, Bitmapset *attrs_used,
+										bool all_attrs, bool inh);
+static Node **pgan_copy_exprs_for_rel(Relation rel, bool inh);
+static Oid	pgan_get_shadow_func(void);
+static char *pgan_get_shadow_name(Relation rel, bool enabled_only);
+static Oid	pgan_get_shadow_relid(Relation rel, const char *name);
+static Oid	pgan_get_shadow(Relation rel);
+static void pgan_get_shadow_relname(Oid relid, char *name);
+static List *pgan_shadow_grantees(Oid shadowid, Oid owner);
+static bool pgan_rel_is_subscribed(Oid relid);
+static void pgan_shadow_enabled(AlterTableStmt *stmt);
+static AttrNumber *pgan_shadow_attmap(Relation rel, Relation shadow);
+static void pgan_shadow_check_owner(Relation rel);
+static char *pgan_qualified_relname(Relation rel);
+static char *pgan_shadow_key_expr(Relation rel);
+static char *pgan_shadow_insert_sql(Relation rel, Relation shadow,
+									const char *from, AttrNumber attnum,
+									const char *seclabel);
+static uint64 pgan_shadow_execute(Oid owner, TriggerData *trigdata,
+								  List *stmts);
+static uint64 pgan_shadow_refresh(Relation rel, Relation shadow,
+								  AttrNumber attnum, const char *seclabel);
+static Query *pgan_build_shadow_subquery(Relation rel, Relation shadow,
+										 Bitmapset *attrs_used,
+										 bool all_attrs);
+static Node *pgan_optimize_label(Relation rel, AttrNumber attnum, Node *expr);
+static Node *pgan_optimize_mutator(Node *node, void *context);
+static bool pgan_get_opt_funcs(void);
+static Oid	pgan_get_ext_func(Oid extoid, const char *name, int nargs,
+							  const Oid *argtypes);
+static bool pgan_regex_char_set(const char *pattern, Oid collid, char *chars,
+								bool *invert);
+static bool pgan_collation_is_libc(Oid collid);
+static bool pgan_label_has_objects(Relation rel, AttrNumber attnum);
+static List *pgan_defer_labels(Query *query);
+static Node *pgan_defer_expand_mutator(Node *node, void *context);
+static Node *pgan_defer_replace_mutator(Node *node, void *context);
 static bool pgan_hack_query(Node *node, void *context);
-static void pgan_hack_rte(RangeTblEntry *rte);
+static void pgan_hack_rte(Query *query, RangeTblEntry *rte);
+static bool pgan_explain_walker(Node *node, void *context);
+static void pgan_explain_add_rel(pganExplainState *state, Relation rel,
+								 bool inh, bool deferred, Node **exprs,
+								 Bitmapset *attnums);
+static bool pgan_explain_rows_walker(PlanState *planstate, void *context);
+static void pgan_explain_print(pganExplainState *state,
+							   QueryDesc *queryDesc);
+static Query *pgan_parse_analyze(const char *sql, Relation rel);
+static bool pgan_rel_is_anonymizable(Relation rel, bool is_copy);
 static bool pgan_is_role_anonymized(void);
+static bool pgan_labeled_var_walker(Node *node, void *context);
 static void pgan_object_relabel(const ObjectAddress *object,
 							    const char *seclabel);
+static void pgan_invalidate_ancestors(Oid relid);
+static void pgan_relcache_callback(Datum arg, Oid relid);
+static void pgan_shmem_request(void);
+static void pgan_shmem_startup(void);
+static Size pgan_stats_memsize(void);
+static void pgan_stats_count(Oid relid, pganStatsKind kind, double time);
+static void pgan_stats_start(instr_time *start);
+static void pgan_stats_time(Oid relid, pganStatsKind kind, instr_time start);
+static uint64 pgan_shared_generation(void);
+#if PG_VERSION_NUM >= 110000
+static bool pgan_shared_attach(void);
+static void pgan_shared_bump_generation(void);
+static TransactionId pgan_get_rel_xmin(Oid relid);
+static bool pgan_shared_lookup(Relation rel, uint64 generation,
+							   pganWalkerContext *context, Node ***exprs);
+static void pgan_shared_store(Relation rel, pganRelLabels *entry);
+static void pgan_shared_sweep(void);
+static void pgan_xact_callback(XactEvent event, void *arg);
+#endif
+static void pgan_authid_callback(Datum arg, int cacheid, uint32 hashvalue);
+static void pgan_proc_callback(Datum arg, int cacheid, uint32 hashvalue);
+static void pgan_subscription_rel_callback(Datum arg, int cacheid,
+										   uint32 hashvalue);
 
 
 void
@@ -237,6 +787,87 @@ _PG_init(void)
 							 NULL,
 							 NULL);
 
+	DefineCustomBoolVariable("pg_anonymize.defer_evaluation",
+							 "Evaluate security labels after ORDER BY and LIMIT when possible.",
+							 NULL,
+							 &pgan_defer_evaluation,
+							 true,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("pg_anonymize.label_indexes",
+							 "Create expression indexes on the security labels.",
+							 NULL,
+							 &pgan_label_indexes,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+#if PG_VERSION_NUM >= 140000
+	DefineCustomBoolVariable("pg_anonymize.label_statistics",
+							 "Create extended statistics on the security labels.",
+							 NULL,
+							 &pgan_label_statistics,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+#endif
+
+	DefineCustomBoolVariable("pg_anonymize.optimize_labels",
+							 "Evaluate common security label expressions with specialized implementations.",
+							 "Only used if the pg_anonymize extension is created in the database.",
+							 &pgan_optimize_labels,
+							 true,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+#if PG_VERSION_NUM >= 140000
+	DefineCustomBoolVariable("pg_anonymize.copy_direct",
+							 "Directly scan the table in anonymized COPY TO STDOUT when possible.",
+							 NULL,
+							 &pgan_copy_direct,
+							 true,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+#endif
+
+	DefineCustomStringVariable("pg_anonymize.copy_since",
+							   "Only emit the rows modified since the given transaction in anonymized COPY TO.",
+							   NULL,
+							   &pgan_copy_since,
+							   "",
+							   PGC_USERSET,
+							   0,
+							   pgan_check_copy_since,
+							   NULL,
+							   NULL);
+
+	DefineCustomStringVariable("pg_anonymize.copy_tablesample",
+							   "TABLESAMPLE clause to apply to anonymized COPY TO.",
+							   NULL,
+							   &pgan_copy_tablesample,
+							   "",
+							   PGC_USERSET,
+							   0,
+							   pgan_check_copy_tablesample,
+							   NULL,
+							   NULL);
+
 	DefineCustomBoolVariable("pg_anonymize.enabled",
 							 "Globally enable pg_anonymize.",
 							 NULL,
@@ -259,6 +890,77 @@ _PG_init(void)
 							 NULL,
 							 NULL);
 
+	DefineCustomStringVariable("pg_anonymize.pseudonym_key",
+							   "Key used by the pseudonymization and fake data functions.",
+							   "32 hexadecimal digits.",
+							   &pgan_pseudonym_key,
+							   "",
+							   PGC_SUSET,
+							   GUC_SUPERUSER_ONLY,
+							   pgan_check_pseudonym_key,
+							   pgan_assign_pseudonym_key,
+							   NULL);
+
+	DefineCustomStringVariable("pg_anonymize.encryption_key",
+							   "Key used by the format-preserving encryption functions.",
+							   "32, 48 or 64 hexadecimal digits, for AES-128, AES-192 or AES-256.",
+							   &pgan_encryption_key,
+							   "",
+							   PGC_SUSET,
+							   GUC_SUPERUSER_ONLY,
+							   pgan_check_encryption_key,
+							   pgan_assign_encryption_key,
+							   NULL);
+
+	/*
+	 * The shared cache of security labels and the statistics are only
+	 * available when loaded in shared_preload_libraries, otherwise only the
+	 * backend-local cache is used.  Their parameters can only be set at
+	 * server start, so they can't be defined otherwise.
+	 */
+	if (process_shared_preload_libraries_in_progress)
+	{
+		DefineCustomIntVariable("pg_anonymize.shared_cache_entries",
+								"Maximum number of relations in the shared cache of security labels.",
+								"Only used if pg_anonymize is in shared_preload_libraries, 0 disables the shared cache.",
+								&pgan_shared_cache_entries,
+								1024,
+								0,
+								INT_MAX / 2,
+								PGC_POSTMASTER,
+								0,
+								NULL,
+								NULL,
+								NULL);
+
+		DefineCustomIntVariable("pg_anonymize.stats_max",
+								"Maximum number of relations tracked in pg_anonymize_stats.",
+								"Only used if pg_anonymize is in shared_preload_libraries, 0 disables the statistics.",
+								&pgan_stats_max,
+								5000,
+								0,
+								INT_MAX / 2,
+								PGC_POSTMASTER,
+								0,
+								NULL,
+								NULL,
+								NULL);
+
+#if PG_VERSION_NUM >= 150000
+		prev_shmem_request_hook = shmem_request_hook;
+		shmem_request_hook = pgan_shmem_request;
+#else
+		pgan_shmem_request();
+#endif
+		prev_shmem_startup_hook = shmem_startup_hook;
+		shmem_startup_hook = pgan_shmem_startup;
+
+#if PG_VERSION_NUM >= 110000
+		if (pgan_shared_cache_entries > 0)
+			RegisterXactCallback(pgan_xact_callback, NULL);
+#endif
+	}
+
 	MarkGUCPrefixReserved("pg_anonymize");
 
 	/* Install hooks. */
@@ -266,6 +968,17 @@ _PG_init(void)
 	post_parse_analyze_hook = pgan_post_parse_analyze;
 	prev_ProcessUtility = ProcessUtility_hook;
 	ProcessUtility_hook = pgan_ProcessUtility;
+	prev_ExplainOneQuery = ExplainOneQuery_hook;
+	ExplainOneQuery_hook = pgan_ExplainOneQuery;
+	prev_ExecutorEnd = ExecutorEnd_hook;
+	ExecutorEnd_hook = pgan_ExecutorEnd;
+
+	/* Keep our label cache in sync with the catalogs. */
+	CacheRegisterRelcacheCallback(pgan_relcache_callback, (Datum) 0);
+	CacheRegisterSyscacheCallback(AUTHOID, pgan_authid_callback, (Datum) 0);
+	CacheRegisterSyscacheCallback(PROCOID, pgan_proc_callback, (Datum) 0);
+	CacheRegisterSyscacheCallback(SUBSCRIPTIONRELMAP,
+								  pgan_subscription_rel_callback, (Datum) 0);
 }
 
 /*
@@ -317,6 +1030,8 @@ pgan_check_expression_valid(Relation rel, const ObjectAddress *object,
 	bool prev_xact_read_only;
 	char *prev_search_path;
 
+	pgan_stats_count(RelationGetRelid(rel), PGAN_STATS_VALIDATION, 0);
+
 	initStringInfo(&sql);
 	appendStringInfo(&sql, "SELECT pg_typeof(%s)::regtype::oid FROM %s.%s LIMIT 1",
 			seclabel,
@@ -402,400 +1117,5462 @@ pgan_check_expression_valid(Relation rel, const ObjectAddress *object,
 }
 
 /*
- * Check that pg_anonymize is loaded last according to the given
- * xxx_preload_libraries_string.
+ * Check whether the given security label expression can be used for an
+ * expression index, or an extended statistics object if for_index is false.
  *
- * If missing_ok is true, don't raise an error if pg_anonymize is not present.
+ * Returns NULL if that's the case, otherwise a description of the problem.
+ */
+static const char *
+pgan_label_ineligible_reason(Relation rel, const char *seclabel,
+							 bool for_index)
+{
+	StringInfoData sql;
+	Query	   *query;
+	Node	   *expr;
+
+	initStringInfo(&sql);
+	appendStringInfo(&sql, "SELECT %s FROM ONLY %s.%s",
+					 seclabel,
+					 quote_identifier(get_namespace_name(RelationGetNamespace(rel))),
+					 quote_identifier(RelationGetRelationName(rel)));
+	query = pgan_parse_analyze(sql.data, rel);
+	expr = (Node *) linitial_node(TargetEntry, query->targetList)->expr;
+
+	if (query->hasSubLinks)
+		return "expression contains a subquery";
+	if (IsA(expr, Var))
+		return "expression is a plain column";
+	if (!contain_var_clause(expr))
+		return "expression does not reference any column";
+	if (contain_mutable_functions(expr))
+		return "expression is not immutable";
+	if (for_index &&
+		!OidIsValid(GetDefaultOpClass(exprType(expr), BTREE_AM_OID)))
+		return "expression type has no default operator class for btree";
+
+	return NULL;
+}
+
+/*
+ * Create or drop the expression index and extended statistics object on the
+ * given security label expression.
+ *
+ * After anonymization, any qual or join clause on an anonymized column
+ * references the security label expression rather than a plain column, so
+ * the planner can't use any index or statistics on the underlying column.
+ * As the security label is analyzed the same way when generating the
+ * anonymized queries, an index or statistics object on the exact same
+ * expression will be matched by the planner as any other expression index or
+ * statistics.
+ *
+ * Any previously created object for the column is always removed, and a new
+ * one is created if the corresponding GUC is enabled and the given expression
+ * is suitable.
  */
 static void
-pgan_check_preload_lib(char *libnames, char *kind, bool missing_ok)
+pgan_sync_label_objects(Relation rel, AttrNumber attnum, const char *seclabel)
 {
-		List	   *xpl;
-		ListCell   *lc;
-		char	   *rawstring;
-		char	   *libname;
-		int			nb;
+	StringInfoData sql;
+	Oid			nspid = RelationGetNamespace(rel);
+	char	   *nspname;
+	char	   *relname;
+	char		idxname[NAMEDATALEN];
+	Oid			idxoid;
+	bool		idx_exists;
+	bool		create_idx = false;
+#if PG_VERSION_NUM >= 140000
+	char		stxname[NAMEDATALEN];
+	bool		stx_exists;
+	bool		create_stx = false;
+#endif
+	int			save_nestlevel;
+	int			ret;
+
+	snprintf(idxname, NAMEDATALEN, "pgan_%u_%d_idx",
+			 RelationGetRelid(rel), attnum);
+	idxoid = get_relname_relid(idxname, nspid);
+	idx_exists = (OidIsValid(idxoid) &&
+				  (get_rel_relkind(idxoid) == RELKIND_INDEX
+#if PG_VERSION_NUM >= 110000
+				   || get_rel_relkind(idxoid) == RELKIND_PARTITIONED_INDEX
+#endif
+				   ));
 
-		/* Need a modifiable copy of string */
-		rawstring = pstrdup(libnames);
+	if (seclabel && pgan_label_indexes)
+		create_idx = (pgan_label_ineligible_reason(rel, seclabel, true) == NULL);
 
-		if (!SplitIdentifierString(rawstring, ',', &xpl))
-			elog(ERROR, "Could not parse %s", kind);
+#if PG_VERSION_NUM >= 140000
+	snprintf(stxname, NAMEDATALEN, "pgan_%u_%d_stat",
+			 RelationGetRelid(rel), attnum);
+	stx_exists = SearchSysCacheExists2(STATEXTNAMENSP,
+									   CStringGetDatum(stxname),
+									   ObjectIdGetDatum(nspid));
 
-		if (!missing_ok)
-		{
-			/* First a quick check to make sure we're the last element. */
-			libname = (char *) llast(xpl);
-			if (strcmp(libname, "pg_anonymize") != 0)
-				elog(ERROR, "pg_anonymize needs to be last in %s", kind);
-		}
+	if (seclabel && pgan_label_statistics)
+		create_stx = (pgan_label_ineligible_reason(rel, seclabel, false) == NULL);
 
-		/*
-		 * Some paranoid check: make sure we're not also somewhere else in the
-		 * xxx_preload_libraries, as in that case we would not be loaded
-		 * last.
-		 */
-		nb = 1;
-		foreach(lc, xpl)
-		{
-			libname = (char *) lfirst(lc);
+	if (!idx_exists && !create_idx && !stx_exists && !create_stx)
+		return;
+#else
+	if (!idx_exists && !create_idx)
+		return;
+#endif
 
-			if (nb != list_length(xpl) && strcmp(libname, "pg_anonymize") == 0)
-				elog(ERROR, "pg_anonymize needs to be last in %s", kind);
+	nspname = quote_identifier(get_namespace_name(nspid));
+	relname = quote_identifier(RelationGetRelationName(rel));
 
-			nb++;
-		}
-}
+	if ((ret = SPI_connect()) < 0)
+	{
+		/* internal error */
+		elog(ERROR, "SPI_connect returned %d", ret);
+	}
 
-/*
- * Adaptation of CopyGetAttnums that optionally allows generated attributes
- */
-static List *
-pgan_get_attnums(TupleDesc tupDesc, Relation rel, List *attnamelist,
-				 bool is_copy)
-{
-	List	   *attnums = NIL;
+	/* Use the same search_path as when the expression is analyzed. */
+	save_nestlevel = NewGUCNestLevel();
+	(void) set_config_option("search_path", "pg_catalog", PGC_USERSET,
+							 PGC_S_SESSION, GUC_ACTION_SAVE, true, 0, false);
 
-	if (attnamelist == NIL)
+	initStringInfo(&sql);
+	if (idx_exists)
 	{
-		/* Generate default column list */
-		int			attr_count = tupDesc->natts;
-		int			i;
+		appendStringInfo(&sql, "DROP INDEX %s.%s",
+						 nspname, quote_identifier(idxname));
+		ret = SPI_execute(sql.data, false, 0);
+		if (ret != SPI_OK_UTILITY)
+			elog(ERROR, "could not drop index \"%s\": error code %d",
+				 idxname, ret);
+	}
 
-		for (i = 0; i < attr_count; i++)
-		{
-			if (TupleDescAttr(tupDesc, i)->attisdropped)
-				continue;
-#if PG_VERSION_NUM >= 120000
-			/* Only COPY should ignore generated attributes */
-			if (TupleDescAttr(tupDesc, i)->attgenerated && is_copy)
-				continue;
-#endif
-			attnums = lappend_int(attnums, i + 1);
-		}
+	if (create_idx)
+	{
+		resetStringInfo(&sql);
+		appendStringInfo(&sql, "CREATE INDEX %s ON %s.%s ((%s))",
+						 quote_identifier(idxname), nspname, relname,
+						 seclabel);
+		ret = SPI_execute(sql.data, false, 0);
+		if (ret != SPI_OK_UTILITY)
+			elog(ERROR, "could not create index \"%s\": error code %d",
+				 idxname, ret);
 	}
-	else
+
+#if PG_VERSION_NUM >= 140000
+	if (stx_exists)
 	{
-		/* Validate the user-supplied list and extract attnums */
-		ListCell   *l;
+		resetStringInfo(&sql);
+		appendStringInfo(&sql, "DROP STATISTICS %s.%s",
+						 nspname, quote_identifier(stxname));
+		ret = SPI_execute(sql.data, false, 0);
+		if (ret != SPI_OK_UTILITY)
+			elog(ERROR, "could not drop statistics \"%s\": error code %d",
+				 stxname, ret);
+	}
 
-		foreach(l, attnamelist)
+	if (create_stx)
+	{
+		resetStringInfo(&sql);
+		appendStringInfo(&sql, "CREATE STATISTICS %s.%s ON (%s) FROM %s.%s",
+						 nspname, quote_identifier(stxname), seclabel,
+						 nspname, relname);
+		ret = SPI_execute(sql.data, false, 0);
+		if (ret != SPI_OK_UTILITY)
+			elog(ERROR, "could not create statistics \"%s\": error code %d",
+				 stxname, ret);
+	}
+#endif
+
+	AtEOXact_GUC(true, save_nestlevel);
+	SPI_finish();
+}
+
+/*
+ * Report all the security labels declared on columns, whether they can be
+ * used for an expression index, and the expression index maintained by
+ * pg_anonymize if any.
+ *
+ * A security label that can't be analyzed anymore, e.g. because a function it
+ * uses has been dropped, is reported with a WARNING and skipped.
+ */
+Datum
+pg_anonymize_label_indexes(PG_FUNCTION_ARGS)
+{
+#define PG_ANONYMIZE_LABEL_INDEXES_COLS	6
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	Relation	secRel;
+	ScanKeyData key;
+	SysScanDesc scan;
+	HeapTuple	tuple;
+	ResourceOwner oldowner = CurrentResourceOwner;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	ScanKeyInit(&key,
+				Anum_pg_seclabel_provider,
+				BTEqualStrategyNumber, F_TEXTEQ,
+				CStringGetTextDatum(PGAN_PROVIDER));
+
+	secRel = table_open(SecLabelRelationId, AccessShareLock);
+	scan = systable_beginscan(secRel, InvalidOid, false, NULL, 1, &key);
+
+	while (HeapTupleIsValid(tuple = systable_getnext(scan)))
+	{
+		FormData_pg_seclabel *form = (FormData_pg_seclabel *) GETSTRUCT(tuple);
+		Datum		values[PG_ANONYMIZE_LABEL_INDEXES_COLS];
+		bool		nulls[PG_ANONYMIZE_LABEL_INDEXES_COLS];
+		Relation	rel;
+		Form_pg_attribute att;
+		char	   *seclabel;
+		const char *reason;
+		char		idxname[NAMEDATALEN];
+		Oid			idxoid;
+		Datum		datum;
+		bool		isnull;
+		bool		failed;
+		int			i = 0;
+
+		if (form->classoid != RelationRelationId || form->objsubid <= 0)
+			continue;
+
+		datum = heap_getattr(tuple, Anum_pg_seclabel_label,
+							 RelationGetDescr(secRel), &isnull);
+		if (isnull)
+			continue;
+
+		rel = try_relation_open(form->objoid, AccessShareLock);
+		if (rel == NULL)
+			continue;
+
+		if (form->objsubid > RelationGetNumberOfAttributes(rel) ||
+			TupleDescAttr(RelationGetDescr(rel),
+						  form->objsubid - 1)->attisdropped)
+		{
+			relation_close(rel, AccessShareLock);
+			continue;
+		}
+
+		att = TupleDescAttr(RelationGetDescr(rel), form->objsubid - 1);
+		seclabel = TextDatumGetCString(datum);
+
+		/*
+		 * Analyzing the expression can fail, so do it in a subtransaction to
+		 * be able to report the other ones.
+		 */
+		failed = false;
+		BeginInternalSubTransaction(NULL);
+		MemoryContextSwitchTo(oldcontext);
+		PG_TRY();
+		{
+			reason = pgan_label_ineligible_reason(rel, seclabel, true);
+
+			ReleaseCurrentSubTransaction();
+			MemoryContextSwitchTo(oldcontext);
+			CurrentResourceOwner = oldowner;
+		}
+		PG_CATCH();
+		{
+			ErrorData  *edata;
+
+			MemoryContextSwitchTo(oldcontext);
+			edata = CopyErrorData();
+			FlushErrorState();
+
+			RollbackAndReleaseCurrentSubTransaction();
+			MemoryContextSwitchTo(oldcontext);
+			CurrentResourceOwner = oldowner;
+
+			ereport(WARNING,
+					(errmsg("could not check the security label of column \"%s\" of relation \"%s\"",
+							NameStr(att->attname),
+							RelationGetRelationName(rel)),
+					 errdetail("%s", edata->message)));
+			FreeErrorData(edata);
+			failed = true;
+		}
+		PG_END_TRY();
+
+		if (failed)
+		{
+			relation_close(rel, AccessShareLock);
+			continue;
+		}
+
+		snprintf(idxname, NAMEDATALEN, "pgan_%u_%d_idx",
+				 RelationGetRelid(rel), form->objsubid);
+		idxoid = get_relname_relid(idxname, RelationGetNamespace(rel));
+
+		memset(nulls, 0, sizeof(nulls));
+
+		values[i++] = ObjectIdGetDatum(RelationGetRelid(rel));
+		values[i++] = NameGetDatum(&att->attname);
+		values[i++] = CStringGetTextDatum(seclabel);
+		values[i++] = BoolGetDatum(reason == NULL);
+		if (reason)
+			values[i++] = CStringGetTextDatum(reason);
+		else
+			nulls[i++] = true;
+		if (OidIsValid(idxoid))
+			values[i++] = ObjectIdGetDatum(idxoid);
+		else
+			nulls[i++] = true;
+
+		Assert(i == PG_ANONYMIZE_LABEL_INDEXES_COLS);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+
+		relation_close(rel, AccessShareLock);
+	}
+
+	systable_endscan(scan);
+	table_close(secRel, AccessShareLock);
+
+	return (Datum) 0;
+}
+
+/*
+ * Report the shared statistics, one row per database, user and relation.
+ */
+Datum
+pg_anonymize_stats(PG_FUNCTION_ARGS)
+{
+#define PG_ANONYMIZE_STATS_COLS	(3 + PGAN_STATS_NB_COUNTERS + 3 * PGAN_STATS_NB_TIMINGS)
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	HASH_SEQ_STATUS hash_seq;
+	pganStatsEntry *entry;
+
+	if (pgan_stats == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_anonymize statistics are not available"),
+				 errhint("pg_anonymize must be loaded via shared_preload_libraries"
+						 " and pg_anonymize.stats_max must not be 0.")));
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	LWLockAcquire(pgan_shared->stats_lock, LW_SHARED);
+
+	hash_seq_init(&hash_seq, pgan_stats);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		Datum		values[PG_ANONYMIZE_STATS_COLS];
+		bool		nulls[PG_ANONYMIZE_STATS_COLS];
+		pganStatsEntry tmp;
+		int			i = 0;
+		int			j;
+
+		memset(nulls, 0, sizeof(nulls));
+
+		SpinLockAcquire(&entry->mutex);
+		tmp = *entry;
+		SpinLockRelease(&entry->mutex);
+
+		values[i++] = ObjectIdGetDatum(tmp.key.dbid);
+		values[i++] = ObjectIdGetDatum(tmp.key.userid);
+		values[i++] = ObjectIdGetDatum(tmp.key.relid);
+
+		for (j = 0; j < PGAN_STATS_NB_COUNTERS; j++)
+			values[i++] = Int64GetDatum(tmp.counters[j]);
+
+		for (j = 0; j < PGAN_STATS_NB_TIMINGS; j++)
+		{
+			values[i++] = Int64GetDatum(tmp.calls[j]);
+			values[i++] = Float8GetDatum(tmp.total_time[j]);
+			values[i++] = Float8GetDatum(tmp.max_time[j]);
+		}
+
+		Assert(i == PG_ANONYMIZE_STATS_COLS);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	LWLockRelease(pgan_shared->stats_lock);
+
+	return (Datum) 0;
+}
+
+/*
+ * Discard all the shared statistics.
+ */
+Datum
+pg_anonymize_stats_reset(PG_FUNCTION_ARGS)
+{
+	HASH_SEQ_STATUS hash_seq;
+	pganStatsEntry *entry;
+
+	if (pgan_stats == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_anonymize statistics are not available"),
+				 errhint("pg_anonymize must be loaded via shared_preload_libraries"
+						 " and pg_anonymize.stats_max must not be 0.")));
+
+	LWLockAcquire(pgan_shared->stats_lock, LW_EXCLUSIVE);
+
+	hash_seq_init(&hash_seq, pgan_stats);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+		hash_search(pgan_stats, &entry->key, HASH_REMOVE, NULL);
+
+	LWLockRelease(pgan_shared->stats_lock);
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * Export the anonymized data of the given relation in the given COPY format,
+ * using up to the given number of parallel workers.
+ *
+ * The relation is split into as many ranges of blocks as requested workers,
+ * each range being exported in its own file, named after the given path and
+ * the range number, so that concatenating the files in order gives the same
+ * rows as a single COPY TO.  The security labels are always applied,
+ * whether the current role is anonymized or not.  The workers use the
+ * snapshot of the caller, so the export is consistent, and the files are
+ * written with the same privileges as COPY TO.
+ *
+ * The leader only exports the ranges that no worker could, e.g. if no worker
+ * could be launched, or if the security labels aren't parallel safe.
+ */
+Datum
+pg_anonymize_export(PG_FUNCTION_ARGS)
+{
+	Oid			relid = PG_GETARG_OID(0);
+	char	   *path = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	int			nparts = PG_GETARG_INT32(2);
+	char	   *format = text_to_cstring(PG_GETARG_TEXT_PP(3));
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	Relation	rel;
+	char	   *sql;
+	Query	   *query;
+	int			nworkers;
+	ParallelContext *pcxt;
+	Size		size;
+	pganExportShared *shared;
+	pganExportShared *local;
+	char	   *sharedsql;
+	uint32		next;
+	int			part;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	if (nparts < 1 || nparts > PGAN_EXPORT_MAX_PARTS)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("number of workers must be between 1 and %d",
+						PGAN_EXPORT_MAX_PARTS)));
+
+	if (strcmp(format, "text") != 0 && strcmp(format, "csv") != 0 &&
+		strcmp(format, "binary") != 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid export format \"%s\"", format),
+				 errhint("Valid formats are \"text\", \"csv\" and \"binary\".")));
+
+	/* Keep room for the range number */
+	if (strlen(path) >= MAXPGPATH - 5)
+		ereport(ERROR,
+				(errcode(ERRCODE_NAME_TOO_LONG),
+				 errmsg("export path is too long")));
+
+	rel = relation_open(relid, AccessShareLock);
+
+	if (rel->rd_rel->relkind != RELKIND_RELATION &&
+		rel->rd_rel->relkind != RELKIND_MATVIEW)
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("cannot export relation \"%s\"",
+						RelationGetRelationName(rel)),
+				 errdetail("Only tables and materialized views can be exported,"
+						   " partitioned tables have to be exported partition"
+						   " by partition.")));
+
+	sql = pgan_get_query_for_relid(rel, NIL, true, true);
+	Assert(sql != NULL);
+
+	/*
+	 * The security labels are evaluated by the workers, so they have to be
+	 * parallel safe, and temporary tables can't be read by the workers.
+	 */
+	query = pgan_parse_analyze(sql, rel);
+	if (max_parallel_hazard(query) != PROPARALLEL_SAFE)
+	{
+		ereport(NOTICE,
+				(errmsg("exporting relation \"%s\" without parallel workers",
+						RelationGetRelationName(rel)),
+				 errdetail("The security labels are not parallel safe.")));
+		nworkers = 0;
+	}
+	else if (RelationUsesLocalBuffers(rel))
+		nworkers = 0;
+	else
+		nworkers = nparts;
+
+	pgan_stats_count(relid, PGAN_STATS_COPY_REWRITE, 0);
+
+	size = add_size(offsetof(pganExportShared, rows),
+					mul_size(sizeof(uint64), nparts));
+
+	EnterParallelMode();
+	pcxt = CreateParallelContext("pg_anonymize", "pgan_export_worker_main",
+								 nworkers
+#if PG_VERSION_NUM >= 110000 && PG_VERSION_NUM < 120000
+								 , false
+#endif
+								 );
+	shm_toc_estimate_chunk(&pcxt->estimator, size);
+	shm_toc_estimate_chunk(&pcxt->estimator, strlen(sql) + 1);
+	shm_toc_estimate_keys(&pcxt->estimator, 2);
+	InitializeParallelDSM(pcxt);
+
+	shared = shm_toc_allocate(pcxt->toc, size);
+	memset(shared, 0, size);
+	shared->nblocks = RelationGetNumberOfBlocks(rel);
+	shared->nparts = nparts;
+	strlcpy(shared->path, path, sizeof(shared->path));
+	strlcpy(shared->format, format, sizeof(shared->format));
+	pg_atomic_init_u32(&shared->next_part, 0);
+	shm_toc_insert(pcxt->toc, PGAN_EXPORT_KEY_SHARED, shared);
+
+	sharedsql = shm_toc_allocate(pcxt->toc, strlen(sql) + 1);
+	strcpy(sharedsql, sql);
+	shm_toc_insert(pcxt->toc, PGAN_EXPORT_KEY_QUERY, sharedsql);
+
+	LaunchParallelWorkers(pcxt);
+	if (pcxt->nworkers_launched > 0)
+		WaitForParallelWorkersToFinish(pcxt);
+
+	/* Keep what's needed to export the remaining parts, if any. */
+	local = palloc(size);
+	memcpy(local, shared, size);
+	next = pg_atomic_read_u32(&shared->next_part);
+
+	DestroyParallelContext(pcxt);
+	ExitParallelMode();
+
+	for (part = next; part < nparts; part++)
+		local->rows[part] = pgan_export_part(local, sql, part);
+
+	relation_close(rel, NoLock);
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	for (part = 0; part < nparts; part++)
+	{
+		Datum		values[3];
+		bool		nulls[3] = {false, false, false};
+
+		values[0] = Int32GetDatum(part);
+		values[1] = CStringGetTextDatum(psprintf("%s.%d", path, part));
+		values[2] = Int64GetDatum((int64) local->rows[part]);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
+
+/*
+ * Entry point of the parallel export workers: export the remaining parts
+ * until there's none left.
+ */
+void
+pgan_export_worker_main(dsm_segment *seg, shm_toc *toc)
+{
+	pganExportShared *shared;
+	char	   *sql;
+	uint32		part;
+
+	shared = shm_toc_lookup(toc, PGAN_EXPORT_KEY_SHARED, false);
+	sql = shm_toc_lookup(toc, PGAN_EXPORT_KEY_QUERY, false);
+
+	while ((part = pg_atomic_fetch_add_u32(&shared->next_part, 1)) <
+		   (uint32) shared->nparts)
+		shared->rows[part] = pgan_export_part(shared, sql, part);
+}
+
+/*
+ * Export the given part of a parallel export, with the given query
+ * generating the anonymized data of the whole relation, and return the
+ * number of exported rows.
+ *
+ * The part is selected with a ctid range, which is only used to restrict the
+ * scanned blocks as of pg14, so the workers read the whole relation before
+ * that.  The last part has no upper bound, although any visible row should
+ * be in the blocks that existed when the export started.
+ */
+static uint64
+pgan_export_part(const pganExportShared *shared, const char *sql, int part)
+{
+	StringInfoData partsql;
+	List	   *parselist;
+	CopyStmt   *stmt;
+	ParseState *pstate;
+	uint64		processed;
+	bool		prev_toplevel = pgan_toplevel;
+	int			save_nestlevel;
+
+	/* The query is already filtered if pg_anonymize.copy_since is set. */
+	initStringInfo(&partsql);
+	appendStringInfo(&partsql, "%s %s ctid >= '(%u,0)'::pg_catalog.tid",
+					 sql, (pgan_copy_since[0] != '\0' ? "AND" : "WHERE"),
+					 (BlockNumber) ((uint64) shared->nblocks * part /
+									shared->nparts));
+	if (part < shared->nparts - 1)
+		appendStringInfo(&partsql, " AND ctid < '(%u,0)'::pg_catalog.tid",
+						 (BlockNumber) ((uint64) shared->nblocks * (part + 1) /
+										shared->nparts));
+
+	parselist = pg_parse_query(partsql.data);
+	Assert(list_length(parselist) == 1);
+
+	stmt = makeNode(CopyStmt);
+	stmt->query = linitial_node(RawStmt, parselist)->stmt;
+	stmt->is_from = false;
+	stmt->filename = psprintf("%s.%d", shared->path, part);
+	stmt->options = list_make1(makeDefElem("format",
+										   (Node *) makeString(pstrdup(shared->format)),
+										   -1));
+
+	pstate = make_parsestate(NULL);
+	pstate->p_sourcetext = partsql.data;
+
+	/*
+	 * The query is analyzed like the one of a rewritten COPY TO, see
+	 * pgan_ProcessUtility().
+	 */
+	save_nestlevel = NewGUCNestLevel();
+	(void) set_config_option("search_path", "pg_catalog", PGC_USERSET,
+							 PGC_S_SESSION, GUC_ACTION_SAVE, true, 0, false);
+
+	pgan_toplevel = false;
+	pgan_copy_pending = true;
+	PG_TRY();
+	{
+		DoCopy(pstate, stmt, 0, partsql.len, &processed);
+		pgan_toplevel = prev_toplevel;
+		pgan_copy_pending = false;
+	}
+	PG_CATCH();
+	{
+		pgan_toplevel = prev_toplevel;
+		pgan_copy_pending = false;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	AtEOXact_GUC(true, save_nestlevel);
+	free_parsestate(pstate);
+
+	return processed;
+}
+
+#if PG_VERSION_NUM >= 140000
+/*
+ * Execute the given COPY relation TO of an anonymized relation with
+ * pgan_copy_to_frontend() if possible, which avoids the overhead of the
+ * executor for the columns without security label.
+ *
+ * Return false if the COPY has to be rewritten as a COPY of the anonymization
+ * query instead, without having emitted anything.
+ */
+static bool
+pgan_try_copy_direct(Relation rel, CopyStmt *stmt, const char *queryString,
+					 QueryCompletion *qc)
+{
+	Oid			relid = RelationGetRelid(rel);
+	Node	  **exprs;
+	List	   *attnums;
+	ParseState *pstate;
+	uint64		processed;
+	bool		prev_toplevel = pgan_toplevel;
+	bool		done;
+	int			save_nestlevel;
+	int			i;
+
+	/*
+	 * Only COPY TO STDOUT of plain tables is handled, and TABLESAMPLE or
+	 * filtering the rows requires a query.
+	 */
+	if (!pgan_copy_direct || stmt->filename != NULL ||
+		whereToSendOutput != DestRemote ||
+		rel->rd_rel->relkind != RELKIND_RELATION ||
+		pgan_copy_tablesample[0] != '\0' || pgan_copy_since[0] != '\0')
+		return false;
+
+	/*
+	 * Let the rewritten COPY report the missing privileges, if any, and apply
+	 * the row level security policies.
+	 */
+	if (pg_class_aclcheck(relid, GetUserId(), ACL_SELECT) != ACLCHECK_OK ||
+		check_enable_rls(relid, InvalidOid, false) == RLS_ENABLED)
+		return false;
+
+	exprs = pgan_copy_exprs_for_rel(rel, false);
+	if (exprs == NULL)
+		return false;
+
+	/* Sublinks need to be planned. */
+	for (i = 1; i <= RelationGetNumberOfAttributes(rel); i++)
+	{
+		if (exprs[i] != NULL && checkExprHasSubLink(exprs[i]))
+			return false;
+	}
+
+	attnums = pgan_get_attnums(RelationGetDescr(rel), rel, stmt->attlist, true);
+
+	pstate = make_parsestate(NULL);
+	pstate->p_sourcetext = queryString;
+
+	/*
+	 * The security labels are evaluated in the same environment as in a
+	 * rewritten COPY TO, see pgan_ProcessUtility().
+	 */
+	save_nestlevel = NewGUCNestLevel();
+	(void) set_config_option("search_path", "pg_catalog", PGC_USERSET,
+							 PGC_S_SESSION, GUC_ACTION_SAVE, true, 0, false);
+
+	pgan_toplevel = false;
+	PG_TRY();
+	{
+		done = pgan_copy_to_frontend(pstate, rel, attnums, exprs,
+									 stmt->options, &processed);
+		pgan_toplevel = prev_toplevel;
+	}
+	PG_CATCH();
+	{
+		pgan_toplevel = prev_toplevel;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	AtEOXact_GUC(true, save_nestlevel);
+	free_parsestate(pstate);
+
+	if (!done)
+		return false;
+
+	pgan_stats_count(relid, PGAN_STATS_COPY_REWRITE, 0);
+
+	if (qc)
+		SetQueryCompletion(qc, CMDTAG_COPY, processed);
+
+	return true;
+}
+#endif
+
+/*
+ * Trigger function logging the keys of the rows deleted from the relation in
+ * the pg_anonymize_deleted table, so that an incremental export, see
+ * pg_anonymize.copy_since, can also remove them.
+ *
+ * It has to be fired AFTER ... FOR EACH STATEMENT, with an OLD TABLE
+ * transition relation for DELETE, and both OLD TABLE and NEW TABLE for
+ * UPDATE, in which case only the keys that don't exist anymore are logged.
+ * The key is the replica identity of the relation, its primary key by
+ * default, as a jsonb object where the anonymized columns have the value of
+ * their security label, as in the export.  A TRUNCATE is logged with a NULL
+ * key.
+ *
+ * The keys are computed with the privileges of the current user, and only
+ * logged with the privileges of the owner of pg_anonymize_deleted.
+ */
+Datum
+pg_anonymize_log_deleted(PG_FUNCTION_ARGS)
+{
+	TriggerData *trigdata = (TriggerData *) fcinfo->context;
+	Relation	rel;
+	Relation	logrel;
+	Oid			nspid;
+	Oid			logrelid;
+	Oid			logowner;
+	Oid			save_userid;
+	int			save_sec_context;
+	int			save_nestlevel;
+	bool		prev_toplevel = pgan_toplevel;
+	Datum		keys = (Datum) 0;
+	bool		keys_isnull = true;
+	StringInfoData sql;
+	int			ret;
+
+	if (!CALLED_AS_TRIGGER(fcinfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+				 errmsg("function \"%s\" was not called by trigger manager",
+						"pg_anonymize_log_deleted")));
+
+	if (!TRIGGER_FIRED_AFTER(trigdata->tg_event) ||
+		!TRIGGER_FIRED_FOR_STATEMENT(trigdata->tg_event))
+		ereport(ERROR,
+				(errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+				 errmsg("function \"%s\" must be fired AFTER ... FOR EACH STATEMENT",
+						"pg_anonymize_log_deleted")));
+
+	rel = trigdata->tg_relation;
+
+	/* The log table is created along with this function. */
+	nspid = get_func_namespace(fcinfo->flinfo->fn_oid);
+	logrelid = get_relname_relid("pg_anonymize_deleted", nspid);
+	if (!OidIsValid(logrelid))
+		elog(ERROR, "could not find table pg_anonymize_deleted");
+
+	logrel = table_open(logrelid, AccessShareLock);
+	logowner = logrel->rd_rel->relowner;
+	table_close(logrel, AccessShareLock);
+
+	if ((ret = SPI_connect()) < 0)
+	{
+		/* internal error */
+		elog(ERROR, "SPI_connect returned %d", ret);
+	}
+
+	/* Use the same search_path as when the expressions are analyzed. */
+	save_nestlevel = NewGUCNestLevel();
+	(void) set_config_option("search_path", "pg_catalog", PGC_USERSET,
+							 PGC_S_SESSION, GUC_ACTION_SAVE, true, 0, false);
+
+	initStringInfo(&sql);
+
+	pgan_toplevel = false;
+	PG_TRY();
+	{
+		if (!TRIGGER_FIRED_BY_TRUNCATE(trigdata->tg_event))
+		{
+			Trigger    *trigger = trigdata->tg_trigger;
+			Bitmapset  *keyattrs;
+			char	  **seclabels;
+			StringInfoData keyexpr;
+			int			i;
+
+			if (trigger->tgoldtable == NULL ||
+				(TRIGGER_FIRED_BY_UPDATE(trigdata->tg_event) &&
+				 trigger->tgnewtable == NULL))
+				ereport(ERROR,
+						(errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+						 errmsg("function \"%s\" requires the transition relations of the trigger",
+								"pg_anonymize_log_deleted"),
+						 errhint("Declare the trigger with REFERENCING OLD TABLE, and also NEW TABLE for UPDATE.")));
+
+			keyattrs = RelationGetIndexAttrBitmap(rel,
+												  INDEX_ATTR_BITMAP_IDENTITY_KEY);
+			if (keyattrs == NULL)
+				ereport(ERROR,
+						(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+						 errmsg("relation \"%s\" has no replica identity index",
+								RelationGetRelationName(rel)),
+						 errhint("Add a primary key to the relation or use REPLICA IDENTITY USING INDEX.")));
+
+			seclabels = pgan_get_rel_seclabels(rel);
+
+			initStringInfo(&keyexpr);
+			appendStringInfoString(&keyexpr, "pg_catalog.jsonb_build_object(");
+			i = -1;
+			while ((i = bms_next_member(keyattrs, i)) >= 0)
+			{
+				AttrNumber	attnum = i + FirstLowInvalidHeapAttributeNumber;
+				char	   *attname = NameStr(TupleDescAttr(RelationGetDescr(rel),
+															attnum - 1)->attname);
+
+				if (keyexpr.data[keyexpr.len - 1] != '(')
+					appendStringInfoString(&keyexpr, ", ");
+
+				appendStringInfo(&keyexpr, "%s, ", quote_literal_cstr(attname));
+				if (seclabels != NULL && seclabels[attnum] != NULL)
+					appendStringInfo(&keyexpr, "(%s)", seclabels[attnum]);
+				else
+					appendStringInfoString(&keyexpr, quote_identifier(attname));
+			}
+			appendStringInfoChar(&keyexpr, ')');
+
+			appendStringInfo(&sql,
+							 "SELECT pg_catalog.array_agg(k) FROM (SELECT %s AS k FROM %s",
+							 keyexpr.data, quote_identifier(trigger->tgoldtable));
+			if (TRIGGER_FIRED_BY_UPDATE(trigdata->tg_event))
+				appendStringInfo(&sql, " EXCEPT SELECT %s FROM %s",
+								 keyexpr.data,
+								 quote_identifier(trigger->tgnewtable));
+			appendStringInfoString(&sql, ") s");
+
+			SPI_register_trigger_data(trigdata);
+			ret = SPI_execute(sql.data, true, 1);
+			if (ret != SPI_OK_SELECT)
+				elog(ERROR, "could not compute the deleted keys: error code %d",
+					 ret);
+
+			Assert(SPI_processed == 1);
+			keys = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc,
+								 1, &keys_isnull);
+		}
+
+		if (TRIGGER_FIRED_BY_TRUNCATE(trigdata->tg_event) || !keys_isnull)
+		{
+			Oid			argtypes[2];
+			Datum		values[2];
+
+			argtypes[0] = OIDOID;
+			values[0] = ObjectIdGetDatum(RelationGetRelid(rel));
+
+			resetStringInfo(&sql);
+			appendStringInfo(&sql,
+							 "INSERT INTO %s.pg_anonymize_deleted (relid, key) ",
+							 quote_identifier(get_namespace_name(nspid)));
+
+			if (keys_isnull)
+				appendStringInfoString(&sql, "VALUES ($1, NULL)");
+			else
+			{
+				argtypes[1] = get_array_type(JSONBOID);
+				values[1] = keys;
+				appendStringInfoString(&sql, "SELECT $1, pg_catalog.unnest($2)");
+			}
+
+			GetUserIdAndSecContext(&save_userid, &save_sec_context);
+			SetUserIdAndSecContext(logowner,
+								   save_sec_context |
+								   SECURITY_LOCAL_USERID_CHANGE |
+								   SECURITY_RESTRICTED_OPERATION);
+
+			ret = SPI_execute_with_args(sql.data, keys_isnull ? 1 : 2,
+										argtypes, values, NULL, false, 0);
+			if (ret != SPI_OK_INSERT)
+				elog(ERROR, "could not log the deleted keys: error code %d",
+					 ret);
+
+			SetUserIdAndSecContext(save_userid, save_sec_context);
+		}
+
+		pgan_toplevel = prev_toplevel;
+	}
+	PG_CATCH();
+	{
+		pgan_toplevel = prev_toplevel;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	AtEOXact_GUC(true, save_nestlevel);
+	SPI_finish();
+
+	return PointerGetDatum(NULL);
+}
+
+/*
+ * Create a shadow table for the given relation, holding the anonymized data
+ * of all its rows, and the triggers maintaining it.  The anonymized roles
+ * then read the shadow table rather than evaluating the security labels, see
+ * pgan_get_shadow().
+ *
+ * The shadow table is created in the schema of the relation and with the
+ * same owner, and no privilege is granted on it.  It has the same columns as
+ * the relation, and an additional one holding the original replica identity
+ * of the rows, so that the deleted or updated rows can be found again.
+ */
+Datum
+pg_anonymize_shadow_create(PG_FUNCTION_ARGS)
+{
+	Oid			relid = PG_GETARG_OID(0);
+	Relation	rel;
+	Relation	shadow;
+	Oid			nspid;
+	Oid			funcnspid;
+	Oid			shadowid;
+	char		shadowname[NAMEDATALEN];
+	char	   *qualrel;
+	char	   *qualshadow;
+	char	   *funcname;
+	char	   *trigarg;
+	Oid			owner;
+	List	   *stmts = NIL;
+	ListCell   *lc;
+
+	/* Block concurrent writes until the triggers are created. */
+	rel = table_open(relid, ShareRowExclusiveLock);
+	nspid = RelationGetNamespace(rel);
+
+	pgan_shadow_check_owner(rel);
+
+	if (rel->rd_rel->relkind != RELKIND_RELATION)
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("\"%s\" is not a table",
+						RelationGetRelationName(rel))));
+
+	if (rel->rd_rel->relpersistence == RELPERSISTENCE_TEMP)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("cannot create a shadow table for temporary relation \"%s\"",
+						RelationGetRelationName(rel))));
+
+	/*
+	 * The statement triggers of a relation don't see the rows modified through
+	 * its ancestors, and do see the rows of its descendants.
+	 */
+	if (rel->rd_rel->relispartition || rel->rd_rel->relhassubclass ||
+		pgan_get_ancestors(relid) != NIL)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("cannot create a shadow table for relation \"%s\"",
+						RelationGetRelationName(rel)),
+				 errdetail("Relations that are part of an inheritance tree are not supported.")));
+
+	if (pgan_get_shadow_name(rel, false) != NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_DUPLICATE_OBJECT),
+				 errmsg("relation \"%s\" already has a shadow table",
+						RelationGetRelationName(rel))));
+
+	if (get_attnum(relid, PGAN_SHADOW_KEY) != InvalidAttrNumber)
+		ereport(ERROR,
+				(errcode(ERRCODE_DUPLICATE_COLUMN),
+				 errmsg("relation \"%s\" has a column named \"%s\"",
+						RelationGetRelationName(rel), PGAN_SHADOW_KEY)));
+
+	/* Check that the relation has a replica identity. */
+	(void) pgan_shadow_key_expr(rel);
+
+	pgan_get_shadow_relname(relid, shadowname);
+	qualrel = pgan_qualified_relname(rel);
+	qualshadow = quote_qualified_identifier(get_namespace_name(nspid),
+											shadowname);
+	/* The trigger function is created along with this function. */
+	funcnspid = get_func_namespace(fcinfo->flinfo->fn_oid);
+	funcname = quote_qualified_identifier(get_namespace_name(funcnspid),
+										  "pg_anonymize_shadow_sync");
+	trigarg = quote_literal_cstr(shadowname);
+
+	/* Same columns, types, typmods and collations, without constraints. */
+	stmts = lappend(stmts,
+					psprintf("CREATE %sTABLE %s AS SELECT *, NULL::pg_catalog.jsonb AS %s FROM ONLY %s WITH NO DATA",
+							 rel->rd_rel->relpersistence == RELPERSISTENCE_UNLOGGED ?
+							 "UNLOGGED " : "",
+							 qualshadow, PGAN_SHADOW_KEY, qualrel));
+	stmts = lappend(stmts,
+					psprintf("CREATE UNIQUE INDEX ON %s (%s)",
+							 qualshadow, PGAN_SHADOW_KEY));
+	(void) pgan_shadow_execute(rel->rd_rel->relowner, NULL, stmts);
+	CommandCounterIncrement();
+
+	shadowid = get_relname_relid(shadowname, nspid);
+	Assert(OidIsValid(shadowid));
+
+	/*
+	 * The shadow table holds the original replica identity of the rows, so
+	 * only its owner can access it, whatever the default privileges.
+	 */
+	stmts = NIL;
+	foreach(lc, pgan_shadow_grantees(shadowid, rel->rd_rel->relowner))
+	{
+		Oid			grantee = lfirst_oid(lc);
+
+		stmts = lappend(stmts,
+						psprintf("REVOKE ALL ON %s FROM %s", qualshadow,
+								 grantee == ACL_ID_PUBLIC ? "PUBLIC" :
+								 quote_identifier(GetUserNameFromId(grantee,
+																	false))));
+	}
+
+	stmts = lappend(stmts,
+					psprintf("CREATE TRIGGER pg_anonymize_shadow_insert AFTER INSERT ON %s REFERENCING NEW TABLE AS new_rows FOR EACH STATEMENT EXECUTE PROCEDURE %s(%s)",
+							 qualrel, funcname, trigarg));
+	stmts = lappend(stmts,
+					psprintf("CREATE TRIGGER pg_anonymize_shadow_update AFTER UPDATE ON %s REFERENCING OLD TABLE AS old_rows NEW TABLE AS new_rows FOR EACH STATEMENT EXECUTE PROCEDURE %s(%s)",
+							 qualrel, funcname, trigarg));
+	stmts = lappend(stmts,
+					psprintf("CREATE TRIGGER pg_anonymize_shadow_delete AFTER DELETE ON %s REFERENCING OLD TABLE AS old_rows FOR EACH STATEMENT EXECUTE PROCEDURE %s(%s)",
+							 qualrel, funcname, trigarg));
+	stmts = lappend(stmts,
+					psprintf("CREATE TRIGGER pg_anonymize_shadow_truncate AFTER TRUNCATE ON %s FOR EACH STATEMENT EXECUTE PROCEDURE %s(%s)",
+							 qualrel, funcname, trigarg));
+
+	/*
+	 * The triggers must also be fired when session_replication_role is set to
+	 * replica, see pgan_get_shadow_name().
+	 */
+	stmts = lappend(stmts,
+					psprintf("ALTER TABLE %s ENABLE ALWAYS TRIGGER pg_anonymize_shadow_insert, ENABLE ALWAYS TRIGGER pg_anonymize_shadow_update, ENABLE ALWAYS TRIGGER pg_anonymize_shadow_delete, ENABLE ALWAYS TRIGGER pg_anonymize_shadow_truncate",
+							 qualrel));
+
+	/*
+	 * ALTER TABLE refuses to process a relation that is still opened, keep
+	 * the lock and open it again afterwards.
+	 */
+	owner = rel->rd_rel->relowner;
+	table_close(rel, NoLock);
+
+	(void) pgan_shadow_execute(owner, NULL, stmts);
+
+	rel = table_open(relid, NoLock);
+
+	shadow = table_open(shadowid, AccessShareLock);
+	(void) pgan_shadow_refresh(rel, shadow, InvalidAttrNumber, NULL);
+	table_close(shadow, NoLock);
+
+	table_close(rel, NoLock);
+
+	PG_RETURN_OID(shadowid);
+}
+
+/*
+ * Remove the triggers maintaining the shadow table of the given relation, and
+ * the shadow table itself.
+ */
+Datum
+pg_anonymize_shadow_drop(PG_FUNCTION_ARGS)
+{
+	Oid			relid = PG_GETARG_OID(0);
+	Relation	rel;
+	Oid			funcid;
+	Oid			shadowid;
+	char	   *qualrel;
+	List	   *stmts = NIL;
+	int			i;
+
+	rel = table_open(relid, AccessExclusiveLock);
+
+	pgan_shadow_check_owner(rel);
+
+	shadowid = pgan_get_shadow_relid(rel, pgan_get_shadow_name(rel, false));
+	funcid = pgan_get_shadow_func();
+	qualrel = pgan_qualified_relname(rel);
+
+	for (i = 0; rel->trigdesc && i < rel->trigdesc->numtriggers; i++)
+	{
+		Trigger    *trigger = &rel->trigdesc->triggers[i];
+
+		if (trigger->tgfoid != funcid)
+			continue;
+
+		stmts = lappend(stmts,
+						psprintf("DROP TRIGGER %s ON %s",
+								 quote_identifier(trigger->tgname), qualrel));
+	}
+
+	if (stmts == NIL)
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_OBJECT),
+				 errmsg("relation \"%s\" does not have a shadow table",
+						RelationGetRelationName(rel))));
+
+	/* Only drop the table if it really is the shadow table. */
+	if (OidIsValid(shadowid))
+		stmts = lappend(stmts,
+						psprintf("DROP TABLE %s",
+								 quote_qualified_identifier(get_namespace_name(RelationGetNamespace(rel)),
+															get_rel_name(shadowid))));
+
+	(void) pgan_shadow_execute(rel->rd_rel->relowner, NULL, stmts);
+
+	table_close(rel, NoLock);
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * Compute again the whole content of the shadow table of the given relation,
+ * and return the number of rows.
+ */
+Datum
+pg_anonymize_shadow_refresh(PG_FUNCTION_ARGS)
+{
+	Oid			relid = PG_GETARG_OID(0);
+	Relation	rel;
+	Relation	shadow;
+	Oid			shadowid;
+	uint64		rows;
+
+	rel = table_open(relid, ShareRowExclusiveLock);
+
+	pgan_shadow_check_owner(rel);
+
+	shadowid = pgan_get_shadow_relid(rel, pgan_get_shadow_name(rel, false));
+	if (!OidIsValid(shadowid))
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_OBJECT),
+				 errmsg("relation \"%s\" does not have a shadow table",
+						RelationGetRelationName(rel))));
+
+	shadow = table_open(shadowid, AccessShareLock);
+	rows = pgan_shadow_refresh(rel, shadow, InvalidAttrNumber, NULL);
+	table_close(shadow, NoLock);
+
+	table_close(rel, NoLock);
+
+	PG_RETURN_INT64((int64) rows);
+}
+
+/*
+ * Trigger function maintaining the shadow table of a relation, whose name is
+ * given as the only argument and must be the one computed by
+ * pgan_get_shadow_relname().  It has to be declared as AFTER ... FOR EACH
+ * STATEMENT triggers with the transition relations, which
+ * pg_anonymize_shadow_create() does.
+ *
+ * The rows of the old transition relation are removed from the shadow table,
+ * and the anonymized rows of the new transition relation are added.  The
+ * shadow table is modified with the privileges of its owner.
+ */
+Datum
+pg_anonymize_shadow_sync(PG_FUNCTION_ARGS)
+{
+	TriggerData *trigdata = (TriggerData *) fcinfo->context;
+	Trigger    *trigger;
+	Relation	rel;
+	Relation	shadow;
+	Oid			shadowid;
+	List	   *stmts = NIL;
+
+	if (!CALLED_AS_TRIGGER(fcinfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+				 errmsg("function \"%s\" was not called by trigger manager",
+						"pg_anonymize_shadow_sync")));
+
+	if (!TRIGGER_FIRED_AFTER(trigdata->tg_event) ||
+		!TRIGGER_FIRED_FOR_STATEMENT(trigdata->tg_event))
+		ereport(ERROR,
+				(errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+				 errmsg("function \"%s\" must be fired AFTER ... FOR EACH STATEMENT",
+						"pg_anonymize_shadow_sync")));
+
+	rel = trigdata->tg_relation;
+	trigger = trigdata->tg_trigger;
+
+	if (trigger->tgnargs != 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+				 errmsg("function \"%s\" requires the name of the shadow table as argument",
+						"pg_anonymize_shadow_sync")));
+
+	shadowid = pgan_get_shadow_relid(rel, trigger->tgargs[0]);
+	if (!OidIsValid(shadowid))
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("\"%s\" is not a valid shadow table for relation \"%s\"",
+						trigger->tgargs[0], RelationGetRelationName(rel)),
+				 errhint("Use pg_anonymize_shadow_drop() and pg_anonymize_shadow_create() to create it again.")));
+
+	shadow = table_open(shadowid, RowExclusiveLock);
+
+	if (TRIGGER_FIRED_BY_TRUNCATE(trigdata->tg_event))
+		stmts = lappend(stmts,
+						psprintf("TRUNCATE %s",
+								 pgan_qualified_relname(shadow)));
+	else
+	{
+		if ((!TRIGGER_FIRED_BY_INSERT(trigdata->tg_event) &&
+			 trigger->tgoldtable == NULL) ||
+			(!TRIGGER_FIRED_BY_DELETE(trigdata->tg_event) &&
+			 trigger->tgnewtable == NULL))
+			ereport(ERROR,
+					(errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+					 errmsg("function \"%s\" requires the transition relations of the trigger",
+							"pg_anonymize_shadow_sync"),
+					 errhint("Declare the trigger with REFERENCING OLD TABLE and/or NEW TABLE.")));
+
+		if (!TRIGGER_FIRED_BY_INSERT(trigdata->tg_event))
+			stmts = lappend(stmts,
+							psprintf("DELETE FROM %s WHERE %s IN (SELECT %s FROM %s)",
+									 pgan_qualified_relname(shadow),
+									 PGAN_SHADOW_KEY, pgan_shadow_key_expr(rel),
+									 quote_identifier(trigger->tgoldtable)));
+
+		if (!TRIGGER_FIRED_BY_DELETE(trigdata->tg_event))
+			stmts = lappend(stmts,
+							pgan_shadow_insert_sql(rel, shadow,
+												   quote_identifier(trigger->tgnewtable),
+												   InvalidAttrNumber, NULL));
+	}
+
+	(void) pgan_shadow_execute(shadow->rd_rel->relowner, trigdata, stmts);
+
+	table_close(shadow, NoLock);
+
+	return PointerGetDatum(NULL);
+}
+
+/*
+ * Check that the current user owns the given relation, as required to manage
+ * its shadow table.
+ */
+static void
+pgan_shadow_check_owner(Relation rel)
+{
+#if PG_VERSION_NUM >= 160000
+	if (!object_ownercheck(RelationRelationId, RelationGetRelid(rel),
+						   GetUserId()))
+#else
+	if (!pg_class_ownercheck(RelationGetRelid(rel), GetUserId()))
+#endif
+		aclcheck_error(ACLCHECK_NOT_OWNER,
+#if PG_VERSION_NUM >= 110000
+					   OBJECT_TABLE,
+#else
+					   ACL_KIND_CLASS,
+#endif
+					   RelationGetRelationName(rel));
+}
+
+/*
+ * Return the schema-qualified and quoted name of the given relation.
+ */
+static char *
+pgan_qualified_relname(Relation rel)
+{
+	return quote_qualified_identifier(get_namespace_name(RelationGetNamespace(rel)),
+									  RelationGetRelationName(rel));
+}
+
+/*
+ * Return the expression computing the original replica identity of the rows
+ * of the given relation, as stored in its shadow table.
+ */
+static char *
+pgan_shadow_key_expr(Relation rel)
+{
+	Bitmapset  *keyattrs;
+	StringInfoData keyexpr;
+	int			i;
+
+	keyattrs = RelationGetIndexAttrBitmap(rel, INDEX_ATTR_BITMAP_IDENTITY_KEY);
+	if (keyattrs == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("relation \"%s\" has no replica identity index",
+						RelationGetRelationName(rel)),
+				 errhint("Add a primary key to the relation or use REPLICA IDENTITY USING INDEX.")));
+
+	initStringInfo(&keyexpr);
+	appendStringInfoString(&keyexpr, "pg_catalog.jsonb_build_object(");
+	i = -1;
+	while ((i = bms_next_member(keyattrs, i)) >= 0)
+	{
+		AttrNumber	attnum = i + FirstLowInvalidHeapAttributeNumber;
+		char	   *attname = NameStr(TupleDescAttr(RelationGetDescr(rel),
+													attnum - 1)->attname);
+
+		if (keyexpr.data[keyexpr.len - 1] != '(')
+			appendStringInfoString(&keyexpr, ", ");
+
+		appendStringInfo(&keyexpr, "%s, %s", quote_literal_cstr(attname),
+						 quote_identifier(attname));
+	}
+	appendStringInfoChar(&keyexpr, ')');
+
+	return keyexpr.data;
+}
+
+/*
+ * Return an INSERT statement adding the anonymized rows of the given FROM
+ * clause to the given shadow table.
+ *
+ * If attnum is valid, the given security label is used for this column
+ * rather than the stored one, as it's not stored yet when a new security
+ * label is declared.  Only the columns that the shadow table has are filled,
+ * so that modifying the relation still works after its columns changed, the
+ * other ones will prevent from using the shadow table.
+ */
+static char *
+pgan_shadow_insert_sql(Relation rel, Relation shadow, const char *from,
+					   AttrNumber attnum, const char *seclabel)
+{
+	TupleDesc	tupdesc = RelationGetDescr(rel);
+	AttrNumber *attmap;
+	char	  **seclabels;
+	StringInfoData cols;
+	StringInfoData exprs;
+	int			i;
+
+	attmap = pgan_shadow_attmap(rel, shadow);
+	seclabels = pgan_get_rel_seclabels(rel);
+
+	if (AttributeNumberIsValid(attnum))
+	{
+		if (seclabels == NULL)
+			seclabels = palloc0(sizeof(char *) * (tupdesc->natts + 1));
+		seclabels[attnum] = seclabel ? pstrdup(seclabel) : NULL;
+	}
+
+	initStringInfo(&cols);
+	initStringInfo(&exprs);
+	for (i = 1; i <= tupdesc->natts; i++)
+	{
+		char	   *attname;
+
+		if (!AttributeNumberIsValid(attmap[i]))
+			continue;
+
+		attname = quote_identifier(NameStr(TupleDescAttr(tupdesc, i - 1)->attname));
+		appendStringInfo(&cols, "%s, ", attname);
+
+		if (seclabels != NULL && seclabels[i] != NULL)
+			appendStringInfo(&exprs, "(%s), ", seclabels[i]);
+		else
+			appendStringInfo(&exprs, "%s, ", attname);
+	}
+
+	return psprintf("INSERT INTO %s (%s%s) SELECT %s%s FROM %s",
+					pgan_qualified_relname(shadow),
+					cols.data, PGAN_SHADOW_KEY,
+					exprs.data, pgan_shadow_key_expr(rel), from);
+}
+
+/*
+ * Execute the given statements maintaining a shadow table, with the
+ * privileges of its given owner, and return the number of rows processed by
+ * the last one.  If trigdata is given, its transition relations are
+ * available to the statements.
+ */
+static uint64
+pgan_shadow_execute(Oid owner, TriggerData *trigdata, List *stmts)
+{
+	Oid			save_userid;
+	int			save_sec_context;
+	int			save_nestlevel;
+	bool		prev_toplevel = pgan_toplevel;
+	uint64		processed = 0;
+	ListCell   *lc;
+	int			ret;
+
+	if ((ret = SPI_connect()) < 0)
+	{
+		/* internal error */
+		elog(ERROR, "SPI_connect returned %d", ret);
+	}
+
+	/* Use the same search_path as when the expressions are analyzed. */
+	save_nestlevel = NewGUCNestLevel();
+	(void) set_config_option("search_path", "pg_catalog", PGC_USERSET,
+							 PGC_S_SESSION, GUC_ACTION_SAVE, true, 0, false);
+
+	if (trigdata != NULL)
+		SPI_register_trigger_data(trigdata);
+
+	GetUserIdAndSecContext(&save_userid, &save_sec_context);
+	SetUserIdAndSecContext(owner,
+						   save_sec_context |
+						   SECURITY_LOCAL_USERID_CHANGE |
+						   SECURITY_RESTRICTED_OPERATION);
+
+	pgan_toplevel = false;
+	PG_TRY();
+	{
+		foreach(lc, stmts)
+		{
+			ret = SPI_execute((const char *) lfirst(lc), false, 0);
+			if (ret < 0)
+				elog(ERROR, "could not maintain the shadow table: error code %d",
+					 ret);
+			processed = SPI_processed;
+		}
+
+		pgan_toplevel = prev_toplevel;
+	}
+	PG_CATCH();
+	{
+		pgan_toplevel = prev_toplevel;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	SetUserIdAndSecContext(save_userid, save_sec_context);
+	AtEOXact_GUC(true, save_nestlevel);
+	SPI_finish();
+
+	return processed;
+}
+
+/*
+ * Compute again the whole content of the given shadow table of the given
+ * relation, and return the number of rows.  See pgan_shadow_insert_sql() for
+ * the meaning of attnum and seclabel.
+ *
+ * The rows are deleted rather than truncated, so that concurrent queries
+ * still see the rows of their snapshot.
+ */
+static uint64
+pgan_shadow_refresh(Relation rel, Relation shadow, AttrNumber attnum,
+					const char *seclabel)
+{
+	List	   *stmts = NIL;
+
+	/* Block concurrent writes, which would also maintain the shadow table. */
+	LockRelationOid(RelationGetRelid(rel), ShareRowExclusiveLock);
+
+	stmts = lappend(stmts,
+					psprintf("DELETE FROM %s",
+							 pgan_qualified_relname(shadow)));
+	stmts = lappend(stmts,
+					pgan_shadow_insert_sql(rel, shadow,
+										   psprintf("ONLY %s",
+													pgan_qualified_relname(rel)),
+										   attnum, seclabel));
+
+	return pgan_shadow_execute(shadow->rd_rel->relowner, NULL, stmts);
+}
+
+/*
+ * Compute again the whole content of the shadow table of the relation of the
+ * given ALTER TABLE statement, if it enabled some triggers and the shadow
+ * table is now maintained by all of them, as the rows modified while any of
+ * them wasn't fired are missing from the shadow table.
+ */
+static void
+pgan_shadow_enabled(AlterTableStmt *stmt)
+{
+	Relation	rel;
+	Relation	shadow;
+	Oid			relid;
+	Oid			shadowid;
+	bool		enabled = false;
+	ListCell   *lc;
+
+	foreach(lc, stmt->cmds)
+	{
+		AlterTableCmd *cmd = lfirst_node(AlterTableCmd, lc);
+
+		if (cmd->subtype == AT_EnableAlwaysTrig)
+			enabled = true;
+	}
+
+	if (!enabled)
+		return;
+
+	/* The relation is already locked by the ALTER TABLE. */
+	relid = RangeVarGetRelid(stmt->relation, NoLock, true);
+	if (!OidIsValid(relid))
+		return;
+
+	rel = table_open(relid, ShareRowExclusiveLock);
+
+	shadowid = pgan_get_shadow_relid(rel, pgan_get_shadow_name(rel, true));
+	if (OidIsValid(shadowid))
+	{
+		shadow = table_open(shadowid, AccessShareLock);
+		(void) pgan_shadow_refresh(rel, shadow, InvalidAttrNumber, NULL);
+		table_close(shadow, NoLock);
+	}
+
+	table_close(rel, NoLock);
+}
+
+/*
+ * Check that pg_anonymize is loaded last according to the given
+ * xxx_preload_libraries_string.
+ *
+ * If missing_ok is true, don't raise an error if pg_anonymize is not present.
+ */
+static void
+pgan_check_preload_lib(char *libnames, char *kind, bool missing_ok)
+{
+		List	   *xpl;
+		ListCell   *lc;
+		char	   *rawstring;
+		char	   *libname;
+		int			nb;
+
+		/* Need a modifiable copy of string */
+		rawstring = pstrdup(libnames);
+
+		if (!SplitIdentifierString(rawstring, ',', &xpl))
+			elog(ERROR, "Could not parse %s", kind);
+
+		if (!missing_ok)
+		{
+			/* First a quick check to make sure we're the last element. */
+			libname = (char *) llast(xpl);
+			if (strcmp(libname, "pg_anonymize") != 0)
+				elog(ERROR, "pg_anonymize needs to be last in %s", kind);
+		}
+
+		/*
+		 * Some paranoid check: make sure we're not also somewhere else in the
+		 * xxx_preload_libraries, as in that case we would not be loaded
+		 * last.
+		 */
+		nb = 1;
+		foreach(lc, xpl)
+		{
+			libname = (char *) lfirst(lc);
+
+			if (nb != list_length(xpl) && strcmp(libname, "pg_anonymize") == 0)
+				elog(ERROR, "pg_anonymize needs to be last in %s", kind);
+
+			nb++;
+		}
+}
+
+/*
+ * Check hook for pg_anonymize.copy_since.
+ *
+ * The value is a transaction id including its epoch, as returned by
+ * txid_current(), and is added as-is to the generated COPY query.
+ */
+static bool
+pgan_check_copy_since(char **newval, void **extra, GucSource source)
+{
+	const char *p = *newval;
+	uint64		xid = 0;
+
+	if (p == NULL || p[0] == '\0')
+		return true;
+
+	for (; *p != '\0'; p++)
+	{
+		if (*p < '0' || *p > '9' ||
+			xid > (PG_UINT64_MAX - (*p - '0')) / 10)
+		{
+			GUC_check_errdetail("The value must be a transaction id as returned by txid_current().");
+			return false;
+		}
+
+		xid = xid * 10 + (*p - '0');
+	}
+
+	if (xid < FirstNormalTransactionId)
+	{
+		GUC_check_errdetail("The value must be a transaction id as returned by txid_current().");
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Return the transaction id of pg_anonymize.copy_since, without its epoch.
+ *
+ * The rows are filtered on the age of their xmin, which can only be compared
+ * to transactions less than 2^31 transactions old.
+ */
+static TransactionId
+pgan_get_copy_since(void)
+{
+	uint64		since = 0;
+	uint64		next;
+	const char *p;
+
+	/* The value has been validated by pgan_check_copy_since(). */
+	for (p = pgan_copy_since; *p != '\0'; p++)
+		since = since * 10 + (*p - '0');
+
+#if PG_VERSION_NUM >= 120000
+	next = U64FromFullTransactionId(ReadNextFullTransactionId());
+#else
+	{
+		TransactionId xid;
+		uint32		epoch;
+
+		GetNextXidAndEpoch(&xid, &epoch);
+		next = ((uint64) epoch << 32) | xid;
+	}
+#endif
+
+	if (since > next)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("transaction " UINT64_FORMAT " of pg_anonymize.copy_since is in the future",
+						since)));
+
+	if (next - since >= ((uint64) 1 << 31))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("transaction " UINT64_FORMAT " of pg_anonymize.copy_since is too old",
+						since),
+				 errhint("Export the whole relation instead.")));
+
+	return (TransactionId) since;
+}
+
+/*
+ * Check hook for pg_anonymize.copy_tablesample.
+ *
+ * The value is added as-is to the generated COPY query, so make sure that it
+ * only contains a TABLESAMPLE clause with constant arguments.
+ */
+static bool
+pgan_check_copy_tablesample(char **newval, void **extra, GucSource source)
+{
+	MemoryContext oldcxt = CurrentMemoryContext;
+	StringInfoData sql;
+	List	   *parselist;
+	SelectStmt *select;
+	RangeTableSample *rts;
+	ListCell   *lc;
+
+	if (*newval == NULL || (*newval)[0] == '\0')
+		return true;
+
+	initStringInfo(&sql);
+	appendStringInfo(&sql, "SELECT FROM pgan TABLESAMPLE %s", *newval);
+
+	PG_TRY();
+	{
+		parselist = pg_parse_query(sql.data);
+	}
+	PG_CATCH();
+	{
+		ErrorData  *edata;
+
+		MemoryContextSwitchTo(oldcxt);
+		edata = CopyErrorData();
+		FlushErrorState();
+
+		GUC_check_errdetail("%s", edata->message);
+		FreeErrorData(edata);
+
+		return false;
+	}
+	PG_END_TRY();
+
+	if (list_length(parselist) != 1 ||
+		!IsA(linitial_node(RawStmt, parselist)->stmt, SelectStmt))
+	{
+		GUC_check_errdetail("Only a TABLESAMPLE clause is allowed.");
+		return false;
+	}
+
+	select = (SelectStmt *) linitial_node(RawStmt, parselist)->stmt;
+
+	if (select->op != SETOP_NONE ||
+		select->distinctClause != NIL ||
+		select->intoClause != NULL ||
+		select->targetList != NIL ||
+		list_length(select->fromClause) != 1 ||
+		!IsA(linitial(select->fromClause), RangeTableSample) ||
+		select->whereClause != NULL ||
+		select->groupClause != NIL ||
+		select->havingClause != NULL ||
+		select->windowClause != NIL ||
+		select->valuesLists != NIL ||
+		select->sortClause != NIL ||
+		select->limitOffset != NULL ||
+		select->limitCount != NULL ||
+		select->lockingClause != NIL ||
+		select->withClause != NULL)
+	{
+		GUC_check_errdetail("Only a TABLESAMPLE clause is allowed.");
+		return false;
+	}
+
+	rts = (RangeTableSample *) linitial(select->fromClause);
+
+	foreach(lc, rts->args)
+	{
+		if (!IsA(lfirst(lc), A_Const))
+		{
+			GUC_check_errdetail("Only constant TABLESAMPLE arguments are allowed.");
+			return false;
+		}
+	}
+
+	if (rts->repeatable != NULL && !IsA(rts->repeatable, A_Const))
+	{
+		GUC_check_errdetail("Only a constant REPEATABLE seed is allowed.");
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Adaptation of CopyGetAttnums that optionally allows generated attributes
+ */
+static List *
+pgan_get_attnums(TupleDesc tupDesc, Relation rel, List *attnamelist,
+				 bool is_copy)
+{
+	List	   *attnums = NIL;
+
+	if (attnamelist == NIL)
+	{
+		/* Generate default column list */
+		int			attr_count = tupDesc->natts;
+		int			i;
+
+		for (i = 0; i < attr_count; i++)
+		{
+			if (TupleDescAttr(tupDesc, i)->attisdropped)
+				continue;
+#if PG_VERSION_NUM >= 120000
+			/* Only COPY should ignore generated attributes */
+			if (TupleDescAttr(tupDesc, i)->attgenerated && is_copy)
+				continue;
+#endif
+			attnums = lappend_int(attnums, i + 1);
+		}
+	}
+	else
+	{
+		/* Validate the user-supplied list and extract attnums */
+		ListCell   *l;
+
+		foreach(l, attnamelist)
+		{
+			char	   *name = strVal(lfirst(l));
+			int			attnum;
+			int			i;
+
+			/* Lookup column name */
+			attnum = InvalidAttrNumber;
+			for (i = 0; i < tupDesc->natts; i++)
+			{
+				Form_pg_attribute att = TupleDescAttr(tupDesc, i);
+
+				if (att->attisdropped)
+					continue;
+				if (namestrcmp(&(att->attname), name) == 0)
+				{
+#if PG_VERSION_NUM >= 120000
+					if (att->attgenerated && is_copy)
+						ereport(ERROR,
+								(errcode(ERRCODE_INVALID_COLUMN_REFERENCE),
+								 errmsg("column \"%s\" is a generated column",
+										name),
+								 errdetail("Generated columns cannot be used in COPY.")));
+#endif
+					attnum = att->attnum;
+					break;
+				}
+			}
+			if (attnum == InvalidAttrNumber)
+			{
+				if (rel != NULL)
+					ereport(ERROR,
+							(errcode(ERRCODE_UNDEFINED_COLUMN),
+							 errmsg("column \"%s\" of relation \"%s\" does not exist",
+									name, RelationGetRelationName(rel))));
+				else
+					ereport(ERROR,
+							(errcode(ERRCODE_UNDEFINED_COLUMN),
+							 errmsg("column \"%s\" does not exist",
+									name)));
+			}
+			/* Check for duplicates */
+			if (list_member_int(attnums, attnum))
+				ereport(ERROR,
+						(errcode(ERRCODE_DUPLICATE_COLUMN),
+						 errmsg("column \"%s\" specified more than once",
+								name)));
+			attnums = lappend_int(attnums, attnum);
+		}
+	}
+
+	return attnums;
+}
+
+/*
+ * Generate an SQL query returning the anonymized data.
+ *
+ * NULL is returned if the relation doesn't need to be anonymized, unless
+ * force is true, in which case a query is generated as long as the relation
+ * can be anonymized.
+ */
+static char *
+pgan_get_query_for_relid(Relation rel, List *attlist, bool is_copy,
+						 bool force)
+{
+	char	  **seclabels;
+	List	   *attnums;
+	ListCell   *lc;
+	TupleDesc	tupdesc;
+	StringInfoData select;
+	instr_time	start;
+	bool		first;
+
+	if (!pgan_rel_is_anonymizable(rel, is_copy))
+		return NULL;
+
+	/* Fetch all the declared SECURITY LABEL on the relation. */
+	seclabels = pgan_get_rel_seclabels(rel);
+
+	/*
+	 * Nothing to do if no SECURITY LABEL declared, unless a sampled or
+	 * incremental COPY or a query was asked.
+	 */
+	if (seclabels == NULL)
+	{
+		if (!force && (!is_copy || (pgan_copy_tablesample[0] == '\0' &&
+									pgan_copy_since[0] == '\0')))
+			return NULL;
+
+		seclabels = palloc0(sizeof(char *) * (RelationGetNumberOfAttributes(rel) + 1));
+	}
+
+	pgan_stats_start(&start);
+
+	tupdesc = RelationGetDescr(rel);
+
+	if (is_copy)
+		attnums = pgan_get_attnums(tupdesc, rel, attlist, is_copy);
+	else
+	{
+		int		i;
+
+		/*
+		 * The query will replace the original relation, so it has to expose
+		 * all the attributes, including the dropped ones, to preserve the
+		 * original attribute numbers.
+		 */
+		Assert(attlist == NIL);
+		attnums = NIL;
+		for (i = 1; i <= tupdesc->natts; i++)
+			attnums = lappend_int(attnums, i);
+	}
+
+	initStringInfo(&select);
+	appendStringInfoString(&select, "SELECT ");
+
+	first = true;
+	foreach(lc, attnums)
+	{
+		FormData_pg_attribute *att;
+		int attnum = lfirst_int(lc);
+
+		if (!first)
+			appendStringInfoString(&select, ", ");
+		else
+			first = false;
+
+		att = TupleDescAttr(tupdesc, attnum - 1);
+
+		/*
+		 * If the column is anonymized, emit the proper expression, otherwise
+		 * just emit the (quoted) column name.  Dropped columns are only
+		 * emitted as placeholders.
+		 */
+		if (att->attisdropped)
+			appendStringInfoString(&select, "NULL");
+		else if (seclabels[attnum] != NULL)
+		{
+			appendStringInfo(&select, "%s AS %s", seclabels[attnum],
+							 quote_identifier(NameStr(att->attname)));
+		}
+		else
+			appendStringInfoString(&select,
+								   quote_identifier(NameStr(att->attname)));
+	}
+
+	/* Finish building the query if we found any security label on the table. */
+	appendStringInfo(&select, " FROM%s %s.%s",
+					 (is_copy ? " ONLY" : ""),
+					 quote_identifier(get_namespace_name(RelationGetNamespace(rel))),
+					 quote_identifier(RelationGetRelationName(rel)));
+
+	/* The value has been validated by pgan_check_copy_tablesample(). */
+	if (is_copy && pgan_copy_tablesample[0] != '\0')
+		appendStringInfo(&select, " TABLESAMPLE %s", pgan_copy_tablesample);
+
+	/*
+	 * Only keep the rows inserted or updated by a transaction that wasn't
+	 * older than the given one.  The xmin of frozen rows is preserved, and
+	 * the rows older than 2^31 transactions have a negative age.
+	 */
+	if (is_copy && pgan_copy_since[0] != '\0')
+		appendStringInfo(&select,
+						 " WHERE pg_catalog.age(xmin) BETWEEN 0"
+						 " AND pg_catalog.age('%u'::pg_catalog.xid)",
+						 pgan_get_copy_since());
+
+	pgan_stats_time(RelationGetRelid(rel), PGAN_STATS_GENERATE_TIME, start);
+
+	return select.data;
+}
+
+/*
+ * Can the given relation be anonymized?
+ */
+static bool
+pgan_rel_is_anonymizable(Relation rel, bool is_copy)
+{
+	/*
+	 * We only anonymize plain (possibly partitioned) relations and
+	 * materialized views.
+	 */
+	if (rel->rd_rel->relkind != RELKIND_RELATION &&
+		rel->rd_rel->relkind != RELKIND_MATVIEW &&
+		rel->rd_rel->relkind != RELKIND_PARTITIONED_TABLE)
+		return false;
+
+	/* COPY isn't allowed for partitioned table. */
+	if (is_copy && rel->rd_rel->relkind == RELKIND_PARTITIONED_TABLE)
+		return false;
+
+	return true;
+}
+
+/*
+ * Build a Query generating the anonymized data for the given relation, using
+ * the given analyzed security labels.
+ *
+ * The Query is built directly rather than generating and analyzing the
+ * equivalent SQL query, so it's cheap enough to be done for every reference
+ * to an anonymized relation.
+ *
+ * If all_attrs is false, only the attributes contained in attrs_used (offset
+ * by FirstLowInvalidHeapAttributeNumber) are computed, the other ones being
+ * replaced by NULL placeholders.  This way the security labels of columns
+ * that are never read are never evaluated.
+ */
+static Query *
+pgan_build_subquery(Relation rel, Node **exprs, Bitmapset *attrs_used,
+					bool all_attrs, bool inh)
+{
+	Query	   *query;
+	RangeTblEntry *rte;
+	TupleDesc	tupdesc = RelationGetDescr(rel);
+	List	   *colnames = NIL;
+	List	   *tlist = NIL;
+	Bitmapset  *selectedCols = NULL;
+#if PG_VERSION_NUM >= 160000
+	RTEPermissionInfo *perminfo;
+#endif
+	ListCell   *lc;
+	int			i;
+
+	/*
+	 * Emit all attributes, including dropped ones, so that the original
+	 * attribute numbers are preserved.
+	 */
+	for (i = 1; i <= tupdesc->natts; i++)
+	{
+		FormData_pg_attribute *att = TupleDescAttr(tupdesc, i - 1);
+		Expr	   *expr;
+
+		if (att->attisdropped)
+		{
+			colnames = lappend(colnames, makeString(pstrdup("")));
+			expr = (Expr *) makeNullConst(INT4OID, -1, InvalidOid);
+		}
+		else
+		{
+			colnames = lappend(colnames,
+							   makeString(pstrdup(NameStr(att->attname))));
+
+			if (!all_attrs &&
+				!bms_is_member(i - FirstLowInvalidHeapAttributeNumber,
+							   attrs_used))
+				expr = (Expr *) makeNullConst(att->atttypid, att->atttypmod,
+											  att->attcollation);
+			else if (exprs[i] != NULL)
+				expr = (Expr *) copyObject(exprs[i]);
+			else
+				expr = (Expr *) makeVar(1, i, att->atttypid, att->atttypmod,
+										att->attcollation, 0);
+		}
+
+		tlist = lappend(tlist, makeTargetEntry(expr, i,
+											   pstrdup(NameStr(att->attname)),
+											   false));
+	}
+
+	/*
+	 * Optimize the security labels once they're all copied, as it can access
+	 * the catalogs.  The other entries are left alone.
+	 */
+	foreach(lc, tlist)
+	{
+		TargetEntry *tle = lfirst_node(TargetEntry, lc);
+
+		tle->expr = (Expr *) pgan_optimize_label(rel, tle->resno,
+												 (Node *) tle->expr);
+	}
+
+	/* The subquery needs to be able to read all the referenced columns. */
+	pull_varattnos((Node *) tlist, 1, &selectedCols);
+
+	rte = makeNode(RangeTblEntry);
+	rte->rtekind = RTE_RELATION;
+	rte->relid = RelationGetRelid(rel);
+	rte->relkind = rel->rd_rel->relkind;
+#if PG_VERSION_NUM >= 120000
+	rte->rellockmode = AccessShareLock;
+#endif
+	rte->eref = makeAlias(RelationGetRelationName(rel), colnames);
+	rte->inh = inh;
+	rte->inFromCl = true;
+
+	query = makeNode(Query);
+	query->commandType = CMD_SELECT;
+	/* Remember to not process it again */
+	query->querySource = QSRC_PARSER;
+	query->canSetTag = true;
+	query->rtable = list_make1(rte);
+	query->jointree = makeFromExpr(list_make1(makeRangeTblRef(1)), NULL);
+	query->targetList = tlist;
+	query->hasSubLinks = checkExprHasSubLink((Node *) tlist);
+
+#if PG_VERSION_NUM >= 160000
+	perminfo = addRTEPermissionInfo(&query->rteperminfos, rte);
+	perminfo->requiredPerms = ACL_SELECT;
+	perminfo->selectedCols = selectedCols;
+#else
+	rte->requiredPerms = ACL_SELECT;
+	rte->checkAsUser = InvalidOid;
+	rte->selectedCols = selectedCols;
+#endif
+
+	return query;
+}
+
+/*
+ * Return the Oid of the trigger function maintaining the shadow tables, or
+ * InvalidOid if the pg_anonymize extension isn't created in the current
+ * database.
+ */
+static Oid
+pgan_get_shadow_func(void)
+{
+	uint64		inval_count = pgan_proc_inval_count;
+	Oid			extoid;
+	Oid			funcid = InvalidOid;
+	Oid			argtypes[1] = {InvalidOid};
+
+	if (pgan_shadow_func_valid)
+		return pgan_shadow_func;
+
+	extoid = get_extension_oid("pg_anonymize", true);
+	if (OidIsValid(extoid))
+		funcid = pgan_get_ext_func(extoid, "pg_anonymize_shadow_sync", 0,
+								   argtypes);
+
+	/* Look it up again next time if it changed in the meantime. */
+	pgan_shadow_func_valid = (inval_count == pgan_proc_inval_count);
+	pgan_shadow_func = funcid;
+
+	return funcid;
+}
+
+/*
+ * Return the name of the shadow table of the given relation, as given to the
+ * triggers maintaining it, or NULL if it doesn't have any.
+ *
+ * If enabled_only is true, the name is only returned if the shadow table is
+ * maintained for all the events by statement triggers that are always fired,
+ * whatever the session_replication_role, i.e. if its content can be trusted.
+ * The triggers are created that way by pg_anonymize_shadow_create(), and the
+ * shadow table is computed again when they're enabled again, see
+ * pgan_shadow_enabled().
+ */
+static char *
+pgan_get_shadow_name(Relation rel, bool enabled_only)
+{
+	TriggerDesc *trigdesc;
+	Oid			funcid;
+	char		name[NAMEDATALEN];
+	bool		found = false;
+	int16		events = 0;
+	int			i;
+
+	/* Look up the function first, as it can access the catalogs. */
+	funcid = pgan_get_shadow_func();
+	trigdesc = rel->trigdesc;
+
+	if (!OidIsValid(funcid) || trigdesc == NULL)
+		return NULL;
+
+	pgan_get_shadow_relname(RelationGetRelid(rel), name);
+
+	for (i = 0; i < trigdesc->numtriggers; i++)
+	{
+		Trigger    *trigger = &trigdesc->triggers[i];
+
+		if (trigger->tgfoid != funcid)
+			continue;
+
+		/* Triggers maintaining another table can't be trusted. */
+		if (trigger->tgnargs != 1 || strcmp(trigger->tgargs[0], name) != 0)
+		{
+			if (enabled_only)
+				return NULL;
+			continue;
+		}
+
+		found = true;
+
+		if (trigger->tgenabled == TRIGGER_FIRES_ALWAYS &&
+			!TRIGGER_FOR_ROW(trigger->tgtype) &&
+			TRIGGER_FOR_AFTER(trigger->tgtype))
+			events |= trigger->tgtype;
+	}
+
+	if (enabled_only &&
+		(!TRIGGER_FOR_INSERT(events) || !TRIGGER_FOR_UPDATE(events) ||
+		 !TRIGGER_FOR_DELETE(events) || !TRIGGER_FOR_TRUNCATE(events)))
+		return NULL;
+
+	return found ? pstrdup(name) : NULL;
+}
+
+/*
+ * Compute the name of the shadow table of the given relation, as created by
+ * pg_anonymize_shadow_create().  The name must be a NAMEDATALEN buffer.
+ */
+static void
+pgan_get_shadow_relname(Oid relid, char *name)
+{
+	snprintf(name, NAMEDATALEN, "pgan_%u_shadow", relid);
+}
+
+/*
+ * Return the Oid of the given shadow table of the given relation, or
+ * InvalidOid if it doesn't exist or can't be a shadow table of the relation.
+ *
+ * The name comes from the triggers, which can be declared by any role having
+ * the TRIGGER privilege on the relation, so it has to be the name computed by
+ * pgan_get_shadow_relname(), and the shadow table has to be a plain table of
+ * the same schema and owner, with the key column.
+ */
+static Oid
+pgan_get_shadow_relid(Relation rel, const char *name)
+{
+	HeapTuple	tuple;
+	Oid			shadowid;
+	char		expected[NAMEDATALEN];
+	bool		valid;
+
+	if (name == NULL)
+		return InvalidOid;
+
+	pgan_get_shadow_relname(RelationGetRelid(rel), expected);
+	if (strcmp(name, expected) != 0)
+		return InvalidOid;
+
+	shadowid = get_relname_relid(name, RelationGetNamespace(rel));
+	if (!OidIsValid(shadowid) || shadowid == RelationGetRelid(rel))
+		return InvalidOid;
+
+	tuple = SearchSysCache1(RELOID, ObjectIdGetDatum(shadowid));
+	if (!HeapTupleIsValid(tuple))
+		return InvalidOid;
+
+	valid = (((Form_pg_class) GETSTRUCT(tuple))->relkind == RELKIND_RELATION &&
+			 ((Form_pg_class) GETSTRUCT(tuple))->relowner == rel->rd_rel->relowner);
+	ReleaseSysCache(tuple);
+
+	if (!valid ||
+		get_atttype(shadowid, get_attnum(shadowid, PGAN_SHADOW_KEY)) != JSONBOID)
+		return InvalidOid;
+
+	return shadowid;
+}
+
+/*
+ * Return the Oid of the shadow table to read rather than evaluating the
+ * security labels of the given relation, or InvalidOid if there's none.
+ *
+ * The result is cached in the relation's label cache entry, which is
+ * invalidated when either the relation or its shadow table is, or when the
+ * logical replication subscriptions change.
+ */
+static Oid
+pgan_get_shadow(Relation rel)
+{
+	pganRelLabels *entry;
+	Oid			relid = RelationGetRelid(rel);
+	Oid			shadowid;
+	uint64		inval_count;
+
+	entry = pgan_get_rel_labels_entry(rel);
+
+	if (entry->shadow_done)
+		return entry->shadowid;
+
+	inval_count = pgan_label_inval_count;
+
+	shadowid = pgan_lookup_shadow(rel);
+
+	/*
+	 * Cache the result, unless an invalidation was received in the meantime,
+	 * in which case the result is only used for the current query.
+	 */
+	if (inval_count == pgan_label_inval_count &&
+		!HistoricSnapshotActive() &&
+		pgan_rel_labels != NULL &&
+		(entry = hash_search(pgan_rel_labels, &relid, HASH_FIND, NULL)) != NULL)
+	{
+		entry->shadowid = shadowid;
+		entry->shadow_done = true;
+	}
+
+	return shadowid;
+}
+
+/*
+ * Workhorse for pgan_get_shadow().
+ *
+ * The shadow table doesn't reflect the rows modified through an ancestor of
+ * the relation, nor the row level security policies, nor the rows applied by
+ * a logical replication subscription, which doesn't fire the statement
+ * triggers, so it's not used in those cases.  It's not used either if any
+ * privilege was granted on it, as it holds the original replica identity of
+ * the rows.
+ */
+static Oid
+pgan_lookup_shadow(Relation rel)
+{
+	Oid			shadowid;
+	char	   *name;
+
+	if (rel->rd_rel->relkind != RELKIND_RELATION ||
+		rel->trigdesc == NULL ||
+		rel->rd_rel->relispartition ||
+		rel->rd_rel->relhassubclass ||
+		rel->rd_rel->relrowsecurity)
+		return InvalidOid;
+
+	name = pgan_get_shadow_name(rel, true);
+	if (name == NULL)
+		return InvalidOid;
+
+	if (pgan_get_ancestors(RelationGetRelid(rel)) != NIL)
+		return InvalidOid;
+
+	shadowid = pgan_get_shadow_relid(rel, name);
+	if (!OidIsValid(shadowid))
+		return InvalidOid;
+
+	if (pgan_shadow_grantees(shadowid, rel->rd_rel->relowner) != NIL ||
+		pgan_rel_is_subscribed(RelationGetRelid(rel)))
+		return InvalidOid;
+
+	return shadowid;
+}
+
+/*
+ * Return the list of the roles, other than the given owner, having any
+ * privilege on the given shadow table.  PUBLIC is returned as ACL_ID_PUBLIC.
+ */
+static List *
+pgan_shadow_grantees(Oid shadowid, Oid owner)
+{
+	HeapTuple	tuple;
+	Datum		datum;
+	bool		isnull;
+	List	   *grantees = NIL;
+
+	tuple = SearchSysCache1(RELOID, ObjectIdGetDatum(shadowid));
+	if (!HeapTupleIsValid(tuple))
+		elog(ERROR, "cache lookup failed for relation %u", shadowid);
+
+	/* A NULL ACL means the default privileges, i.e. only for the owner. */
+	datum = SysCacheGetAttr(RELOID, tuple, Anum_pg_class_relacl, &isnull);
+	if (!isnull)
+	{
+		Acl		   *acl = DatumGetAclP(datum);
+		AclItem    *aidat = ACL_DAT(acl);
+		int			i;
+
+		for (i = 0; i < ACL_NUM(acl); i++)
+		{
+			if (aidat[i].ai_grantee != owner)
+				grantees = list_append_unique_oid(grantees,
+												  aidat[i].ai_grantee);
+		}
+	}
+
+	ReleaseSysCache(tuple);
+
+	return grantees;
+}
+
+/*
+ * Return whether the given relation is part of a logical replication
+ * subscription.
+ */
+static bool
+pgan_rel_is_subscribed(Oid relid)
+{
+	Relation	srrel;
+	ScanKeyData key;
+	SysScanDesc scan;
+	bool		found;
+
+	srrel = table_open(SubscriptionRelRelationId, AccessShareLock);
+
+	ScanKeyInit(&key,
+				Anum_pg_subscription_rel_srrelid,
+				BTEqualStrategyNumber, F_OIDEQ,
+				ObjectIdGetDatum(relid));
+
+	scan = systable_beginscan(srrel, SubscriptionRelSrrelidSrsubidIndexId,
+							  true, NULL, 1, &key);
+	found = HeapTupleIsValid(systable_getnext(scan));
+
+	systable_endscan(scan);
+	table_close(srrel, AccessShareLock);
+
+	return found;
+}
+
+/*
+ * Return an array, indexed by the attribute number of the given relation, of
+ * the attribute number of the corresponding column of the given shadow table,
+ * or InvalidAttrNumber if there's none.  The columns are matched by name, and
+ * must have the same type, typmod and collation.
+ */
+static AttrNumber *
+pgan_shadow_attmap(Relation rel, Relation shadow)
+{
+	TupleDesc	tupdesc = RelationGetDescr(rel);
+	TupleDesc	shadowdesc = RelationGetDescr(shadow);
+	AttrNumber *attmap;
+	int			i;
+
+	attmap = (AttrNumber *) palloc0(sizeof(AttrNumber) * (tupdesc->natts + 1));
+
+	for (i = 1; i <= tupdesc->natts; i++)
+	{
+		Form_pg_attribute att = TupleDescAttr(tupdesc, i - 1);
+		int			j;
+
+		if (att->attisdropped)
+			continue;
+
+		for (j = 1; j <= shadowdesc->natts; j++)
+		{
+			Form_pg_attribute satt = TupleDescAttr(shadowdesc, j - 1);
+
+			if (satt->attisdropped ||
+				strcmp(NameStr(att->attname), NameStr(satt->attname)) != 0)
+				continue;
+
+			if (att->atttypid == satt->atttypid &&
+				att->atttypmod == satt->atttypmod &&
+				att->attcollation == satt->attcollation)
+				attmap[i] = j;
+			break;
+		}
+	}
+
+	return attmap;
+}
+
+/*
+ * Build a Query reading the given shadow table of the given relation, to be
+ * used instead of the one built by pgan_build_subquery(), or NULL if some of
+ * the needed columns are missing from the shadow table.
+ *
+ * See pgan_build_subquery() for the meaning of attrs_used and all_attrs.
+ *
+ * No privilege is needed on the shadow table, which only contains anonymized
+ * data, but the relation itself is kept in the range table, outside of the
+ * join tree, so that the usual privileges on the relation are checked and
+ * that it's locked.
+ */
+static Query *
+pgan_build_shadow_subquery(Relation rel, Relation shadow,
+						   Bitmapset *attrs_used, bool all_attrs)
+{
+	Query	   *query;
+	RangeTblEntry *rte;
+	RangeTblEntry *shadowrte;
+	TupleDesc	tupdesc = RelationGetDescr(rel);
+	TupleDesc	shadowdesc = RelationGetDescr(shadow);
+	AttrNumber *attmap;
+	List	   *colnames = NIL;
+	List	   *shadowcolnames = NIL;
+	List	   *tlist = NIL;
+	Bitmapset  *selectedCols;
+#if PG_VERSION_NUM >= 160000
+	RTEPermissionInfo *perminfo;
+#endif
+	int			i;
+
+	attmap = pgan_shadow_attmap(rel, shadow);
+
+	/*
+	 * Emit all attributes, including dropped ones, so that the original
+	 * attribute numbers are preserved.
+	 */
+	for (i = 1; i <= tupdesc->natts; i++)
+	{
+		FormData_pg_attribute *att = TupleDescAttr(tupdesc, i - 1);
+		Expr	   *expr;
+
+		if (att->attisdropped)
+		{
+			colnames = lappend(colnames, makeString(pstrdup("")));
+			expr = (Expr *) makeNullConst(INT4OID, -1, InvalidOid);
+		}
+		else
+		{
+			colnames = lappend(colnames,
+							   makeString(pstrdup(NameStr(att->attname))));
+
+			if (!all_attrs &&
+				!bms_is_member(i - FirstLowInvalidHeapAttributeNumber,
+							   attrs_used))
+				expr = (Expr *) makeNullConst(att->atttypid, att->atttypmod,
+											  att->attcollation);
+			else if (AttributeNumberIsValid(attmap[i]))
+				expr = (Expr *) makeVar(1, attmap[i], att->atttypid,
+										att->atttypmod, att->attcollation, 0);
+			else
+				return NULL;
+		}
+
+		tlist = lappend(tlist, makeTargetEntry(expr, i,
+											   pstrdup(NameStr(att->attname)),
+											   false));
+	}
+
+	for (i = 1; i <= shadowdesc->natts; i++)
+	{
+		FormData_pg_attribute *att = TupleDescAttr(shadowdesc, i - 1);
+
+		shadowcolnames = lappend(shadowcolnames,
+								 makeString(pstrdup(att->attisdropped ?
+													"" :
+													NameStr(att->attname))));
+	}
+
+	shadowrte = makeNode(RangeTblEntry);
+	shadowrte->rtekind = RTE_RELATION;
+	shadowrte->relid = RelationGetRelid(shadow);
+	shadowrte->relkind = shadow->rd_rel->relkind;
+#if PG_VERSION_NUM >= 120000
+	shadowrte->rellockmode = AccessShareLock;
+#endif
+	shadowrte->eref = makeAlias(RelationGetRelationName(shadow),
+								shadowcolnames);
+	shadowrte->inh = false;
+	shadowrte->inFromCl = true;
+
+	rte = makeNode(RangeTblEntry);
+	rte->rtekind = RTE_RELATION;
+	rte->relid = RelationGetRelid(rel);
+	rte->relkind = rel->rd_rel->relkind;
+#if PG_VERSION_NUM >= 120000
+	rte->rellockmode = AccessShareLock;
+#endif
+	rte->eref = makeAlias(RelationGetRelationName(rel), colnames);
+	rte->inh = false;
+	rte->inFromCl = false;
+
+	query = makeNode(Query);
+	query->commandType = CMD_SELECT;
+	/* Remember to not process it again */
+	query->querySource = QSRC_PARSER;
+	query->canSetTag = true;
+	query->rtable = list_make2(shadowrte, rte);
+	query->jointree = makeFromExpr(list_make1(makeRangeTblRef(1)), NULL);
+	query->targetList = tlist;
+
+	/* The relation columns that the outer query reads. */
+	if (all_attrs)
+		selectedCols = bms_make_singleton(InvalidAttrNumber -
+										  FirstLowInvalidHeapAttributeNumber);
+	else
+		selectedCols = bms_copy(attrs_used);
+
+#if PG_VERSION_NUM >= 160000
+	perminfo = addRTEPermissionInfo(&query->rteperminfos, rte);
+	perminfo->requiredPerms = ACL_SELECT;
+	perminfo->selectedCols = selectedCols;
+#else
+	shadowrte->requiredPerms = 0;
+	rte->requiredPerms = ACL_SELECT;
+	rte->checkAsUser = InvalidOid;
+	rte->selectedCols = selectedCols;
+#endif
+
+	return query;
+}
+
+/*
+ * Return the analyzed security labels for the given relation, as an array
+ * indexed by the attribute number, or NULL if the relation doesn't have any
+ * security label.
+ *
+ * The expressions are analyzed only once and then cached along with the
+ * relation security labels.  The returned array belongs to the cache and is
+ * only valid until the next catalog access, so caller should copy what it
+ * needs before doing anything else.
+ */
+static Node **
+pgan_get_exprs_for_rel(Relation rel)
+{
+	Oid			relid = RelationGetRelid(rel);
+	pganRelLabels *entry;
+	uint64		inval_count;
+	char	   *sql;
+	Query	   *query;
+	Node	  **exprs;
+	ListCell   *lc;
+
+	entry = pgan_get_rel_labels_entry(rel);
+
+	/* Nothing to do if no SECURITY LABEL declared. */
+	if (entry->seclabels == NULL)
+		return NULL;
+
+	if (entry->exprs != NULL)
+		return entry->exprs;
+
+	inval_count = pgan_label_inval_count;
+
+	sql = pgan_get_query_for_relid(rel, NIL, false, false);
+
+	/* The labels could have been removed concurrently. */
+	if (sql == NULL)
+		return NULL;
+
+	query = pgan_parse_analyze(sql, rel);
+
+	/*
+	 * The expressions are evaluated for each row of the relation, so they
+	 * can't contain anything that would change the number of rows.
+	 */
+	if (query->hasAggs || query->hasWindowFuncs || query->hasTargetSRFs)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("aggregate, window and set-returning functions are not"
+						" supported in anonymization expressions"),
+				 errcontext("during anonymization of table %s",
+							RelationGetRelationName(rel))));
+
+	/* The targetlist contains all the attributes, in order. */
+	Assert(list_length(query->targetList) == RelationGetNumberOfAttributes(rel));
+
+	/*
+	 * Cache the analyzed expressions, unless an invalidation was received in
+	 * the meantime, in which case the entry may not exist anymore and the
+	 * expressions will only be used for the current query.
+	 */
+	entry = NULL;
+	if (inval_count == pgan_label_inval_count)
+		entry = hash_search(pgan_rel_labels, &relid, HASH_FIND, NULL);
+
+	exprs = (Node **) MemoryContextAllocZero(entry ? entry->cxt :
+											 CurrentMemoryContext,
+											 sizeof(Node *) *
+											 (RelationGetNumberOfAttributes(rel) + 1));
+
+	foreach(lc, query->targetList)
+	{
+		TargetEntry *tle = lfirst_node(TargetEntry, lc);
+		FormData_pg_attribute *att;
+
+		att = TupleDescAttr(RelationGetDescr(rel), tle->resno - 1);
+
+		/* Only keep the actual security labels. */
+		if (att->attisdropped ||
+			(IsA(tle->expr, Var) && ((Var *) tle->expr)->varattno == tle->resno))
+			continue;
+
+		if (entry)
+		{
+			MemoryContext oldcxt = MemoryContextSwitchTo(entry->cxt);
+
+			exprs[tle->resno] = copyObject((Node *) tle->expr);
+			MemoryContextSwitchTo(oldcxt);
+		}
+		else
+			exprs[tle->resno] = (Node *) tle->expr;
+	}
+
+	if (entry)
+	{
+		entry->exprs = exprs;
+#if PG_VERSION_NUM >= 110000
+		pgan_shared_store(rel, entry);
+#endif
+	}
+
+	return exprs;
+}
+
+/*
+ * Return the analyzed security labels to use when querying the given relation
+ * and all its descendants, or NULL if none of them needs to be anonymized.
+ *
+ * Descendants can have their own security labels, that should be used for
+ * their rows rather than the ones of the given relation.  For any column
+ * where a descendant has a different security label, the expression is a CASE
+ * on the tableoid system column, so that each row gets the security label of
+ * the relation it comes from, while the whole tree is still scanned as a
+ * single relation, preserving partition pruning and parallelism.
+ *
+ * The security label of a descendant is its own security label, or if
+ * pg_anonymize.inherit_labels is enabled the one of the first intermediate
+ * ancestor having one, using the same depth-first search as
+ * pgan_get_rel_seclabels_worker(), and otherwise the security label of the
+ * given relation.
+ *
+ * As for pgan_get_exprs_for_rel(), the result is cached and the returned
+ * array is only valid until the next catalog access.
+ */
+static Node **
+pgan_get_tree_exprs(Relation rel)
+{
+	Oid			relid = RelationGetRelid(rel);
+	TupleDesc	tupdesc = RelationGetDescr(rel);
+	int			natts = tupdesc->natts;
+	pganRelLabels *entry;
+	pganTreeMember *members;
+	Relation	secRel;
+	Relation	inhRel;
+	Node	  **relexprs;
+	Node	  **exprs;
+	List	  **branches;
+	List	  **analyzed;
+	List	   *children;
+	ListCell   *lc;
+	uint64		inval_count;
+	bool		found = false;
+	int			nb_members;
+	int			i;
+
+	if (!rel->rd_rel->relhassubclass)
+		return pgan_get_exprs_for_rel(rel);
+
+	entry = pgan_get_rel_labels_entry(rel);
+
+	if (entry->tree_done)
+		return entry->tree_exprs;
+
+	inval_count = pgan_label_inval_count;
+
+	exprs = (Node **) palloc0(sizeof(Node *) * (natts + 1));
+	relexprs = pgan_get_exprs_for_rel(rel);
+	for (i = 1; relexprs != NULL && i <= natts; i++)
+		exprs[i] = copyObject(relexprs[i]);
+
+	children = find_all_inheritors(relid, AccessShareLock, NULL);
+
+	/*
+	 * First get the own security labels of all the descendants, mapped to the
+	 * given relation attribute numbers, and their direct parents.
+	 */
+	nb_members = list_length(children);
+	members = (pganTreeMember *) palloc0(sizeof(pganTreeMember) * nb_members);
+
+	secRel = table_open(SecLabelRelationId, AccessShareLock);
+	inhRel = table_open(InheritsRelationId, AccessShareLock);
+
+	i = 0;
+	foreach(lc, children)
+	{
+		pganTreeMember *member = &members[i++];
+		Relation	child;
+		TupleDesc	childdesc;
+		ScanKeyData keys[3];
+		SysScanDesc scan;
+		HeapTuple	tuple;
+		int			childnatts;
+		int			p;
+
+		member->relid = lfirst_oid(lc);
+
+		if (member->relid == relid)
+			continue;
+
+		child = relation_open(member->relid, NoLock);
+		childdesc = RelationGetDescr(child);
+		childnatts = childdesc->natts;
+
+		/* Partitioned tables don't have any row on their own. */
+		member->leaf = (child->rd_rel->relkind != RELKIND_PARTITIONED_TABLE &&
+						pgan_rel_is_anonymizable(child, false));
+
+		/* Map the attributes by name, as the attnums can differ. */
+		member->c2p = (AttrNumber *) palloc0(sizeof(AttrNumber) * childnatts);
+		for (p = 1; p <= natts; p++)
+		{
+			Form_pg_attribute att = TupleDescAttr(tupdesc, p - 1);
+			int			c;
+
+			if (att->attisdropped)
+				continue;
+
+			for (c = 1; c <= childnatts; c++)
+			{
+				Form_pg_attribute catt = TupleDescAttr(childdesc, c - 1);
+
+				if (!catt->attisdropped &&
+					namestrcmp(&catt->attname, NameStr(att->attname)) == 0)
+				{
+					member->c2p[c - 1] = p;
+					break;
+				}
+			}
+		}
+
+		ScanKeyInit(&keys[0],
+					Anum_pg_seclabel_objoid,
+					BTEqualStrategyNumber, F_OIDEQ,
+					ObjectIdGetDatum(member->relid));
+		ScanKeyInit(&keys[1],
+					Anum_pg_seclabel_classoid,
+					BTEqualStrategyNumber, F_OIDEQ,
+					ObjectIdGetDatum(RelationRelationId));
+		ScanKeyInit(&keys[2],
+					Anum_pg_seclabel_provider,
+					BTEqualStrategyNumber, F_TEXTEQ,
+					CStringGetTextDatum(PGAN_PROVIDER));
+
+		scan = systable_beginscan(secRel, SecLabelObjectIndexId, true,
+								  NULL, 3, keys);
+
+		while (HeapTupleIsValid(tuple = systable_getnext(scan)))
+		{
+			int			attnum = ((FormData_pg_seclabel *) GETSTRUCT(tuple))->objsubid;
+			Datum		datum;
+			bool		isnull;
+
+			datum = heap_getattr(tuple, Anum_pg_seclabel_label,
+								 RelationGetDescr(secRel), &isnull);
+
+			/* Columns that only exist in the descendant can be ignored. */
+			if (isnull || attnum <= 0 || attnum > childnatts ||
+				member->c2p[attnum - 1] == InvalidAttrNumber)
+				continue;
+
+			if (member->seclabels == NULL)
+				member->seclabels = (char **) palloc0(sizeof(char *) *
+													  (natts + 1));
+			member->seclabels[member->c2p[attnum - 1]] = TextDatumGetCString(datum);
+		}
+		systable_endscan(scan);
+
+		ScanKeyInit(&keys[0],
+					Anum_pg_inherits_inhrelid,
+					BTEqualStrategyNumber, F_OIDEQ,
+					ObjectIdGetDatum(member->relid));
+
+		scan = systable_beginscan(inhRel, InheritsRelidSeqnoIndexId, true,
+								  NULL, 1, keys);
+
+		/* Temporarily store the Oids, in inhseqno order. */
+		while (HeapTupleIsValid(tuple = systable_getnext(scan)))
+		{
+			Oid			parent = ((Form_pg_inherits) GETSTRUCT(tuple))->inhparent;
+
+			/* Only the intermediate ancestors are needed. */
+			if (parent != relid)
+				member->parents = lappend_oid(member->parents, parent);
+		}
+		systable_endscan(scan);
+
+		relation_close(child, NoLock);
+	}
+
+	table_close(inhRel, AccessShareLock);
+	table_close(secRel, AccessShareLock);
+
+	/* Convert the parent Oids to members. */
+	if (pgan_inherit_labels)
+	{
+		HASHCTL		ctl;
+		HTAB	   *htab;
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(Oid);
+		ctl.entrysize = sizeof(pganTreeMemberEntry);
+		ctl.hcxt = CurrentMemoryContext;
+		htab = hash_create("pg_anonymize tree members", nb_members, &ctl,
+						   HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+		for (i = 0; i < nb_members; i++)
+		{
+			pganTreeMemberEntry *hentry;
+
+			hentry = (pganTreeMemberEntry *) hash_search(htab,
+														 &members[i].relid,
+														 HASH_ENTER, NULL);
+			hentry->member = &members[i];
+		}
+
+		for (i = 0; i < nb_members; i++)
+		{
+			List	   *parents = NIL;
+
+			foreach(lc, members[i].parents)
+			{
+				Oid			parent = lfirst_oid(lc);
+				pganTreeMemberEntry *hentry;
+
+				hentry = (pganTreeMemberEntry *) hash_search(htab, &parent,
+															 HASH_FIND, NULL);
+
+				/* Concurrently added ancestor, ignore it. */
+				if (hentry == NULL)
+					continue;
+
+				parents = lappend(parents, hentry->member);
+			}
+			members[i].parents = parents;
+		}
+
+		hash_destroy(htab);
+	}
+	else
+	{
+		for (i = 0; i < nb_members; i++)
+			members[i].parents = NIL;
+	}
+
+	/*
+	 * Then resolve the security label of each leaf descendant, and group them
+	 * by distinct analyzed expression.
+	 */
+	branches = (List **) palloc0(sizeof(List *) * (natts + 1));
+	analyzed = (List **) palloc0(sizeof(List *) * (natts + 1));
+
+	for (i = 0; i < nb_members; i++)
+	{
+		pganTreeMember *member = &members[i];
+		int			p;
+
+		if (member->relid == relid || !member->leaf)
+			continue;
+
+		for (p = 1; p <= natts; p++)
+		{
+			pganTreeBranch *branch = NULL;
+			char	   *seclabel;
+			Node	   *expr = NULL;
+			ListCell   *lc2;
+
+			seclabel = pgan_get_tree_member_seclabel(member, p);
+
+			if (seclabel == NULL)
+				continue;
+
+			/* Only analyze each distinct security label once. */
+			foreach(lc2, analyzed[p])
+			{
+				pganTreeBranch *prev = (pganTreeBranch *) lfirst(lc2);
+
+				if (strcmp(prev->seclabel, seclabel) == 0)
+				{
+					expr = prev->expr;
+					break;
+				}
+			}
+
+			if (expr == NULL)
+			{
+				pganTreeBranch *prev;
+
+				expr = pgan_analyze_tree_seclabel(rel, member, seclabel);
+
+				prev = (pganTreeBranch *) palloc0(sizeof(pganTreeBranch));
+				prev->seclabel = seclabel;
+				prev->expr = expr;
+				analyzed[p] = lappend(analyzed[p], prev);
+			}
+
+			/* Nothing to do if it's the same as the relation one. */
+			if ((exprs[p] != NULL && equal(expr, exprs[p])) ||
+				(exprs[p] == NULL && IsA(expr, Var) &&
+				 ((Var *) expr)->varattno == p))
+				continue;
+
+			foreach(lc2, branches[p])
+			{
+				if (equal(expr, ((pganTreeBranch *) lfirst(lc2))->expr))
+				{
+					branch = (pganTreeBranch *) lfirst(lc2);
+					break;
+				}
+			}
+
+			if (branch == NULL)
+			{
+				branch = (pganTreeBranch *) palloc0(sizeof(pganTreeBranch));
+				branch->expr = expr;
+				branches[p] = lappend(branches[p], branch);
+			}
+
+			branch->relids = lappend_oid(branch->relids, member->relid);
+			found = true;
+		}
+	}
+
+	/* Generate the CASE expressions for the columns that need it. */
+	for (i = 1; found && i <= natts; i++)
+	{
+		Form_pg_attribute att = TupleDescAttr(tupdesc, i - 1);
+		CaseExpr   *caseexpr;
+		Var		   *tableoid;
+
+		if (branches[i] == NIL)
+			continue;
+
+		tableoid = makeVar(1, TableOidAttributeNumber, OIDOID, -1,
+						   InvalidOid, 0);
+
+		caseexpr = makeNode(CaseExpr);
+		caseexpr->casetype = att->atttypid;
+		caseexpr->arg = NULL;
+		caseexpr->args = NIL;
+		if (exprs[i] != NULL)
+			caseexpr->defresult = (Expr *) exprs[i];
+		else
+			caseexpr->defresult = (Expr *) makeVar(1, i, att->atttypid,
+												   att->atttypmod,
+												   att->attcollation, 0);
+		caseexpr->casecollid = exprCollation((Node *) caseexpr->defresult);
+		caseexpr->location = -1;
+
+		foreach(lc, branches[i])
+		{
+			pganTreeBranch *branch = (pganTreeBranch *) lfirst(lc);
+			ScalarArrayOpExpr *saop;
+			CaseWhen   *when;
+			Datum	   *elems;
+			ListCell   *lc2;
+			int			j = 0;
+
+			elems = (Datum *) palloc(sizeof(Datum) * list_length(branch->relids));
+			foreach(lc2, branch->relids)
+				elems[j++] = ObjectIdGetDatum(lfirst_oid(lc2));
+
+			saop = makeNode(ScalarArrayOpExpr);
+			saop->opno = OidEqualOperator;
+			saop->opfuncid = F_OIDEQ;
+			saop->useOr = true;
+			saop->inputcollid = InvalidOid;
+			saop->args = list_make2(copyObject(tableoid),
+									makeConst(OIDARRAYOID, -1, InvalidOid, -1,
+											  PointerGetDatum(construct_array(elems,
+																			  j,
+																			  OIDOID,
+																			  sizeof(Oid),
+																			  true,
+																			  'i')),
+											  false, false));
+			saop->location = -1;
+
+			when = makeNode(CaseWhen);
+			when->expr = (Expr *) saop;
+			when->result = (Expr *) branch->expr;
+			when->location = -1;
+
+			caseexpr->args = lappend(caseexpr->args, when);
+		}
+
+		exprs[i] = (Node *) caseexpr;
+	}
+
+	if (!found && relexprs == NULL)
+	{
+		pfree(exprs);
+		exprs = NULL;
+	}
+
+	/*
+	 * Cache the result, unless an invalidation was received in the meantime,
+	 * in which case the result is only used for the current query.
+	 */
+	if (inval_count == pgan_label_inval_count &&
+		(entry = hash_search(pgan_rel_labels, &relid, HASH_FIND, NULL)) != NULL)
+	{
+		MemoryContext oldcxt = MemoryContextSwitchTo(entry->cxt);
+
+		if (exprs != NULL)
+		{
+			entry->tree_exprs = (Node **) palloc0(sizeof(Node *) * (natts + 1));
+			for (i = 1; i <= natts; i++)
+				entry->tree_exprs[i] = copyObject(exprs[i]);
+		}
+
+		entry->nb_descendants = list_length(children);
+		entry->descendants = (Oid *) palloc(sizeof(Oid) *
+											(entry->nb_descendants + 1));
+		i = 0;
+		foreach(lc, children)
+			entry->descendants[i++] = lfirst_oid(lc);
+
+		entry->tree_done = true;
+		MemoryContextSwitchTo(oldcxt);
+
+		return entry->tree_exprs;
+	}
+
+	return exprs;
+}
+
+/*
+ * Return the security label of the given inheritance tree member for the
+ * given tree root attribute number, see pgan_get_tree_exprs(), or NULL if
+ * there's none.
+ */
+static char *
+pgan_get_tree_member_seclabel(pganTreeMember *member, AttrNumber attnum)
+{
+	ListCell   *lc;
+
+	if (member->seclabels != NULL && member->seclabels[attnum] != NULL)
+		return member->seclabels[attnum];
+
+	/* The parents are only kept if the security labels are inherited. */
+	foreach(lc, member->parents)
+	{
+		char	   *seclabel;
+
+		seclabel = pgan_get_tree_member_seclabel((pganTreeMember *) lfirst(lc),
+												 attnum);
+		if (seclabel != NULL)
+			return seclabel;
+	}
+
+	return NULL;
+}
+
+/*
+ * Analyze the given security label for the given inheritance tree member, and
+ * return the expression mapped to the tree root attribute numbers.
+ */
+static Node *
+pgan_analyze_tree_seclabel(Relation rel, pganTreeMember *member,
+						   const char *seclabel)
+{
+	StringInfoData sql;
+	Relation	child;
+	Query	   *query;
+	Node	   *expr;
+
+	/* The member is already locked. */
+	child = relation_open(member->relid, NoLock);
+
+	initStringInfo(&sql);
+	appendStringInfo(&sql, "SELECT %s FROM ONLY %s.%s",
+					 seclabel,
+					 quote_identifier(get_namespace_name(RelationGetNamespace(child))),
+					 quote_identifier(RelationGetRelationName(child)));
+	query = pgan_parse_analyze(sql.data, child);
+
+	if (query->hasAggs || query->hasWindowFuncs || query->hasTargetSRFs)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("aggregate, window and set-returning functions are not"
+						" supported in anonymization expressions"),
+				 errcontext("during anonymization of table %s",
+							RelationGetRelationName(child))));
+
+	expr = (Node *) linitial_node(TargetEntry, query->targetList)->expr;
+	expr = pgan_map_child_expr(rel, child, expr, member->c2p);
+
+	relation_close(child, NoLock);
+
+	return expr;
+}
+
+/*
+ * Convert the given security label of the given descendant so that it can be
+ * used with the given relation attribute numbers, according to the given
+ * descendant to relation attribute number map.
+ */
+static Node *
+pgan_map_child_expr(Relation rel, Relation child, Node *expr, AttrNumber *c2p)
+{
+	Bitmapset  *attrs = NULL;
+	bool		found_whole_row;
+	int			childnatts = RelationGetNumberOfAttributes(child);
+	int			x = -1;
+#if PG_VERSION_NUM >= 130000
+	AttrMap    *map;
+#endif
+
+	pull_varattnos(expr, 1, &attrs);
+	while ((x = bms_next_member(attrs, x)) >= 0)
+	{
+		AttrNumber	attno = x + FirstLowInvalidHeapAttributeNumber;
+
+		if (attno == InvalidAttrNumber ||
+			(attno > 0 && c2p[attno - 1] == InvalidAttrNumber))
+			ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("cannot anonymize table \"%s\" with its descendants",
+							RelationGetRelationName(rel)),
+					 errdetail("The security labels of descendant \"%s\" reference columns that don't exist in table \"%s\".",
+							   RelationGetRelationName(child),
+							   RelationGetRelationName(rel)),
+					 errhint("Query table \"%s\" with ONLY, or query the descendant directly.",
+							 RelationGetRelationName(rel))));
+	}
+
+#if PG_VERSION_NUM >= 130000
+	map = make_attrmap(childnatts);
+	memcpy(map->attnums, c2p, sizeof(AttrNumber) * childnatts);
+	expr = map_variable_attnos(expr, 1, 0, map, InvalidOid, &found_whole_row);
+	free_attrmap(map);
+#else
+	expr = map_variable_attnos(expr, 1, 0, c2p, childnatts, InvalidOid,
+							   &found_whole_row);
+#endif
+
+	Assert(!found_whole_row);
+
+	return expr;
+}
+
+/*
+ * Return a Query generating the anonymized data for the given relation, or
+ * NULL if the relation doesn't need to be anonymized.  If inh is true, the
+ * query also returns the anonymized data of all the descendants.  The
+ * anonymized data is read from the shadow table of the relation if it has a
+ * usable one, see pgan_get_shadow().
+ *
+ * See pgan_build_subquery() for the meaning of attrs_used and all_attrs.
+ */
+static Query *
+pgan_get_subquery_for_rel(Relation rel, Bitmapset *attrs_used, bool all_attrs,
+						  bool inh)
+{
+	Node	  **exprs;
+	Oid			shadowid;
+
+	if (!pgan_rel_is_anonymizable(rel, false))
+		return NULL;
+
+	if (inh)
+		exprs = pgan_get_tree_exprs(rel);
+	else
+		exprs = pgan_get_exprs_for_rel(rel);
+
+	if (exprs == NULL)
+		return NULL;
+
+	/*
+	 * Read the precomputed anonymized data if the relation has a shadow
+	 * table.  This accesses the catalogs, so the security labels have to be
+	 * looked up again if it can't be used.
+	 */
+	shadowid = pgan_get_shadow(rel);
+	if (OidIsValid(shadowid))
+	{
+		Relation	shadow;
+		Query	   *query;
+
+		shadow = table_open(shadowid, AccessShareLock);
+		query = pgan_build_shadow_subquery(rel, shadow, attrs_used, all_attrs);
+		table_close(shadow, NoLock);
+
+		if (query != NULL)
+			return query;
+
+		if (inh)
+			exprs = pgan_get_tree_exprs(rel);
+		else
+			exprs = pgan_get_exprs_for_rel(rel);
+
+		if (exprs == NULL)
+			return NULL;
+	}
+
+	/* No catalog access happens here, so the cached array is still valid. */
+	return pgan_build_subquery(rel, exprs, attrs_used, all_attrs, inh);
+}
+
+/*
+ * Return a copy of the analyzed security labels for the given relation, and
+ * all its descendants if inh is true, or NULL if the relation doesn't need to
+ * be anonymized.  The security labels are optimized as they would be in the
+ * subquery, see pgan_optimize_label().
+ */
+static Node **
+pgan_copy_exprs_for_rel(Relation rel, bool inh)
+{
+	Node	  **exprs;
+	Node	  **res;
+	int			natts = RelationGetNumberOfAttributes(rel);
+	int			i;
+
+	if (!pgan_rel_is_anonymizable(rel, false))
+		return NULL;
+
+	if (inh)
+		exprs = pgan_get_tree_exprs(rel);
+	else
+		exprs = pgan_get_exprs_for_rel(rel);
+
+	if (exprs == NULL)
+		return NULL;
+
+	res = (Node **) palloc0(sizeof(Node *) * (natts + 1));
+	for (i = 1; i <= natts; i++)
+		res[i] = copyObject(exprs[i]);
+
+	/* This can access the catalogs, so only do it on the copy. */
+	for (i = 1; i <= natts; i++)
+		res[i] = pgan_optimize_label(rel, i, res[i]);
+
+	return res;
+}
+
+/*
+ * Return the given analyzed security label, with the expression shapes that
+ * have a specialized implementation replaced by a call to it, see
+ * pgan_optimize_mutator().
+ *
+ * The security labels are cached in their original form and only optimized
+ * when used, so that they stay valid if the extension providing the
+ * specialized implementations is dropped.  The given expression can be
+ * modified.
+ *
+ * rel can be NULL if the expression can't be matched against an index or
+ * extended statistics, see pgan_label_has_objects().
+ */
+static Node *
+pgan_optimize_label(Relation rel, AttrNumber attnum, Node *expr)
+{
+	pganOptimizeContext context;
+
+	if (expr == NULL || !pgan_optimize_labels)
+		return expr;
+
+	if (!pgan_get_opt_funcs())
+		return expr;
+
+	/* The lookup could be invalidated while optimizing. */
+	context.funcs = pgan_opt_funcs;
+	context.rel = rel;
+	context.attnum = attnum;
+	context.allowed = -1;
+
+	return pgan_optimize_mutator(expr, &context);
+}
+
+/*
+ * Replace the recognized expression shapes with their specialized
+ * implementation, which gives the exact same result:
+ *
+ * - regexp_replace(x, pattern, replacement, 'g'), if pattern only matches a
+ *   single ASCII character of a fixed set (see pgan_regex_char_set()) and
+ *   replacement doesn't contain any backslash, becomes
+ *   pg_anonymize_replace_chars(x, chars, replacement, invert)
+ * - substr(x, 1, n) || suffix and left(x, n) || suffix, with a constant
+ *   n >= 0 and a constant suffix, become pg_anonymize_prefix(x, n, suffix)
+ * - date_trunc(unit, x)::date with x a date becomes
+ *   pg_anonymize_date_trunc(unit, x)
+ *
+ * The expressions are processed bottom-up, so x is optimized too.
+ */
+static Node *
+pgan_optimize_mutator(Node *node, void *context)
+{
+	pganOptimizeContext *ctx = (pganOptimizeContext *) context;
+	pganOptFuncs *funcs = &ctx->funcs;
+	Node	   *result = NULL;
+
+	if (node == NULL)
+		return NULL;
+
+	/* Don't bother with the subqueries, if any. */
+	if (IsA(node, Query))
+		return node;
+
+	node = expression_tree_mutator(node, pgan_optimize_mutator, context);
+
+	if (IsA(node, FuncExpr))
+	{
+		FuncExpr   *func = (FuncExpr *) node;
+
+		if (func->funcid == funcs->regexp_replace &&
+			OidIsValid(funcs->replace_chars))
+		{
+			Const	   *pattern = (Const *) lsecond(func->args);
+			Const	   *replacement = (Const *) lthird(func->args);
+			Const	   *flags = (Const *) lfourth(func->args);
+			char		chars[128];
+			bool		invert;
+
+			if (IsA(pattern, Const) && !pattern->constisnull &&
+				IsA(replacement, Const) && !replacement->constisnull &&
+				IsA(flags, Const) && !flags->constisnull &&
+				strcmp(TextDatumGetCString(flags->constvalue), "g") == 0 &&
+				strchr(TextDatumGetCString(replacement->constvalue), '\\') == NULL &&
+				pgan_regex_char_set(TextDatumGetCString(pattern->constvalue),
+									func->inputcollid, chars, &invert))
+			{
+				result = (Node *) makeFuncExpr(funcs->replace_chars, TEXTOID,
+											   list_make4(linitial(func->args),
+														  makeConst(TEXTOID, -1,
+																	DEFAULT_COLLATION_OID,
+																	-1,
+																	CStringGetTextDatum(chars),
+																	false, false),
+														  replacement,
+														  makeBoolConst(invert, false)),
+											   func->funccollid,
+											   func->inputcollid,
+											   COERCE_EXPLICIT_CALL);
+			}
+		}
+		else if (func->funcid == funcs->tstz_date &&
+				 OidIsValid(funcs->date_trunc))
+		{
+			FuncExpr   *trunc = (FuncExpr *) linitial(func->args);
+			FuncExpr   *cast;
+
+			if (IsA(trunc, FuncExpr) && trunc->funcid == funcs->trunc_tstz)
+			{
+				cast = (FuncExpr *) lsecond(trunc->args);
+
+				if (IsA(cast, FuncExpr) && cast->funcid == funcs->date_tstz)
+					result = (Node *) makeFuncExpr(funcs->date_trunc, DATEOID,
+												   list_make2(linitial(trunc->args),
+															  linitial(cast->args)),
+												   InvalidOid,
+												   trunc->inputcollid,
+												   COERCE_EXPLICIT_CALL);
+			}
+		}
+	}
+	else if (IsA(node, OpExpr) &&
+			 ((OpExpr *) node)->opfuncid == funcs->textcat &&
+			 OidIsValid(funcs->prefix))
+	{
+		OpExpr	   *op = (OpExpr *) node;
+		FuncExpr   *func = (FuncExpr *) linitial(op->args);
+		Const	   *suffix = (Const *) lsecond(op->args);
+		Const	   *keep = NULL;
+
+		if (IsA(suffix, Const) && !suffix->constisnull &&
+			suffix->consttype == TEXTOID && IsA(func, FuncExpr))
+		{
+			if ((func->funcid == funcs->substr ||
+				 func->funcid == funcs->substring) &&
+				IsA(lsecond(func->args), Const) &&
+				!((Const *) lsecond(func->args))->constisnull &&
+				DatumGetInt32(((Const *) lsecond(func->args))->constvalue) == 1)
+				keep = (Const *) lthird(func->args);
+			else if (func->funcid == funcs->left)
+				keep = (Const *) lsecond(func->args);
+
+			if (keep != NULL && IsA(keep, Const) && !keep->constisnull &&
+				DatumGetInt32(keep->constvalue) >= 0)
+				result = (Node *) makeFuncExpr(funcs->prefix, TEXTOID,
+											   list_make3(linitial(func->args),
+														  keep, suffix),
+											   op->opcollid,
+											   op->inputcollid,
+											   COERCE_EXPLICIT_CALL);
+		}
+	}
+
+	if (result == NULL)
+		return node;
+
+	/*
+	 * The planner can only match an expression index or extended statistics
+	 * on the security label with the original expression.
+	 */
+	if (ctx->allowed == -1)
+		ctx->allowed = (ctx->rel == NULL ||
+						!pgan_label_has_objects(ctx->rel, ctx->attnum));
+
+	return ctx->allowed ? result : node;
+}
+
+/*
+ * Look up the functions used by pgan_optimize_label(), and return whether any
+ * optimization is possible, i.e. if the pg_anonymize extension is created in
+ * the current database.
+ */
+static bool
+pgan_get_opt_funcs(void)
+{
+	pganOptFuncs funcs;
+	uint64		inval_count = pgan_proc_inval_count;
+	Oid			extoid;
+	Oid			argtypes[4];
+
+	if (pgan_opt_funcs.valid)
+		return OidIsValid(pgan_opt_funcs.replace_chars);
+
+	memset(&funcs, 0, sizeof(pganOptFuncs));
+
+	extoid = get_extension_oid("pg_anonymize", true);
+	if (OidIsValid(extoid))
+	{
+		argtypes[0] = TEXTOID;
+		argtypes[1] = TEXTOID;
+		argtypes[2] = TEXTOID;
+		argtypes[3] = BOOLOID;
+		funcs.replace_chars = pgan_get_ext_func(extoid,
+												"pg_anonymize_replace_chars",
+												4, argtypes);
+		argtypes[1] = INT4OID;
+		funcs.prefix = pgan_get_ext_func(extoid, "pg_anonymize_prefix", 3,
+										 argtypes);
+		argtypes[1] = DATEOID;
+		funcs.date_trunc = pgan_get_ext_func(extoid, "pg_anonymize_date_trunc",
+											 2, argtypes);
+	}
+
+	/* All or nothing, in case of a partially upgraded extension. */
+	if (OidIsValid(funcs.replace_chars) && OidIsValid(funcs.prefix) &&
+		OidIsValid(funcs.date_trunc))
+	{
+		argtypes[0] = TEXTOID;
+		argtypes[1] = TEXTOID;
+		argtypes[2] = TEXTOID;
+		argtypes[3] = TEXTOID;
+		funcs.regexp_replace = LookupFuncName(SystemFuncName("regexp_replace"),
+											  4, argtypes, false);
+		argtypes[1] = INT4OID;
+		argtypes[2] = INT4OID;
+		funcs.substr = LookupFuncName(SystemFuncName("substr"), 3, argtypes,
+									  false);
+		funcs.substring = LookupFuncName(SystemFuncName("substring"), 3,
+										 argtypes, false);
+		funcs.left = LookupFuncName(SystemFuncName("left"), 2, argtypes,
+									false);
+		argtypes[1] = TEXTOID;
+		funcs.textcat = LookupFuncName(SystemFuncName("textcat"), 2, argtypes,
+									   false);
+		argtypes[0] = DATEOID;
+		funcs.date_tstz = LookupFuncName(SystemFuncName("timestamptz"), 1,
+										 argtypes, false);
+		argtypes[0] = TEXTOID;
+		argtypes[1] = TIMESTAMPTZOID;
+		funcs.trunc_tstz = LookupFuncName(SystemFuncName("date_trunc"), 2,
+										  argtypes, false);
+		argtypes[0] = TIMESTAMPTZOID;
+		funcs.tstz_date = LookupFuncName(SystemFuncName("date"), 1, argtypes,
+										 false);
+	}
+	else
+		memset(&funcs, 0, sizeof(pganOptFuncs));
+
+	/* Look them up again next time if they changed in the meantime. */
+	funcs.valid = (inval_count == pgan_proc_inval_count);
+	pgan_opt_funcs = funcs;
+
+	return OidIsValid(funcs.replace_chars);
+}
+
+/*
+ * Return the Oid of the given function of the given extension, or InvalidOid
+ * if it doesn't exist or if its privileges were changed, as the anonymized
+ * roles may not be able to execute it anymore.
+ */
+static Oid
+pgan_get_ext_func(Oid extoid, const char *name, int nargs,
+				  const Oid *argtypes)
+{
+	CatCList   *catlist;
+	Oid			result = InvalidOid;
+	int			i;
+
+	catlist = SearchSysCacheList1(PROCNAMEARGSNSP, CStringGetDatum(name));
+
+	for (i = 0; i < catlist->n_members; i++)
+	{
+		HeapTuple	proctup = &catlist->members[i]->tuple;
+		Form_pg_proc procform = (Form_pg_proc) GETSTRUCT(proctup);
+		Oid			funcid;
+
+#if PG_VERSION_NUM >= 120000
+		funcid = procform->oid;
+#else
+		funcid = HeapTupleGetOid(proctup);
+#endif
+
+		if (procform->pronargs != nargs ||
+			memcmp(procform->proargtypes.values, argtypes,
+				   sizeof(Oid) * nargs) != 0)
+			continue;
+
+		if (!heap_attisnull(proctup, Anum_pg_proc_proacl
+#if PG_VERSION_NUM >= 110000
+							, NULL
+#endif
+							))
+			continue;
+
+		if (getExtensionOfObject(ProcedureRelationId, funcid) != extoid)
+			continue;
+
+		result = funcid;
+		break;
+	}
+
+	ReleaseSysCacheList(catlist);
+
+	return result;
+}
+
+/*
+ * If the given regular expression only matches a single character of a fixed
+ * set of ASCII characters, store them in chars as a NUL-terminated string,
+ * set invert if it matches all the other characters instead, and return true.
+ *
+ * Only the following patterns are recognized, for which the set of matched
+ * characters doesn't depend on the locale:
+ *
+ * - a single ASCII letter, digit or space
+ * - a bracket expression, possibly negated, only containing ASCII letters,
+ *   digits, punctuation characters other than \, [, ], ^ and -, spaces, and
+ *   ranges of letters or digits
+ * - \d and [[:digit:]], only if the libc provider is used for the collation,
+ *   as other providers can match other decimal digits
+ */
+static bool
+pgan_regex_char_set(const char *pattern, Oid collid, char *chars,
+					bool *invert)
+{
+	bool		set[128];
+	const char *p = pattern;
+	int			nb = 0;
+	int			c;
+
+	/*
+	 * regexp_replace() doesn't support a nondeterministic collation, let it
+	 * raise the error.
+	 */
+	if (!OidIsValid(collid))
+		return false;
+#if PG_VERSION_NUM >= 120000
+	if (!get_collation_isdeterministic(collid))
+		return false;
+#endif
+
+	memset(set, 0, sizeof(set));
+	*invert = false;
+
+	if (strcmp(p, "\\d") == 0 || strcmp(p, "[[:digit:]]") == 0)
+	{
+		if (!pgan_collation_is_libc(collid))
+			return false;
+
+		for (c = '0'; c <= '9'; c++)
+			set[c] = true;
+	}
+	else if (p[0] != '\0' && p[1] == '\0' &&
+			 (isalnum((unsigned char) p[0]) || p[0] == ' ') &&
+			 !IS_HIGHBIT_SET(p[0]))
+		set[(unsigned char) p[0]] = true;
+	else if (*p++ == '[')
+	{
+		if (*p == '^')
+		{
+			*invert = true;
+			p++;
+		}
+
+		/* A leading ] is a literal, don't bother with it. */
+		if (*p == ']')
+			return false;
+
+		while (*p != ']')
+		{
+			unsigned char lo = (unsigned char) *p;
+
+			if (lo == '\0' || IS_HIGHBIT_SET(lo) ||
+				!(isprint(lo) || lo == ' ') ||
+				strchr("\\[^-", lo) != NULL)
+				return false;
+
+			/* A range, only between letters or digits */
+			if (p[1] == '-' && p[2] != ']')
+			{
+				unsigned char hi = (unsigned char) p[2];
+
+				if (IS_HIGHBIT_SET(hi) || !isalnum(lo) || !isalnum(hi) ||
+					hi < lo)
+					return false;
+
+				for (c = lo; c <= hi; c++)
+					set[c] = true;
+				p += 3;
+			}
+			else
+			{
+				set[lo] = true;
+				p++;
+			}
+		}
+
+		/* Nothing is allowed after the bracket expression. */
+		if (p[1] != '\0')
+			return false;
+	}
+	else
+		return false;
+
+	for (c = 1; c < 128; c++)
+	{
+		if (set[c])
+			chars[nb++] = (char) c;
+	}
+	chars[nb] = '\0';
+
+	return true;
+}
+
+/*
+ * Does the given collation use the libc provider?  Other providers use
+ * Unicode properties to classify characters.
+ */
+static bool
+pgan_collation_is_libc(Oid collid)
+{
+	HeapTuple	tuple;
+	char		provider;
+
+	if (collid == DEFAULT_COLLATION_OID)
+	{
+#if PG_VERSION_NUM >= 150000
+		tuple = SearchSysCache1(DATABASEOID, ObjectIdGetDatum(MyDatabaseId));
+		if (!HeapTupleIsValid(tuple))
+			elog(ERROR, "cache lookup failed for database %u", MyDatabaseId);
+		provider = ((Form_pg_database) GETSTRUCT(tuple))->datlocprovider;
+		ReleaseSysCache(tuple);
+#else
+		provider = COLLPROVIDER_LIBC;
+#endif
+	}
+	else
+	{
+		tuple = SearchSysCache1(COLLOID, ObjectIdGetDatum(collid));
+		if (!HeapTupleIsValid(tuple))
+			elog(ERROR, "cache lookup failed for collation %u", collid);
+		provider = ((Form_pg_collation) GETSTRUCT(tuple))->collprovider;
+		ReleaseSysCache(tuple);
+	}
+
+	return (provider == COLLPROVIDER_LIBC);
+}
+
+/*
+ * Does the given column have an index or extended statistics on its security
+ * label, see pgan_sync_label_objects()?
+ */
+static bool
+pgan_label_has_objects(Relation rel, AttrNumber attnum)
+{
+	Oid			nspid = RelationGetNamespace(rel);
+	char		name[NAMEDATALEN];
+
+	snprintf(name, NAMEDATALEN, "pgan_%u_%d_idx",
+			 RelationGetRelid(rel), attnum);
+	if (OidIsValid(get_relname_relid(name, nspid)))
+		return true;
+
+#if PG_VERSION_NUM >= 140000
+	snprintf(name, NAMEDATALEN, "pgan_%u_%d_stat",
+			 RelationGetRelid(rel), attnum);
+	if (SearchSysCacheExists2(STATEXTNAMENSP, CStringGetDatum(name),
+							  ObjectIdGetDatum(nspid)))
+		return true;
+#endif
+
+	return false;
+}
+
+/*
+ * Parse and analyze the given anonymization query for the given relation.
+ */
+static Query *
+pgan_parse_analyze(const char *sql, Relation rel)
+{
+	List	   *parselist;
+	RawStmt	   *raw;
+	Query	   *query;
+	instr_time	start;
+	bool		prev_toplevel = pgan_toplevel;
+	int			save_nestlevel;
+
+	pgan_stats_start(&start);
+
+	PG_TRY();
+	{
+		parselist = pg_parse_query(sql);
+	}
+	PG_CATCH();
+	{
+		errcontext("during anonymization of table %s",
+				   RelationGetRelationName(rel));
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	Assert(list_length(parselist) == 1);
+	Assert(IsA(linitial(parselist), RawStmt));
+
+	raw = linitial_node(RawStmt, parselist);
+
+	/*
+	 * The expressions are validated with a search_path only containing
+	 * pg_catalog, so use the same for the analysis.  This makes the result
+	 * independent of the caller's search_path, which is required to cache
+	 * it, and also prevents an anonymized role from hijacking any function or
+	 * operator used in the expressions.
+	 */
+	save_nestlevel = NewGUCNestLevel();
+	(void) set_config_option("search_path", "pg_catalog", PGC_USERSET,
+							 PGC_S_SESSION, GUC_ACTION_SAVE, true, 0, false);
+
+	/*
+	 * Be careful to not call our post_parse_analyze_hook when generating
+	 * the new query.
+	 */
+	pgan_toplevel = false;
+	PG_TRY();
+	{
+		query = parse_analyze_fixedparams(raw, sql, NULL, 0, NULL);
+		pgan_toplevel = prev_toplevel;
+	}
+	PG_CATCH();
+	{
+		pgan_toplevel = prev_toplevel;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	AtEOXact_GUC(true, save_nestlevel);
+
+	pgan_stats_time(RelationGetRelid(rel), PGAN_STATS_PARSE_TIME, start);
+
+	return query;
+}
+
+/*
+ * Get all SECURITY LABELs for the given relation.
+ *
+ * This function returns an array, indexed by the underlying column attribute
+ * number, of the security labels.  The array is allocated in the caller's
+ * memory context, as the cached version can be invalidated at any catalog
+ * access.
+ *
+ * If the relation doesn't have any security label defined, NULL is returned.
+ */
+char **
+pgan_get_rel_seclabels(Relation rel)
+{
+	pganRelLabels *entry;
+	char	  **seclabels;
+	int			i;
+
+	entry = pgan_get_rel_labels_entry(rel);
+
+	if (entry->seclabels == NULL)
+		return NULL;
+
+	seclabels = palloc0(sizeof(char *) * (entry->natts + 1));
+	for (i = 1; i <= entry->natts; i++)
+	{
+		if (entry->seclabels[i] != NULL)
+			seclabels[i] = pstrdup(entry->seclabels[i]);
+	}
+
+	return seclabels;
+}
+
+/*
+ * Return the cached security labels entry for the given relation, building it
+ * if needed.
+ *
+ * The returned entry is only valid until the next catalog access, as any
+ * invalidation can remove it.
+ */
+static pganRelLabels *
+pgan_get_rel_labels_entry(Relation rel)
+{
+	Oid			relid = RelationGetRelid(rel);
+	pganRelLabels *entry;
+	pganWalkerContext *context;
+	MemoryContext cxt,
+				oldcxt;
+	Node	  **exprs = NULL;
+	instr_time	start;
+	uint64		inval_count;
+	uint64		generation;
+	bool		shared = false;
+	bool		historic;
+	bool		cached;
+	bool		found;
+	ListCell   *lc;
+	int			i;
+
+	/*
+	 * During logical decoding the catalogs are read with a historic snapshot,
+	 * so the result can neither come from the caches nor be stored in them.
+	 */
+	historic = HistoricSnapshotActive();
+
+	if (pgan_rel_labels == NULL)
+	{
+		HASHCTL		ctl;
+
+		pgan_label_cxt = AllocSetContextCreate(CacheMemoryContext,
+											   "pg_anonymize label cache",
+											   ALLOCSET_DEFAULT_SIZES);
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(Oid);
+		ctl.entrysize = sizeof(pganRelLabels);
+		ctl.hcxt = pgan_label_cxt;
+		pgan_rel_labels = hash_create("pg_anonymize label cache", 128, &ctl,
+									  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
+
+	entry = NULL;
+	if (!historic)
+		entry = hash_search(pgan_rel_labels, &relid, HASH_FIND, NULL);
+
+	if (entry)
+	{
+		/* The entry is only usable if built with the same inheritance rule. */
+		if (entry->inherit == pgan_inherit_labels)
+		{
+			pgan_stats_count(relid, PGAN_STATS_CACHE_HIT, 0);
+			return entry;
+		}
+
+		MemoryContextDelete(entry->cxt);
+		hash_search(pgan_rel_labels, &relid, HASH_REMOVE, NULL);
+	}
+
+	/*
+	 * Build the new entry in a dedicated memory context, only attached to our
+	 * cache once everything is done so that nothing leaks in case of error.
+	 */
+	cxt = AllocSetContextCreate(CurrentMemoryContext,
+								"pg_anonymize label cache entry",
+								ALLOCSET_SMALL_SIZES);
+	oldcxt = MemoryContextSwitchTo(cxt);
+
+	pgan_stats_start(&start);
+
+	inval_count = pgan_label_inval_count;
+
+	/* Must be read before looking at the catalogs, see pgan_shared_store(). */
+	generation = pgan_shared_generation();
+
+	context = (pganWalkerContext *) palloc0(sizeof(pganWalkerContext));
+
+	/*
+	 * Use the shared cache if possible, otherwise the worker function does all
+	 * the work.
+	 */
+#if PG_VERSION_NUM >= 110000
+	if (!historic)
+		shared = pgan_shared_lookup(rel, generation, context, &exprs);
+#endif
+	if (!shared)
+		pgan_get_rel_seclabels_worker(rel, context);
+
+	MemoryContextSwitchTo(oldcxt);
+
+	pgan_stats_count(relid, PGAN_STATS_CACHE_MISS, 0);
+	if (shared)
+		pgan_stats_count(relid, PGAN_STATS_SHARED_CACHE_HIT, 0);
+	pgan_stats_time(relid, PGAN_STATS_LOOKUP_TIME, start);
+
+	/*
+	 * If an invalidation was received while we were looking at the catalogs,
+	 * we can't know if the result is still valid.  Use it for the current
+	 * query, as it's as correct as it would have been without the cache, but
+	 * don't keep it around.  Note that the entry will be freed with the
+	 * caller's memory context.
+	 */
+	cached = (!historic && inval_count == pgan_label_inval_count &&
+			  pgan_rel_labels != NULL);
+	if (!cached)
+	{
+		entry = (pganRelLabels *) MemoryContextAllocZero(cxt,
+														 sizeof(pganRelLabels));
+		entry->relid = relid;
+	}
+	else
+	{
+		entry = hash_search(pgan_rel_labels, &relid, HASH_ENTER, &found);
+		Assert(!found);
+
+		/*
+		 * As for the uncached entry, the fields that are only filled later
+		 * must start zeroed.
+		 */
+		memset(entry, 0, sizeof(pganRelLabels));
+		entry->relid = relid;
+		MemoryContextSetParent(cxt, pgan_label_cxt);
+	}
+
+	entry->cxt = cxt;
+	entry->inherit = pgan_inherit_labels;
+	entry->generation = generation;
+	entry->exprs = exprs;
+	entry->tree_done = false;
+	entry->tree_exprs = NULL;
+	entry->nb_descendants = 0;
+	entry->descendants = NULL;
+	entry->shadow_done = false;
+	entry->shadowid = InvalidOid;
+	entry->natts = RelationGetNumberOfAttributes(rel);
+	entry->seclabels = (context->nb_labels == 0 ? NULL : context->seclabels);
+	entry->nb_ancestors = list_length(context->ancestors);
+	entry->ancestors = (Oid *) MemoryContextAlloc(cxt, sizeof(Oid) *
+												  (entry->nb_ancestors + 1));
+	i = 0;
+	foreach(lc, context->ancestors)
+		entry->ancestors[i++] = lfirst_oid(lc);
+
+#if PG_VERSION_NUM >= 110000
+	/* Share the result with other backends if it was built here. */
+	if (!shared && cached)
+		pgan_shared_store(rel, entry);
+#endif
+
+	return entry;
+}
+
+/*
+ * Register a relcache invalidation for all the ancestors of the given
+ * relation, as their cached security labels for the whole inheritance tree
+ * depend on the security labels of this relation.
+ */
+static void
+pgan_invalidate_ancestors(Oid relid)
+{
+	ListCell   *lc;
+
+	foreach(lc, pgan_get_ancestors(relid))
+		CacheInvalidateRelcacheByRelid(lfirst_oid(lc));
+}
+
+/*
+ * Relcache invalidation callback.
+ *
+ * Remove any cached entry for the given relation, and any cached entry that
+ * depends on it.  An InvalidOid relid means that all entries should be
+ * removed.
+ */
+static void
+pgan_relcache_callback(Datum arg, Oid relid)
+{
+	HASH_SEQ_STATUS status;
+	pganRelLabels *entry;
+
+	pgan_label_inval_count++;
+
+	if (pgan_rel_labels == NULL)
+		return;
+
+	if (!OidIsValid(relid))
+	{
+		/* This will also release the hash table and all the entries. */
+		MemoryContextDelete(pgan_label_cxt);
+		pgan_label_cxt = NULL;
+		pgan_rel_labels = NULL;
+		return;
+	}
+
+	hash_seq_init(&status, pgan_rel_labels);
+	while ((entry = hash_seq_search(&status)) != NULL)
+	{
+		bool		remove = (entry->relid == relid);
+		int			i;
+
+		for (i = 0; !remove && i < entry->nb_ancestors; i++)
+			remove = (entry->ancestors[i] == relid);
+
+		for (i = 0; !remove && i < entry->nb_descendants; i++)
+			remove = (entry->descendants[i] == relid);
+
+		if (!remove && entry->shadow_done)
+			remove = (entry->shadowid == relid);
+
+		if (remove)
+		{
+			MemoryContextDelete(entry->cxt);
+			hash_search(pgan_rel_labels, &entry->relid, HASH_REMOVE, NULL);
+		}
+	}
+}
+
+/*
+ * Return the current generation of the shared cache, or 0 if there's no
+ * shared cache.
+ */
+static uint64
+pgan_shared_generation(void)
+{
+#if PG_VERSION_NUM >= 110000
+	if (pgan_shared != NULL)
+		return pg_atomic_read_u64(&pgan_shared->generation);
+#endif
+
+	return 0;
+}
+
+/*
+ * Request the shared memory needed for the shared cache and the statistics.
+ */
+static void
+pgan_shmem_request(void)
+{
+#if PG_VERSION_NUM >= 150000
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+#endif
+
+	RequestAddinShmemSpace(add_size(MAXALIGN(sizeof(pganSharedState)),
+									pgan_stats_memsize()));
+	RequestNamedLWLockTranche("pg_anonymize", 2);
+}
+
+/*
+ * Initialize the shared state and the statistics.  The DSA area and the
+ * shared hash table of the shared cache are only created when first needed,
+ * see pgan_shared_attach().
+ */
+static void
+pgan_shmem_startup(void)
+{
+	HASHCTL		info;
+	bool		found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	pgan_shared = ShmemInitStruct("pg_anonymize", sizeof(pganSharedState),
+								  &found);
+
+	if (!found)
+	{
+		LWLockPadded *locks = GetNamedLWLockTranche("pg_anonymize");
+
+		pgan_shared->lock = &locks[0].lock;
+		pgan_shared->stats_lock = &locks[1].lock;
+#if PG_VERSION_NUM >= 110000
+		pgan_shared->tranche_id = LWLockNewTrancheId();
+		pgan_shared->initialized = false;
+		pg_atomic_init_u64(&pgan_shared->generation, 0);
+		pg_atomic_init_u32(&pgan_shared->nb_entries, 0);
+#endif
+	}
+
+	if (pgan_stats_max > 0)
+	{
+		memset(&info, 0, sizeof(info));
+		info.keysize = sizeof(pganStatsKey);
+		info.entrysize = sizeof(pganStatsEntry);
+		pgan_stats = ShmemInitHash("pg_anonymize stats",
+								   pgan_stats_max, pgan_stats_max,
+								   &info,
+								   HASH_ELEM | HASH_BLOBS);
+	}
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Estimate the shared memory needed for the statistics.
+ */
+static Size
+pgan_stats_memsize(void)
+{
+	if (pgan_stats_max == 0)
+		return 0;
+
+	return hash_estimate_size(pgan_stats_max, sizeof(pganStatsEntry));
+}
+
+/*
+ * Count an event for the given relation in the shared statistics, if
+ * available.  For the timed events, the given time is in milliseconds.
+ *
+ * Nothing is tracked for new relations once pg_anonymize.stats_max entries
+ * exist, until the statistics are reset.
+ */
+static void
+pgan_stats_count(Oid relid, pganStatsKind kind, double time)
+{
+	pganStatsKey key;
+	pganStatsEntry *entry;
+
+	if (pgan_stats == NULL)
+		return;
+
+	key.dbid = MyDatabaseId;
+	key.userid = GetUserId();
+	key.relid = relid;
+
+	LWLockAcquire(pgan_shared->stats_lock, LW_SHARED);
+
+	entry = (pganStatsEntry *) hash_search(pgan_stats, &key, HASH_FIND, NULL);
+
+	if (entry == NULL)
+	{
+		bool		found;
+
+		/* Need an exclusive lock to add the new entry. */
+		LWLockRelease(pgan_shared->stats_lock);
+		LWLockAcquire(pgan_shared->stats_lock, LW_EXCLUSIVE);
+
+		if (hash_get_num_entries(pgan_stats) >= pgan_stats_max)
+		{
+			LWLockRelease(pgan_shared->stats_lock);
+			return;
+		}
+
+		entry = (pganStatsEntry *) hash_search(pgan_stats, &key,
+											   HASH_ENTER_NULL, &found);
+		if (entry == NULL)
+		{
+			LWLockRelease(pgan_shared->stats_lock);
+			return;
+		}
+
+		if (!found)
+		{
+			memset(&entry->counters, 0,
+				   sizeof(pganStatsEntry) - offsetof(pganStatsEntry, counters));
+			SpinLockInit(&entry->mutex);
+		}
+	}
+
+	SpinLockAcquire(&entry->mutex);
+	if (kind < PGAN_STATS_NB_COUNTERS)
+		entry->counters[kind]++;
+	else
+	{
+		int			i = kind - PGAN_STATS_NB_COUNTERS;
+
+		entry->calls[i]++;
+		entry->total_time[i] += time;
+		if (time > entry->max_time[i])
+			entry->max_time[i] = time;
+	}
+	SpinLockRelease(&entry->mutex);
+
+	LWLockRelease(pgan_shared->stats_lock);
+}
+
+/*
+ * Record the start of a timed event, if the statistics are available.
+ */
+static void
+pgan_stats_start(instr_time *start)
+{
+	if (pgan_stats != NULL)
+		INSTR_TIME_SET_CURRENT(*start);
+	else
+		INSTR_TIME_SET_ZERO(*start);
+}
+
+/*
+ * Count a timed event started with pgan_stats_start(), if the statistics are
+ * available.
+ */
+static void
+pgan_stats_time(Oid relid, pganStatsKind kind, instr_time start)
+{
+	instr_time	duration;
+
+	if (pgan_stats == NULL)
+		return;
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+
+	pgan_stats_count(relid, kind, INSTR_TIME_GET_MILLISEC(duration));
+}
+
+#if PG_VERSION_NUM >= 110000
+/*
+ * Attach to the shared cache, creating it if needed.  Returns false if there's
+ * no shared cache.
+ */
+static bool
+pgan_shared_attach(void)
+{
+	MemoryContext oldcxt;
+	dsa_area   *area;
+	dshash_table *hash;
+
+	if (pgan_shared_hash != NULL)
+		return true;
+
+	if (pgan_shared == NULL || pgan_shared_cache_entries == 0)
+		return false;
+
+	pgan_shared_params.tranche_id = pgan_shared->tranche_id;
+	LWLockRegisterTranche(pgan_shared->tranche_id, "pg_anonymize");
+
+	/* The mapping must survive the current query. */
+	oldcxt = MemoryContextSwitchTo(TopMemoryContext);
+
+	LWLockAcquire(pgan_shared->lock, LW_EXCLUSIVE);
+
+	if (!pgan_shared->initialized)
+	{
+		area = dsa_create(pgan_shared->tranche_id);
+		dsa_pin(area);
+		dsa_pin_mapping(area);
+		hash = dshash_create(area, &pgan_shared_params, NULL);
+
+		pgan_shared->area = dsa_get_handle(area);
+		pgan_shared->hash = dshash_get_hash_table_handle(hash);
+		pgan_shared->initialized = true;
+	}
+	else
+	{
+		area = dsa_attach(pgan_shared->area);
+		dsa_pin_mapping(area);
+		hash = dshash_attach(area, &pgan_shared_params, pgan_shared->hash,
+							 NULL);
+	}
+
+	LWLockRelease(pgan_shared->lock);
+
+	MemoryContextSwitchTo(oldcxt);
+
+	pgan_shared_area = area;
+	pgan_shared_hash = hash;
+
+	return true;
+}
+
+/*
+ * Make all the current entries of the shared cache obsolete.
+ */
+static void
+pgan_shared_bump_generation(void)
+{
+	if (pgan_shared != NULL)
+		pg_atomic_fetch_add_u64(&pgan_shared->generation, 1);
+}
+
+/*
+ * Return the xmin of the pg_class row of the given relation.
+ */
+static TransactionId
+pgan_get_rel_xmin(Oid relid)
+{
+	HeapTuple	tuple;
+	TransactionId xmin;
+
+	tuple = SearchSysCache1(RELOID, ObjectIdGetDatum(relid));
+	if (!HeapTupleIsValid(tuple))
+		elog(ERROR, "cache lookup failed for relation %u", relid);
+
+	xmin = HeapTupleHeaderGetRawXmin(tuple->t_data);
+	ReleaseSysCache(tuple);
+
+	return xmin;
+}
+
+/*
+ * Look for a usable entry for the given relation in the shared cache.  If
+ * found, fill the given zero-initialized context with the resolved security
+ * labels and ancestors, the analyzed expressions if any in exprs, and return
+ * true.  Everything is allocated in the current memory context.
+ *
+ * The entry is only usable if it was built with the given generation, which
+ * must have been read before looking at the catalogs, for the same relation
+ * definition and with the same ancestors.  The ancestors are checked again
+ * as attaching a partition or adding an inheritance parent doesn't
+ * necessarily modify the relation's pg_class row.
+ *
+ * The shared cache isn't used if the current transaction changed some
+ * security labels, as the shared entries don't reflect those changes.
+ */
+static bool
+pgan_shared_lookup(Relation rel, uint64 generation,
+				   pganWalkerContext *context, Node ***exprs)
+{
+	Oid			relid = RelationGetRelid(rel);
+	int			natts = RelationGetNumberOfAttributes(rel);
+	pganSharedKey key;
+	pganSharedEntry *sentry;
+	pganSharedData header;
+	List	   *ancestors = NIL;
+	ListCell   *lc;
+	char	   *data = NULL;
+	char	   *ptr;
+	char	  **seclabels;
+	bool		valid;
+	int			nb_labels = 0;
+	int			i;
+
+	*exprs = NULL;
+
+	if (pgan_shared_relabeled || !pgan_shared_attach())
+		return false;
+
+	key.dbid = MyDatabaseId;
+	key.relid = relid;
+
+	sentry = dshash_find(pgan_shared_hash, &key, false);
+	if (sentry == NULL)
+		return false;
+
+	if (sentry->generation == generation && DsaPointerIsValid(sentry->data))
+	{
+		data = palloc(sentry->len);
+		memcpy(data, dsa_get_address(pgan_shared_area, sentry->data),
+			   sentry->len);
+	}
+	dshash_release_lock(pgan_shared_hash, sentry);
+
+	/* Obsolete entry, remove it if nobody replaced it in the meantime. */
+	if (data == NULL)
+	{
+		sentry = dshash_find(pgan_shared_hash, &key, true);
+		if (sentry == NULL)
+			return false;
+
+		if (sentry->generation != pgan_shared_generation())
 		{
-			char	   *name = strVal(lfirst(l));
-			int			attnum;
-			int			i;
+			if (DsaPointerIsValid(sentry->data))
+				dsa_free(pgan_shared_area, sentry->data);
+			dshash_delete_entry(pgan_shared_hash, sentry);
+			pg_atomic_fetch_sub_u32(&pgan_shared->nb_entries, 1);
+		}
+		else
+			dshash_release_lock(pgan_shared_hash, sentry);
 
-			/* Lookup column name */
-			attnum = InvalidAttrNumber;
-			for (i = 0; i < tupDesc->natts; i++)
+		return false;
+	}
+
+	memcpy(&header, data, sizeof(pganSharedData));
+	ptr = data + sizeof(pganSharedData);
+
+	valid = (header.natts == natts &&
+			 header.inherit == pgan_inherit_labels &&
+			 header.tupdesc_hash == hashTupleDesc(RelationGetDescr(rel)) &&
+			 header.xmin == pgan_get_rel_xmin(relid));
+
+	if (valid && pgan_inherit_labels)
+		ancestors = pgan_get_ancestors(relid);
+
+	if (valid && list_length(ancestors) != header.nb_ancestors)
+		valid = false;
+
+	foreach(lc, ancestors)
+	{
+		Oid			ancestor;
+
+		if (!valid)
+			break;
+
+		memcpy(&ancestor, ptr, sizeof(Oid));
+		ptr += sizeof(Oid);
+
+		if (ancestor != lfirst_oid(lc))
+			valid = false;
+	}
+
+	/* The entry will be replaced with an up to date version. */
+	if (!valid)
+	{
+		list_free(ancestors);
+		pfree(data);
+		return false;
+	}
+
+	seclabels = (char **) palloc0(sizeof(char *) * (natts + 1));
+	for (i = 1; i <= natts; i++)
+	{
+		if (*ptr++ == '\0')
+			continue;
+
+		seclabels[i] = pstrdup(ptr);
+		ptr += strlen(ptr) + 1;
+		nb_labels++;
+	}
+
+	if (header.has_exprs && nb_labels > 0)
+	{
+		*exprs = (Node **) palloc0(sizeof(Node *) * (natts + 1));
+		for (i = 1; i <= natts; i++)
+		{
+			if (*ptr++ == '\0')
+				continue;
+
+			(*exprs)[i] = stringToNode(ptr);
+			ptr += strlen(ptr) + 1;
+		}
+	}
+
+	context->seclabels = seclabels;
+	context->nb_labels = nb_labels;
+	context->ancestors = ancestors;
+
+	pfree(data);
+
+	return true;
+}
+
+/*
+ * Store the given local cache entry in the shared cache, unless its
+ * generation is obsolete.
+ *
+ * Any security label change bumps the generation when its transaction
+ * commits, and the entry generation is read before looking at the catalogs,
+ * so an entry can never be stored with a generation more recent than its
+ * content.  Other relevant changes require a lock conflicting with the one
+ * the caller holds on the relation, and are detected using the pg_class
+ * xmin, the tuple descriptor hash and the ancestors.
+ *
+ * Nothing is stored if the current transaction changed some security labels,
+ * as they could be rolled back.
+ */
+static void
+pgan_shared_store(Relation rel, pganRelLabels *entry)
+{
+	Oid			relid = RelationGetRelid(rel);
+	pganSharedKey key;
+	pganSharedEntry *sentry;
+	pganSharedData header;
+	StringInfoData buf;
+	dsa_pointer dp;
+	uint64		inval_count;
+	bool		found;
+	int			i;
+
+	if (pgan_shared_relabeled || !pgan_shared_attach())
+		return;
+
+	if (entry->generation != pgan_shared_generation())
+		return;
+
+	memset(&header, 0, sizeof(pganSharedData));
+
+	/*
+	 * The syscache lookup can process invalidations, which can release the
+	 * given entry.
+	 */
+	inval_count = pgan_label_inval_count;
+	header.xmin = pgan_get_rel_xmin(relid);
+	if (inval_count != pgan_label_inval_count)
+		return;
+
+	header.tupdesc_hash = hashTupleDesc(RelationGetDescr(rel));
+	header.natts = entry->natts;
+	header.inherit = entry->inherit;
+	header.has_exprs = (entry->exprs != NULL);
+	header.nb_ancestors = entry->nb_ancestors;
+
+	initStringInfo(&buf);
+	appendBinaryStringInfo(&buf, (char *) &header, sizeof(pganSharedData));
+	appendBinaryStringInfo(&buf, (char *) entry->ancestors,
+						   sizeof(Oid) * entry->nb_ancestors);
+
+	/* Each string is prefixed with a flag saying if it's NULL. */
+	for (i = 1; i <= entry->natts; i++)
+	{
+		char	   *seclabel = (entry->seclabels ? entry->seclabels[i] : NULL);
+
+		appendStringInfoChar(&buf, seclabel ? 1 : 0);
+		if (seclabel)
+			appendBinaryStringInfo(&buf, seclabel, strlen(seclabel) + 1);
+	}
+
+	for (i = 1; entry->exprs != NULL && i <= entry->natts; i++)
+	{
+		appendStringInfoChar(&buf, entry->exprs[i] ? 1 : 0);
+		if (entry->exprs[i])
+		{
+			char	   *str = nodeToString(entry->exprs[i]);
+
+			appendBinaryStringInfo(&buf, str, strlen(str) + 1);
+			pfree(str);
+		}
+	}
+
+	key.dbid = MyDatabaseId;
+	key.relid = relid;
+
+	sentry = dshash_find(pgan_shared_hash, &key, true);
+	if (sentry == NULL)
+	{
+		if (pg_atomic_read_u32(&pgan_shared->nb_entries) >=
+			pgan_shared_cache_entries)
+			pgan_shared_sweep();
+
+		/* Still full, the entry will only be cached locally. */
+		if (pg_atomic_read_u32(&pgan_shared->nb_entries) >=
+			pgan_shared_cache_entries)
+			return;
+
+		sentry = dshash_find_or_insert(pgan_shared_hash, &key, &found);
+		if (!found)
+		{
+			sentry->data = InvalidDsaPointer;
+			sentry->has_exprs = false;
+			pg_atomic_fetch_add_u32(&pgan_shared->nb_entries, 1);
+		}
+	}
+	else if (sentry->generation == entry->generation && sentry->has_exprs &&
+			 !header.has_exprs)
+	{
+		/* Don't replace a more complete entry. */
+		dshash_release_lock(pgan_shared_hash, sentry);
+		return;
+	}
+
+	dp = dsa_allocate_extended(pgan_shared_area, buf.len, DSA_ALLOC_NO_OOM);
+
+	if (DsaPointerIsValid(sentry->data))
+		dsa_free(pgan_shared_area, sentry->data);
+
+	if (!DsaPointerIsValid(dp))
+	{
+		dshash_delete_entry(pgan_shared_hash, sentry);
+		pg_atomic_fetch_sub_u32(&pgan_shared->nb_entries, 1);
+		return;
+	}
+
+	memcpy(dsa_get_address(pgan_shared_area, dp), buf.data, buf.len);
+	sentry->data = dp;
+	sentry->len = buf.len;
+	sentry->generation = entry->generation;
+	sentry->has_exprs = header.has_exprs;
+
+	dshash_release_lock(pgan_shared_hash, sentry);
+	pfree(buf.data);
+}
+
+/*
+ * Remove all the obsolete entries from the shared cache.  Sequential scans of
+ * a shared hash table are only possible since pg15, so on older versions the
+ * obsolete entries are only removed when looked up.
+ */
+static void
+pgan_shared_sweep(void)
+{
+#if PG_VERSION_NUM >= 150000
+	dshash_seq_status status;
+	pganSharedEntry *sentry;
+	uint64		generation = pgan_shared_generation();
+
+	dshash_seq_init(&status, pgan_shared_hash, true);
+	while ((sentry = dshash_seq_next(&status)) != NULL)
+	{
+		if (sentry->generation == generation)
+			continue;
+
+		if (DsaPointerIsValid(sentry->data))
+			dsa_free(pgan_shared_area, sentry->data);
+		dshash_delete_current(&status);
+		pg_atomic_fetch_sub_u32(&pgan_shared->nb_entries, 1);
+	}
+	dshash_seq_term(&status);
+#endif
+}
+
+/*
+ * Transaction callback, making the shared cache entries obsolete when a
+ * transaction that changed some security labels commits or aborts, so that
+ * nothing built while the change was in progress survives it.  For a
+ * prepared transaction, this is done when it's committed, see
+ * pgan_ProcessUtility().
+ */
+static void
+pgan_xact_callback(XactEvent event, void *arg)
+{
+	switch (event)
+	{
+		case XACT_EVENT_COMMIT:
+		case XACT_EVENT_ABORT:
+			if (pgan_shared_relabeled)
+				pgan_shared_bump_generation();
+			pgan_shared_relabeled = false;
+			break;
+		case XACT_EVENT_PREPARE:
+			pgan_shared_relabeled = false;
+			break;
+		default:
+			break;
+	}
+}
+#endif
+
+/*
+ * Return the Oids of all the ancestors of the given relation, in depth-first
+ * order, only looking at pg_inherits.  Each relation's parents are visited
+ * in inhseqno order, and an ancestor reached multiple times through multiple
+ * inheritance is only returned once.
+ *
+ * The ancestors are not opened or locked, which is safe as detaching or
+ * dropping an ancestor requires a lock on the given relation, that the caller
+ * is expected to hold.
+ */
+static List *
+pgan_get_ancestors(Oid relid)
+{
+	Relation	inhRel;
+	List	   *ancestors = NIL;
+	List	   *stack = list_make1_oid(relid);
+
+	inhRel = table_open(InheritsRelationId, AccessShareLock);
+
+	while (stack != NIL)
+	{
+		Oid			cur = linitial_oid(stack);
+		List	   *parents = NIL;
+		ScanKeyData key;
+		SysScanDesc scan;
+		HeapTuple	tuple;
+		ListCell   *lc;
+
+		stack = list_delete_first(stack);
+
+		if (cur != relid)
+		{
+			if (list_member_oid(ancestors, cur))
+				continue;
+			ancestors = lappend_oid(ancestors, cur);
+		}
+
+		ScanKeyInit(&key,
+					Anum_pg_inherits_inhrelid,
+					BTEqualStrategyNumber, F_OIDEQ,
+					ObjectIdGetDatum(cur));
+
+		scan = systable_beginscan(inhRel, InheritsRelidSeqnoIndexId, true,
+								  NULL, 1, &key);
+
+		/* Push the parents so that the first one is processed first. */
+		while (HeapTupleIsValid(tuple = systable_getnext(scan)))
+			parents = lcons_oid(((Form_pg_inherits) GETSTRUCT(tuple))->inhparent,
+								parents);
+		systable_endscan(scan);
+
+		foreach(lc, parents)
+			stack = lcons_oid(lfirst_oid(lc), stack);
+		list_free(parents);
+	}
+
+	table_close(inhRel, AccessShareLock);
+
+	return ancestors;
+}
+
+/*
+ * Function that looks for security labels for the given relation, and any of
+ * its ancestor(s).
+ *
+ * The ancestors are first resolved using pgan_get_ancestors(), without
+ * opening or locking them.  The security labels of the relation and all its
+ * ancestors are then retrieved in a single pg_seclabel scan, and each column
+ * gets the security label of the first relation having one in that order.
+ * Ancestors columns are mapped by name using the syscache, for the same
+ * reason.
+ *
+ * Caller is responsible for passing a zero-initialized context.  This
+ * function will allocate the seclabel array only if nb_labels is not zero.
+ */
+static void
+pgan_get_rel_seclabels_worker(Relation rel, pganWalkerContext *context)
+{
+	Oid			relid = RelationGetRelid(rel);
+	int			natts = RelationGetNumberOfAttributes(rel);
+	Relation	secRel;
+	ScanKeyData keys[3];
+	SysScanDesc scan;
+	HeapTuple	tuple;
+	pganSeclabelRow *rows;
+	Datum	   *relids;
+	Oid		   *sorted;
+	ArrayType  *arr;
+	ListCell   *lc;
+	bool		indexOK;
+	int			nb_relids;
+	int			nb_rows = 0;
+	int			max_rows = 16;
+	int			i;
+
+	if (pgan_inherit_labels)
+		context->ancestors = pgan_get_ancestors(relid);
+
+	/* Relations to look at, in precedence order. */
+	nb_relids = list_length(context->ancestors) + 1;
+	relids = (Datum *) palloc(sizeof(Datum) * nb_relids);
+	sorted = (Oid *) palloc(sizeof(Oid) * nb_relids);
+	relids[0] = ObjectIdGetDatum(relid);
+	sorted[0] = relid;
+	i = 1;
+	foreach(lc, context->ancestors)
+	{
+		sorted[i] = lfirst_oid(lc);
+		relids[i++] = ObjectIdGetDatum(lfirst_oid(lc));
+	}
+	qsort(sorted, nb_relids, sizeof(Oid), oid_cmp);
+
+	/*
+	 * Fetch all the security labels in a single index scan, using an array
+	 * key on the object oid.  Heap scans can't handle array keys, so in that
+	 * case only filter on the other keys and check the object oid
+	 * afterwards.
+	 */
+	indexOK = !IgnoreSystemIndexes;
+	arr = construct_array(relids, nb_relids, OIDOID, sizeof(Oid), true, 'i');
+	i = 0;
+	if (indexOK)
+		ScanKeyEntryInitialize(&keys[i++], SK_SEARCHARRAY,
+							   Anum_pg_seclabel_objoid,
+							   BTEqualStrategyNumber, InvalidOid,
+							   InvalidOid, F_OIDEQ, PointerGetDatum(arr));
+	ScanKeyInit(&keys[i++],
+				Anum_pg_seclabel_classoid,
+				BTEqualStrategyNumber, F_OIDEQ,
+				ObjectIdGetDatum(RelationRelationId));
+	ScanKeyInit(&keys[i++],
+				Anum_pg_seclabel_provider,
+				BTEqualStrategyNumber, F_TEXTEQ,
+				CStringGetTextDatum(PGAN_PROVIDER));
+
+	secRel = table_open(SecLabelRelationId, AccessShareLock);
+	scan = systable_beginscan(secRel, SecLabelObjectIndexId, indexOK,
+							  NULL, i, keys);
+
+	rows = (pganSeclabelRow *) palloc(sizeof(pganSeclabelRow) * max_rows);
+	while (HeapTupleIsValid(tuple = systable_getnext(scan)))
+	{
+		FormData_pg_seclabel *seclabel = (FormData_pg_seclabel *) GETSTRUCT(tuple);
+		Datum		datum;
+		bool		isnull;
+
+		if (!bsearch(&seclabel->objoid, sorted, nb_relids, sizeof(Oid),
+					 oid_cmp))
+			continue;
+
+		datum = heap_getattr(tuple, Anum_pg_seclabel_label,
+							 RelationGetDescr(secRel), &isnull);
+		if (isnull)
+			continue;
+
+		if (nb_rows == max_rows)
+		{
+			max_rows *= 2;
+			rows = (pganSeclabelRow *) repalloc(rows, sizeof(pganSeclabelRow) *
+												max_rows);
+		}
+
+		rows[nb_rows].objoid = seclabel->objoid;
+		rows[nb_rows].attnum = seclabel->objsubid;
+		rows[nb_rows].seclabel = TextDatumGetCString(datum);
+		nb_rows++;
+	}
+	systable_endscan(scan);
+	table_close(secRel, AccessShareLock);
+
+	if (nb_rows == 0)
+		return;
+
+	context->seclabels = palloc0(sizeof(char *) *
+			/* AttrNumber is 1-based */
+			(natts + 1));
+
+	/* Apply the security labels, by precedence order. */
+	for (i = 0; i < nb_relids && context->nb_labels < natts; i++)
+	{
+		Oid			cur = DatumGetObjectId(relids[i]);
+		int			j;
+
+		for (j = 0; j < nb_rows; j++)
+		{
+			int			attnum = rows[j].attnum;
+
+			if (rows[j].objoid != cur)
+				continue;
+
+			/*
+			 * Ancestors can have a different tuple descriptor, so map the
+			 * column by name.
+			 */
+			if (cur != relid)
 			{
-				Form_pg_attribute att = TupleDescAttr(tupDesc, i);
+				HeapTuple	atttup;
 
-				if (att->attisdropped)
+				atttup = SearchSysCache2(ATTNUM, ObjectIdGetDatum(cur),
+										 Int16GetDatum(attnum));
+				if (!HeapTupleIsValid(atttup))
 					continue;
-				if (namestrcmp(&(att->attname), name) == 0)
-				{
-#if PG_VERSION_NUM >= 120000
-					if (att->attgenerated && is_copy)
-						ereport(ERROR,
-								(errcode(ERRCODE_INVALID_COLUMN_REFERENCE),
-								 errmsg("column \"%s\" is a generated column",
-										name),
-								 errdetail("Generated columns cannot be used in COPY.")));
-#endif
-					attnum = att->attnum;
-					break;
-				}
+
+				attnum = get_attnum(relid,
+									NameStr(((Form_pg_attribute) GETSTRUCT(atttup))->attname));
+				ReleaseSysCache(atttup);
 			}
-			if (attnum == InvalidAttrNumber)
+
+			if (attnum <= 0 || attnum > natts)
+				continue;
+
+			/* Don't overload an existing security label. */
+			if (context->seclabels[attnum] == NULL)
 			{
-				if (rel != NULL)
-					ereport(ERROR,
-							(errcode(ERRCODE_UNDEFINED_COLUMN),
-							 errmsg("column \"%s\" of relation \"%s\" does not exist",
-									name, RelationGetRelationName(rel))));
-				else
-					ereport(ERROR,
-							(errcode(ERRCODE_UNDEFINED_COLUMN),
-							 errmsg("column \"%s\" does not exist",
-									name)));
+				context->seclabels[attnum] = rows[j].seclabel;
+				context->nb_labels++;
 			}
-			/* Check for duplicates */
-			if (list_member_int(attnums, attnum))
-				ereport(ERROR,
-						(errcode(ERRCODE_DUPLICATE_COLUMN),
-						 errmsg("column \"%s\" specified more than once",
-								name)));
-			attnums = lappend_int(attnums, attnum);
 		}
 	}
+}
 
-	return attnums;
+/*
+ * Walker function looking for a reference to an anonymized column, or a
+ * whole-row reference, of the given relation.
+ */
+static bool
+pgan_labeled_var_walker(Node *node, void *context)
+{
+	pganLabeledVarContext *ctx = (pganLabeledVarContext *) context;
+
+	if (node == NULL)
+		return false;
+
+	if (IsA(node, Var))
+	{
+		Var		   *var = (Var *) node;
+
+		if (var->varno != ctx->varno ||
+			var->varlevelsup != ctx->sublevels_up)
+			return false;
+
+		if (var->varattno == InvalidAttrNumber)
+			return true;
+
+		return (var->varattno > 0 && ctx->exprs[var->varattno] != NULL);
+	}
+
+	if (IsA(node, Query))
+	{
+		bool		res;
+
+		ctx->sublevels_up++;
+		res = query_tree_walker((Query *) node,
+								pgan_labeled_var_walker,
+								context,
+								0);
+		ctx->sublevels_up--;
+
+		return res;
+	}
+
+	return expression_tree_walker(node, pgan_labeled_var_walker, context);
 }
 
 /*
- * Generate an SQL query returning the anonymized data.
+ * Mutator function replacing any reference to an anonymized column with the
+ * underlying security label.
  */
-static char *
-pgan_get_query_for_relid(Relation rel, List *attlist, bool is_copy)
+static Node *
+pgan_defer_expand_mutator(Node *node, void *context)
 {
-	char	  **seclabels;
-	List	   *attnums;
-	ListCell   *lc;
-	TupleDesc	tupdesc;
-	StringInfoData select;
-	bool		first;
-
-	/*
-	 * We only anonymize plain (possibly partitioned) relations and
-	 * materialized views.
-	 */
-	if (rel->rd_rel->relkind != RELKIND_RELATION &&
-		rel->rd_rel->relkind != RELKIND_MATVIEW &&
-		rel->rd_rel->relkind != RELKIND_PARTITIONED_TABLE)
-		return NULL;
-
-	/* COPY isn't allowed for partitioned table. */
-	if (is_copy && rel->rd_rel->relkind == RELKIND_PARTITIONED_TABLE)
-		return NULL;
-
-	/* Fetch all the declared SECURITY LABEL on the relation. */
-	seclabels = pgan_get_rel_seclabels(rel);
+	pganDeferContext *ctx = (pganDeferContext *) context;
 
-	/* Nothing to do if no SECURITY LABEL declared. */
-	if (seclabels == NULL)
+	if (node == NULL)
 		return NULL;
 
-	tupdesc = RelationGetDescr(rel);
-	attnums = pgan_get_attnums(tupdesc, rel, attlist, is_copy);
-
-	initStringInfo(&select);
-	appendStringInfoString(&select, "SELECT ");
-
-	first = true;
-	foreach(lc, attnums)
+	if (IsA(node, Var))
 	{
-		FormData_pg_attribute *att;
-		int attnum = lfirst_int(lc);
+		Var		   *var = (Var *) node;
+		Node	  **exprs;
+		Node	   *expr;
 
-		if (!first)
-			appendStringInfoString(&select, ", ");
-		else
-			first = false;
+		Assert(var->varlevelsup == 0);
 
-		att = TupleDescAttr(tupdesc, attnum - 1);
+		exprs = ctx->exprs[var->varno];
+		if (exprs == NULL || var->varattno <= 0 || exprs[var->varattno] == NULL)
+			return (Node *) copyObject(var);
 
-		/*
-		 * If the column is anonymized, emit the proper expression, otherwise
-		 * just emit the (quoted) column name.
-		 */
-		if (seclabels[attnum] != NULL)
-		{
-			appendStringInfo(&select, "%s AS %s", seclabels[attnum],
-							 quote_identifier(NameStr(att->attname)));
-		}
-		else
-		{
-			Assert(!att->attisdropped);
-			appendStringInfoString(&select,
-								   quote_identifier(NameStr(att->attname)));
-		}
+		/* The security labels are analyzed with a single range table entry. */
+		expr = copyObject(exprs[var->varattno]);
+		ChangeVarNodes(expr, 1, var->varno, 0);
+
+		return expr;
 	}
 
-	/* Finish building the query if we found any security label on the table. */
-	appendStringInfo(&select, " FROM%s %s.%s",
-					 (is_copy ? " ONLY" : ""),
-					 quote_identifier(get_namespace_name(RelationGetNamespace(rel))),
-					 quote_identifier(RelationGetRelationName(rel)));
-	return select.data;
+	return expression_tree_mutator(node, pgan_defer_expand_mutator, context);
 }
 
 /*
- * Get all SECURITY LABELs for the given relation.
- *
- * This function returns an array, indexed by the underlying column attribute
- * number, of the security labels.
- *
- * If the relation doesn't have any security label defined, NULL is returned.
+ * Mutator function replacing any Var with the matching passthrough column of
+ * the inner query.
  */
-static char **
-pgan_get_rel_seclabels(Relation rel)
+static Node *
+pgan_defer_replace_mutator(Node *node, void *context)
 {
-	pganWalkerContext *context;
-
-	context = (pganWalkerContext *) palloc0(sizeof(pganWalkerContext));
+	pganDeferContext *ctx = (pganDeferContext *) context;
 
-	context->secRel = table_open(SecLabelRelationId, AccessShareLock);
+	if (node == NULL)
+		return NULL;
 
-	/* The worker function does all the work. */
-	pgan_get_rel_seclabels_worker(rel, context);
+	if (IsA(node, Var))
+	{
+		Var		   *var = (Var *) node;
+		ListCell   *lc;
+		int			resno = ctx->first_resno;
 
-	table_close(context->secRel, AccessShareLock);
+		foreach(lc, ctx->passthrough)
+		{
+			Var		   *pvar = lfirst_node(Var, lc);
 
-	if (context->inhRel)
-		table_close(context->inhRel, AccessShareLock);
+			if (pvar->varno == var->varno && pvar->varattno == var->varattno)
+				return (Node *) makeVar(1, resno, var->vartype, var->vartypmod,
+										var->varcollid, 0);
+			resno++;
+		}
 
-	if (context->nb_labels == 0)
-		return NULL;
+		elog(ERROR, "could not find passthrough column for var %d.%d",
+			 var->varno, var->varattno);
+	}
 
-	return context->seclabels;
+	return expression_tree_mutator(node, pgan_defer_replace_mutator, context);
 }
 
 /*
- * Function that looks for security labels for the given relation, and any of
- * its ancestor(s).
+ * Try to defer the evaluation of the security labels after the ORDER BY and
+ * LIMIT / OFFSET clauses of the given top-level query.
  *
- * This function will recurse, using a depth-first search, for all the given
- * relation ancestor(s) (if any) until either a security label has been found
- * for all columns of the original relation, or no more ancestor exist.
+ * If anonymized columns are only referenced in the final targetlist of the
+ * query, the query is transformed so that the original query is pushed down
+ * in a subquery emitting the raw values, with a wrapper query that evaluates
+ * the security labels on top of it, ie. only for the rows actually returned.
+ * The subquery can't be flattened by the planner as it has a LIMIT or OFFSET
+ * clause.
  *
- * Caller is responsible for opening and caching pg_catalog in secRel, with the
- * rest of the members zero-initialized.  This function will allocate the
- * seclabel array only if nb_labels is not zero and may open and cache
- * pg_inherits in inhRel.  Caller is also responsible for checking if inhRel is
- * cached and closing it in that case.
+ * Returns the list of range table entries that must not be anonymized, as
+ * their anonymized columns, if any, are now handled by the wrapper query.
  */
-static void
-pgan_get_rel_seclabels_worker(Relation rel, pganWalkerContext *context)
+static List *
+pgan_defer_labels(Query *query)
 {
-	TupleDesc	tupdesc;
-	AttrMap	   *attrMap;
-	ScanKeyData keys[3];
-	SysScanDesc scan;
-	HeapTuple	tuple;
-
-	ScanKeyInit(&keys[0],
-				Anum_pg_seclabel_objoid,
-				BTEqualStrategyNumber, F_OIDEQ,
-				ObjectIdGetDatum(RelationGetRelid(rel)));
-	ScanKeyInit(&keys[1],
-				Anum_pg_seclabel_classoid,
-				BTEqualStrategyNumber, F_OIDEQ,
-				ObjectIdGetDatum(RelationRelationId));
-	ScanKeyInit(&keys[2],
-				Anum_pg_seclabel_provider,
-				BTEqualStrategyNumber, F_TEXTEQ,
-				CStringGetTextDatum(PGAN_PROVIDER));
+	Node	 ***exprs;
+	List	   *deferred_rtes = NIL;
+	List	   *deferred_tles = NIL;
+	List	   *nonfinal = NIL;
+	List	   *saved_tlist;
+	List	   *inner_tlist = NIL;
+	List	   *outer_tlist = NIL;
+	List	   *junk = NIL;
+	List	   *colnames = NIL;
+	List	   *expanded = NIL;
+	Query	   *inner;
+	Query	   *outer;
+	RangeTblEntry *subrte;
+	pganDeferContext dctx;
+	ListCell   *lc;
+	ListCell   *lc2;
+	Index		rti;
+	int			resno;
 
-	scan = systable_beginscan(context->secRel, SecLabelObjectIndexId, true,
-							  NULL, 3, keys);
+	if (!pgan_defer_evaluation)
+		return NIL;
 
-	tuple = systable_getnext(scan);
+	/*
+	 * Only handle plain SELECT queries with a LIMIT or OFFSET, as otherwise
+	 * the labels would be evaluated for all the rows anyway, and no
+	 * processing that could evaluate the targetlist earlier.
+	 */
+	if (query->commandType != CMD_SELECT ||
+		query->utilityStmt != NULL ||
+		(query->limitCount == NULL && query->limitOffset == NULL) ||
+		query->setOperations != NULL ||
+		query->hasAggs ||
+		query->hasWindowFuncs ||
+		query->hasTargetSRFs ||
+		query->hasModifyingCTE ||
+		query->hasForUpdate ||
+		query->groupClause != NIL ||
+		query->groupingSets != NIL ||
+		query->havingQual != NULL ||
+		query->distinctClause != NIL ||
+		query->rowMarks != NIL)
+		return NIL;
 
 	/*
-	 * Bail out if we didn't find any SECURITY LABEL for that relation and user
-	 * don't want to inherit security labels, but after the necessary cleanup.
+	 * Join alias variables could hide a reference to an anonymized column,
+	 * and outer joins could null the computed expressions, so only handle
+	 * queries without explicit JOIN.
 	 */
-	if (!HeapTupleIsValid(tuple) && !pgan_inherit_labels)
+	foreach(lc, query->rtable)
 	{
-		systable_endscan(scan);
-		return;
+		if (lfirst_node(RangeTblEntry, lc)->rtekind == RTE_JOIN)
+			return NIL;
 	}
 
-	tupdesc = RelationGetDescr(rel);
-
 	/*
-	 * If this is the first call, we're passed the original relation.  In that
-	 * case we save a copy of its tupledesc and allocate the seclabel array.
-	 * Otherwise, we need to build an AttrMap as there's no guarantee that the
-	 * original relation and the current ancestor have the same tuple
-	 * descriptor.
+	 * Only the targetlist entries that are simply returned to the client can
+	 * have their evaluation deferred.
 	 */
-	if (context->tupdesc == NULL)
+	foreach(lc, query->targetList)
 	{
-		context->tupdesc = CreateTupleDescCopy(tupdesc);
-		/* No map needed. */
-		attrMap = NULL;
+		TargetEntry *tle = lfirst_node(TargetEntry, lc);
 
-		context->seclabels = palloc0(sizeof(char *) *
-				/* AttrNumber is 1-based */
-				(RelationGetNumberOfAttributes(rel) + 1));
+		if (tle->resjunk || tle->ressortgroupref != 0 ||
+			checkExprHasSubLink((Node *) tle->expr))
+			nonfinal = lappend(nonfinal, tle);
 	}
-	else
+
+	exprs = (Node ***) palloc0(sizeof(Node **) *
+							   (list_length(query->rtable) + 1));
+
+	rti = 0;
+	foreach(lc, query->rtable)
 	{
-		attrMap = build_attrmap_by_name_if_req(context->tupdesc,
-											   tupdesc
-#if PG_VERSION_NUM >= 160000
-											   , false
-#endif
-											   );
+		RangeTblEntry *rte = lfirst_node(RangeTblEntry, lc);
+		pganLabeledVarContext ctx;
+		Relation	rel;
+		Node	  **relexprs;
+		bool		found;
+		int			i;
+
+		rti++;
+
+		if (rte->rtekind != RTE_RELATION)
+			continue;
+
+		rel = relation_open(rte->relid, AccessShareLock);
+		relexprs = pgan_copy_exprs_for_rel(rel, rte->inh);
+		found = false;
+		for (i = 1; relexprs && i <= RelationGetNumberOfAttributes(rel); i++)
+			found |= checkExprHasSubLink(relexprs[i]);
+		if (relexprs != NULL)
+			found |= OidIsValid(pgan_get_shadow(rel));
+		relation_close(rel, NoLock);
+
+		/*
+		 * Nothing to do if the relation isn't anonymized, and we can't move
+		 * security labels containing a subquery.  There's also no point in
+		 * deferring the security labels of a relation having a shadow table,
+		 * as they're already computed.
+		 */
+		if (relexprs == NULL || found)
+			continue;
+
+		/*
+		 * Check that no anonymized column is referenced anywhere else than in
+		 * the final targetlist entries.
+		 */
+		ctx.varno = rti;
+		ctx.exprs = relexprs;
+		ctx.sublevels_up = 0;
+
+		saved_tlist = query->targetList;
+		query->targetList = nonfinal;
+		found = query_tree_walker(query, pgan_labeled_var_walker, &ctx,
+								  QTW_IGNORE_JOINALIASES);
+		query->targetList = saved_tlist;
+
+		/*
+		 * Whole-row references can't be expanded, so they're not allowed in
+		 * the final targetlist entries either.
+		 */
+		foreach(lc2, query->targetList)
+		{
+			TargetEntry *tle = lfirst_node(TargetEntry, lc2);
+			ListCell   *lc3;
+
+			if (found || list_member_ptr(nonfinal, tle))
+				continue;
+
+			foreach(lc3, pull_var_clause((Node *) tle->expr, 0))
+			{
+				Var		   *var = lfirst_node(Var, lc3);
+
+				if (var->varno == rti && var->varattno == InvalidAttrNumber)
+				{
+					found = true;
+					break;
+				}
+			}
+		}
+
+		if (found)
+			continue;
+
+		exprs[rti] = relexprs;
+		deferred_rtes = lappend(deferred_rtes, rte);
 	}
 
-	while (HeapTupleIsValid(tuple))
+	if (deferred_rtes == NIL)
+		return NIL;
+
+	/* Look for the targetlist entries needing deferred evaluation. */
+	foreach(lc, query->targetList)
 	{
-		Datum		datum;
-		bool		isnull;
+		TargetEntry *tle = lfirst_node(TargetEntry, lc);
+		List	   *vars;
 
-		datum = heap_getattr(tuple, Anum_pg_seclabel_label,
-							 RelationGetDescr(context->secRel), &isnull);
-		if (!isnull)
+		if (list_member_ptr(nonfinal, tle))
+			continue;
+
+		vars = pull_var_clause((Node *) tle->expr, 0);
+		foreach(lc2, vars)
 		{
-			int	attnum = ((FormData_pg_seclabel *) GETSTRUCT(tuple))->objsubid;
+			Var		   *var = lfirst_node(Var, lc2);
 
-			/* If an AttrMap was build, get the mapped AttrNumber. */
-			if (attrMap)
+			if (exprs[var->varno] != NULL && var->varattno > 0 &&
+				exprs[var->varno][var->varattno] != NULL)
 			{
-				Assert(attnum <= attrMap->maplen);
-				attnum = attrMap->attnums[attnum - 1];
-				Assert(attnum <= context->tupdesc->natts);
+				deferred_tles = lappend(deferred_tles, tle);
+				break;
 			}
+		}
+	}
 
-			/* Don't overload an existing security label. */
-			if (context->seclabels[attnum] == NULL)
+	/*
+	 * If no anonymized column is referenced at all, the relations can be
+	 * used as-is.
+	 */
+	if (deferred_tles == NIL)
+		return deferred_rtes;
+
+	/*
+	 * Build the inner query targetlist.  The deferred entries are replaced
+	 * with NULL placeholders, and all the raw columns needed to compute them
+	 * are added after the original non-junk entries.
+	 */
+	memset(&dctx, 0, sizeof(pganDeferContext));
+	dctx.exprs = exprs;
+
+	resno = 0;
+	foreach(lc, query->targetList)
+	{
+		TargetEntry *tle = lfirst_node(TargetEntry, lc);
+		Node	   *expr;
+
+		if (tle->resjunk)
+		{
+			junk = lappend(junk, tle);
+			continue;
+		}
+
+		resno++;
+		Assert(tle->resno == resno);
+		colnames = lappend(colnames,
+						   makeString(pstrdup(tle->resname ? tle->resname :
+											  "?column?")));
+
+		if (!list_member_ptr(deferred_tles, tle))
+		{
+			inner_tlist = lappend(inner_tlist, tle);
+			expanded = lappend(expanded, NULL);
+			continue;
+		}
+
+		expr = pgan_defer_expand_mutator((Node *) tle->expr, &dctx);
+		expanded = lappend(expanded, expr);
+
+		foreach(lc2, pull_var_clause(expr, 0))
+		{
+			Var		   *var = lfirst_node(Var, lc2);
+			ListCell   *lc3;
+			bool		found = false;
+
+			foreach(lc3, dctx.passthrough)
 			{
-				context->seclabels[attnum] = TextDatumGetCString(datum);
-				context->nb_labels++;
+				Var		   *pvar = lfirst_node(Var, lc3);
+
+				if (pvar->varno == var->varno && pvar->varattno == var->varattno)
+				{
+					found = true;
+					break;
+				}
 			}
+
+			if (!found)
+				dctx.passthrough = lappend(dctx.passthrough, var);
 		}
 
-		tuple = systable_getnext(scan);
+		tle = flatCopyTargetEntry(tle);
+		tle->expr = (Expr *) makeNullConst(exprType((Node *) tle->expr),
+										   exprTypmod((Node *) tle->expr),
+										   exprCollation((Node *) tle->expr));
+		inner_tlist = lappend(inner_tlist, tle);
 	}
-	systable_endscan(scan);
-
-	if (attrMap)
-		free_attrmap(attrMap);
 
 	/*
-	 * If we found a security label for all columns of the ancestor relation,
-	 * or user don't want to inherit security labels, we're done!
+	 * The security labels can reference other columns than the ones the query
+	 * reads, make sure that the permissions are checked for them too.
 	 */
-	if (context->nb_labels == context->tupdesc->natts ||
-		!pgan_inherit_labels)
+	foreach(lc, dctx.passthrough)
 	{
-		return;
-	}
+		Var		   *var = lfirst_node(Var, lc);
+		RangeTblEntry *rte = rt_fetch(var->varno, query->rtable);
+		int			attr = var->varattno - FirstLowInvalidHeapAttributeNumber;
 
-	/* Check if we need to inherit security labels from ancestor */
-	if (context->inhRel == NULL)
-		context->inhRel = table_open(InheritsRelationId, AccessShareLock);
+		if (exprs[var->varno] == NULL)
+			continue;
 
-	ScanKeyInit(&keys[0],
-				Anum_pg_inherits_inhrelid,
-				BTEqualStrategyNumber, F_OIDEQ,
-				ObjectIdGetDatum(RelationGetRelid(rel)));
+#if PG_VERSION_NUM >= 160000
+		if (rte->perminfoindex != 0)
+		{
+			RTEPermissionInfo *perminfo;
+
+			perminfo = getRTEPermissionInfo(query->rteperminfos, rte);
+			perminfo->selectedCols = bms_add_member(perminfo->selectedCols,
+													attr);
+		}
+#else
+		rte->selectedCols = bms_add_member(rte->selectedCols, attr);
+#endif
+	}
+
+	dctx.first_resno = resno + 1;
+	foreach(lc, dctx.passthrough)
+	{
+		Var		   *var = (Var *) copyObject(lfirst_node(Var, lc));
+		char	   *resname = psprintf("pgan_raw_%d", ++resno);
 
-	scan = systable_beginscan(context->inhRel, InheritsRelidSeqnoIndexId, true,
-							  NULL, 1, keys);
+		colnames = lappend(colnames, makeString(resname));
+		inner_tlist = lappend(inner_tlist,
+							  makeTargetEntry((Expr *) var, resno, resname,
+											  false));
+	}
 
-	/* Iterate over all ancestors if any, using a depth-first search. */
-	while ((tuple = systable_getnext(scan)) != NULL)
+	foreach(lc, junk)
 	{
-		Form_pg_inherits inh = (Form_pg_inherits) GETSTRUCT(tuple);
-		Oid			inhparent = inh->inhparent;
-		Relation	parentRel;
+		TargetEntry *tle = flatCopyTargetEntry(lfirst_node(TargetEntry, lc));
+
+		tle->resno = ++resno;
+		inner_tlist = lappend(inner_tlist, tle);
+	}
 
-		parentRel = table_open(inhparent, AccessShareLock);
+	/* Build the wrapper query targetlist. */
+	resno = 0;
+	forboth(lc, query->targetList, lc2, expanded)
+	{
+		TargetEntry *tle = lfirst_node(TargetEntry, lc);
+		TargetEntry *newtle;
+		Node	   *expr = (Node *) lfirst(lc2);
 
-		pgan_get_rel_seclabels_worker(parentRel, context);
+		if (tle->resjunk)
+			break;
 
-		table_close(parentRel, AccessShareLock);
+		resno++;
+		if (expr != NULL)
+			expr = pgan_defer_replace_mutator(expr, &dctx);
+		else
+			expr = (Node *) makeVar(1, resno,
+									exprType((Node *) tle->expr),
+									exprTypmod((Node *) tle->expr),
+									exprCollation((Node *) tle->expr),
+									0);
+
+		newtle = makeTargetEntry((Expr *) expr, resno, tle->resname, false);
+		newtle->resorigtbl = tle->resorigtbl;
+		newtle->resorigcol = tle->resorigcol;
+		outer_tlist = lappend(outer_tlist, newtle);
 	}
-	systable_endscan(scan);
+
+	/* The original query becomes the inner query. */
+	inner = makeNode(Query);
+	memcpy(inner, query, sizeof(Query));
+	inner->targetList = inner_tlist;
+
+	/*
+	 * The parser always sets canSetTag, and it's ignored for subqueries, so
+	 * use it to recognize the deferral wrapper, see pgan_explain_walker().
+	 */
+	inner->canSetTag = false;
+
+	subrte = makeNode(RangeTblEntry);
+	subrte->rtekind = RTE_SUBQUERY;
+	subrte->subquery = inner;
+	subrte->eref = makeAlias("pgan_deferred", colnames);
+	subrte->inFromCl = true;
+
+	/*
+	 * And the wrapper query replaces the original query, keeping the fields
+	 * that other modules may have set.
+	 */
+	outer = makeNode(Query);
+	outer->commandType = CMD_SELECT;
+	outer->querySource = query->querySource;
+	outer->queryId = query->queryId;
+	outer->canSetTag = query->canSetTag;
+	outer->stmt_location = query->stmt_location;
+	outer->stmt_len = query->stmt_len;
+	outer->rtable = list_make1(subrte);
+	outer->jointree = makeFromExpr(list_make1(makeRangeTblRef(1)), NULL);
+	outer->targetList = outer_tlist;
+
+	memcpy(query, outer, sizeof(Query));
+
+	foreach(lc, deferred_rtes)
+		pgan_stats_count(lfirst_node(RangeTblEntry, lc)->relid,
+						 PGAN_STATS_REWRITE, 0);
+
+	return deferred_rtes;
 }
 
 /*
  * Walker function for query_tree_walker.
- * Inspect all range table entries in all found queries.
+ * Inspect all range table entries in all found queries, except the ones
+ * contained in the given context List.
  */
 static bool
 pgan_hack_query(Node *node, void *context)
@@ -816,7 +6593,11 @@ pgan_hack_query(Node *node, void *context)
 			if (rte->rtekind != RTE_RELATION)
 				continue;
 
-			pgan_hack_rte(rte);
+			/* Ignore relations whose anonymization has been deferred. */
+			if (list_member_ptr((List *) context, rte))
+				continue;
+
+			pgan_hack_rte(query, rte);
 		}
 
 		return query_tree_walker(query,
@@ -835,63 +6616,63 @@ pgan_hack_query(Node *node, void *context)
  * anonymized table if any of the relation's field should be anonymized.
  */
 static void
-pgan_hack_rte(RangeTblEntry *rte)
+pgan_hack_rte(Query *query, RangeTblEntry *rte)
 {
 	Relation rel;
-	char *sql;
-
-	rel = relation_open(rte->relid, AccessShareLock);
-	sql = pgan_get_query_for_relid(rel, NIL, false);
-	relation_close(rel, NoLock);
+	Query *subquery;
+	Bitmapset *attrs_used = NULL;
+	bool all_attrs = false;
 
 	/*
-	 * If we got a query, transform the given rte in a subquery pointing to it.
+	 * Only compute the columns that the query reads.  The parser has already
+	 * recorded them for the permission checks.
 	 */
-	if (sql)
+#if PG_VERSION_NUM >= 160000
+	if (rte->perminfoindex != 0)
 	{
-		List *parselist;
-		RawStmt *raw;
-		Query *subquery;
-		bool prev_toplevel = pgan_toplevel;
+		RTEPermissionInfo *perminfo;
 
-		PG_TRY();
-		{
-			parselist = pg_parse_query(sql);
-		}
-		PG_CATCH();
-		{
-			errcontext("during anonymization of table %s", get_rel_name(rte->relid));
-			PG_RE_THROW();
-		}
-		PG_END_TRY();
+		perminfo = getRTEPermissionInfo(query->rteperminfos, rte);
+		attrs_used = perminfo->selectedCols;
+	}
+	else
+		all_attrs = true;
+#else
+	attrs_used = rte->selectedCols;
+#endif
 
-		Assert(list_length(parselist) == 1);
-		Assert(IsA(linitial(parselist), RawStmt));
+	/* A whole-row reference requires all the columns. */
+	if (bms_is_member(InvalidAttrNumber - FirstLowInvalidHeapAttributeNumber,
+					  attrs_used))
+		all_attrs = true;
 
-		raw = linitial_node(RawStmt, parselist);
+	rel = relation_open(rte->relid, AccessShareLock);
+	subquery = pgan_get_subquery_for_rel(rel, attrs_used, all_attrs, rte->inh);
+	relation_close(rel, NoLock);
 
+	/*
+	 * If we got a query, transform the given rte in a subquery pointing to it.
+	 */
+	if (subquery)
+	{
 		/*
-		 * Be careful to not call our post_parse_analyze_hook when generating
-		 * the new query.
+		 * Sample the underlying relation rather than the subquery, which
+		 * isn't supported anyway.  The arguments can't reference the sampled
+		 * relation, but could reference a previous lateral relation.
 		 */
-		pgan_toplevel = false;
-		PG_TRY();
-		{
-			subquery = parse_analyze_fixedparams(raw, sql, NULL, 0, NULL);
-			pgan_toplevel = prev_toplevel;
-		}
-		PG_CATCH();
+		if (rte->tablesample)
 		{
-			pgan_toplevel = prev_toplevel;
-			PG_RE_THROW();
-		}
-		PG_END_TRY();
+			RangeTblEntry *subrte;
 
-		/* Remember to not process it again */
-		subquery->querySource = QSRC_PARSER;
+			subrte = linitial_node(RangeTblEntry, subquery->rtable);
+			subrte->tablesample = rte->tablesample;
+			IncrementVarSublevelsUp((Node *) subrte->tablesample, 1, 0);
+		}
 
 		AcquireRewriteLocks(subquery, true, false);
 
+		pgan_stats_count(rte->relid, PGAN_STATS_REWRITE, 0);
+
 		rte->rtekind = RTE_SUBQUERY;
 		rte->subquery = subquery;
 		rte->security_barrier = false;
@@ -920,16 +6701,111 @@ pgan_hack_rte(RangeTblEntry *rte)
 	}
 }
 
-static bool
-pgan_is_role_anonymized(void)
+/*
+ * Is the current user declared as anonymized?
+ *
+ * The answer is cached per role, so that non anonymized roles only pay for a
+ * hash lookup.  Note that we rely on GetUserId(), so SET ROLE and SECURITY
+ * DEFINER functions are correctly handled.
+ */
+static bool
+pgan_is_role_anonymized(void)
+{
+	Oid				roleid = GetUserId();
+	pganRoleEntry  *entry;
+	ObjectAddress	addr;
+	char		   *seclabel;
+	uint64			inval_count;
+	bool			anonymized;
+
+	if (pgan_roles == NULL)
+	{
+		HASHCTL		ctl;
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(Oid);
+		ctl.entrysize = sizeof(pganRoleEntry);
+		ctl.hcxt = CacheMemoryContext;
+		pgan_roles = hash_create("pg_anonymize role cache", 16, &ctl,
+								 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
+
+	entry = hash_search(pgan_roles, &roleid, HASH_FIND, NULL);
+	if (entry)
+		return entry->anonymized;
+
+	inval_count = pgan_role_inval_count;
+
+	ObjectAddressSet(addr, AuthIdRelationId, roleid);
+	seclabel = GetSecurityLabel(&addr, PGAN_PROVIDER);
+
+	anonymized = (seclabel && strcmp(seclabel, PGAN_ROLE_ANONYMIZED) == 0);
+
+	/* Only cache the result if no invalidation happened in the meantime. */
+	if (inval_count == pgan_role_inval_count && pgan_roles != NULL)
+	{
+		entry = hash_search(pgan_roles, &roleid, HASH_ENTER, NULL);
+		entry->anonymized = anonymized;
+	}
+
+	return anonymized;
+}
+
+/*
+ * pg_authid syscache invalidation callback.
+ *
+ * Role modifications are rare, so simply discard the whole cache.
+ */
+static void
+pgan_authid_callback(Datum arg, int cacheid, uint32 hashvalue)
 {
-	ObjectAddress	addr;
-	char		   *seclabel;
+	pgan_role_inval_count++;
 
-	ObjectAddressSet(addr, AuthIdRelationId, GetUserId());
-	seclabel = GetSecurityLabel(&addr, PGAN_PROVIDER);
+	if (pgan_roles == NULL)
+		return;
+
+	hash_destroy(pgan_roles);
+	pgan_roles = NULL;
+}
+
+/*
+ * pg_proc syscache invalidation callback.
+ *
+ * The optimized security labels and the shadow tables rely on functions of
+ * the extension, which could have been created or dropped, so look them up
+ * again.  The security labels themselves are cached in their original form.
+ */
+static void
+pgan_proc_callback(Datum arg, int cacheid, uint32 hashvalue)
+{
+	pgan_proc_inval_count++;
+	pgan_opt_funcs.valid = false;
+	pgan_shadow_func_valid = false;
+}
+
+/*
+ * pg_subscription_rel syscache invalidation callback.
+ *
+ * A subscribed relation can't use its shadow table, see pgan_get_shadow(), so
+ * look the shadow tables up again.  The security labels are still valid.
+ */
+static void
+pgan_subscription_rel_callback(Datum arg, int cacheid, uint32 hashvalue)
+{
+	HASH_SEQ_STATUS status;
+	pganRelLabels *entry;
+
+	pgan_label_inval_count++;
+
+	if (pgan_rel_labels == NULL)
+		return;
 
-	return (seclabel && strcmp(seclabel, PGAN_ROLE_ANONYMIZED) == 0);
+	hash_seq_init(&status, pgan_rel_labels);
+	while ((entry = hash_seq_search(&status)) != NULL)
+	{
+		entry->shadow_done = false;
+		entry->shadowid = InvalidOid;
+	}
 }
 
 /*
@@ -943,6 +6819,8 @@ pgan_post_parse_analyze(ParseState *pstate, Query *query
 #endif
 		)
 {
+	List	   *deferred;
+
 	/* XXX - should we try to prevent write queries ? */
 
 	if (prev_post_parse_analyze_hook)
@@ -952,6 +6830,27 @@ pgan_post_parse_analyze(ParseState *pstate, Query *query
 #endif
 				);
 
+	/*
+	 * The query of a rewritten COPY TO is generated from the security
+	 * labels, so only optimize them, see pgan_ProcessUtility().
+	 */
+	if (pgan_copy_pending)
+	{
+		ListCell   *lc;
+
+		pgan_copy_pending = false;
+
+		foreach(lc, query->targetList)
+		{
+			TargetEntry *tle = lfirst_node(TargetEntry, lc);
+
+			tle->expr = (Expr *) pgan_optimize_label(NULL, InvalidAttrNumber,
+													 (Node *) tle->expr);
+		}
+
+		return;
+	}
+
 	/* Module disabled, recursive call or aborted transaction, bail out. */
 	if (!pgan_enabled || !pgan_toplevel || !IsTransactionState())
 		return;
@@ -960,13 +6859,37 @@ pgan_post_parse_analyze(ParseState *pstate, Query *query
 	if (!pgan_is_role_anonymized())
 		return;
 
+	/*
+	 * The inner query of EXPLAIN, CREATE TABLE AS and DECLARE CURSOR is
+	 * analyzed along with the utility statement, without calling this hook,
+	 * so process it here or it would read the original data.
+	 */
+	while (query->commandType == CMD_UTILITY)
+	{
+		Node	   *stmt = query->utilityStmt;
+
+		if (IsA(stmt, ExplainStmt))
+			query = (Query *) ((ExplainStmt *) stmt)->query;
+		else if (IsA(stmt, CreateTableAsStmt))
+			query = (Query *) ((CreateTableAsStmt *) stmt)->query;
+		else if (IsA(stmt, DeclareCursorStmt))
+			query = (Query *) ((DeclareCursorStmt *) stmt)->query;
+		else
+			return;
+
+		/* e.g. EXPLAIN EXECUTE, processed when the statement was prepared */
+		if (query == NULL || !IsA(query, Query))
+			return;
+	}
+
 	/*
 	 * Walk the query and generate rewritten subqueries when needed.  We need
 	 * to do this last as we don't have a way to generate a proper query string
 	 * for that new Query, other any module relying on the Query and the
 	 * query string to be consistent (like pg_stat_statements) would fail.
 	 */
-	pgan_hack_query((Node *) query, NULL);
+	deferred = pgan_defer_labels(query);
+	pgan_hack_query((Node *) query, deferred);
 }
 
 /*
@@ -993,6 +6916,7 @@ pgan_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
 	char *sql;
 	bool prev_toplevel = pgan_toplevel;
 	const char *newsql = queryString;
+	int save_nestlevel = -1;
 
 	/* Module disabled, recursive call or not a COPY statement, bail out. */
 	if (!pgan_enabled || !pgan_toplevel || !IsA(parsetree, CopyStmt))
@@ -1008,7 +6932,16 @@ pgan_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
 		goto hook;
 
 	rel = relation_openrv(stmt->relation, AccessShareLock);
-	sql = pgan_get_query_for_relid(rel, stmt->attlist, true);
+
+#if PG_VERSION_NUM >= 140000
+	if (pgan_try_copy_direct(rel, stmt, queryString, qc))
+	{
+		relation_close(rel, NoLock);
+		return;
+	}
+#endif
+
+	sql = pgan_get_query_for_relid(rel, stmt->attlist, true, false);
 	relation_close(rel, NoLock);
 
 	/* If we got a query, use it in the COPY TO statement */
@@ -1041,6 +6974,9 @@ pgan_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
 		}
 		stmt->query = linitial_node(RawStmt, parselist)->stmt;
 		pgan_toplevel = false;
+		pgan_copy_pending = true;
+
+		pgan_stats_count(RelationGetRelid(rel), PGAN_STATS_COPY_REWRITE, 0);
 
 		/*
 		 * Generate a query string corresponding to the statement we're now
@@ -1057,6 +6993,15 @@ pgan_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
 		newsql = copysql.data;
 		pstmt->stmt_location = 0;
 		pstmt->stmt_len = strlen(newsql);
+
+		/*
+		 * Analyze the expressions with the same search_path as when they're
+		 * validated, see pgan_parse_analyze().
+		 */
+		save_nestlevel = NewGUCNestLevel();
+		(void) set_config_option("search_path", "pg_catalog", PGC_USERSET,
+								 PGC_S_SESSION, GUC_ACTION_SAVE, true, 0,
+								 false);
 	}
 
 hook:
@@ -1090,15 +7035,415 @@ hook:
 									);
 
 		pgan_toplevel = prev_toplevel;
+		pgan_copy_pending = false;
+
+		if (save_nestlevel != -1)
+			AtEOXact_GUC(true, save_nestlevel);
+
+		/*
+		 * The shadow table can be out of date if its triggers were disabled,
+		 * but not if we're maintaining it ourselves.
+		 */
+		if (pgan_toplevel && IsA(parsetree, AlterTableStmt))
+			pgan_shadow_enabled((AlterTableStmt *) parsetree);
+
+#if PG_VERSION_NUM >= 110000
+		/*
+		 * The prepared transaction could have changed some security labels,
+		 * see pgan_xact_callback().
+		 */
+		if (IsA(parsetree, TransactionStmt) &&
+			((TransactionStmt *) parsetree)->kind == TRANS_STMT_COMMIT_PREPARED)
+			pgan_shared_bump_generation();
+#endif
 	}
 	PG_CATCH();
 	{
 		pgan_toplevel = prev_toplevel;
+		pgan_copy_pending = false;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+}
+
+/*
+ * Remember the anonymized relations referenced by the query to explain, so
+ * that pgan_ExecutorEnd() can annotate its plan.
+ */
+static void
+pgan_ExplainOneQuery(Query *query, int cursorOptions, IntoClause *into,
+					 ExplainState *es, const char *queryString,
+					 ParamListInfo params, QueryEnvironment *queryEnv)
+{
+	pganExplainState *prev_explain = pgan_explain;
+	pganExplainState *state = NULL;
+
+	/*
+	 * The query was rewritten during parse analysis, so it has to be
+	 * inspected before the planner flattens the generated subqueries.
+	 */
+	if (pgan_enabled && IsTransactionState() && pgan_is_role_anonymized())
+	{
+		state = (pganExplainState *) palloc0(sizeof(pganExplainState));
+		state->es = es;
+		state->queryString = queryString;
+
+		pgan_explain_walker((Node *) query, state);
+
+		if (state->rels == NIL)
+			state = NULL;
+	}
+
+	pgan_explain = state;
+	PG_TRY();
+	{
+		if (prev_ExplainOneQuery)
+			prev_ExplainOneQuery(query, cursorOptions, into, es, queryString,
+								 params, queryEnv);
+		else
+			standard_ExplainOneQuery(query, cursorOptions, into, es,
+									 queryString, params, queryEnv);
+
+		pgan_explain = prev_explain;
+	}
+	PG_CATCH();
+	{
+		pgan_explain = prev_explain;
 		PG_RE_THROW();
 	}
 	PG_END_TRY();
 }
 
+/*
+ * Walker function for query_tree_walker.
+ * Find the subqueries generated by pgan_hack_rte() and the relations whose
+ * anonymization has been deferred by pgan_defer_labels().
+ */
+static bool
+pgan_explain_walker(Node *node, void *context)
+{
+	pganExplainState *state = (pganExplainState *) context;
+
+	if (node == NULL)
+		return false;
+
+	if (IsA(node, Query))
+	{
+		Query	   *query = (Query *) node;
+		RangeTblEntry *rte;
+		ListCell   *lc;
+
+		if (query->querySource == QSRC_PARSER)
+		{
+			Relation	rel;
+			Node	  **exprs;
+			Bitmapset  *attnums = NULL;
+
+			rte = linitial_node(RangeTblEntry, query->rtable);
+			rel = relation_open(rte->relid, AccessShareLock);
+			exprs = pgan_copy_exprs_for_rel(rel, rte->inh);
+
+			/* Unread columns were replaced with NULL placeholders. */
+			foreach(lc, exprs ? query->targetList : NIL)
+			{
+				TargetEntry *tle = lfirst_node(TargetEntry, lc);
+
+				if (exprs[tle->resno] != NULL &&
+					equal(tle->expr, exprs[tle->resno]))
+					attnums = bms_add_member(attnums, tle->resno);
+			}
+
+			pgan_explain_add_rel(state, rel, rte->inh, false, exprs, attnums);
+			relation_close(rel, NoLock);
+
+			return false;
+		}
+
+		/*
+		 * The relations left in the inner query of the deferral wrapper are
+		 * the ones whose security labels are evaluated by the wrapper, the
+		 * other ones have been replaced by a subquery.
+		 */
+		rte = (list_length(query->rtable) == 1 ?
+			   linitial_node(RangeTblEntry, query->rtable) : NULL);
+		if (rte != NULL && rte->rtekind == RTE_SUBQUERY &&
+			rte->subquery != NULL && !rte->subquery->canSetTag)
+		{
+			Query	   *inner = rte->subquery;
+
+			foreach(lc, inner->rtable)
+			{
+				RangeTblEntry *subrte = lfirst_node(RangeTblEntry, lc);
+				Bitmapset  *selected;
+				Bitmapset  *attnums = NULL;
+				Relation	rel;
+				Node	  **exprs;
+				int			i;
+
+				if (subrte->rtekind != RTE_RELATION)
+					continue;
+
+#if PG_VERSION_NUM >= 160000
+				if (subrte->perminfoindex == 0)
+					continue;
+				selected = getRTEPermissionInfo(inner->rteperminfos,
+												subrte)->selectedCols;
+#else
+				selected = subrte->selectedCols;
+#endif
+
+				rel = relation_open(subrte->relid, AccessShareLock);
+				exprs = pgan_copy_exprs_for_rel(rel, subrte->inh);
+
+				for (i = 1; exprs && i <= RelationGetNumberOfAttributes(rel); i++)
+				{
+					if (exprs[i] != NULL &&
+						bms_is_member(i - FirstLowInvalidHeapAttributeNumber,
+									  selected))
+						attnums = bms_add_member(attnums, i);
+				}
+
+				pgan_explain_add_rel(state, rel, subrte->inh, true, exprs,
+									 attnums);
+				relation_close(rel, NoLock);
+			}
+		}
+
+		return query_tree_walker(query,
+								 pgan_explain_walker,
+								 context,
+								 0);
+	}
+
+	return expression_tree_walker(node,
+								  pgan_explain_walker,
+								  context);
+}
+
+/*
+ * Record the given anonymized columns of the given relation, merging multiple
+ * references to the same relation.
+ */
+static void
+pgan_explain_add_rel(pganExplainState *state, Relation rel, bool inh,
+					 bool deferred, Node **exprs, Bitmapset *attnums)
+{
+	pganExplainRel *erel;
+	ListCell   *lc;
+
+	if (bms_is_empty(attnums))
+		return;
+
+	foreach(lc, state->rels)
+	{
+		erel = (pganExplainRel *) lfirst(lc);
+
+		if (erel->relid == RelationGetRelid(rel) && erel->deferred == deferred)
+		{
+			erel->attnums = bms_add_members(erel->attnums, attnums);
+			if (inh && list_length(erel->relids) == 1)
+				erel->relids = find_all_inheritors(erel->relid, NoLock, NULL);
+			return;
+		}
+	}
+
+	erel = (pganExplainRel *) palloc0(sizeof(pganExplainRel));
+	erel->relid = RelationGetRelid(rel);
+	erel->deferred = deferred;
+	erel->nspname = get_namespace_name(RelationGetNamespace(rel));
+	erel->relname = pstrdup(RelationGetRelationName(rel));
+	erel->exprs = exprs;
+	erel->attnums = attnums;
+	/* The relation and its descendants are already locked by the query. */
+	if (inh)
+		erel->relids = find_all_inheritors(erel->relid, NoLock, NULL);
+	else
+		erel->relids = list_make1_oid(erel->relid);
+
+	state->rels = lappend(state->rels, erel);
+}
+
+/*
+ * Annotate the plan of the query being explained, if any, before it's shut
+ * down.  This is called by ExplainOnePlan() after printing the plan tree, so
+ * the instrumentation is still available.
+ */
+static void
+pgan_ExecutorEnd(QueryDesc *queryDesc)
+{
+	if (pgan_explain != NULL && !pgan_explain->done &&
+		queryDesc->sourceText == pgan_explain->queryString)
+	{
+		pgan_explain->done = true;
+		pgan_explain_print(pgan_explain, queryDesc);
+	}
+
+	if (prev_ExecutorEnd)
+		prev_ExecutorEnd(queryDesc);
+	else
+		standard_ExecutorEnd(queryDesc);
+}
+
+/*
+ * Walker function for planstate_tree_walker.
+ * Count the rows emitted by the scans of the anonymized relations.
+ */
+static bool
+pgan_explain_rows_walker(PlanState *planstate, void *context)
+{
+	pganExplainState *state = (pganExplainState *) context;
+	Index		scanrelid = 0;
+
+	switch (nodeTag(planstate->plan))
+	{
+		case T_SeqScan:
+		case T_SampleScan:
+		case T_IndexScan:
+		case T_IndexOnlyScan:
+		case T_BitmapHeapScan:
+		case T_TidScan:
+#if PG_VERSION_NUM >= 140000
+		case T_TidRangeScan:
+#endif
+		case T_ForeignScan:
+		case T_CustomScan:
+			scanrelid = ((Scan *) planstate->plan)->scanrelid;
+			break;
+		default:
+			break;
+	}
+
+	if (scanrelid > 0 && planstate->instrument != NULL)
+	{
+		Oid			relid = rt_fetch(scanrelid, state->rtable)->relid;
+		ListCell   *lc;
+
+		foreach(lc, state->rels)
+		{
+			pganExplainRel *erel = (pganExplainRel *) lfirst(lc);
+
+			if (!erel->deferred && list_member_oid(erel->relids, relid))
+			{
+				erel->rows += planstate->instrument->ntuples;
+				break;
+			}
+		}
+	}
+
+	return planstate_tree_walker(planstate, pgan_explain_rows_walker, context);
+}
+
+/*
+ * Emit the anonymized relations, their anonymized columns and the security
+ * labels used for them.  With ANALYZE, also emit the number of anonymized
+ * rows and the resulting number of security label evaluations.
+ */
+static void
+pgan_explain_print(pganExplainState *state, QueryDesc *queryDesc)
+{
+	ExplainState *es = state->es;
+	bool		analyze = (es->analyze && queryDesc->planstate != NULL);
+	double		outer_rows = 0;
+	ListCell   *lc;
+
+#if PG_VERSION_NUM < 110000
+	if (es->format != EXPLAIN_FORMAT_TEXT)
+		return;
+#endif
+
+	if (analyze)
+	{
+		PlanState  *planstate = queryDesc->planstate;
+
+		state->rtable = queryDesc->plannedstmt->rtable;
+		pgan_explain_rows_walker(planstate, state);
+
+		/* Deferred labels are evaluated for the rows the query returns. */
+		if (planstate->instrument != NULL)
+		{
+			InstrEndLoop(planstate->instrument);
+			outer_rows = planstate->instrument->ntuples;
+		}
+	}
+
+	ExplainOpenGroup("Anonymized Relations", "Anonymized Relations", false, es);
+
+	foreach(lc, state->rels)
+	{
+		pganExplainRel *erel = (pganExplainRel *) lfirst(lc);
+		List	   *context;
+		int			attnum = -1;
+
+		if (es->format == EXPLAIN_FORMAT_TEXT)
+		{
+			appendStringInfoSpaces(es->str, es->indent * 2);
+			appendStringInfo(es->str, "Anonymized Relation: %s\n",
+							 quote_qualified_identifier(erel->nspname,
+														erel->relname));
+			es->indent++;
+		}
+		else
+		{
+			ExplainOpenGroup("Anonymized Relation", NULL, true, es);
+			ExplainPropertyText("Relation Name", erel->relname, es);
+			ExplainPropertyText("Schema", erel->nspname, es);
+		}
+
+		ExplainPropertyText("Evaluation", erel->deferred ? "deferred" : "scan",
+							es);
+
+		context = deparse_context_for(erel->relname, erel->relid);
+		ExplainOpenGroup("Labels", "Labels", false, es);
+		while ((attnum = bms_next_member(erel->attnums, attnum)) >= 0)
+		{
+			char	   *attname = get_attname(erel->relid, attnum
+#if PG_VERSION_NUM >= 110000
+											  , false
+#endif
+											  );
+			char	   *expr = deparse_expression(erel->exprs[attnum], context,
+												  false, false);
+
+			if (es->format == EXPLAIN_FORMAT_TEXT)
+				ExplainPropertyText("Label",
+									psprintf("%s = %s",
+											 quote_identifier(attname), expr),
+									es);
+			else
+			{
+				ExplainOpenGroup("Label", NULL, true, es);
+				ExplainPropertyText("Column", attname, es);
+				ExplainPropertyText("Expression", expr, es);
+				ExplainCloseGroup("Label", NULL, true, es);
+			}
+		}
+		ExplainCloseGroup("Labels", "Labels", false, es);
+
+		if (analyze)
+		{
+			double		rows = erel->deferred ? outer_rows : erel->rows;
+
+#if PG_VERSION_NUM >= 110000
+			ExplainPropertyFloat("Anonymized Rows", NULL, rows, 0, es);
+			ExplainPropertyFloat("Label Evaluations", NULL,
+								 rows * bms_num_members(erel->attnums), 0, es);
+#else
+			ExplainPropertyFloat("Anonymized Rows", rows, 0, es);
+			ExplainPropertyFloat("Label Evaluations",
+								 rows * bms_num_members(erel->attnums), 0, es);
+#endif
+		}
+
+		if (es->format == EXPLAIN_FORMAT_TEXT)
+			es->indent--;
+		else
+			ExplainCloseGroup("Anonymized Relation", NULL, true, es);
+	}
+
+	ExplainCloseGroup("Anonymized Relations", "Anonymized Relations", false,
+					  es);
+}
+
 /*
  * Sanity checks on the user provided security labels.
  */
@@ -1110,6 +7455,7 @@ pgan_object_relabel(const ObjectAddress *object, const char *seclabel)
 		case RelationRelationId:
 		{
 			Relation rel;
+			Oid			shadowid;
 
 			if (object->objectSubId == 0)
 				elog(ERROR, "only security labels on columns are supported");
@@ -1130,12 +7476,50 @@ pgan_object_relabel(const ObjectAddress *object, const char *seclabel)
 					pgan_check_expression_valid(rel, object, seclabel);
 			}
 
+			pgan_sync_label_objects(rel, object->objectSubId, seclabel);
+
+			/*
+			 * The shadow table, if any, has to be computed again with the new
+			 * security label, which isn't stored yet.
+			 */
+			shadowid = pgan_get_shadow_relid(rel,
+											 pgan_get_shadow_name(rel, false));
+			if (OidIsValid(shadowid))
+			{
+				Relation	shadow;
+
+				shadow = table_open(shadowid, AccessShareLock);
+				(void) pgan_shadow_refresh(rel, shadow, object->objectSubId,
+										   seclabel);
+				table_close(shadow, NoLock);
+			}
+
+			/*
+			 * Make sure that all backends, including our own, will discard
+			 * any cached data about this relation, its descendants and its
+			 * ancestors.
+			 */
+			CacheInvalidateRelcache(rel);
+			pgan_invalidate_ancestors(RelationGetRelid(rel));
+
+#if PG_VERSION_NUM >= 110000
+			/* And that other backends won't use the shared cache anymore. */
+			pgan_shared_relabeled = true;
+#endif
+
 			relation_close(rel, AccessShareLock);
 			break;
 		}
 		case AuthIdRelationId:
 			if (seclabel && strcmp(seclabel, PGAN_ROLE_ANONYMIZED) != 0)
 				elog(ERROR, "invalid label \"%s\" for a role", seclabel);
+
+			/*
+			 * Role security labels are not stored in pg_authid, so we have to
+			 * explicitly ask all backends to discard their cached role
+			 * status.
+			 */
+			CacheInvalidateCatalog(AuthIdRelationId);
 			break;
 		default:
 			elog(ERROR, "pg_anonymize does not support \"%s\" catalog",
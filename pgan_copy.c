@@ -0,0 +1,431 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgan_copy.c
+ *		Direct COPY TO STDOUT of an anonymized table
+ *
+ * An anonymized COPY relation TO is normally rewritten as a COPY of the
+ * anonymization query, which goes through the whole executor: each row is
+ * projected into a new tuple before being handed to COPY.  For the common
+ * case of a COPY TO STDOUT in text or CSV format that doesn't need any
+ * encoding conversion, this file instead scans the table directly as a plain
+ * COPY does, only evaluates the security labels of the anonymized columns and
+ * emits the other columns straight from the scanned tuple.  The output is
+ * formatted exactly as COPY would, see CopyAttributeOutText() and
+ * CopyAttributeOutCSV() in core.
+ *
+ *
+ * pg_anonymize
+ * Copyright (C) 2022-2024 - Julien Rouhaud.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#if PG_VERSION_NUM >= 140000
+
+#include "access/tableam.h"
+#include "commands/copy.h"
+#include "commands/defrem.h"
+#include "commands/progress.h"
+#include "executor/executor.h"
+#include "libpq/libpq.h"
+#include "libpq/pqformat.h"
+#include "mb/pg_wchar.h"
+#include "nodes/nodeFuncs.h"
+#include "pgstat.h"
+#include "utils/lsyscache.h"
+#include "utils/rel.h"
+#include "utils/snapmgr.h"
+
+#include "pgan_copy.h"
+
+/* An emitted column */
+typedef struct pganCopyColumn
+{
+	AttrNumber	attnum;
+	ExprState  *label;			/* security label, NULL if not anonymized */
+	FmgrInfo	out;			/* output function of the emitted value */
+	bool		force_quote;	/* always quote in CSV */
+} pganCopyColumn;
+
+/* Formatting state of the COPY */
+typedef struct pganCopyState
+{
+	StringInfoData row;			/* the row being formatted */
+	char		delim;
+	char		quote;
+	char		escape;
+	const char *null_print;
+	bool		single_attr;	/* only one column emitted? */
+	uint64		bytes;			/* bytes sent so far */
+} pganCopyState;
+
+static void pgan_copy_out_text(pganCopyState *cstate, const char *string);
+static void pgan_copy_out_csv(pganCopyState *cstate, const char *string,
+							  bool use_quote);
+static void pgan_copy_send_row(pganCopyState *cstate);
+
+/*
+ * Emit the given value in text format, backslash-escaping the delimiter,
+ * backslashes and the control characters.
+ *
+ * The server encoding is also the client encoding and never embeds ASCII
+ * bytes in multibyte characters, so the string can be processed bytewise.
+ */
+static void
+pgan_copy_out_text(pganCopyState *cstate, const char *string)
+{
+	const char *ptr = string;
+	const char *start = ptr;
+	char		delimc = cstate->delim;
+	char		c;
+
+	while ((c = *ptr) != '\0')
+	{
+		if ((unsigned char) c < (unsigned char) 0x20)
+		{
+			switch (c)
+			{
+				case '\b':
+					c = 'b';
+					break;
+				case '\f':
+					c = 'f';
+					break;
+				case '\n':
+					c = 'n';
+					break;
+				case '\r':
+					c = 'r';
+					break;
+				case '\t':
+					c = 't';
+					break;
+				case '\v':
+					c = 'v';
+					break;
+				default:
+					/* The other control characters are kept as-is */
+					if (c != delimc)
+					{
+						ptr++;
+						continue;
+					}
+					break;
+			}
+
+			appendBinaryStringInfo(&cstate->row, start, ptr - start);
+			appendStringInfoCharMacro(&cstate->row, '\\');
+			appendStringInfoCharMacro(&cstate->row, c);
+			start = ++ptr;
+		}
+		else if (c == '\\' || c == delimc)
+		{
+			appendBinaryStringInfo(&cstate->row, start, ptr - start);
+			appendStringInfoCharMacro(&cstate->row, '\\');
+			/* The character itself is part of the next run */
+			start = ptr++;
+		}
+		else
+			ptr++;
+	}
+
+	appendBinaryStringInfo(&cstate->row, start, ptr - start);
+}
+
+/*
+ * Emit the given value in CSV format, quoting it if asked or if it could
+ * otherwise be misinterpreted.
+ */
+static void
+pgan_copy_out_csv(pganCopyState *cstate, const char *string, bool use_quote)
+{
+	const char *ptr;
+	const char *start;
+	char		c;
+
+	/* A value looking like the NULL marker has to be quoted */
+	if (!use_quote && strcmp(string, cstate->null_print) == 0)
+		use_quote = true;
+
+	/* So does a lone \. that would be read as the end-of-data marker */
+	if (!use_quote && cstate->single_attr && strcmp(string, "\\.") == 0)
+		use_quote = true;
+
+	for (ptr = string; !use_quote && (c = *ptr) != '\0'; ptr++)
+	{
+		if (c == cstate->delim || c == cstate->quote || c == '\n' || c == '\r')
+			use_quote = true;
+	}
+
+	if (!use_quote)
+	{
+		appendStringInfoString(&cstate->row, string);
+		return;
+	}
+
+	appendStringInfoCharMacro(&cstate->row, cstate->quote);
+
+	start = string;
+	for (ptr = string; (c = *ptr) != '\0'; ptr++)
+	{
+		if (c == cstate->quote || c == cstate->escape)
+		{
+			appendBinaryStringInfo(&cstate->row, start, ptr - start);
+			appendStringInfoCharMacro(&cstate->row, cstate->escape);
+			/* The character itself is part of the next run */
+			start = ptr;
+		}
+	}
+	appendBinaryStringInfo(&cstate->row, start, ptr - start);
+
+	appendStringInfoCharMacro(&cstate->row, cstate->quote);
+}
+
+/*
+ * Send the formatted row to the client as a single CopyData message.
+ */
+static void
+pgan_copy_send_row(pganCopyState *cstate)
+{
+	appendStringInfoCharMacro(&cstate->row, '\n');
+	pq_putmessage('d', cstate->row.data, cstate->row.len);
+
+	cstate->bytes += cstate->row.len;
+	resetStringInfo(&cstate->row);
+}
+
+/*
+ * Execute a COPY TO STDOUT of the given attributes of the relation, with the
+ * given COPY options, emitting the value of the given analyzed and optimized
+ * security labels rather than the original values for the anonymized
+ * attributes.  exprs is indexed by attribute number.
+ *
+ * The caller is responsible for checking the privileges on the relation, and
+ * for making sure that it's a plain table without row level security and that
+ * the security labels can be evaluated without being planned.
+ *
+ * Return false without doing anything if the options require a format that
+ * isn't handled here, in which case the COPY has to be executed by core,
+ * otherwise store the number of emitted rows in processed.
+ */
+bool
+pgan_copy_to_frontend(ParseState *pstate, Relation rel, List *attnums,
+					  Node **exprs, List *options, uint64 *processed)
+{
+	CopyFormatOptions opts;
+	pganCopyState cstate;
+	pganCopyColumn *columns;
+	TupleDesc	tupdesc = RelationGetDescr(rel);
+	EState	   *estate;
+	ExprContext *econtext;
+	TupleTableSlot *slot;
+	TableScanDesc scan;
+	StringInfoData buf;
+	ListCell   *lc;
+	bool		csv = false;
+	int			encoding;
+	int			natts = list_length(attnums);
+	int			i;
+	const int	progress_cols[] = {
+		PROGRESS_COPY_COMMAND,
+		PROGRESS_COPY_TYPE
+	};
+	int64		progress_vals[] = {
+		PROGRESS_COPY_COMMAND_TO,
+		PROGRESS_COPY_TYPE_PIPE
+	};
+	const int	progress_row_cols[] = {
+		PROGRESS_COPY_TUPLES_PROCESSED,
+		PROGRESS_COPY_BYTES_PROCESSED
+	};
+	int64		progress_row_vals[2];
+
+	/* The binary format is left to core. */
+	foreach(lc, options)
+	{
+		DefElem    *defel = lfirst_node(DefElem, lc);
+
+		if (strcmp(defel->defname, "format") == 0)
+		{
+			char	   *fmt = defGetString(defel);
+
+			if (strcmp(fmt, "binary") == 0)
+				return false;
+
+			csv = (strcmp(fmt, "csv") == 0);
+		}
+	}
+
+	/* This raises the same errors as the COPY itself for invalid options. */
+	memset(&opts, 0, sizeof(CopyFormatOptions));
+	ProcessCopyOptions(pstate, &opts, false, options);
+
+	/*
+	 * The values are emitted as they're generated, so the encoding conversion
+	 * is left to core.  As is the FORCE_QUOTE column list, which is rarely
+	 * used.
+	 */
+	encoding = (opts.file_encoding >= 0 ? opts.file_encoding :
+				pg_get_client_encoding());
+	if (encoding != GetDatabaseEncoding() && encoding != PG_SQL_ASCII)
+		return false;
+
+	if (opts.force_quote != NIL)
+		return false;
+
+	cstate.delim = opts.delim[0];
+	cstate.quote = csv ? opts.quote[0] : '\0';
+	cstate.escape = csv ? opts.escape[0] : '\0';
+	cstate.null_print = opts.null_print;
+	cstate.single_attr = (natts == 1);
+	cstate.bytes = 0;
+	initStringInfo(&cstate.row);
+
+	estate = CreateExecutorState();
+	econtext = GetPerTupleExprContext(estate);
+	slot = table_slot_create(rel, NULL);
+	econtext->ecxt_scantuple = slot;
+
+	columns = (pganCopyColumn *) palloc(sizeof(pganCopyColumn) * natts);
+	i = 0;
+	foreach(lc, attnums)
+	{
+		pganCopyColumn *col = &columns[i++];
+		AttrNumber	attnum = lfirst_int(lc);
+		Oid			typid;
+		Oid			func;
+		bool		isvarlena;
+
+		col->attnum = attnum;
+		col->force_quote = opts.force_quote_all;
+
+		if (exprs[attnum] != NULL)
+		{
+			col->label = ExecPrepareExpr((Expr *) exprs[attnum], estate);
+			typid = exprType(exprs[attnum]);
+		}
+		else
+		{
+			col->label = NULL;
+			typid = TupleDescAttr(tupdesc, attnum - 1)->atttypid;
+		}
+
+		getTypeOutputInfo(typid, &func, &isvarlena);
+		fmgr_info(func, &col->out);
+	}
+
+	pgstat_progress_start_command(PROGRESS_COMMAND_COPY,
+								  RelationGetRelid(rel));
+	pgstat_progress_update_multi_param(2, progress_cols, progress_vals);
+
+	/* CopyOutResponse, all the columns being in text format */
+	pq_beginmessage(&buf, 'H');
+	pq_sendbyte(&buf, 0);
+	pq_sendint16(&buf, natts);
+	for (i = 0; i < natts; i++)
+		pq_sendint16(&buf, 0);
+	pq_endmessage(&buf);
+
+	if (opts.header_line)
+	{
+		for (i = 0; i < natts; i++)
+		{
+			char	   *colname;
+
+			colname = NameStr(TupleDescAttr(tupdesc,
+											columns[i].attnum - 1)->attname);
+
+			if (i > 0)
+				appendStringInfoCharMacro(&cstate.row, cstate.delim);
+
+			if (csv)
+				pgan_copy_out_csv(&cstate, colname, false);
+			else
+				pgan_copy_out_text(&cstate, colname);
+		}
+
+		pgan_copy_send_row(&cstate);
+	}
+
+	*processed = 0;
+	scan = table_beginscan(rel, GetActiveSnapshot(), 0, NULL);
+	while (table_scan_getnextslot(scan, ForwardScanDirection, slot))
+	{
+		MemoryContext oldcxt;
+
+		CHECK_FOR_INTERRUPTS();
+
+		ResetExprContext(econtext);
+		oldcxt = MemoryContextSwitchTo(econtext->ecxt_per_tuple_memory);
+
+		slot_getallattrs(slot);
+
+		for (i = 0; i < natts; i++)
+		{
+			pganCopyColumn *col = &columns[i];
+			Datum		value;
+			bool		isnull;
+
+			if (col->label != NULL)
+				value = ExecEvalExpr(col->label, econtext, &isnull);
+			else
+			{
+				value = slot->tts_values[col->attnum - 1];
+				isnull = slot->tts_isnull[col->attnum - 1];
+			}
+
+			if (i > 0)
+				appendStringInfoCharMacro(&cstate.row, cstate.delim);
+
+			if (isnull)
+				appendStringInfoString(&cstate.row, cstate.null_print);
+			else
+			{
+				char	   *string = OutputFunctionCall(&col->out, value);
+
+				if (csv)
+					pgan_copy_out_csv(&cstate, string, col->force_quote);
+				else
+					pgan_copy_out_text(&cstate, string);
+			}
+		}
+
+		pgan_copy_send_row(&cstate);
+
+		MemoryContextSwitchTo(oldcxt);
+
+		progress_row_vals[0] = ++(*processed);
+		progress_row_vals[1] = cstate.bytes;
+		pgstat_progress_update_multi_param(2, progress_row_cols,
+										   progress_row_vals);
+	}
+	table_endscan(scan);
+
+	/* CopyDone */
+	pq_putemptymessage('c');
+
+	pgstat_progress_end_command();
+
+	ExecDropSingleTupleTableSlot(slot);
+	FreeExecutorState(estate);
+	pfree(cstate.row.data);
+	pfree(columns);
+
+	return true;
+}
+
+#endif							/* PG_VERSION_NUM >= 140000 */
@@ -0,0 +1,37 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgan_copy.h
+ *		Direct COPY TO STDOUT of an anonymized table
+ *
+ *
+ * pg_anonymize
+ * Copyright (C) 2022-2024 - Julien Rouhaud.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PGAN_COPY_H
+#define PGAN_COPY_H
+
+#if PG_VERSION_NUM >= 140000
+#include "parser/parse_node.h"
+#include "utils/relcache.h"
+
+extern bool pgan_copy_to_frontend(ParseState *pstate, Relation rel,
+								  List *attnums, Node **exprs, List *options,
+								  uint64 *processed);
+#endif
+
+#endif							/* PGAN_COPY_H */
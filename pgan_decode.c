@@ -0,0 +1,939 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgan_decode.c
+ *		Anonymizing logical decoding output plugin
+ *
+ * The pg_anonymize library can be used as a logical decoding output plugin,
+ * emitting the decoded changes in the same text format as test_decoding,
+ * with the security labels applied to the anonymized columns.  The change
+ * stream can then be used to maintain an anonymized replica, and consumed
+ * with pg_recvlogical or the SQL functions.
+ *
+ * The security labels are the ones that were declared when the change
+ * happened, as the catalogs are read with a historic snapshot.  They are
+ * resolved with pgan_get_rel_seclabels(), but analyzed here without opening
+ * the relation, and the result is cached for each relation until an
+ * invalidation is decoded.  For the same reason, only expressions that don't
+ * need to read any table can be evaluated: functions have to be implemented
+ * in C and immutable, except for the functions of the pg_anonymize extension
+ * which are only stable because they depend on their key.
+ *
+ *
+ * pg_anonymize
+ * Copyright (C) 2022-2024 - Julien Rouhaud.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "access/htup_details.h"
+#include "access/sysattr.h"
+#include "catalog/dependency.h"
+#if PG_VERSION_NUM >= 110000
+#include "catalog/pg_inherits.h"
+#endif
+#include "catalog/pg_language.h"
+#include "catalog/pg_proc.h"
+#include "catalog/pg_type.h"
+#include "commands/extension.h"
+#include "executor/executor.h"
+#include "nodes/makefuncs.h"
+#include "nodes/nodeFuncs.h"
+#if PG_VERSION_NUM >= 120000
+#include "optimizer/optimizer.h"
+#else
+#include "optimizer/planner.h"
+#include "optimizer/var.h"
+#endif
+#include "parser/parse_coerce.h"
+#include "parser/parse_collate.h"
+#include "parser/parse_expr.h"
+#include "parser/parse_node.h"
+#include "replication/logical.h"
+#include "replication/output_plugin.h"
+#include "tcop/tcopprot.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include "utils/syscache.h"
+#if PG_VERSION_NUM >= 160000
+#include "varatt.h"
+#endif
+
+#include "pgan_decode.h"
+
+/* The decoded tuples are directly stored in the changes as of pg17 */
+#if PG_VERSION_NUM >= 170000
+#define PGAN_CHANGE_TUPLE(tuple)	(tuple)
+#else
+#define PGAN_CHANGE_TUPLE(tuple)	((tuple) != NULL ? &(tuple)->tuple : NULL)
+#endif
+
+/* Private data of the output plugin */
+typedef struct pganDecodeData
+{
+	MemoryContext context;		/* reset after each change */
+	MemoryContext cache_cxt;	/* holds the relation cache */
+	ExprContext *econtext;		/* to evaluate the security labels */
+	bool		include_xids;
+	bool		skip_empty_xacts;
+	bool		null_unsafe_labels;
+	bool		xact_wrote_changes;
+} pganDecodeData;
+
+/* An emitted column */
+typedef struct pganDecodeColumn
+{
+	char	   *typname;		/* formatted type name */
+	Oid			typid;
+	Oid			typoutput;
+	bool		typisvarlena;
+	ExprState  *label;			/* security label, NULL if not anonymized */
+	Bitmapset  *refs;			/* attributes referenced by the label */
+	bool		unsafe;			/* label can't be evaluated, emitted as NULL */
+} pganDecodeColumn;
+
+/* Cached state of a decoded relation */
+typedef struct pganDecodeRel
+{
+	Oid			relid;			/* hash key, must be first */
+	bool		valid;			/* false if an invalidation was received */
+	bool		inherits;		/* has the relation any ancestor */
+	MemoryContext cxt;			/* holds everything below */
+	TupleTableSlot *slot;		/* to evaluate the security labels */
+	pganDecodeColumn *cols;		/* indexed by attnum - 1 */
+} pganDecodeRel;
+
+/* Context of pgan_decode_unsafe_walker() */
+typedef struct pganDecodeSafeContext
+{
+	Oid			extoid;			/* oid of the pg_anonymize extension */
+} pganDecodeSafeContext;
+
+extern PGDLLEXPORT void _PG_output_plugin_init(OutputPluginCallbacks *cb);
+
+/* Cached relations of the running decoding, NULL if none */
+static HTAB *pgan_decode_rels = NULL;
+
+/* Number of invalidations received, see pgan_decode_get_rel() */
+static uint64 pgan_decode_inval_count = 0;
+
+static void pgan_decode_startup(LogicalDecodingContext *ctx,
+								OutputPluginOptions *opt, bool is_init);
+static void pgan_decode_shutdown(LogicalDecodingContext *ctx);
+static void pgan_decode_begin_txn(LogicalDecodingContext *ctx,
+								  ReorderBufferTXN *txn);
+static void pgan_decode_commit_txn(LogicalDecodingContext *ctx,
+								   ReorderBufferTXN *txn,
+								   XLogRecPtr commit_lsn);
+static void pgan_decode_change(LogicalDecodingContext *ctx,
+							   ReorderBufferTXN *txn, Relation rel,
+							   ReorderBufferChange *change);
+#if PG_VERSION_NUM >= 110000
+static void pgan_decode_truncate(LogicalDecodingContext *ctx,
+								 ReorderBufferTXN *txn, int nrelations,
+								 Relation relations[],
+								 ReorderBufferChange *change);
+#endif
+static void pgan_decode_write_begin(LogicalDecodingContext *ctx,
+									ReorderBufferTXN *txn, bool last_write);
+static void pgan_decode_write_relname(StringInfo out, Relation rel);
+static void pgan_decode_write_tuple(pganDecodeData *data, StringInfo out,
+									pganDecodeRel *entry, HeapTuple tuple,
+									bool skip_nulls);
+static void pgan_decode_write_literal(StringInfo out, Oid typid,
+									  char *outputstr);
+static pganDecodeRel *pgan_decode_get_rel(pganDecodeData *data, Relation rel);
+static Node *pgan_decode_analyze_label(Relation rel, TupleDesc tupdesc,
+									   AttrNumber attnum,
+									   const char *seclabel);
+static Node *pgan_decode_columnref_hook(ParseState *pstate, ColumnRef *cref);
+static bool pgan_decode_unsafe_walker(Node *node, void *context);
+static bool pgan_decode_unsafe_func(Oid funcid, void *context);
+static void pgan_decode_bool_option(DefElem *elem, bool *value);
+static void pgan_decode_reset_callback(void *arg);
+static void pgan_decode_relcache_callback(Datum arg, Oid relid);
+static void pgan_decode_proc_callback(Datum arg, int cacheid,
+									  uint32 hashvalue);
+
+/*
+ * Output plugin entry point, called when pg_anonymize is used as the plugin
+ * of a logical replication slot.
+ */
+void
+_PG_output_plugin_init(OutputPluginCallbacks *cb)
+{
+	AssertVariableIsOfType(&_PG_output_plugin_init, LogicalOutputPluginInit);
+
+	cb->startup_cb = pgan_decode_startup;
+	cb->begin_cb = pgan_decode_begin_txn;
+	cb->change_cb = pgan_decode_change;
+#if PG_VERSION_NUM >= 110000
+	cb->truncate_cb = pgan_decode_truncate;
+#endif
+	cb->commit_cb = pgan_decode_commit_txn;
+	cb->shutdown_cb = pgan_decode_shutdown;
+}
+
+static void
+pgan_decode_startup(LogicalDecodingContext *ctx, OutputPluginOptions *opt,
+					bool is_init)
+{
+	static bool callbacks_registered = false;
+	pganDecodeData *data;
+	MemoryContextCallback *cb;
+	HASHCTL		ctl;
+	ListCell   *lc;
+
+	data = palloc0(sizeof(pganDecodeData));
+	data->context = AllocSetContextCreate(ctx->context,
+										  "pg_anonymize decoding context",
+										  ALLOCSET_DEFAULT_SIZES);
+	data->cache_cxt = AllocSetContextCreate(ctx->context,
+											"pg_anonymize decoding cache",
+											ALLOCSET_DEFAULT_SIZES);
+	data->econtext = CreateStandaloneExprContext();
+	data->include_xids = true;
+	data->skip_empty_xacts = false;
+	data->null_unsafe_labels = false;
+
+	ctx->output_plugin_private = data;
+	opt->output_type = OUTPUT_PLUGIN_TEXTUAL_OUTPUT;
+
+	foreach(lc, ctx->output_plugin_options)
+	{
+		DefElem    *elem = lfirst(lc);
+
+		Assert(elem->arg == NULL || IsA(elem->arg, String));
+
+		if (strcmp(elem->defname, "include-xids") == 0)
+			pgan_decode_bool_option(elem, &data->include_xids);
+		else if (strcmp(elem->defname, "skip-empty-xacts") == 0)
+			pgan_decode_bool_option(elem, &data->skip_empty_xacts);
+		else if (strcmp(elem->defname, "null-unsafe-labels") == 0)
+			pgan_decode_bool_option(elem, &data->null_unsafe_labels);
+		else
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("option \"%s\" = \"%s\" is unknown",
+							elem->defname,
+							elem->arg ? strVal(elem->arg) : "(null)")));
+	}
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(Oid);
+	ctl.entrysize = sizeof(pganDecodeRel);
+	ctl.hcxt = data->cache_cxt;
+	pgan_decode_rels = hash_create("pg_anonymize decoding cache", 128, &ctl,
+								   HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	/*
+	 * The shutdown callback isn't called if the decoding fails, so forget
+	 * about the cache when its memory is released.
+	 */
+	cb = MemoryContextAlloc(data->cache_cxt, sizeof(MemoryContextCallback));
+	cb->func = pgan_decode_reset_callback;
+	cb->arg = NULL;
+	MemoryContextRegisterResetCallback(data->cache_cxt, cb);
+
+	/*
+	 * The invalidations of the decoded transactions are executed when they're
+	 * replayed, so they keep the cache in sync with the historic catalogs.
+	 * The callbacks can't be unregistered, so only register them once.
+	 */
+	if (!callbacks_registered)
+	{
+		CacheRegisterRelcacheCallback(pgan_decode_relcache_callback,
+									  (Datum) 0);
+		CacheRegisterSyscacheCallback(PROCOID, pgan_decode_proc_callback,
+									  (Datum) 0);
+		callbacks_registered = true;
+	}
+}
+
+static void
+pgan_decode_shutdown(LogicalDecodingContext *ctx)
+{
+	pganDecodeData *data = ctx->output_plugin_private;
+
+	/* The rest is released with the decoding context. */
+	FreeExprContext(data->econtext, true);
+}
+
+static void
+pgan_decode_begin_txn(LogicalDecodingContext *ctx, ReorderBufferTXN *txn)
+{
+	pganDecodeData *data = ctx->output_plugin_private;
+
+	data->xact_wrote_changes = false;
+	if (data->skip_empty_xacts)
+		return;
+
+	pgan_decode_write_begin(ctx, txn, true);
+}
+
+static void
+pgan_decode_commit_txn(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
+					   XLogRecPtr commit_lsn)
+{
+	pganDecodeData *data = ctx->output_plugin_private;
+
+	if (data->skip_empty_xacts && !data->xact_wrote_changes)
+		return;
+
+	OutputPluginPrepareWrite(ctx, true);
+	if (data->include_xids)
+		appendStringInfo(ctx->out, "COMMIT %u", txn->xid);
+	else
+		appendStringInfoString(ctx->out, "COMMIT");
+	OutputPluginWrite(ctx, true);
+}
+
+/*
+ * Emit an INSERT, UPDATE or DELETE, with the anonymized values.
+ */
+static void
+pgan_decode_change(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
+				   Relation rel, ReorderBufferChange *change)
+{
+	pganDecodeData *data = ctx->output_plugin_private;
+	pganDecodeRel *entry;
+	HeapTuple	oldtuple;
+	HeapTuple	newtuple;
+	MemoryContext oldcxt;
+
+#if PG_VERSION_NUM < 110000
+	/*
+	 * Ignore the transient heaps of table rewrites, which can't be mapped to
+	 * the original relation and its security labels before pg11.
+	 */
+	if (strncmp(RelationGetRelationName(rel), "pg_temp_", 8) == 0 &&
+		!RelationUsesLocalBuffers(rel))
+		return;
+#endif
+
+	oldcxt = MemoryContextSwitchTo(data->context);
+
+	entry = pgan_decode_get_rel(data, rel);
+
+	if (data->skip_empty_xacts && !data->xact_wrote_changes)
+		pgan_decode_write_begin(ctx, txn, false);
+	data->xact_wrote_changes = true;
+
+	oldtuple = PGAN_CHANGE_TUPLE(change->data.tp.oldtuple);
+	newtuple = PGAN_CHANGE_TUPLE(change->data.tp.newtuple);
+
+	OutputPluginPrepareWrite(ctx, true);
+
+	appendStringInfoString(ctx->out, "table ");
+	pgan_decode_write_relname(ctx->out, rel);
+	appendStringInfoChar(ctx->out, ':');
+
+	switch (change->action)
+	{
+		case REORDER_BUFFER_CHANGE_INSERT:
+			appendStringInfoString(ctx->out, " INSERT:");
+			if (newtuple == NULL)
+				appendStringInfoString(ctx->out, " (no-tuple-data)");
+			else
+				pgan_decode_write_tuple(data, ctx->out, entry, newtuple,
+										false);
+			break;
+		case REORDER_BUFFER_CHANGE_UPDATE:
+			appendStringInfoString(ctx->out, " UPDATE:");
+			if (oldtuple != NULL)
+			{
+				appendStringInfoString(ctx->out, " old-key:");
+				pgan_decode_write_tuple(data, ctx->out, entry, oldtuple,
+										true);
+				appendStringInfoString(ctx->out, " new-tuple:");
+			}
+
+			if (newtuple == NULL)
+				appendStringInfoString(ctx->out, " (no-tuple-data)");
+			else
+				pgan_decode_write_tuple(data, ctx->out, entry, newtuple,
+										false);
+			break;
+		case REORDER_BUFFER_CHANGE_DELETE:
+			appendStringInfoString(ctx->out, " DELETE:");
+			if (oldtuple == NULL)
+				appendStringInfoString(ctx->out, " (no-tuple-data)");
+			else
+				pgan_decode_write_tuple(data, ctx->out, entry, oldtuple,
+										true);
+			break;
+		default:
+			Assert(false);
+	}
+
+	OutputPluginWrite(ctx, true);
+
+	MemoryContextSwitchTo(oldcxt);
+	MemoryContextReset(data->context);
+}
+
+#if PG_VERSION_NUM >= 110000
+/*
+ * Emit a TRUNCATE, which doesn't contain any data.
+ */
+static void
+pgan_decode_truncate(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
+					 int nrelations, Relation relations[],
+					 ReorderBufferChange *change)
+{
+	pganDecodeData *data = ctx->output_plugin_private;
+	MemoryContext oldcxt;
+	int			i;
+
+	oldcxt = MemoryContextSwitchTo(data->context);
+
+	if (data->skip_empty_xacts && !data->xact_wrote_changes)
+		pgan_decode_write_begin(ctx, txn, false);
+	data->xact_wrote_changes = true;
+
+	OutputPluginPrepareWrite(ctx, true);
+
+	appendStringInfoString(ctx->out, "table ");
+	for (i = 0; i < nrelations; i++)
+	{
+		if (i > 0)
+			appendStringInfoString(ctx->out, ", ");
+		pgan_decode_write_relname(ctx->out, relations[i]);
+	}
+	appendStringInfoString(ctx->out, ": TRUNCATE:");
+
+	if (change->data.truncate.restart_seqs || change->data.truncate.cascade)
+	{
+		if (change->data.truncate.restart_seqs)
+			appendStringInfoString(ctx->out, " restart_seqs");
+		if (change->data.truncate.cascade)
+			appendStringInfoString(ctx->out, " cascade");
+	}
+	else
+		appendStringInfoString(ctx->out, " (no-flags)");
+
+	OutputPluginWrite(ctx, true);
+
+	MemoryContextSwitchTo(oldcxt);
+	MemoryContextReset(data->context);
+}
+#endif
+
+static void
+pgan_decode_write_begin(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
+						bool last_write)
+{
+	pganDecodeData *data = ctx->output_plugin_private;
+
+	OutputPluginPrepareWrite(ctx, last_write);
+	if (data->include_xids)
+		appendStringInfo(ctx->out, "BEGIN %u", txn->xid);
+	else
+		appendStringInfoString(ctx->out, "BEGIN");
+	OutputPluginWrite(ctx, last_write);
+}
+
+static void
+pgan_decode_write_relname(StringInfo out, Relation rel)
+{
+	appendStringInfoString(out,
+						   quote_qualified_identifier(get_namespace_name(RelationGetNamespace(rel)),
+													  RelationGetRelationName(rel)));
+}
+
+/*
+ * Append all the columns of the given tuple, evaluating the security labels
+ * of the anonymized columns.
+ *
+ * NULL columns are omitted if skip_nulls is true, which is used for the old
+ * tuples that only contain the replica identity.  The security labels of
+ * those columns are then evaluated with all the other columns being NULL.
+ */
+static void
+pgan_decode_write_tuple(pganDecodeData *data, StringInfo out,
+						pganDecodeRel *entry, HeapTuple tuple, bool skip_nulls)
+{
+	TupleTableSlot *slot = entry->slot;
+	TupleDesc	tupdesc = slot->tts_tupleDescriptor;
+	ExprContext *econtext = data->econtext;
+	int			i;
+
+#if PG_VERSION_NUM >= 120000
+	ExecStoreHeapTuple(tuple, slot, false);
+#else
+	ExecStoreTuple(tuple, slot, InvalidBuffer, false);
+#endif
+	slot_getallattrs(slot);
+	econtext->ecxt_scantuple = slot;
+
+	for (i = 0; i < tupdesc->natts; i++)
+	{
+		Form_pg_attribute att = TupleDescAttr(tupdesc, i);
+		pganDecodeColumn *col = &entry->cols[i];
+		Datum		value = slot->tts_values[i];
+		bool		isnull = slot->tts_isnull[i];
+		bool		unchanged_toast = false;
+
+		if (att->attisdropped)
+			continue;
+
+		if (isnull && skip_nulls)
+			continue;
+
+		if (col->unsafe)
+			isnull = true;
+		else if (col->label != NULL)
+		{
+			int			attnum = -1;
+
+			/*
+			 * The unchanged TOASTed values are not part of the decoded
+			 * tuple, so the security label can't be evaluated if it needs
+			 * any of them.
+			 */
+			while ((attnum = bms_next_member(col->refs, attnum)) >= 0)
+			{
+				if (!slot->tts_isnull[attnum - 1] &&
+					TupleDescAttr(tupdesc, attnum - 1)->attlen == -1 &&
+					VARATT_IS_EXTERNAL_ONDISK(DatumGetPointer(slot->tts_values[attnum - 1])))
+				{
+					unchanged_toast = true;
+					break;
+				}
+			}
+
+			if (!unchanged_toast)
+				value = ExecEvalExprSwitchContext(col->label, econtext,
+												  &isnull);
+		}
+		else if (!isnull && col->typisvarlena &&
+				 VARATT_IS_EXTERNAL_ONDISK(DatumGetPointer(value)))
+			unchanged_toast = true;
+
+		appendStringInfoChar(out, ' ');
+		appendStringInfoString(out, quote_identifier(NameStr(att->attname)));
+		appendStringInfo(out, "[%s]:", col->typname);
+
+		if (unchanged_toast)
+			appendStringInfoString(out, "unchanged-toast-datum");
+		else if (isnull)
+			appendStringInfoString(out, "null");
+		else
+		{
+			if (col->typisvarlena)
+				value = PointerGetDatum(PG_DETOAST_DATUM(value));
+
+			pgan_decode_write_literal(out, col->typid,
+									  OidOutputFunctionCall(col->typoutput,
+															value));
+		}
+	}
+
+	ResetExprContext(econtext);
+	ExecClearTuple(slot);
+}
+
+/*
+ * Append the given value, quoted as a literal of the given type.
+ */
+static void
+pgan_decode_write_literal(StringInfo out, Oid typid, char *outputstr)
+{
+	const char *p;
+
+	switch (typid)
+	{
+		case INT2OID:
+		case INT4OID:
+		case INT8OID:
+		case OIDOID:
+		case FLOAT4OID:
+		case FLOAT8OID:
+		case NUMERICOID:
+			/* NB: We don't care about Inf, NaN et al. */
+			appendStringInfoString(out, outputstr);
+			break;
+
+		case BITOID:
+		case VARBITOID:
+			appendStringInfo(out, "B'%s'", outputstr);
+			break;
+
+		case BOOLOID:
+			if (strcmp(outputstr, "t") == 0)
+				appendStringInfoString(out, "true");
+			else
+				appendStringInfoString(out, "false");
+			break;
+
+		default:
+			appendStringInfoChar(out, '\'');
+			for (p = outputstr; *p; p++)
+			{
+				if (SQL_STR_DOUBLE(*p, false))
+					appendStringInfoChar(out, *p);
+				appendStringInfoChar(out, *p);
+			}
+			appendStringInfoChar(out, '\'');
+			break;
+	}
+}
+
+/*
+ * Return the cached state of the given relation, building it if needed.
+ */
+static pganDecodeRel *
+pgan_decode_get_rel(pganDecodeData *data, Relation rel)
+{
+	Oid			relid = RelationGetRelid(rel);
+	pganDecodeRel *entry;
+	TupleDesc	tupdesc;
+	MemoryContext oldcxt;
+	char	  **seclabels;
+	pganDecodeSafeContext context;
+	uint64		inval_count;
+	bool		found;
+	int			i;
+
+	entry = hash_search(pgan_decode_rels, &relid, HASH_ENTER, &found);
+
+	if (found && entry->valid)
+		return entry;
+
+	/*
+	 * The old state, if any, is only released here, as an invalidation can
+	 * be received while it's being used.
+	 */
+	if (found && entry->cxt != NULL)
+		MemoryContextDelete(entry->cxt);
+
+	entry->valid = false;
+	entry->cxt = AllocSetContextCreate(data->cache_cxt,
+									   "pg_anonymize decoding relation",
+									   ALLOCSET_SMALL_SIZES);
+
+	inval_count = pgan_decode_inval_count;
+
+	/* The security labels as of the decoded change. */
+	seclabels = pgan_get_rel_seclabels(rel);
+	context.extoid = get_extension_oid("pg_anonymize", true);
+
+	oldcxt = MemoryContextSwitchTo(entry->cxt);
+
+	tupdesc = CreateTupleDescCopy(RelationGetDescr(rel));
+#if PG_VERSION_NUM >= 120000
+	entry->slot = MakeSingleTupleTableSlot(tupdesc, &TTSOpsHeapTuple);
+#else
+	entry->slot = MakeSingleTupleTableSlot(tupdesc);
+#endif
+	entry->cols = palloc0(sizeof(pganDecodeColumn) * tupdesc->natts);
+
+	for (i = 0; i < tupdesc->natts; i++)
+	{
+		Form_pg_attribute att = TupleDescAttr(tupdesc, i);
+		pganDecodeColumn *col = &entry->cols[i];
+		Node	   *expr;
+		Bitmapset  *refs = NULL;
+		int			attnum;
+
+		if (att->attisdropped)
+			continue;
+
+		col->typname = format_type_be(att->atttypid);
+		col->typid = att->atttypid;
+		getTypeOutputInfo(att->atttypid, &col->typoutput, &col->typisvarlena);
+
+		if (seclabels == NULL || seclabels[att->attnum] == NULL)
+			continue;
+
+		expr = pgan_decode_analyze_label(rel, tupdesc, att->attnum,
+										 seclabels[att->attnum]);
+
+		if (pgan_decode_unsafe_walker(expr, &context))
+		{
+			ereport(data->null_unsafe_labels ? WARNING : ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("security label of column \"%s\" of relation \"%s\" cannot be evaluated during logical decoding",
+							NameStr(att->attname),
+							RelationGetRelationName(rel)),
+					 errdetail("Only immutable functions implemented in C and the functions of pg_anonymize can be used."),
+					 data->null_unsafe_labels ?
+					 errhint("The column is emitted as NULL.") : 0));
+
+			col->unsafe = true;
+			continue;
+		}
+
+		/* Add the default arguments, the functions are all safe now. */
+		expr = (Node *) expression_planner((Expr *) expr);
+
+		/* The attribute numbers are offset by FirstLowInvalidHeapAttributeNumber. */
+		pull_varattnos(expr, 1, &refs);
+		attnum = -1;
+		while ((attnum = bms_next_member(refs, attnum)) >= 0)
+			col->refs = bms_add_member(col->refs,
+									   attnum + FirstLowInvalidHeapAttributeNumber);
+
+		col->label = ExecInitExpr((Expr *) expr, NULL);
+	}
+
+	MemoryContextSwitchTo(oldcxt);
+
+	/*
+	 * The relation also depends on the security labels of its ancestors, but
+	 * only gets the invalidations for itself.
+	 */
+#if PG_VERSION_NUM >= 110000
+	entry->inherits = has_superclass(relid);
+#else
+	/* has_superclass() is only available as of pg11. */
+	entry->inherits = true;
+#endif
+
+	/*
+	 * If an invalidation was received while we were looking at the catalogs,
+	 * only use the result for the current change.
+	 */
+	entry->valid = (inval_count == pgan_decode_inval_count);
+
+	return entry;
+}
+
+/*
+ * Parse and analyze the given security label of the given relation.
+ *
+ * The relation isn't added to the range table, as it would require to lock
+ * it, and the columns are resolved by pgan_decode_columnref_hook() instead.
+ * The expression is coerced to the column type, as the anonymized value is
+ * emitted as a value of the column.
+ */
+static Node *
+pgan_decode_analyze_label(Relation rel, TupleDesc tupdesc, AttrNumber attnum,
+						  const char *seclabel)
+{
+	Form_pg_attribute att = TupleDescAttr(tupdesc, attnum - 1);
+	ParseState *pstate;
+	List	   *parselist;
+	SelectStmt *stmt;
+	ResTarget  *res;
+	Node	   *expr;
+	char	   *sql;
+	int			save_nestlevel;
+
+	sql = psprintf("SELECT %s", seclabel);
+	parselist = pg_parse_query(sql);
+
+	/* The security labels have been checked when they were declared. */
+	if (list_length(parselist) != 1)
+		elog(ERROR, "unexpected security label \"%s\"", seclabel);
+	stmt = (SelectStmt *) linitial_node(RawStmt, parselist)->stmt;
+	if (!IsA(stmt, SelectStmt) || list_length(stmt->targetList) != 1)
+		elog(ERROR, "unexpected security label \"%s\"", seclabel);
+	res = linitial_node(ResTarget, stmt->targetList);
+
+	pstate = make_parsestate(NULL);
+	pstate->p_sourcetext = sql;
+	pstate->p_pre_columnref_hook = pgan_decode_columnref_hook;
+	pstate->p_ref_hook_state = (void *) tupdesc;
+
+	/* Use the same search_path as when the labels are validated. */
+	save_nestlevel = NewGUCNestLevel();
+	(void) set_config_option("search_path", "pg_catalog", PGC_USERSET,
+							 PGC_S_SESSION, GUC_ACTION_SAVE, true, 0, false);
+
+	expr = transformExpr(pstate, res->val, EXPR_KIND_SELECT_TARGET);
+	expr = coerce_to_target_type(pstate, expr, exprType(expr),
+								 att->atttypid, att->atttypmod,
+								 COERCION_ASSIGNMENT, COERCE_IMPLICIT_CAST,
+								 -1);
+	if (expr == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATATYPE_MISMATCH),
+				 errmsg("security label of column \"%s\" of relation \"%s\" cannot be coerced to type %s",
+						NameStr(att->attname), RelationGetRelationName(rel),
+						format_type_be(att->atttypid))));
+	assign_expr_collations(pstate, expr);
+
+	AtEOXact_GUC(true, save_nestlevel);
+
+	free_parsestate(pstate);
+
+	return expr;
+}
+
+/*
+ * Resolve the unqualified column references to the columns of the relation
+ * whose tuple descriptor is passed in p_ref_hook_state.
+ */
+static Node *
+pgan_decode_columnref_hook(ParseState *pstate, ColumnRef *cref)
+{
+	TupleDesc	tupdesc = (TupleDesc) pstate->p_ref_hook_state;
+	Node	   *field;
+	int			i;
+
+	if (list_length(cref->fields) != 1)
+		return NULL;
+
+	field = linitial(cref->fields);
+	if (!IsA(field, String))
+		return NULL;
+
+	for (i = 0; i < tupdesc->natts; i++)
+	{
+		Form_pg_attribute att = TupleDescAttr(tupdesc, i);
+		Var		   *var;
+
+		if (att->attisdropped ||
+			strcmp(NameStr(att->attname), strVal(field)) != 0)
+			continue;
+
+		var = makeVar(1, att->attnum, att->atttypid, att->atttypmod,
+					  att->attcollation, 0);
+		var->location = cref->location;
+
+		return (Node *) var;
+	}
+
+	return NULL;
+}
+
+/*
+ * Walker function returning true if the given expression can't be evaluated
+ * during logical decoding.
+ */
+static bool
+pgan_decode_unsafe_walker(Node *node, void *context)
+{
+	if (node == NULL)
+		return false;
+
+	/*
+	 * Anything that could read a table or depends on the session, including
+	 * the domain constraints that can call any function.
+	 */
+	if (IsA(node, SubLink) || IsA(node, Aggref) || IsA(node, WindowFunc) ||
+		IsA(node, Param) || IsA(node, SQLValueFunction) ||
+		IsA(node, NextValueExpr) || IsA(node, CoerceToDomain))
+		return true;
+
+	if (IsA(node, FuncExpr) && ((FuncExpr *) node)->funcretset)
+		return true;
+	if (IsA(node, OpExpr) && ((OpExpr *) node)->opretset)
+		return true;
+
+	if (check_functions_in_node(node, pgan_decode_unsafe_func, context))
+		return true;
+
+	return expression_tree_walker(node, pgan_decode_unsafe_walker, context);
+}
+
+/*
+ * check_functions_in_node() callback, returning true if the given function
+ * can't be executed during logical decoding.
+ */
+static bool
+pgan_decode_unsafe_func(Oid funcid, void *context)
+{
+	pganDecodeSafeContext *ctx = (pganDecodeSafeContext *) context;
+	HeapTuple	tuple;
+	Form_pg_proc proc;
+	bool		native;
+	bool		immutable;
+
+	tuple = SearchSysCache1(PROCOID, ObjectIdGetDatum(funcid));
+	if (!HeapTupleIsValid(tuple))
+		elog(ERROR, "cache lookup failed for function %u", funcid);
+	proc = (Form_pg_proc) GETSTRUCT(tuple);
+	native = (proc->prolang == INTERNALlanguageId ||
+			  proc->prolang == ClanguageId);
+	immutable = (proc->provolatile == PROVOLATILE_IMMUTABLE);
+	ReleaseSysCache(tuple);
+
+	if (!native)
+		return true;
+
+	if (immutable)
+		return false;
+
+	return !OidIsValid(ctx->extoid) ||
+		getExtensionOfObject(ProcedureRelationId, funcid) != ctx->extoid;
+}
+
+static void
+pgan_decode_bool_option(DefElem *elem, bool *value)
+{
+	/* A missing value means true. */
+	if (elem->arg == NULL)
+		*value = true;
+	else if (!parse_bool(strVal(elem->arg), value))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("could not parse value \"%s\" for parameter \"%s\"",
+						strVal(elem->arg), elem->defname)));
+}
+
+/*
+ * Memory context reset callback of the relation cache.
+ */
+static void
+pgan_decode_reset_callback(void *arg)
+{
+	pgan_decode_rels = NULL;
+}
+
+/*
+ * Relcache invalidation callback.
+ *
+ * Mark the given relation as invalid, and the relations that have ancestors
+ * as their security labels could depend on it.  An InvalidOid relid means
+ * that all relations should be invalidated.
+ */
+static void
+pgan_decode_relcache_callback(Datum arg, Oid relid)
+{
+	HASH_SEQ_STATUS status;
+	pganDecodeRel *entry;
+
+	pgan_decode_inval_count++;
+
+	if (pgan_decode_rels == NULL)
+		return;
+
+	hash_seq_init(&status, pgan_decode_rels);
+	while ((entry = hash_seq_search(&status)) != NULL)
+	{
+		if (!OidIsValid(relid) || entry->relid == relid || entry->inherits)
+			entry->valid = false;
+	}
+}
+
+/*
+ * pg_proc syscache invalidation callback.
+ *
+ * The functions used in the security labels could have been modified, so
+ * check them all again.
+ */
+static void
+pgan_decode_proc_callback(Datum arg, int cacheid, uint32 hashvalue)
+{
+	pgan_decode_relcache_callback(arg, InvalidOid);
+}
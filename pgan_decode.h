@@ -0,0 +1,33 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgan_decode.h
+ *		Anonymizing logical decoding output plugin
+ *
+ *
+ * pg_anonymize
+ * Copyright (C) 2022-2024 - Julien Rouhaud.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PGAN_DECODE_H
+#define PGAN_DECODE_H
+
+#include "utils/relcache.h"
+
+/* Defined in pg_anonymize.c */
+extern char **pgan_get_rel_seclabels(Relation rel);
+
+#endif							/* PGAN_DECODE_H */
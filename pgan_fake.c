@@ -0,0 +1,159 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgan_fake.c
+ *		Fake data substitution functions usable in security labels
+ *
+ * The values are replaced with a realistic value, like a first name or a
+ * city, chosen in a compiled-in dictionary from the keyed hash of the
+ * original value, so that the same value is always replaced with the same
+ * fake value, see pgan_pseudo.c.  The dictionaries live in the read-only data
+ * of the module, shared by all the backends, and each backend only builds a
+ * small index of their values when they're first used.
+ *
+ *
+ * pg_anonymize
+ * Copyright (C) 2022-2024 - Julien Rouhaud.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "fmgr.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+
+#include "pgan_fake_data.h"
+#include "pgan_pseudo.h"
+
+/* The available dictionaries, in the pgan_fake_dicts order */
+typedef enum pganFakeKind
+{
+	PGAN_FAKE_FIRST_NAME,
+	PGAN_FAKE_LAST_NAME,
+	PGAN_FAKE_CITY,
+	PGAN_FAKE_STREET
+} pganFakeKind;
+
+/* A dictionary, and its backend-local index */
+typedef struct pganFakeDict
+{
+	const char *arena;			/* NUL-terminated values, contiguous */
+	Size		size;			/* size of the arena */
+	int			count;			/* # of values, 0 until indexed */
+	uint16	   *offsets;		/* start of each value, and end of arena */
+} pganFakeDict;
+
+PG_FUNCTION_INFO_V1(pg_anonymize_fake_first_name);
+PG_FUNCTION_INFO_V1(pg_anonymize_fake_last_name);
+PG_FUNCTION_INFO_V1(pg_anonymize_fake_city);
+PG_FUNCTION_INFO_V1(pg_anonymize_fake_street);
+
+/* The arrays' trailing NUL is already the terminator of their last value */
+static pganFakeDict pgan_fake_dicts[] = {
+	{pgan_fake_first_names, sizeof(pgan_fake_first_names) - 1, 0, NULL},
+	{pgan_fake_last_names, sizeof(pgan_fake_last_names) - 1, 0, NULL},
+	{pgan_fake_cities, sizeof(pgan_fake_cities) - 1, 0, NULL},
+	{pgan_fake_streets, sizeof(pgan_fake_streets) - 1, 0, NULL}
+};
+
+static void pgan_fake_index(pganFakeDict *dict);
+static Datum pgan_fake(FunctionCallInfo fcinfo, pganFakeKind kind);
+
+/*
+ * Build the index of the values of the given dictionary, so that any value
+ * can be found without scanning the arena.
+ */
+static void
+pgan_fake_index(pganFakeDict *dict)
+{
+	uint16	   *offsets;
+	int			count = 0;
+	Size		i;
+
+	StaticAssertStmt(sizeof(pgan_fake_first_names) <= PG_UINT16_MAX &&
+					 sizeof(pgan_fake_last_names) <= PG_UINT16_MAX &&
+					 sizeof(pgan_fake_cities) <= PG_UINT16_MAX &&
+					 sizeof(pgan_fake_streets) <= PG_UINT16_MAX,
+					 "dictionaries must be indexable with uint16 offsets");
+
+	for (i = 0; i < dict->size; i++)
+	{
+		if (dict->arena[i] == '\0')
+			count++;
+	}
+
+	offsets = MemoryContextAlloc(TopMemoryContext,
+								 sizeof(uint16) * (count + 1));
+
+	count = 0;
+	offsets[0] = 0;
+	for (i = 0; i < dict->size; i++)
+	{
+		if (dict->arena[i] == '\0')
+			offsets[++count] = i + 1;
+	}
+
+	dict->offsets = offsets;
+	dict->count = count;
+}
+
+/*
+ * Return the value of the given dictionary chosen from the keyed hash of the
+ * first argument.
+ */
+static Datum
+pgan_fake(FunctionCallInfo fcinfo, pganFakeKind kind)
+{
+	pganFakeDict *dict = &pgan_fake_dicts[kind];
+	uint64		hash;
+	int			i;
+
+	pgan_pseudo_hash(fcinfo, false, &hash);
+
+	if (dict->count == 0)
+		pgan_fake_index(dict);
+
+	i = hash % dict->count;
+
+	/* Don't include the value's terminator */
+	PG_RETURN_TEXT_P(cstring_to_text_with_len(dict->arena + dict->offsets[i],
+											  dict->offsets[i + 1] -
+											  dict->offsets[i] - 1));
+}
+
+Datum
+pg_anonymize_fake_first_name(PG_FUNCTION_ARGS)
+{
+	return pgan_fake(fcinfo, PGAN_FAKE_FIRST_NAME);
+}
+
+Datum
+pg_anonymize_fake_last_name(PG_FUNCTION_ARGS)
+{
+	return pgan_fake(fcinfo, PGAN_FAKE_LAST_NAME);
+}
+
+Datum
+pg_anonymize_fake_city(PG_FUNCTION_ARGS)
+{
+	return pgan_fake(fcinfo, PGAN_FAKE_CITY);
+}
+
+Datum
+pg_anonymize_fake_street(PG_FUNCTION_ARGS)
+{
+	return pgan_fake(fcinfo, PGAN_FAKE_STREET);
+}
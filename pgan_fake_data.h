@@ -0,0 +1,158 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgan_fake_data.h
+ *		Dictionaries of the fake data substitution functions
+ *
+ * Each dictionary is a single arena of NUL-terminated values, so that it's
+ * stored contiguously in the read-only data of the module, shared by all the
+ * backends, and doesn't require any relocation.  Only include it from
+ * pgan_fake.c.
+ *
+ *
+ * pg_anonymize
+ * Copyright (C) 2022-2024 - Julien Rouhaud.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PGAN_FAKE_DATA_H
+#define PGAN_FAKE_DATA_H
+
+/* First names */
+static const char pgan_fake_first_names[] =
+	"James\0" "Mary\0" "Robert\0" "Patricia\0" "John\0" "Jennifer\0"
+	"Michael\0" "Linda\0" "David\0" "Elizabeth\0" "William\0" "Barbara\0"
+	"Richard\0" "Susan\0" "Joseph\0" "Jessica\0" "Thomas\0" "Sarah\0"
+	"Christopher\0" "Karen\0" "Charles\0" "Lisa\0" "Daniel\0" "Nancy\0"
+	"Matthew\0" "Betty\0" "Anthony\0" "Sandra\0" "Mark\0" "Margaret\0"
+	"Donald\0" "Ashley\0" "Steven\0" "Kimberly\0" "Andrew\0" "Emily\0"
+	"Paul\0" "Donna\0" "Joshua\0" "Michelle\0" "Kenneth\0" "Carol\0"
+	"Kevin\0" "Amanda\0" "Brian\0" "Melissa\0" "George\0" "Deborah\0"
+	"Timothy\0" "Stephanie\0" "Ronald\0" "Dorothy\0" "Jason\0" "Rebecca\0"
+	"Edward\0" "Sharon\0" "Jeffrey\0" "Laura\0" "Ryan\0" "Cynthia\0"
+	"Jacob\0" "Amy\0" "Gary\0" "Kathleen\0" "Nicholas\0" "Angela\0" "Eric\0"
+	"Shirley\0" "Jonathan\0" "Brenda\0" "Stephen\0" "Emma\0" "Larry\0"
+	"Anna\0" "Justin\0" "Pamela\0" "Scott\0" "Nicole\0" "Brandon\0"
+	"Samantha\0" "Benjamin\0" "Katherine\0" "Samuel\0" "Christine\0"
+	"Gregory\0" "Helen\0" "Alexander\0" "Debra\0" "Patrick\0" "Rachel\0"
+	"Frank\0" "Carolyn\0" "Raymond\0" "Janet\0" "Jack\0" "Maria\0" "Dennis\0"
+	"Catherine\0" "Jerry\0" "Heather\0" "Tyler\0" "Diane\0" "Aaron\0"
+	"Olivia\0" "Jose\0" "Julie\0" "Adam\0" "Joyce\0" "Nathan\0" "Victoria\0"
+	"Henry\0" "Ruth\0" "Zachary\0" "Virginia\0" "Douglas\0" "Lauren\0"
+	"Peter\0" "Kelly\0" "Kyle\0" "Christina\0" "Noah\0" "Joan\0" "Ethan\0"
+	"Evelyn\0" "Jeremy\0" "Judith\0" "Walter\0" "Andrea\0" "Christian\0"
+	"Hannah\0" "Keith\0" "Megan\0" "Roger\0" "Cheryl\0" "Terry\0"
+	"Jacqueline\0" "Austin\0" "Martha\0" "Sean\0" "Madison\0" "Gerald\0"
+	"Teresa\0" "Carl\0" "Gloria\0" "Harold\0" "Sara\0" "Dylan\0" "Janice\0"
+	"Arthur\0" "Ann\0" "Lawrence\0" "Kathryn\0" "Jordan\0" "Abigail\0"
+	"Jesse\0" "Sophia\0" "Bryan\0" "Frances\0" "Billy\0" "Jean\0" "Bruce\0"
+	"Alice\0" "Gabriel\0" "Judy\0" "Joe\0" "Isabella\0" "Logan\0" "Julia\0"
+	"Alan\0" "Grace\0" "Juan\0" "Amber\0" "Albert\0" "Denise\0" "Willie\0"
+	"Danielle\0" "Elijah\0" "Marilyn\0" "Wayne\0" "Beverly\0" "Randy\0"
+	"Charlotte\0" "Vincent\0" "Natalie\0" "Mason\0" "Theresa\0" "Roy\0"
+	"Diana\0" "Ralph\0" "Brittany\0" "Bobby\0" "Doris\0" "Russell\0"
+	"Kayla\0" "Bradley\0" "Alexis\0" "Philip\0" "Lori\0" "Eugene\0" "Marie\0";
+
+/* Last names */
+static const char pgan_fake_last_names[] =
+	"Smith\0" "Johnson\0" "Williams\0" "Brown\0" "Jones\0" "Garcia\0"
+	"Miller\0" "Davis\0" "Rodriguez\0" "Martinez\0" "Hernandez\0" "Lopez\0"
+	"Gonzalez\0" "Wilson\0" "Anderson\0" "Thomas\0" "Taylor\0" "Moore\0"
+	"Jackson\0" "Martin\0" "Lee\0" "Perez\0" "Thompson\0" "White\0"
+	"Harris\0" "Sanchez\0" "Clark\0" "Ramirez\0" "Lewis\0" "Robinson\0"
+	"Walker\0" "Young\0" "Allen\0" "King\0" "Wright\0" "Scott\0" "Torres\0"
+	"Nguyen\0" "Hill\0" "Flores\0" "Green\0" "Adams\0" "Nelson\0" "Baker\0"
+	"Hall\0" "Rivera\0" "Campbell\0" "Mitchell\0" "Carter\0" "Roberts\0"
+	"Gomez\0" "Phillips\0" "Evans\0" "Turner\0" "Diaz\0" "Parker\0" "Cruz\0"
+	"Edwards\0" "Collins\0" "Reyes\0" "Stewart\0" "Morris\0" "Morales\0"
+	"Murphy\0" "Cook\0" "Rogers\0" "Gutierrez\0" "Ortiz\0" "Morgan\0"
+	"Cooper\0" "Peterson\0" "Bailey\0" "Reed\0" "Kelly\0" "Howard\0"
+	"Ramos\0" "Kim\0" "Cox\0" "Ward\0" "Richardson\0" "Watson\0" "Brooks\0"
+	"Chavez\0" "Wood\0" "James\0" "Bennett\0" "Gray\0" "Mendoza\0" "Ruiz\0"
+	"Hughes\0" "Price\0" "Alvarez\0" "Castillo\0" "Sanders\0" "Patel\0"
+	"Myers\0" "Long\0" "Ross\0" "Foster\0" "Jimenez\0" "Powell\0" "Jenkins\0"
+	"Perry\0" "Russell\0" "Sullivan\0" "Bell\0" "Coleman\0" "Butler\0"
+	"Henderson\0" "Barnes\0" "Gonzales\0" "Fisher\0" "Vasquez\0" "Simmons\0"
+	"Romero\0" "Jordan\0" "Patterson\0" "Alexander\0" "Hamilton\0" "Graham\0"
+	"Reynolds\0" "Griffin\0" "Wallace\0" "Moreno\0" "West\0" "Cole\0"
+	"Hayes\0" "Bryant\0" "Herrera\0" "Gibson\0" "Ellis\0" "Tran\0" "Medina\0"
+	"Aguilar\0" "Stevens\0" "Murray\0" "Ford\0" "Castro\0" "Marshall\0"
+	"Owens\0" "Harrison\0" "Fernandez\0" "McDonald\0" "Woods\0"
+	"Washington\0" "Kennedy\0" "Wells\0" "Vargas\0" "Henry\0" "Chen\0"
+	"Freeman\0" "Webb\0" "Tucker\0" "Guzman\0" "Burns\0" "Crawford\0"
+	"Olson\0" "Simpson\0" "Porter\0" "Hunter\0" "Gordon\0" "Mendez\0"
+	"Silva\0" "Shaw\0" "Snyder\0" "Mason\0" "Dixon\0" "Munoz\0" "Hunt\0"
+	"Hicks\0" "Holmes\0" "Palmer\0" "Wagner\0" "Black\0" "Robertson\0"
+	"Boyd\0" "Rose\0" "Stone\0" "Salazar\0" "Fox\0" "Warren\0" "Mills\0"
+	"Meyer\0" "Rice\0" "Schmidt\0" "Garza\0" "Daniels\0" "Ferguson\0"
+	"Nichols\0" "Stephens\0" "Soto\0" "Weaver\0" "Ryan\0" "Gardner\0"
+	"Payne\0" "Grant\0" "Dunn\0" "Kelley\0" "Spencer\0" "Hawkins\0"
+	"Arnold\0" "Pierce\0" "Vazquez\0" "Hansen\0" "Peters\0" "Santos\0"
+	"Hart\0" "Bradley\0" "Knight\0";
+
+/* City names */
+static const char pgan_fake_cities[] =
+	"Springfield\0" "Riverside\0" "Franklin\0" "Greenville\0" "Bristol\0"
+	"Clinton\0" "Fairview\0" "Salem\0" "Madison\0" "Georgetown\0"
+	"Arlington\0" "Ashland\0" "Burlington\0" "Manchester\0" "Marion\0"
+	"Oxford\0" "Clayton\0" "Jackson\0" "Milton\0" "Auburn\0" "Dayton\0"
+	"Lexington\0" "Milford\0" "Winchester\0" "Hudson\0" "Kingston\0"
+	"Dover\0" "Newport\0" "Centerville\0" "Mount Vernon\0" "Oakland\0"
+	"Lebanon\0" "Chester\0" "Cleveland\0" "Hamilton\0" "Lancaster\0"
+	"Monroe\0" "Plymouth\0" "Portland\0" "Richmond\0" "Shelbyville\0"
+	"Troy\0" "Union\0" "Washington\0" "Williamsburg\0" "Columbia\0"
+	"Concord\0" "Danville\0" "Farmington\0" "Glendale\0" "Hanover\0"
+	"Harrison\0" "Highland\0" "Jamestown\0" "Lakewood\0" "Lincoln\0"
+	"Livingston\0" "Marshall\0" "Middletown\0" "Newton\0" "Oak Grove\0"
+	"Pleasant Hill\0" "Princeton\0" "Quincy\0" "Rochester\0" "Shady Grove\0"
+	"Sheffield\0" "Somerset\0" "Stratford\0" "Sunnyvale\0" "Trenton\0"
+	"Vernon\0" "Warren\0" "Waverly\0" "Westfield\0" "Wilmington\0"
+	"Windsor\0" "Woodstock\0" "Belmont\0" "Cambridge\0" "Camden\0" "Canton\0"
+	"Carlisle\0" "Cedar Falls\0" "Chatham\0" "Easton\0" "Elkton\0"
+	"Florence\0" "Fulton\0" "Greenwood\0" "Hartford\0" "Hillsboro\0"
+	"Jefferson\0" "Kensington\0" "Lakeside\0" "Maplewood\0" "Melrose\0"
+	"Norwood\0" "Oakdale\0" "Pine Bluff\0" "Rockport\0" "Stanton\0";
+
+/* Street names */
+static const char pgan_fake_streets[] =
+	"Main Street\0" "Oak Avenue\0" "Maple Street\0" "Park Avenue\0"
+	"Pine Street\0" "Cedar Lane\0" "Elm Street\0" "Washington Avenue\0"
+	"Lake Street\0" "Hill Road\0" "Church Street\0" "High Street\0"
+	"Walnut Street\0" "Spring Street\0" "North Street\0" "Ridge Road\0"
+	"Sunset Boulevard\0" "Jefferson Avenue\0" "Lincoln Road\0" "Mill Lane\0"
+	"River Road\0" "Chestnut Street\0" "Willow Lane\0" "Meadow Drive\0"
+	"Forest Avenue\0" "Madison Avenue\0" "Center Street\0"
+	"Franklin Street\0" "Highland Avenue\0" "Park Place\0" "Front Street\0"
+	"School Street\0" "Water Street\0" "Bridge Street\0" "Union Street\0"
+	"Valley Road\0" "Broadway\0" "Cherry Lane\0" "Birch Road\0"
+	"Dogwood Drive\0" "Hickory Lane\0" "Lakeview Drive\0" "Magnolia Avenue\0"
+	"Orchard Road\0" "Prospect Street\0" "Railroad Avenue\0" "Rose Lane\0"
+	"Spruce Street\0" "Sycamore Drive\0" "Vine Street\0" "Adams Street\0"
+	"Cambridge Road\0" "Canal Street\0" "Cedar Street\0" "Clinton Avenue\0"
+	"College Avenue\0" "Colonial Drive\0" "Court Street\0" "Dover Road\0"
+	"East Street\0" "Essex Court\0" "Fairway Drive\0" "Garden Street\0"
+	"Glenwood Avenue\0" "Grand Avenue\0" "Green Street\0" "Grove Street\0"
+	"Harbor Road\0" "Heritage Drive\0" "Holly Court\0" "Jackson Street\0"
+	"King Street\0" "Laurel Lane\0" "Liberty Street\0" "Linden Avenue\0"
+	"Market Street\0" "Mountain View Road\0" "New Street\0"
+	"Oak Ridge Road\0" "Old Mill Road\0" "Pleasant Street\0"
+	"Poplar Avenue\0" "Queen Street\0" "Riverside Drive\0"
+	"Rosewood Avenue\0" "Second Street\0" "Shady Lane\0" "South Street\0"
+	"Summit Avenue\0" "Third Street\0" "Valley View Drive\0"
+	"Victoria Street\0" "West Street\0" "Westwood Road\0" "Winding Way\0"
+	"Windsor Drive\0" "Woodland Avenue\0" "York Road\0" "Academy Street\0"
+	"Beacon Street\0" "Cottage Street\0" "Depot Street\0" "Elmwood Avenue\0";
+
+#endif							/* PGAN_FAKE_DATA_H */
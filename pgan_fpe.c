@@ -0,0 +1,540 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgan_fpe.c
+ *		Format-preserving encryption functions usable in security labels
+ *
+ * The values are encrypted with FF1, as specified in NIST SP 800-38G, using
+ * AES keyed with the pg_anonymize.encryption_key parameter.  Only the
+ * characters of the given alphabet are encrypted, the other ones are kept as
+ * is, so that e.g. a formatted card number stays a valid looking card number
+ * and can be decrypted back by authorized users.
+ *
+ * AES is provided by OpenSSL, which uses the AES-NI instructions when
+ * available and a portable implementation otherwise.  The cipher context is
+ * only keyed once per backend and key, so encrypting a value only costs the
+ * eleven AES blocks of the FF1 rounds.
+ *
+ *
+ * pg_anonymize
+ * Copyright (C) 2022-2024 - Julien Rouhaud.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "fmgr.h"
+#include "utils/builtins.h"
+
+#ifdef USE_OPENSSL
+#include <openssl/evp.h>
+#endif
+
+#include "pgan_fpe.h"
+
+/* Maximum length of the key, AES-256 */
+#define PGAN_FPE_KEY_MAX_LEN 32
+
+/*
+ * Each half of the numeral string is handled as a single integer, so radix
+ * to the power of the length of the longest half must not exceed 2^56.  This
+ * way the modular arithmetic of the rounds never overflows, and the PRF
+ * output is never longer than one AES block.
+ */
+#define PGAN_FPE_MAX_RANGE (UINT64CONST(1) << 56)
+
+/* Longest numeral string, for a radix of 2 */
+#define PGAN_FPE_MAX_DIGITS 112
+
+/* Minimum domain size required by NIST SP 800-38G */
+#define PGAN_FPE_MIN_DOMAIN 1000000
+
+#define PGAN_FPE_ROUNDS 10
+
+/* Parsed pg_anonymize.encryption_key */
+typedef struct pganFpeKey
+{
+	int			keylen;			/* 0 if no key is set */
+	unsigned char key[PGAN_FPE_KEY_MAX_LEN];
+} pganFpeKey;
+
+/*
+ * Alphabet of the FPE functions, cached in fn_extra as it's usually a
+ * constant.
+ */
+typedef struct pganFpeAlphabet
+{
+	int			radix;			/* 0 if not built yet */
+	int			minlen;			/* minimum number of characters */
+	int			maxlen;			/* maximum number of characters */
+	int8		digits[128];	/* value of each character, or -1 */
+	char		chars[128];
+} pganFpeAlphabet;
+
+PG_FUNCTION_INFO_V1(pg_anonymize_fpe_encrypt);
+PG_FUNCTION_INFO_V1(pg_anonymize_fpe_decrypt);
+
+/* GUC */
+char	   *pgan_encryption_key = NULL;
+
+static pganFpeKey pgan_fpe_key = {0};
+
+/*
+ * Incremented whenever pg_anonymize.encryption_key is assigned, so that the
+ * cipher context is keyed again.
+ */
+static uint64 pgan_fpe_key_generation = 0;
+
+#ifdef USE_OPENSSL
+static EVP_CIPHER_CTX *pgan_fpe_ctx = NULL;
+static uint64 pgan_fpe_ctx_generation = 0;
+#endif
+
+static Datum pgan_fpe(FunctionCallInfo fcinfo, bool encrypt);
+#ifdef USE_OPENSSL
+static pganFpeAlphabet *pgan_fpe_get_alphabet(FmgrInfo *flinfo,
+											  text *alphabet);
+static EVP_CIPHER_CTX *pgan_fpe_get_ctx(void);
+static inline void pgan_fpe_aes(EVP_CIPHER_CTX *ctx, const unsigned char *in,
+								unsigned char *out);
+static void pgan_ff1(EVP_CIPHER_CTX *ctx, uint8 *x, int n, int radix,
+					 const unsigned char *tweak, int t, bool encrypt);
+#endif
+
+/*
+ * Check that the pg_anonymize.encryption_key is either empty or an AES-128,
+ * AES-192 or AES-256 key given as hexadecimal digits.
+ */
+bool
+pgan_check_encryption_key(char **newval, void **extra, GucSource source)
+{
+	const char *p = *newval;
+	int			len = (p == NULL ? 0 : strlen(p));
+	pganFpeKey	key;
+	int			i;
+
+	if (len != 0 && len != 32 && len != 48 && len != 64)
+	{
+		GUC_check_errdetail("The key must be 32, 48 or 64 hexadecimal digits.");
+		return false;
+	}
+
+	memset(&key, 0, sizeof(pganFpeKey));
+	for (i = 0; i < len; i++)
+	{
+		char		c = p[i];
+		int			nibble;
+
+		if (c >= '0' && c <= '9')
+			nibble = c - '0';
+		else if (c >= 'a' && c <= 'f')
+			nibble = c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F')
+			nibble = c - 'A' + 10;
+		else
+		{
+			GUC_check_errdetail("The key must be 32, 48 or 64 hexadecimal digits.");
+			return false;
+		}
+
+		key.key[i / 2] |= (i % 2 == 0) ? nibble << 4 : nibble;
+	}
+	key.keylen = len / 2;
+
+#if PG_VERSION_NUM >= 160000
+	*extra = guc_malloc(LOG, sizeof(pganFpeKey));
+#else
+	*extra = malloc(sizeof(pganFpeKey));
+#endif
+	if (*extra == NULL)
+		return false;
+
+	memcpy(*extra, &key, sizeof(pganFpeKey));
+
+	return true;
+}
+
+void
+pgan_assign_encryption_key(const char *newval, void *extra)
+{
+	if (extra != NULL)
+		pgan_fpe_key = *((pganFpeKey *) extra);
+	else
+		memset(&pgan_fpe_key, 0, sizeof(pganFpeKey));
+
+	pgan_fpe_key_generation++;
+}
+
+#ifdef USE_OPENSSL
+/*
+ * Return the given alphabet of the FPE functions, building it if needed.  It
+ * must contain between 2 and 128 distinct ASCII characters.
+ */
+static pganFpeAlphabet *
+pgan_fpe_get_alphabet(FmgrInfo *flinfo, text *alphabet)
+{
+	pganFpeAlphabet *state = (pganFpeAlphabet *) flinfo->fn_extra;
+	const char *p = VARDATA_ANY(alphabet);
+	int			len = VARSIZE_ANY_EXHDR(alphabet);
+	uint64		range;
+	int			maxhalf;
+	int			i;
+
+	if (state != NULL && state->radix != 0 && state->radix == len &&
+		memcmp(state->chars, p, len) == 0)
+		return state;
+
+	if (state == NULL)
+	{
+		state = MemoryContextAlloc(flinfo->fn_mcxt, sizeof(pganFpeAlphabet));
+		flinfo->fn_extra = state;
+	}
+	state->radix = 0;
+
+	if (len < 2)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("alphabet must contain at least 2 characters")));
+
+	memset(state->digits, -1, sizeof(state->digits));
+	for (i = 0; i < len; i++)
+	{
+		unsigned char c = (unsigned char) p[i];
+
+		if (IS_HIGHBIT_SET(c))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("only ASCII characters can be used in the alphabet")));
+
+		if (state->digits[c] != -1)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("alphabet must not contain duplicate characters")));
+
+		state->digits[c] = i;
+	}
+
+	maxhalf = 0;
+	for (range = len; range <= PGAN_FPE_MAX_RANGE; range *= len)
+		maxhalf++;
+	state->maxlen = maxhalf * 2;
+
+	state->minlen = 2;
+	for (range = len * len; range < PGAN_FPE_MIN_DOMAIN; range *= len)
+		state->minlen++;
+
+	memcpy(state->chars, p, len);
+	state->radix = len;
+
+	return state;
+}
+
+/*
+ * Return the backend's cipher context, keyed with the current
+ * pg_anonymize.encryption_key.
+ */
+static EVP_CIPHER_CTX *
+pgan_fpe_get_ctx(void)
+{
+	const EVP_CIPHER *cipher;
+
+	if (pgan_fpe_key.keylen == 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_anonymize.encryption_key is not set"),
+				 errhint("Set it to 32, 48 or 64 random hexadecimal digits in the server configuration.")));
+
+	if (pgan_fpe_ctx == NULL)
+	{
+		pgan_fpe_ctx = EVP_CIPHER_CTX_new();
+		if (pgan_fpe_ctx == NULL)
+			ereport(ERROR,
+					(errcode(ERRCODE_OUT_OF_MEMORY),
+					 errmsg("out of memory")));
+		pgan_fpe_ctx_generation = 0;
+	}
+
+	if (pgan_fpe_ctx_generation == pgan_fpe_key_generation)
+		return pgan_fpe_ctx;
+
+	switch (pgan_fpe_key.keylen)
+	{
+		case 16:
+			cipher = EVP_aes_128_ecb();
+			break;
+		case 24:
+			cipher = EVP_aes_192_ecb();
+			break;
+		default:
+			cipher = EVP_aes_256_ecb();
+			break;
+	}
+
+	if (EVP_EncryptInit_ex(pgan_fpe_ctx, cipher, NULL, pgan_fpe_key.key,
+						   NULL) != 1 ||
+		EVP_CIPHER_CTX_set_padding(pgan_fpe_ctx, 0) != 1)
+		elog(ERROR, "could not initialize the AES cipher");
+
+	pgan_fpe_ctx_generation = pgan_fpe_key_generation;
+
+	return pgan_fpe_ctx;
+}
+
+/* Encrypt a single AES block. */
+static inline void
+pgan_fpe_aes(EVP_CIPHER_CTX *ctx, const unsigned char *in, unsigned char *out)
+{
+	int			outlen;
+
+	if (EVP_EncryptUpdate(ctx, out, &outlen, in, 16) != 1 || outlen != 16)
+		elog(ERROR, "could not encrypt with the AES cipher");
+}
+
+/*
+ * Encrypt or decrypt in place the numeral string x of length n in the given
+ * radix with FF1, as specified in NIST SP 800-38G.
+ *
+ * As radix^v doesn't exceed 2^56, NUM(A) and NUM(B) are kept as integers, b is
+ * at most 7 bytes and d at most 12, so S is always the first d bytes of R.
+ * The first block of the PRF input, P, is the same for all the rounds, so its
+ * encryption is only done once.
+ */
+static void
+pgan_ff1(EVP_CIPHER_CTX *ctx, uint8 *x, int n, int radix,
+		 const unsigned char *tweak, int t, bool encrypt)
+{
+	int			u = n / 2;
+	int			v = n - u;
+	uint64		mu = 1;
+	uint64		mv = 1;
+	uint64		numa = 0;
+	uint64		numb = 0;
+	uint64		range;
+	int			b;
+	int			d;
+	int			qlen;
+	int			i;
+	unsigned char p[16];
+	unsigned char y0[16];
+	unsigned char q[16];
+	unsigned char r[16];
+
+	for (i = 0; i < u; i++)
+		mu *= radix;
+	for (i = 0; i < v; i++)
+		mv *= radix;
+	Assert(mv <= PGAN_FPE_MAX_RANGE);
+
+	/* b = ceil(ceil(v * log2(radix)) / 8), i.e. the bytes of radix^v - 1 */
+	b = 0;
+	for (range = mv - 1; range > 0; range >>= 8)
+		b++;
+	d = 4 * ((b + 3) / 4) + 4;
+	Assert(d <= 16);
+
+	for (i = 0; i < u; i++)
+		numa = numa * radix + x[i];
+	for (i = u; i < n; i++)
+		numb = numb * radix + x[i];
+
+	p[0] = 1;
+	p[1] = 2;
+	p[2] = 1;
+	p[3] = (radix >> 16) & 0xFF;
+	p[4] = (radix >> 8) & 0xFF;
+	p[5] = radix & 0xFF;
+	p[6] = PGAN_FPE_ROUNDS;
+	p[7] = u & 0xFF;
+	p[8] = (n >> 24) & 0xFF;
+	p[9] = (n >> 16) & 0xFF;
+	p[10] = (n >> 8) & 0xFF;
+	p[11] = n & 0xFF;
+	p[12] = (t >> 24) & 0xFF;
+	p[13] = (t >> 16) & 0xFF;
+	p[14] = (t >> 8) & 0xFF;
+	p[15] = t & 0xFF;
+	pgan_fpe_aes(ctx, p, y0);
+
+	/* Q = T || [0]^((-t-b-1) mod 16) || [i]^1 || [NUM(B)]^b */
+	qlen = t + ((-t - b - 1) % 16 + 16) % 16 + 1 + b;
+
+	for (i = 0; i < PGAN_FPE_ROUNDS; i++)
+	{
+		int			round = encrypt ? i : PGAN_FPE_ROUNDS - 1 - i;
+		uint64		m = (round % 2 == 0) ? mu : mv;
+		uint64		num = encrypt ? numb : numa;
+		uint64		y = 0;
+		int			off;
+		int			j;
+
+		/* R = PRF(P || Q), a CBC-MAC continuing from the encrypted P */
+		memcpy(r, y0, 16);
+		for (off = 0; off < qlen; off += 16)
+		{
+			for (j = 0; j < 16; j++)
+			{
+				int			pos = off + j;
+				unsigned char c;
+
+				if (pos < t)
+					c = tweak[pos];
+				else if (pos < qlen - b - 1)
+					c = 0;
+				else if (pos == qlen - b - 1)
+					c = round;
+				else
+					c = (num >> (8 * (qlen - 1 - pos))) & 0xFF;
+
+				q[j] = r[j] ^ c;
+			}
+			pgan_fpe_aes(ctx, q, r);
+		}
+
+		/* y = NUM(S) mod radix^m, which is all that's needed */
+		for (j = 0; j < d; j++)
+			y = ((y << 8) | r[j]) % m;
+
+		if (encrypt)
+		{
+			uint64		c = (numa + y) % m;
+
+			numa = numb;
+			numb = c;
+		}
+		else
+		{
+			uint64		c = (numb + m - y) % m;
+
+			numb = numa;
+			numa = c;
+		}
+	}
+
+	for (i = u - 1; i >= 0; i--)
+	{
+		x[i] = numa % radix;
+		numa /= radix;
+	}
+	for (i = n - 1; i >= u; i--)
+	{
+		x[i] = numb % radix;
+		numb /= radix;
+	}
+}
+#endif							/* USE_OPENSSL */
+
+/*
+ * Encrypt or decrypt the characters of the value belonging to the alphabet
+ * with FF1, keeping the other characters as is.
+ */
+static Datum
+pgan_fpe(FunctionCallInfo fcinfo, bool encrypt)
+{
+#ifdef USE_OPENSSL
+	text	   *value = PG_GETARG_TEXT_PP(0);
+	bytea	   *tweak = PG_GETARG_BYTEA_PP(2);
+	const char *src = VARDATA_ANY(value);
+	int			len = VARSIZE_ANY_EXHDR(value);
+	pganFpeAlphabet *alphabet;
+	EVP_CIPHER_CTX *ctx;
+	uint8		x[PGAN_FPE_MAX_DIGITS];
+	int			n = 0;
+	text	   *result;
+	char	   *dst;
+	int			i;
+
+	alphabet = pgan_fpe_get_alphabet(fcinfo->flinfo, PG_GETARG_TEXT_PP(1));
+	ctx = pgan_fpe_get_ctx();
+
+	/*
+	 * Bytes of multibyte characters all have the high bit set in the server
+	 * encodings, so they can't be mistaken for a character of the alphabet.
+	 */
+	for (i = 0; i < len; i++)
+	{
+		unsigned char c = (unsigned char) src[i];
+
+		if (IS_HIGHBIT_SET(c) || alphabet->digits[c] == -1)
+			continue;
+
+		if (n == alphabet->maxlen)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("value must not contain more than %d characters of the alphabet",
+							alphabet->maxlen)));
+
+		x[n++] = alphabet->digits[c];
+	}
+
+	if (n < alphabet->minlen)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("value must contain at least %d characters of the alphabet",
+						alphabet->minlen)));
+
+	pgan_ff1(ctx, x, n, alphabet->radix,
+			 (unsigned char *) VARDATA_ANY(tweak), VARSIZE_ANY_EXHDR(tweak),
+			 encrypt);
+
+	result = (text *) palloc(VARHDRSZ + len);
+	SET_VARSIZE(result, VARHDRSZ + len);
+	dst = VARDATA(result);
+
+	n = 0;
+	for (i = 0; i < len; i++)
+	{
+		unsigned char c = (unsigned char) src[i];
+
+		if (IS_HIGHBIT_SET(c) || alphabet->digits[c] == -1)
+			dst[i] = src[i];
+		else
+			dst[i] = alphabet->chars[x[n++]];
+	}
+
+	PG_RETURN_TEXT_P(result);
+#else
+	ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			 errmsg("format-preserving encryption is not supported by this build"),
+			 errhint("pg_anonymize must be compiled with a server built with OpenSSL.")));
+	PG_RETURN_NULL();			/* keep compiler quiet */
+#endif
+}
+
+/*
+ * pg_anonymize_fpe_encrypt(value text, alphabet text DEFAULT '0123456789',
+ *							tweak bytea DEFAULT '')
+ *
+ * Encrypt the characters of the value belonging to the alphabet, keeping the
+ * other ones.
+ */
+Datum
+pg_anonymize_fpe_encrypt(PG_FUNCTION_ARGS)
+{
+	return pgan_fpe(fcinfo, true);
+}
+
+/*
+ * pg_anonymize_fpe_decrypt(value text, alphabet text DEFAULT '0123456789',
+ *							tweak bytea DEFAULT '')
+ *
+ * Decrypt a value encrypted by pg_anonymize_fpe_encrypt() with the same
+ * alphabet and tweak.
+ */
+Datum
+pg_anonymize_fpe_decrypt(PG_FUNCTION_ARGS)
+{
+	return pgan_fpe(fcinfo, false);
+}
@@ -0,0 +1,37 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgan_fpe.h
+ *		Format-preserving encryption functions
+ *
+ *
+ * pg_anonymize
+ * Copyright (C) 2022-2024 - Julien Rouhaud.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PGAN_FPE_H
+#define PGAN_FPE_H
+
+#include "utils/guc.h"
+
+/* GUC, defined in _PG_init() with the other parameters */
+extern char *pgan_encryption_key;
+
+extern bool pgan_check_encryption_key(char **newval, void **extra,
+									  GucSource source);
+extern void pgan_assign_encryption_key(const char *newval, void *extra);
+
+#endif							/* PGAN_FPE_H */
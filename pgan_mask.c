@@ -0,0 +1,797 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgan_mask.c
+ *		Native masking functions usable in security labels
+ *
+ *
+ * pg_anonymize
+ * Copyright (C) 2022-2024 - Julien Rouhaud.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "fmgr.h"
+#include "mb/pg_wchar.h"
+#include "utils/builtins.h"
+#include "utils/date.h"
+#include "utils/datetime.h"
+
+/*
+ * The text kernels scan the input by blocks of 16 (SSE2) or 32 (AVX2) bytes.
+ * SSE2 is always available on x86-64, AVX2 is only used if the module is
+ * compiled for it, e.g. with PG_CFLAGS=-mavx2.  Other platforms use the
+ * scalar implementation.
+ */
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define USE_AVX2
+#define PGAN_BLOCK_SIZE 32
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define USE_SSE2
+#define PGAN_BLOCK_SIZE 16
+#else
+#define PGAN_BLOCK_SIZE 16
+#endif
+
+/* Characters masked by pgan_mask_kernel() */
+typedef enum pganMaskClass
+{
+	PGAN_MASK_DIGITS,			/* ASCII digits */
+	PGAN_MASK_LETTERS,			/* ASCII letters and non-ASCII characters */
+	PGAN_MASK_ALL				/* All characters */
+} pganMaskClass;
+
+PG_FUNCTION_INFO_V1(pg_anonymize_mask_digits);
+PG_FUNCTION_INFO_V1(pg_anonymize_mask_letters);
+PG_FUNCTION_INFO_V1(pg_anonymize_mask_all_but_last);
+PG_FUNCTION_INFO_V1(pg_anonymize_partial);
+PG_FUNCTION_INFO_V1(pg_anonymize_mask_email);
+PG_FUNCTION_INFO_V1(pg_anonymize_mask_phone);
+PG_FUNCTION_INFO_V1(pg_anonymize_redact);
+PG_FUNCTION_INFO_V1(pg_anonymize_replace_chars);
+PG_FUNCTION_INFO_V1(pg_anonymize_prefix);
+PG_FUNCTION_INFO_V1(pg_anonymize_date_trunc);
+
+/*
+ * Set of ASCII characters used by pg_anonymize_replace_chars(), cached in
+ * fn_extra as the characters are usually a constant.
+ */
+typedef struct pganCharSet
+{
+	bits8		set[16];		/* one bit per ASCII character */
+	bool		digits;			/* exactly the ASCII digits */
+	int			len;			/* length of chars */
+	char		chars[FLEXIBLE_ARRAY_MEMBER];	/* source characters */
+} pganCharSet;
+
+static const char *pgan_get_mask(text *mask, int *masklen);
+static bool pgan_char_matches(const char *c, int clen, pganMaskClass cls);
+static int	pgan_count_matches(const char *src, int len, pganMaskClass cls);
+static text *pgan_mask_text(const char *src, int len, pganMaskClass cls,
+							const char *mask, int masklen, int limit);
+static int	pgan_mask_kernel(const char *src, int len, char *dst,
+							 pganMaskClass cls, const char *mask, int masklen,
+							 int limit);
+static pganCharSet *pgan_get_char_set(FmgrInfo *flinfo, text *chars);
+
+/*
+ * Return the given mask, which must be a single character, and its length in
+ * bytes.
+ */
+static const char *
+pgan_get_mask(text *mask, int *masklen)
+{
+	const char *p = VARDATA_ANY(mask);
+	int			len = VARSIZE_ANY_EXHDR(mask);
+
+	if (len == 0 || pg_mblen(p) != len)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("the mask must be a single character")));
+
+	*masklen = len;
+	return p;
+}
+
+/*
+ * Does the given character, of clen bytes, belong to the given class?
+ */
+static inline bool
+pgan_char_matches(const char *c, int clen, pganMaskClass cls)
+{
+	switch (cls)
+	{
+		case PGAN_MASK_DIGITS:
+			return (clen == 1 && *c >= '0' && *c <= '9');
+		case PGAN_MASK_LETTERS:
+			return (clen > 1 || IS_HIGHBIT_SET(*c) ||
+					(*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z'));
+		case PGAN_MASK_ALL:
+			return true;
+	}
+
+	return false;				/* keep compiler quiet */
+}
+
+/*
+ * Return the number of characters of the given class in the given string.
+ */
+static int
+pgan_count_matches(const char *src, int len, pganMaskClass cls)
+{
+	int			count = 0;
+	int			i = 0;
+
+	if (cls == PGAN_MASK_ALL)
+		return pg_mbstrlen_with_len(src, len);
+
+	while (i < len)
+	{
+		int			clen = IS_HIGHBIT_SET(src[i]) ? pg_mblen(src + i) : 1;
+
+		if (pgan_char_matches(src + i, clen, cls))
+			count++;
+		i += clen;
+	}
+
+	return count;
+}
+
+/*
+ * Return a text with the characters of the given class replaced by the given
+ * mask.  If limit isn't negative, only the first limit characters of the
+ * class are masked.
+ */
+static text *
+pgan_mask_text(const char *src, int len, pganMaskClass cls, const char *mask,
+			   int masklen, int limit)
+{
+	text	   *result;
+	int			outlen;
+
+	/* A character is at least one byte, and is replaced by a single mask. */
+	result = (text *) palloc(VARHDRSZ + (Size) len * masklen);
+	outlen = pgan_mask_kernel(src, len, VARDATA(result), cls, mask, masklen,
+							  limit);
+	SET_VARSIZE(result, VARHDRSZ + outlen);
+
+	return result;
+}
+
+/*
+ * Copy src to dst, replacing the characters of the given class with the given
+ * mask, and return the number of bytes written.  If limit isn't negative,
+ * only the first limit characters of the class are masked.
+ *
+ * dst must be at least len * masklen bytes long.
+ *
+ * Multibyte characters of all server encodings only consist of bytes with the
+ * high bit set, so blocks of plain ASCII can be processed bytewise with SIMD
+ * instructions as long as the mask is a single byte.  Other blocks are
+ * processed a character at a time.
+ */
+static int
+pgan_mask_kernel(const char *src, int len, char *dst, pganMaskClass cls,
+				 const char *mask, int masklen, int limit)
+{
+	int			i = 0;
+	int			o = 0;
+
+	while (i < len)
+	{
+		int			end;
+
+		/* Nothing more to mask, copy the rest. */
+		if (limit == 0)
+		{
+			memcpy(dst + o, src + i, len - i);
+			o += len - i;
+			break;
+		}
+
+#if defined(USE_AVX2) || defined(USE_SSE2)
+		if (masklen == 1)
+		{
+#ifdef USE_AVX2
+			const __m256i maskv = _mm256_set1_epi8(*mask);
+#else
+			const __m128i maskv = _mm_set1_epi8(*mask);
+#endif
+
+			while (i + PGAN_BLOCK_SIZE <= len)
+			{
+#ifdef USE_AVX2
+				__m256i		v = _mm256_loadu_si256((const __m256i *) (src + i));
+				__m256i		x;
+				__m256i		m;
+				uint32		bits;
+
+				/* Non-ASCII characters need to be processed one by one. */
+				if (cls != PGAN_MASK_DIGITS && _mm256_movemask_epi8(v) != 0)
+					break;
+
+				/* x <= k (unsigned) iff min(x, k) == x */
+				if (cls == PGAN_MASK_DIGITS)
+				{
+					x = _mm256_sub_epi8(v, _mm256_set1_epi8('0'));
+					m = _mm256_cmpeq_epi8(_mm256_min_epu8(x, _mm256_set1_epi8(9)), x);
+				}
+				else if (cls == PGAN_MASK_LETTERS)
+				{
+					x = _mm256_sub_epi8(_mm256_or_si256(v, _mm256_set1_epi8(0x20)),
+										_mm256_set1_epi8('a'));
+					m = _mm256_cmpeq_epi8(_mm256_min_epu8(x, _mm256_set1_epi8(25)), x);
+				}
+				else
+					m = _mm256_set1_epi8((char) 0xFF);
+
+				bits = (uint32) _mm256_movemask_epi8(m);
+#else
+				__m128i		v = _mm_loadu_si128((const __m128i *) (src + i));
+				__m128i		x;
+				__m128i		m;
+				uint32		bits;
+
+				/* Non-ASCII characters need to be processed one by one. */
+				if (cls != PGAN_MASK_DIGITS && _mm_movemask_epi8(v) != 0)
+					break;
+
+				/* x <= k (unsigned) iff min(x, k) == x */
+				if (cls == PGAN_MASK_DIGITS)
+				{
+					x = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+					m = _mm_cmpeq_epi8(_mm_min_epu8(x, _mm_set1_epi8(9)), x);
+				}
+				else if (cls == PGAN_MASK_LETTERS)
+				{
+					x = _mm_sub_epi8(_mm_or_si128(v, _mm_set1_epi8(0x20)),
+									 _mm_set1_epi8('a'));
+					m = _mm_cmpeq_epi8(_mm_min_epu8(x, _mm_set1_epi8(25)), x);
+				}
+				else
+					m = _mm_set1_epi8((char) 0xFF);
+
+				bits = (uint32) _mm_movemask_epi8(m);
+#endif
+
+				/* Let the scalar code handle the end of the limit. */
+				if (limit > 0)
+				{
+					int			n = 0;
+					uint32		b = bits;
+
+					while (b != 0)
+					{
+						b &= b - 1;
+						n++;
+					}
+
+					if (n > limit)
+						break;
+					limit -= n;
+				}
+
+#ifdef USE_AVX2
+				_mm256_storeu_si256((__m256i *) (dst + o),
+									_mm256_blendv_epi8(v, maskv, m));
+#else
+				_mm_storeu_si128((__m128i *) (dst + o),
+								 _mm_or_si128(_mm_and_si128(m, maskv),
+											  _mm_andnot_si128(m, v)));
+#endif
+				i += PGAN_BLOCK_SIZE;
+				o += PGAN_BLOCK_SIZE;
+
+				if (limit == 0)
+					break;
+			}
+
+			if (limit == 0 || i >= len)
+				continue;
+		}
+#endif
+
+		/*
+		 * Process a block a character at a time, possibly going a bit past
+		 * its end to stay on a character boundary.  Digits are never part of
+		 * a multibyte character, and the SIMD code may have stopped in the
+		 * middle of one, so they're searched bytewise.
+		 */
+		end = Min(len, i + PGAN_BLOCK_SIZE);
+		while (i < end)
+		{
+			int			clen = 1;
+
+			if (cls != PGAN_MASK_DIGITS && IS_HIGHBIT_SET(src[i]))
+				clen = Min(pg_mblen(src + i), len - i);
+
+			if (limit != 0 && pgan_char_matches(src + i, clen, cls))
+			{
+				memcpy(dst + o, mask, masklen);
+				o += masklen;
+				if (limit > 0)
+					limit--;
+			}
+			else
+			{
+				memcpy(dst + o, src + i, clen);
+				o += clen;
+			}
+			i += clen;
+		}
+	}
+
+	return o;
+}
+
+/*
+ * pg_anonymize_mask_digits(value text, mask text DEFAULT 'X')
+ *
+ * Replace all the digits with the mask, e.g. for a phone number.  Same as
+ * regexp_replace(value, '\d', mask, 'g'), but much faster.
+ */
+Datum
+pg_anonymize_mask_digits(PG_FUNCTION_ARGS)
+{
+	text	   *value = PG_GETARG_TEXT_PP(0);
+	const char *mask;
+	int			masklen;
+
+	mask = pgan_get_mask(PG_GETARG_TEXT_PP(1), &masklen);
+
+	PG_RETURN_TEXT_P(pgan_mask_text(VARDATA_ANY(value),
+									VARSIZE_ANY_EXHDR(value),
+									PGAN_MASK_DIGITS, mask, masklen, -1));
+}
+
+/*
+ * pg_anonymize_mask_letters(value text, mask text DEFAULT 'X')
+ *
+ * Replace all the letters with the mask.  Any non-ASCII character is
+ * considered as a letter.
+ */
+Datum
+pg_anonymize_mask_letters(PG_FUNCTION_ARGS)
+{
+	text	   *value = PG_GETARG_TEXT_PP(0);
+	const char *mask;
+	int			masklen;
+
+	mask = pgan_get_mask(PG_GETARG_TEXT_PP(1), &masklen);
+
+	PG_RETURN_TEXT_P(pgan_mask_text(VARDATA_ANY(value),
+									VARSIZE_ANY_EXHDR(value),
+									PGAN_MASK_LETTERS, mask, masklen, -1));
+}
+
+/*
+ * pg_anonymize_mask_all_but_last(value text, keep int, mask text DEFAULT 'X')
+ *
+ * Replace all the characters with the mask, except the last keep ones, e.g.
+ * for a credit card number.
+ */
+Datum
+pg_anonymize_mask_all_but_last(PG_FUNCTION_ARGS)
+{
+	text	   *value = PG_GETARG_TEXT_PP(0);
+	int32		keep = PG_GETARG_INT32(1);
+	const char *src = VARDATA_ANY(value);
+	int			len = VARSIZE_ANY_EXHDR(value);
+	const char *mask;
+	int			masklen;
+	int			limit;
+
+	mask = pgan_get_mask(PG_GETARG_TEXT_PP(2), &masklen);
+
+	limit = Max(0, pgan_count_matches(src, len, PGAN_MASK_ALL) - Max(0, keep));
+
+	PG_RETURN_TEXT_P(pgan_mask_text(src, len, PGAN_MASK_ALL, mask, masklen,
+									limit));
+}
+
+/*
+ * pg_anonymize_partial(value text, prefix int, padding text, suffix int)
+ *
+ * Keep the first prefix and last suffix characters, and replace the rest
+ * with the given padding.  If the value doesn't have more than prefix +
+ * suffix characters, only the padding is returned so that short values are
+ * not entirely revealed.
+ */
+Datum
+pg_anonymize_partial(PG_FUNCTION_ARGS)
+{
+	text	   *value = PG_GETARG_TEXT_PP(0);
+	int32		prefix = Max(0, PG_GETARG_INT32(1));
+	text	   *padding = PG_GETARG_TEXT_PP(2);
+	int32		suffix = Max(0, PG_GETARG_INT32(3));
+	const char *src = VARDATA_ANY(value);
+	int			len = VARSIZE_ANY_EXHDR(value);
+	int			padlen = VARSIZE_ANY_EXHDR(padding);
+	int			nchars;
+	int			prefixlen;
+	int			suffixlen;
+	text	   *result;
+	char	   *dst;
+
+	nchars = pg_mbstrlen_with_len(src, len);
+	if ((int64) prefix + suffix >= nchars)
+		PG_RETURN_TEXT_P(padding);
+
+	prefixlen = pg_mbcharcliplen(src, len, prefix);
+	suffixlen = len - pg_mbcharcliplen(src, len, nchars - suffix);
+
+	result = (text *) palloc(VARHDRSZ + prefixlen + padlen + suffixlen);
+	SET_VARSIZE(result, VARHDRSZ + prefixlen + padlen + suffixlen);
+	dst = VARDATA(result);
+	memcpy(dst, src, prefixlen);
+	memcpy(dst + prefixlen, VARDATA_ANY(padding), padlen);
+	memcpy(dst + prefixlen + padlen, src + len - suffixlen, suffixlen);
+
+	PG_RETURN_TEXT_P(result);
+}
+
+/*
+ * pg_anonymize_mask_email(value text, mask text DEFAULT '*')
+ *
+ * Replace all the characters of the local part of an email address with the
+ * mask, except the first one, and keep the domain.  If there's no @, all the
+ * characters but the first one are masked.
+ */
+Datum
+pg_anonymize_mask_email(PG_FUNCTION_ARGS)
+{
+	text	   *value = PG_GETARG_TEXT_PP(0);
+	const char *src = VARDATA_ANY(value);
+	int			len = VARSIZE_ANY_EXHDR(value);
+	const char *at;
+	const char *mask;
+	int			masklen;
+	int			locallen;
+	int			firstlen;
+	int			outlen;
+	text	   *result;
+	char	   *dst;
+
+	mask = pgan_get_mask(PG_GETARG_TEXT_PP(1), &masklen);
+
+	/* The last @ separates the local part, which can be quoted. */
+	at = NULL;
+	for (locallen = len - 1; locallen >= 0; locallen--)
+	{
+		if (src[locallen] == '@')
+		{
+			at = src + locallen;
+			break;
+		}
+	}
+	if (at == NULL)
+		locallen = len;
+
+	if (locallen == 0)
+		PG_RETURN_TEXT_P(value);
+
+	firstlen = pg_mblen(src);
+	firstlen = Min(firstlen, locallen);
+
+	result = (text *) palloc(VARHDRSZ + (Size) len * masklen);
+	dst = VARDATA(result);
+	memcpy(dst, src, firstlen);
+	outlen = firstlen;
+	outlen += pgan_mask_kernel(src + firstlen, locallen - firstlen,
+							   dst + outlen, PGAN_MASK_ALL, mask, masklen, -1);
+	memcpy(dst + outlen, src + locallen, len - locallen);
+	outlen += len - locallen;
+	SET_VARSIZE(result, VARHDRSZ + outlen);
+
+	PG_RETURN_TEXT_P(result);
+}
+
+/*
+ * pg_anonymize_mask_phone(value text, keep int DEFAULT 2,
+ *						   mask text DEFAULT 'X')
+ *
+ * Replace all the digits with the mask, except the last keep ones, keeping
+ * any other character like the spaces or the leading +.
+ */
+Datum
+pg_anonymize_mask_phone(PG_FUNCTION_ARGS)
+{
+	text	   *value = PG_GETARG_TEXT_PP(0);
+	int32		keep = PG_GETARG_INT32(1);
+	const char *src = VARDATA_ANY(value);
+	int			len = VARSIZE_ANY_EXHDR(value);
+	const char *mask;
+	int			masklen;
+	int			limit;
+
+	mask = pgan_get_mask(PG_GETARG_TEXT_PP(2), &masklen);
+
+	limit = Max(0, pgan_count_matches(src, len, PGAN_MASK_DIGITS) - Max(0, keep));
+
+	PG_RETURN_TEXT_P(pgan_mask_text(src, len, PGAN_MASK_DIGITS, mask, masklen,
+									limit));
+}
+
+/*
+ * pg_anonymize_redact(value text, width int DEFAULT 8, mask text DEFAULT '*')
+ *
+ * Return width times the mask, whatever the value, so that not even its length
+ * is revealed.
+ */
+Datum
+pg_anonymize_redact(PG_FUNCTION_ARGS)
+{
+	int32		width = PG_GETARG_INT32(1);
+	const char *mask;
+	int			masklen;
+	text	   *result;
+	char	   *dst;
+	int			i;
+
+	mask = pgan_get_mask(PG_GETARG_TEXT_PP(2), &masklen);
+
+	if (width < 0 || width > 1024)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("the width must be between 0 and 1024")));
+
+	result = (text *) palloc(VARHDRSZ + width * masklen);
+	SET_VARSIZE(result, VARHDRSZ + width * masklen);
+	dst = VARDATA(result);
+
+	if (masklen == 1)
+		memset(dst, *mask, width);
+	else
+	{
+		for (i = 0; i < width; i++)
+			memcpy(dst + i * masklen, mask, masklen);
+	}
+
+	PG_RETURN_TEXT_P(result);
+}
+
+/*
+ * Return the set of characters for the given chars argument of
+ * pg_anonymize_replace_chars(), building it if needed.
+ */
+static pganCharSet *
+pgan_get_char_set(FmgrInfo *flinfo, text *chars)
+{
+	pganCharSet *cs = (pganCharSet *) flinfo->fn_extra;
+	const char *p = VARDATA_ANY(chars);
+	int			len = VARSIZE_ANY_EXHDR(chars);
+	int			i;
+
+	if (cs != NULL && cs->len == len && memcmp(cs->chars, p, len) == 0)
+		return cs;
+
+	if (cs != NULL)
+		pfree(cs);
+	flinfo->fn_extra = NULL;
+
+	cs = MemoryContextAllocZero(flinfo->fn_mcxt,
+								offsetof(pganCharSet, chars) + len);
+	for (i = 0; i < len; i++)
+	{
+		unsigned char c = (unsigned char) p[i];
+
+		if (IS_HIGHBIT_SET(c))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("only ASCII characters can be replaced")));
+
+		cs->set[c >> 3] |= (1 << (c & 7));
+	}
+
+	/* '0' to '9' are the bits 0x30 to 0x39. */
+	cs->digits = true;
+	for (i = 0; i < 16; i++)
+	{
+		bits8		expected = (i == 6 ? 0xFF : i == 7 ? 0x03 : 0);
+
+		if (cs->set[i] != expected)
+			cs->digits = false;
+	}
+
+	cs->len = len;
+	memcpy(cs->chars, p, len);
+	flinfo->fn_extra = cs;
+
+	return cs;
+}
+
+/*
+ * pg_anonymize_replace_chars(value text, chars text, replacement text,
+ *							  invert bool DEFAULT false)
+ *
+ * Replace every character of the value found in chars, or not found in chars
+ * if invert is true, with the replacement, which can be of any length.  Only
+ * ASCII characters can be given in chars.  Same as regexp_replace(value,
+ * '[chars]', replacement, 'g'), or '[^chars]' if invert is true, as long as
+ * the replacement doesn't contain a backslash.
+ */
+Datum
+pg_anonymize_replace_chars(PG_FUNCTION_ARGS)
+{
+	text	   *value = PG_GETARG_TEXT_PP(0);
+	text	   *replacement = PG_GETARG_TEXT_PP(2);
+	bool		invert = PG_GETARG_BOOL(3);
+	const char *src = VARDATA_ANY(value);
+	int			len = VARSIZE_ANY_EXHDR(value);
+	const char *rep = VARDATA_ANY(replacement);
+	int			replen = VARSIZE_ANY_EXHDR(replacement);
+	pganCharSet *cs;
+	Size		outlen;
+	text	   *result;
+	char	   *dst;
+	int			i;
+
+	cs = pgan_get_char_set(fcinfo->flinfo, PG_GETARG_TEXT_PP(1));
+
+	/* The most common case can use the SIMD kernel. */
+	if (cs->digits && !invert && replen > 0 && pg_mblen(rep) == replen)
+		PG_RETURN_TEXT_P(pgan_mask_text(src, len, PGAN_MASK_DIGITS, rep,
+										replen, -1));
+
+	/*
+	 * Compute the exact result size if a character can be replaced with a
+	 * longer string.  As for pgan_mask_kernel(), only the non-ASCII
+	 * characters need to be processed a character at a time.
+	 */
+	outlen = len;
+	for (i = 0; replen > 1 && i < len;)
+	{
+		unsigned char c = (unsigned char) src[i];
+
+		if (IS_HIGHBIT_SET(c))
+		{
+			if (invert)
+				outlen += replen - 1;
+			i += pg_mblen(src + i);
+			continue;
+		}
+
+		if (((cs->set[c >> 3] & (1 << (c & 7))) != 0) != invert)
+			outlen += replen - 1;
+		i++;
+	}
+
+	if (outlen > MaxAllocSize - VARHDRSZ)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("result is too large")));
+
+	result = (text *) palloc(VARHDRSZ + outlen);
+	dst = VARDATA(result);
+
+	for (i = 0; i < len;)
+	{
+		unsigned char c = (unsigned char) src[i];
+		int			clen = 1;
+		bool		match;
+
+		if (IS_HIGHBIT_SET(c))
+		{
+			clen = Min(pg_mblen(src + i), len - i);
+			match = invert;
+		}
+		else
+			match = (((cs->set[c >> 3] & (1 << (c & 7))) != 0) != invert);
+
+		if (match)
+		{
+			memcpy(dst, rep, replen);
+			dst += replen;
+		}
+		else
+		{
+			memcpy(dst, src + i, clen);
+			dst += clen;
+		}
+		i += clen;
+	}
+
+	SET_VARSIZE(result, dst - (char *) result);
+
+	PG_RETURN_TEXT_P(result);
+}
+
+/*
+ * pg_anonymize_prefix(value text, keep int, suffix text)
+ *
+ * Return the first keep characters of the value followed by the suffix.
+ * Same as substr(value, 1, keep) || suffix, without building the
+ * intermediate text.
+ */
+Datum
+pg_anonymize_prefix(PG_FUNCTION_ARGS)
+{
+	text	   *value = PG_GETARG_TEXT_PP(0);
+	int32		keep = PG_GETARG_INT32(1);
+	text	   *suffix = PG_GETARG_TEXT_PP(2);
+	const char *src = VARDATA_ANY(value);
+	int			len = VARSIZE_ANY_EXHDR(value);
+	int			suffixlen = VARSIZE_ANY_EXHDR(suffix);
+	int			prefixlen;
+	text	   *result;
+
+	/* Same error as substr() */
+	if (keep < 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_SUBSTRING_ERROR),
+				 errmsg("negative substring length not allowed")));
+
+	prefixlen = pg_mbcharcliplen(src, len, keep);
+
+	result = (text *) palloc(VARHDRSZ + prefixlen + suffixlen);
+	SET_VARSIZE(result, VARHDRSZ + prefixlen + suffixlen);
+	memcpy(VARDATA(result), src, prefixlen);
+	memcpy(VARDATA(result) + prefixlen, VARDATA_ANY(suffix), suffixlen);
+
+	PG_RETURN_TEXT_P(result);
+}
+
+/*
+ * pg_anonymize_date_trunc(unit text, value date)
+ *
+ * Same as date_trunc(unit, value)::date, which goes through a timestamp with
+ * time zone.
+ *
+ * Truncating a date to the year, quarter or month is done directly on the
+ * date, which gives the same result as long as the conversion to a timestamp
+ * with time zone doesn't change the month.  This can only happen if the date
+ * is the last day of the month and its midnight doesn't exist in the current
+ * time zone, so those are processed as the original expression, as well as
+ * any other unit, dates before year 1 or too far in the future, and
+ * infinite dates.
+ */
+Datum
+pg_anonymize_date_trunc(PG_FUNCTION_ARGS)
+{
+	text	   *unit = PG_GETARG_TEXT_PP(0);
+	DateADT		value = PG_GETARG_DATEADT(1);
+	const char *u = VARDATA_ANY(unit);
+	int			ulen = VARSIZE_ANY_EXHDR(unit);
+	int			year;
+	int			month;
+	int			day;
+
+	if (DATE_NOT_FINITE(value))
+		goto fallback;
+
+	j2date(value + POSTGRES_EPOCH_JDATE, &year, &month, &day);
+
+	if (year < 1 || year > 9999 || day == day_tab[isleap(year)][month - 1])
+		goto fallback;
+
+	if (ulen == 4 && pg_strncasecmp(u, "year", 4) == 0)
+		month = 1;
+	else if (ulen == 7 && pg_strncasecmp(u, "quarter", 7) == 0)
+		month = 3 * ((month - 1) / 3) + 1;
+	else if (!(ulen == 5 && pg_strncasecmp(u, "month", 5) == 0))
+		goto fallback;
+
+	PG_RETURN_DATEADT(date2j(year, month, 1) - POSTGRES_EPOCH_JDATE);
+
+fallback:
+	PG_RETURN_DATUM(DirectFunctionCall1(timestamptz_date,
+										DirectFunctionCall2(timestamptz_trunc,
+															PointerGetDatum(unit),
+															DirectFunctionCall1(date_timestamptz,
+																				DateADTGetDatum(value)))));
+}
@@ -0,0 +1,532 @@
+/*-------------------------------------------------------------------------
+ *
+ * pgan_pseudo.c
+ *		Keyed pseudonymization functions usable in security labels
+ *
+ * The pseudonyms are computed with SipHash-2-4, keyed with the
+ * pg_anonymize.pseudonym_key parameter, so that the same value always gives
+ * the same pseudonym whatever the table it comes from, and joins on the
+ * anonymized columns still work, while they can't be computed or reversed
+ * without the key.  The initial SipHash state derived from the key is
+ * computed once per backend, when the parameter is set.
+ *
+ *
+ * pg_anonymize
+ * Copyright (C) 2022-2024 - Julien Rouhaud.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "catalog/pg_type.h"
+#include "fmgr.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "utils/uuid.h"
+
+#include "pgan_pseudo.h"
+
+/* Length of the key, given as twice as many hexadecimal digits */
+#define PGAN_KEY_LEN 16
+
+/* Maximum length of pg_anonymize_pseudonym_text() result */
+#define PGAN_PSEUDONYM_MAX_LEN 1024
+
+/*
+ * pg_anonymize_pseudonym_text() extracts as many characters from each 64 bits
+ * of hash as possible as long as the alphabet size to the power of that
+ * number of characters doesn't exceed 2^48, so that the bias of the modulo is
+ * negligible.
+ */
+#define PGAN_ALPHABET_MAX_RANGE (UINT64CONST(1) << 48)
+
+#define ROTL64(x, b) (uint64) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND \
+	do { \
+		v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; v0 = ROTL64(v0, 32); \
+		v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2; \
+		v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0; \
+		v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; v2 = ROTL64(v2, 32); \
+	} while (0)
+
+/* SipHash initial state derived from pg_anonymize.pseudonym_key */
+typedef struct pganSipKey
+{
+	bool		valid;			/* false if no key is set */
+	uint64		v[4];
+} pganSipKey;
+
+/* How the argument of the pseudonymization functions is hashed */
+typedef enum pganPseudoInput
+{
+	PGAN_INPUT_VARLENA,			/* text or bytea, hash the raw bytes */
+	PGAN_INPUT_INT8,			/* hash the 8 bytes in little-endian order */
+	PGAN_INPUT_UUID				/* hash the 16 bytes */
+} pganPseudoInput;
+
+/*
+ * Per-call-site state of the pseudonymization functions, cached in fn_extra.
+ * The alphabet is only used by pg_anonymize_pseudonym_text(), and is usually
+ * a constant.
+ */
+typedef struct pganPseudoState
+{
+	pganPseudoInput input;
+	int			alphalen;		/* 0 if not built yet */
+	int			perword;		/* characters extracted per 64 bits */
+	char		alphabet[128];
+} pganPseudoState;
+
+PG_FUNCTION_INFO_V1(pg_anonymize_pseudonym);
+PG_FUNCTION_INFO_V1(pg_anonymize_pseudonym_uuid);
+PG_FUNCTION_INFO_V1(pg_anonymize_pseudonym_text);
+
+/* GUC */
+char	   *pgan_pseudonym_key = NULL;
+
+static pganSipKey pgan_sip_key = {false};
+
+static inline uint64 pgan_load64(const unsigned char *p);
+static inline void pgan_store64(unsigned char *p, uint64 v);
+static void pgan_siphash(const unsigned char *data, Size len, bool wide,
+						 uint64 *hash);
+static pganPseudoState *pgan_get_pseudo_state(FunctionCallInfo fcinfo);
+static void pgan_set_alphabet(pganPseudoState *state, text *alphabet);
+
+/*
+ * Read 8 bytes as a little-endian integer, as specified by SipHash, whatever
+ * the platform.
+ */
+static inline uint64
+pgan_load64(const unsigned char *p)
+{
+	return (uint64) p[0] | ((uint64) p[1] << 8) | ((uint64) p[2] << 16) |
+		((uint64) p[3] << 24) | ((uint64) p[4] << 32) |
+		((uint64) p[5] << 40) | ((uint64) p[6] << 48) | ((uint64) p[7] << 56);
+}
+
+static inline void
+pgan_store64(unsigned char *p, uint64 v)
+{
+	int			i;
+
+	for (i = 0; i < 8; i++)
+		p[i] = (unsigned char) (v >> (8 * i));
+}
+
+/*
+ * Compute SipHash-2-4 of the given data with the current key, in its 64 bits
+ * version, or its 128 bits version if wide is true.
+ */
+static void
+pgan_siphash(const unsigned char *data, Size len, bool wide, uint64 *hash)
+{
+	uint64		v0 = pgan_sip_key.v[0];
+	uint64		v1 = pgan_sip_key.v[1];
+	uint64		v2 = pgan_sip_key.v[2];
+	uint64		v3 = pgan_sip_key.v[3];
+	const unsigned char *end = data + (len & ~((Size) 7));
+	uint64		b = ((uint64) len) << 56;
+	uint64		m;
+
+	Assert(pgan_sip_key.valid);
+
+	if (wide)
+		v1 ^= 0xee;
+
+	for (; data < end; data += 8)
+	{
+		m = pgan_load64(data);
+		v3 ^= m;
+		SIPROUND;
+		SIPROUND;
+		v0 ^= m;
+	}
+
+	switch (len & 7)
+	{
+		case 7:
+			b |= ((uint64) data[6]) << 48;
+			/* FALLTHROUGH */
+		case 6:
+			b |= ((uint64) data[5]) << 40;
+			/* FALLTHROUGH */
+		case 5:
+			b |= ((uint64) data[4]) << 32;
+			/* FALLTHROUGH */
+		case 4:
+			b |= ((uint64) data[3]) << 24;
+			/* FALLTHROUGH */
+		case 3:
+			b |= ((uint64) data[2]) << 16;
+			/* FALLTHROUGH */
+		case 2:
+			b |= ((uint64) data[1]) << 8;
+			/* FALLTHROUGH */
+		case 1:
+			b |= ((uint64) data[0]);
+			break;
+		case 0:
+			break;
+	}
+
+	v3 ^= b;
+	SIPROUND;
+	SIPROUND;
+	v0 ^= b;
+
+	v2 ^= wide ? 0xee : 0xff;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+	hash[0] = v0 ^ v1 ^ v2 ^ v3;
+
+	if (!wide)
+		return;
+
+	v1 ^= 0xdd;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+	hash[1] = v0 ^ v1 ^ v2 ^ v3;
+}
+
+/*
+ * Check that the pg_anonymize.pseudonym_key is either empty or 32
+ * hexadecimal digits, and derive the SipHash initial state from it, so that
+ * it's only done once rather than for every hashed value.
+ */
+bool
+pgan_check_pseudonym_key(char **newval, void **extra, GucSource source)
+{
+	const char *p = *newval;
+	unsigned char raw[PGAN_KEY_LEN];
+	pganSipKey *key;
+	int			i;
+
+	if (p != NULL && p[0] != '\0')
+	{
+		if (strlen(p) != PGAN_KEY_LEN * 2)
+		{
+			GUC_check_errdetail("The key must be %d hexadecimal digits.",
+								PGAN_KEY_LEN * 2);
+			return false;
+		}
+
+		for (i = 0; i < PGAN_KEY_LEN * 2; i++)
+		{
+			char		c = p[i];
+			int			nibble;
+
+			if (c >= '0' && c <= '9')
+				nibble = c - '0';
+			else if (c >= 'a' && c <= 'f')
+				nibble = c - 'a' + 10;
+			else if (c >= 'A' && c <= 'F')
+				nibble = c - 'A' + 10;
+			else
+			{
+				GUC_check_errdetail("The key must be %d hexadecimal digits.",
+									PGAN_KEY_LEN * 2);
+				return false;
+			}
+
+			if (i % 2 == 0)
+				raw[i / 2] = nibble << 4;
+			else
+				raw[i / 2] |= nibble;
+		}
+	}
+
+#if PG_VERSION_NUM >= 160000
+	key = guc_malloc(LOG, sizeof(pganSipKey));
+#else
+	key = malloc(sizeof(pganSipKey));
+#endif
+	if (key == NULL)
+		return false;
+
+	if (p == NULL || p[0] == '\0')
+	{
+		memset(key, 0, sizeof(pganSipKey));
+	}
+	else
+	{
+		uint64		k0 = pgan_load64(raw);
+		uint64		k1 = pgan_load64(raw + 8);
+
+		key->valid = true;
+		key->v[0] = k0 ^ UINT64CONST(0x736f6d6570736575);
+		key->v[1] = k1 ^ UINT64CONST(0x646f72616e646f6d);
+		key->v[2] = k0 ^ UINT64CONST(0x6c7967656e657261);
+		key->v[3] = k1 ^ UINT64CONST(0x7465646279746573);
+	}
+
+	*extra = key;
+
+	return true;
+}
+
+void
+pgan_assign_pseudonym_key(const char *newval, void *extra)
+{
+	if (extra != NULL)
+		pgan_sip_key = *((pganSipKey *) extra);
+	else
+		memset(&pgan_sip_key, 0, sizeof(pganSipKey));
+}
+
+/*
+ * Return the state of the given pseudonymization function call site,
+ * building it if needed.
+ */
+static pganPseudoState *
+pgan_get_pseudo_state(FunctionCallInfo fcinfo)
+{
+	pganPseudoState *state = (pganPseudoState *) fcinfo->flinfo->fn_extra;
+	Oid			argtype;
+
+	if (state != NULL)
+		return state;
+
+	argtype = get_fn_expr_argtype(fcinfo->flinfo, 0);
+	if (!OidIsValid(argtype))
+		elog(ERROR, "could not determine the input data type");
+
+	state = MemoryContextAllocZero(fcinfo->flinfo->fn_mcxt,
+								   sizeof(pganPseudoState));
+
+	switch (getBaseType(argtype))
+	{
+		case INT8OID:
+			state->input = PGAN_INPUT_INT8;
+			break;
+		case UUIDOID:
+			state->input = PGAN_INPUT_UUID;
+			break;
+		default:
+			state->input = PGAN_INPUT_VARLENA;
+			break;
+	}
+
+	fcinfo->flinfo->fn_extra = state;
+
+	return state;
+}
+
+/*
+ * Hash the first argument of the pseudonymization function with SipHash, in
+ * its 64 bits or 128 bits (if wide is true) version.  The function's fn_extra
+ * is used to cache the argument type.
+ */
+void
+pgan_pseudo_hash(FunctionCallInfo fcinfo, bool wide, uint64 *hash)
+{
+	pganPseudoState *state;
+
+	if (!pgan_sip_key.valid)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_anonymize.pseudonym_key is not set"),
+				 errhint("Set it to %d random hexadecimal digits in the server configuration.",
+						 PGAN_KEY_LEN * 2)));
+
+	state = pgan_get_pseudo_state(fcinfo);
+
+	switch (state->input)
+	{
+		case PGAN_INPUT_VARLENA:
+			{
+				text	   *value = PG_GETARG_TEXT_PP(0);
+
+				pgan_siphash((unsigned char *) VARDATA_ANY(value),
+							 VARSIZE_ANY_EXHDR(value), wide, hash);
+				break;
+			}
+		case PGAN_INPUT_INT8:
+			{
+				unsigned char buf[8];
+
+				pgan_store64(buf, (uint64) PG_GETARG_INT64(0));
+				pgan_siphash(buf, sizeof(buf), wide, hash);
+				break;
+			}
+		case PGAN_INPUT_UUID:
+			pgan_siphash(PG_GETARG_UUID_P(0)->data, UUID_LEN, wide, hash);
+			break;
+	}
+}
+
+/*
+ * Cache the given alphabet of pg_anonymize_pseudonym_text() in the state,
+ * unless it's already the cached one.  It must contain between 2 and 128
+ * distinct ASCII characters.
+ */
+static void
+pgan_set_alphabet(pganPseudoState *state, text *alphabet)
+{
+	const char *p = VARDATA_ANY(alphabet);
+	int			len = VARSIZE_ANY_EXHDR(alphabet);
+	bits8		seen[16];
+	uint64		range;
+	int			i;
+
+	if (state->alphalen != 0 && state->alphalen == len &&
+		memcmp(state->alphabet, p, len) == 0)
+		return;
+
+	state->alphalen = 0;
+
+	if (len < 2)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("alphabet must contain at least 2 characters")));
+
+	memset(seen, 0, sizeof(seen));
+	for (i = 0; i < len; i++)
+	{
+		unsigned char c = (unsigned char) p[i];
+
+		if (IS_HIGHBIT_SET(c))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("only ASCII characters can be used in the alphabet")));
+
+		if (seen[c >> 3] & (1 << (c & 7)))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("alphabet must not contain duplicate characters")));
+
+		seen[c >> 3] |= (1 << (c & 7));
+	}
+
+	state->perword = 0;
+	for (range = len; range <= PGAN_ALPHABET_MAX_RANGE; range *= len)
+		state->perword++;
+
+	memcpy(state->alphabet, p, len);
+	state->alphalen = len;
+}
+
+/*
+ * pg_anonymize_pseudonym(value text|bytea|bigint|uuid)
+ *
+ * Return a bigint pseudonym of the value, computed with a 64 bits keyed
+ * SipHash.
+ */
+Datum
+pg_anonymize_pseudonym(PG_FUNCTION_ARGS)
+{
+	uint64		hash;
+
+	pgan_pseudo_hash(fcinfo, false, &hash);
+
+	PG_RETURN_INT64((int64) hash);
+}
+
+/*
+ * pg_anonymize_pseudonym_uuid(value text|bytea|bigint|uuid)
+ *
+ * Return a version 4 uuid pseudonym of the value, computed with a 128 bits
+ * keyed SipHash, 122 bits of which are kept.
+ */
+Datum
+pg_anonymize_pseudonym_uuid(PG_FUNCTION_ARGS)
+{
+	uint64		hash[2];
+	pg_uuid_t  *result;
+
+	pgan_pseudo_hash(fcinfo, true, hash);
+
+	result = (pg_uuid_t *) palloc(sizeof(pg_uuid_t));
+	pgan_store64(result->data, hash[0]);
+	pgan_store64(result->data + 8, hash[1]);
+
+	/* Set the version and variant bits, see RFC 9562. */
+	result->data[6] = (result->data[6] & 0x0f) | 0x40;
+	result->data[8] = (result->data[8] & 0x3f) | 0x80;
+
+	PG_RETURN_UUID_P(result);
+}
+
+/*
+ * pg_anonymize_pseudonym_text(value text|bytea|bigint|uuid,
+ *							   length int DEFAULT 16,
+ *							   alphabet text DEFAULT '0123456789abc...xyz')
+ *
+ * Return a pseudonym of the value made of length characters of the given
+ * alphabet.  The characters are extracted from a 128 bits keyed SipHash,
+ * extended as needed for long pseudonyms or big alphabets by hashing that
+ * hash with a counter.
+ */
+Datum
+pg_anonymize_pseudonym_text(PG_FUNCTION_ARGS)
+{
+	int32		length = PG_GETARG_INT32(1);
+	pganPseudoState *state;
+	uint64		hash[2];
+	uint64		word = 0;
+	int			avail = 0;
+	int			nwords = 0;
+	text	   *result;
+	char	   *dst;
+	int			i;
+
+	if (length < 1 || length > PGAN_PSEUDONYM_MAX_LEN)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("pseudonym length must be between 1 and %d",
+						PGAN_PSEUDONYM_MAX_LEN)));
+
+	pgan_pseudo_hash(fcinfo, true, hash);
+
+	state = pgan_get_pseudo_state(fcinfo);
+	pgan_set_alphabet(state, PG_GETARG_TEXT_PP(2));
+
+	result = (text *) palloc(VARHDRSZ + length);
+	SET_VARSIZE(result, VARHDRSZ + length);
+	dst = VARDATA(result);
+
+	for (i = 0; i < length; i++)
+	{
+		if (avail == 0)
+		{
+			if (nwords < 2)
+				word = hash[nwords];
+			else
+			{
+				unsigned char block[24];
+
+				pgan_store64(block, hash[0]);
+				pgan_store64(block + 8, hash[1]);
+				pgan_store64(block + 16, (uint64) nwords);
+				pgan_siphash(block, sizeof(block), false, &word);
+			}
+
+			nwords++;
+			avail = state->perword;
+		}
+
+		dst[i] = state->alphabet[word % state->alphalen];
+		word /= state->alphalen;
+		avail--;
+	}
+
+	PG_RETURN_TEXT_P(result);
+}
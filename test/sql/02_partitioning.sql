@@ -30,7 +30,8 @@ COPY t_part_list_2 TO STDOUT;
 SET pg_anonymize.enabled = 'on';
 SET pg_anonymize.inherit_labels = false;
 
---should see anonymized data when selecting from root partition
+--should see anonymized data when selecting from root partition, with the
+-- partitions' own security labels
 SELECT * FROM t_part_list ORDER BY id;
 COPY t_part_list TO STDOUT;
 -- but original data from any leaf partition when label inheritance is disabled
@@ -75,7 +76,8 @@ COPY t_part_range_3_5 TO STDOUT;
 SET pg_anonymize.enabled = 'on';
 SET pg_anonymize.inherit_labels = false;
 
---should see anonymized data when selecting from root partition
+--should see anonymized data when selecting from root partition, with the
+-- partitions' own security labels
 SELECT * FROM t_part_range ORDER BY id;
 COPY t_part_range TO STDOUT;
 -- but original data from any leaf partition when label inheritance is disabled
@@ -135,7 +137,8 @@ COPY t_part_nest_23_3 TO STDOUT;
 SET pg_anonymize.enabled = 'on';
 SET pg_anonymize.inherit_labels = false;
 
--- should see anonymized data when selecting from root partition
+-- should see anonymized data when selecting from root partition, with the
+-- partitions' own security labels
 SELECT * FROM t_part_nest ORDER BY id;
 COPY t_part_nest TO STDOUT;
 -- but original data from any leaf / subpartition when label inheritance is
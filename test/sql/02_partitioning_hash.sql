@@ -28,7 +28,8 @@ COPY t_part_hash_1 TO STDOUT;
 SET pg_anonymize.enabled = 'on';
 SET pg_anonymize.inherit_labels = false;
 
---should see anonymized data when selecting from root partition
+--should see anonymized data when selecting from root partition, with the
+-- partitions' own security labels
 SELECT * FROM t_part_hash ORDER BY id;
 COPY t_part_hash TO STDOUT;
 -- but original data from any leaf partition when label inheritance is disabled
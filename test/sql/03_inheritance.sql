@@ -37,7 +37,8 @@ COPY t_inh_ab_c TO STDOUT;
 SET pg_anonymize.enabled = 'on';
 SET pg_anonymize.inherit_labels = false;
 
---should see anonymized data when selecting from parent table
+--should see anonymized data when selecting from parent table, with the
+-- children's own security labels
 SELECT * FROM t_inh ORDER BY id;
 COPY t_inh TO STDOUT;
 -- but original data from any leaf table when label inheritance is disabled
@@ -60,6 +61,27 @@ COPY t_inh_b TO STDOUT;
 SELECT * FROM t_inh_ab_c ORDER BY id;
 COPY t_inh_ab_c TO STDOUT;
 
+-- ONLY should only see the parent rows
+SELECT * FROM ONLY t_inh ORDER BY id;
+
+-- security labels of children are used even if the parent doesn't have any
+CREATE TABLE t_inh_nolabel(id integer, val text);
+CREATE TABLE t_inh_nolabel_1 () INHERITS (t_inh_nolabel);
+CREATE TABLE t_inh_nolabel_2 (extra text) INHERITS (t_inh_nolabel);
+INSERT INTO t_inh_nolabel SELECT 1, 'val 1';
+INSERT INTO t_inh_nolabel_1 SELECT 2, 'val 2';
+INSERT INTO t_inh_nolabel_2 SELECT 3, 'val 3', 'extra 3';
+SECURITY LABEL FOR pg_anonymize
+    ON COLUMN public.t_inh_nolabel_1.val IS $$'child hidden'::text$$;
+SELECT * FROM t_inh_nolabel ORDER BY id;
+SELECT * FROM ONLY t_inh_nolabel ORDER BY id;
+-- but they can't reference columns that don't exist in the parent
+SECURITY LABEL FOR pg_anonymize
+    ON COLUMN public.t_inh_nolabel_2.val IS $$extra$$;
+SELECT * FROM t_inh_nolabel ORDER BY id;
+SELECT * FROM ONLY t_inh_nolabel ORDER BY id;
+SELECT * FROM t_inh_nolabel_2 ORDER BY id;
+
 -- cleanup
 SET pg_anonymize.enabled = 'on';
 SECURITY LABEL FOR pg_anonymize ON ROLE :current_user IS NULL;
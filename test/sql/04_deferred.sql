@@ -0,0 +1,63 @@
+LOAD 'pg_anonymize';
+
+-- function reporting each evaluation
+CREATE FUNCTION public.noisy_mask(val text) RETURNS text
+LANGUAGE plpgsql IMMUTABLE COST 1 AS
+$$
+BEGIN
+    RAISE NOTICE 'masking %', val;
+    RETURN 'masked';
+END;
+$$;
+
+CREATE TABLE t_deferred(id integer, val text);
+INSERT INTO t_deferred SELECT i, 'val ' || i FROM generate_series(1, 5) i;
+
+SET pg_anonymize.check_labels = off;
+SECURITY LABEL FOR pg_anonymize
+    ON COLUMN public.t_deferred.val IS $$public.noisy_mask(val)$$;
+RESET pg_anonymize.check_labels;
+
+CREATE TABLE t_deferred_acl(id integer, val text, secret text);
+INSERT INTO t_deferred_acl VALUES (1, 'val 1', 'secret 1');
+SECURITY LABEL FOR pg_anonymize
+    ON COLUMN public.t_deferred_acl.val IS $$val || ' ' || secret$$;
+
+-- mask our own user
+SELECT current_user \gset
+SECURITY LABEL FOR pg_anonymize ON ROLE :current_user IS 'anonymize';
+
+-- anonymized column not referenced, no evaluation
+SELECT id FROM t_deferred ORDER BY id LIMIT 2;
+-- only evaluated for the returned rows
+SELECT * FROM t_deferred ORDER BY id LIMIT 2;
+SELECT id, val || '!' AS v FROM t_deferred ORDER BY id DESC LIMIT 2 OFFSET 1;
+
+SET pg_anonymize.defer_evaluation = off;
+-- evaluated for all rows
+SELECT * FROM t_deferred ORDER BY id LIMIT 2;
+RESET pg_anonymize.defer_evaluation;
+
+-- anonymized column used for sorting, evaluated for all rows
+SELECT * FROM t_deferred ORDER BY val, id LIMIT 2;
+
+-- the columns referenced by the security labels need the SELECT privilege
+CREATE ROLE pgan_deferred_user;
+GRANT SELECT (id, val) ON t_deferred_acl TO pgan_deferred_user;
+SECURITY LABEL FOR pg_anonymize ON ROLE pgan_deferred_user IS 'anonymize';
+SET ROLE pgan_deferred_user;
+SELECT id FROM t_deferred_acl ORDER BY id LIMIT 1;
+SELECT id, val FROM t_deferred_acl ORDER BY id LIMIT 1;
+SET pg_anonymize.defer_evaluation = off;
+SELECT id, val FROM t_deferred_acl ORDER BY id LIMIT 1;
+RESET pg_anonymize.defer_evaluation;
+RESET ROLE;
+GRANT SELECT (secret) ON t_deferred_acl TO pgan_deferred_user;
+SET ROLE pgan_deferred_user;
+SELECT id, val FROM t_deferred_acl ORDER BY id LIMIT 1;
+RESET ROLE;
+
+-- cleanup
+SECURITY LABEL FOR pg_anonymize ON ROLE :current_user IS NULL;
+DROP TABLE t_deferred_acl;
+DROP ROLE pgan_deferred_user;
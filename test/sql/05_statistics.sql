@@ -0,0 +1,36 @@
+LOAD 'pg_anonymize';
+
+CREATE TABLE t_stats(id integer, val text);
+INSERT INTO t_stats SELECT i, (i % 4)::text || ' secret' FROM generate_series(1, 1000) i;
+
+SET pg_anonymize.label_statistics = on;
+
+-- should create a statistics object
+SECURITY LABEL FOR pg_anonymize
+    ON COLUMN public.t_stats.val IS $$pg_catalog.substr(val, 1, 1)$$;
+SELECT stxname = format('pgan_%s_2_stat', 't_stats'::regclass::oid) AS ok
+FROM pg_statistic_ext
+WHERE stxrelid = 't_stats'::regclass;
+
+-- and gather statistics for the anonymized data
+ANALYZE t_stats;
+SELECT expr, n_distinct, most_common_vals
+FROM pg_stats_ext_exprs
+WHERE tablename = 't_stats';
+
+-- should not create a statistics object for a constant expression
+SECURITY LABEL FOR pg_anonymize
+    ON COLUMN public.t_stats.val IS $$'hidden'::text$$;
+SELECT stxname = format('pgan_%s_2_stat', 't_stats'::regclass::oid) AS ok
+FROM pg_statistic_ext
+WHERE stxrelid = 't_stats'::regclass;
+
+-- should drop the statistics object when the label is removed
+SECURITY LABEL FOR pg_anonymize
+    ON COLUMN public.t_stats.val IS $$pg_catalog.substr(val, 1, 1)$$;
+SECURITY LABEL FOR pg_anonymize ON COLUMN public.t_stats.val IS NULL;
+SELECT stxname = format('pgan_%s_2_stat', 't_stats'::regclass::oid) AS ok
+FROM pg_statistic_ext
+WHERE stxrelid = 't_stats'::regclass;
+
+RESET pg_anonymize.label_statistics;
@@ -0,0 +1,89 @@
+LOAD 'pg_anonymize';
+CREATE EXTENSION pg_anonymize;
+
+CREATE TABLE t_idx(id integer, val text, other text);
+INSERT INTO t_idx SELECT i, 'val ' || i, 'other ' || i
+FROM generate_series(1, 1000) i;
+
+SET pg_anonymize.label_indexes = on;
+
+-- should create an expression index
+SECURITY LABEL FOR pg_anonymize
+    ON COLUMN public.t_idx.val IS $$pg_catalog.upper(val)$$;
+-- but not for a constant expression
+SECURITY LABEL FOR pg_anonymize
+    ON COLUMN public.t_idx.other IS $$'hidden'::text$$;
+
+SELECT regexp_replace(pg_get_indexdef(indexrelid), 'pgan_\d+_2_idx',
+    'pgan_XXX_2_idx') AS indexdef
+FROM pg_index
+WHERE indrelid = 't_idx'::regclass;
+
+SELECT relid, attname, label, index_eligible, reason,
+    index_name IS NOT NULL AS has_index
+FROM pg_anonymize_label_indexes()
+WHERE relid = 't_idx'::regclass
+ORDER BY attname;
+
+-- should drop the index when the expression isn't immutable anymore
+SECURITY LABEL FOR pg_anonymize
+    ON COLUMN public.t_idx.val IS $$pg_catalog.md5(pg_catalog.random()::text)$$;
+SELECT count(*) FROM pg_index WHERE indrelid = 't_idx'::regclass;
+SELECT relid, attname, label, index_eligible, reason,
+    index_name IS NOT NULL AS has_index
+FROM pg_anonymize_label_indexes()
+WHERE relid = 't_idx'::regclass
+ORDER BY attname;
+
+-- or when the label is removed
+SECURITY LABEL FOR pg_anonymize
+    ON COLUMN public.t_idx.val IS $$pg_catalog.upper(val)$$;
+SELECT count(*) FROM pg_index WHERE indrelid = 't_idx'::regclass;
+
+-- the index can be used for the queries of anonymized roles
+CREATE FUNCTION public.explain_idx(query text) RETURNS SETOF text
+LANGUAGE plpgsql AS
+$$
+DECLARE
+    line text;
+BEGIN
+    FOR line IN EXECUTE 'EXPLAIN (COSTS OFF) ' || query
+    LOOP
+        RETURN NEXT regexp_replace(line, 'pgan_\d+_2_idx', 'pgan_XXX_2_idx');
+    END LOOP;
+END;
+$$;
+SELECT current_user \gset
+SECURITY LABEL FOR pg_anonymize ON ROLE :current_user IS 'anonymize';
+SET enable_seqscan = off;
+SET enable_bitmapscan = off;
+SELECT * FROM public.explain_idx($$SELECT id FROM t_idx WHERE val = 'VAL 42'$$);
+SELECT id, val FROM t_idx WHERE val = 'VAL 42';
+RESET enable_seqscan;
+RESET enable_bitmapscan;
+SECURITY LABEL FOR pg_anonymize ON ROLE :current_user IS NULL;
+
+SECURITY LABEL FOR pg_anonymize ON COLUMN public.t_idx.val IS NULL;
+SELECT count(*) FROM pg_index WHERE indrelid = 't_idx'::regclass;
+
+RESET pg_anonymize.label_indexes;
+
+-- security labels that can't be analyzed are skipped
+SET pg_anonymize.check_labels = off;
+SECURITY LABEL FOR pg_anonymize
+    ON COLUMN public.t_idx.id IS $$public.pgan_no_such_function(id)$$;
+RESET pg_anonymize.check_labels;
+SELECT relid, attname, index_eligible
+FROM pg_anonymize_label_indexes()
+WHERE relid = 't_idx'::regclass
+ORDER BY attname;
+SECURITY LABEL FOR pg_anonymize ON COLUMN public.t_idx.id IS NULL;
+
+-- only superusers can call it by default
+CREATE ROLE pgan_idx_user;
+SET ROLE pgan_idx_user;
+SELECT count(*) FROM pg_anonymize_label_indexes();
+RESET ROLE;
+DROP ROLE pgan_idx_user;
+
+DROP EXTENSION pg_anonymize;
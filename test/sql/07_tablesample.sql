@@ -0,0 +1,38 @@
+LOAD 'pg_anonymize';
+
+CREATE TABLE t_sample(id integer, val text);
+INSERT INTO t_sample SELECT i, 'val ' || i FROM generate_series(1, 3) i;
+CREATE TABLE t_sample_nolabel(id integer, val text);
+INSERT INTO t_sample_nolabel SELECT i, 'val ' || i FROM generate_series(1, 3) i;
+
+SECURITY LABEL FOR pg_anonymize
+    ON COLUMN public.t_sample.val IS $$'hidden'::text$$;
+
+-- mask our own user
+SELECT current_user \gset
+SECURITY LABEL FOR pg_anonymize ON ROLE :current_user IS 'anonymize';
+
+-- TABLESAMPLE should be preserved
+SELECT * FROM t_sample TABLESAMPLE SYSTEM (0);
+SELECT * FROM t_sample TABLESAMPLE SYSTEM (100) ORDER BY id;
+SELECT * FROM t_sample TABLESAMPLE BERNOULLI (0) REPEATABLE (42);
+SELECT count(*) FROM t_sample TABLESAMPLE SYSTEM (0);
+
+-- COPY TO is sampled on demand, even for tables without security labels
+SET pg_anonymize.copy_tablesample = 'SYSTEM (0)';
+COPY t_sample TO STDOUT;
+COPY t_sample_nolabel TO STDOUT;
+SET pg_anonymize.copy_tablesample = 'BERNOULLI (100) REPEATABLE (42)';
+COPY t_sample TO STDOUT;
+COPY t_sample_nolabel (val) TO STDOUT;
+RESET pg_anonymize.copy_tablesample;
+COPY t_sample TO STDOUT;
+
+-- only a TABLESAMPLE clause is accepted
+SET pg_anonymize.copy_tablesample = 'SYSTEM (1) WHERE true';
+SET pg_anonymize.copy_tablesample = 'SYSTEM ((SELECT 1))';
+SET pg_anonymize.copy_tablesample = 'SYSTEM (1) REPEATABLE (random())';
+SET pg_anonymize.copy_tablesample = 'SYSTEM (1';
+
+-- cleanup
+SECURITY LABEL FOR pg_anonymize ON ROLE :current_user IS NULL;
@@ -0,0 +1,54 @@
+LOAD 'pg_anonymize';
+
+CREATE TABLE t_explain(id integer, val text, secret text);
+INSERT INTO t_explain SELECT i, 'val ' || i, 'secret ' || i
+    FROM generate_series(1, 3) i;
+
+SECURITY LABEL FOR pg_anonymize
+    ON COLUMN public.t_explain.val IS $$upper(val)$$;
+SECURITY LABEL FOR pg_anonymize
+    ON COLUMN public.t_explain.secret IS $$'hidden'::text$$;
+
+-- only keep the annotations, as the plan format depends on the major version
+CREATE FUNCTION public.explain_anonymization(query text) RETURNS SETOF text
+LANGUAGE plpgsql AS
+$$
+DECLARE
+    line text;
+    keep bool := false;
+BEGIN
+    FOR line IN EXECUTE 'EXPLAIN (ANALYZE, COSTS OFF, TIMING OFF, SUMMARY OFF, BUFFERS OFF) '
+        || query
+    LOOP
+        keep := keep OR line LIKE 'Anonymized Relation:%';
+        IF keep THEN
+            RETURN NEXT line;
+        END IF;
+    END LOOP;
+END;
+$$;
+
+-- mask our own user
+SELECT current_user \gset
+SECURITY LABEL FOR pg_anonymize ON ROLE :current_user IS 'anonymize';
+
+-- the anonymized relations and columns are shown
+EXPLAIN (COSTS OFF) SELECT * FROM t_explain;
+EXPLAIN (COSTS OFF) SELECT id, secret FROM t_explain WHERE id = 1;
+EXPLAIN (COSTS OFF) SELECT id FROM t_explain;
+
+-- with ANALYZE, the number of anonymized rows and evaluations are shown
+SELECT * FROM public.explain_anonymization('SELECT * FROM t_explain');
+SELECT * FROM public.explain_anonymization(
+    'SELECT val FROM t_explain WHERE id > 1');
+SELECT * FROM public.explain_anonymization(
+    'SELECT id, secret FROM t_explain ORDER BY id LIMIT 1');
+
+-- the inner query of CREATE TABLE AS is annotated too
+EXPLAIN (COSTS OFF) CREATE TABLE t_explain_ctas AS SELECT secret FROM t_explain;
+
+-- a subquery written by the user is never mistaken for a deferral wrapper
+EXPLAIN (COSTS OFF) SELECT * FROM (SELECT id, val FROM t_explain) pgan_deferred;
+
+-- cleanup
+SECURITY LABEL FOR pg_anonymize ON ROLE :current_user IS NULL;
@@ -0,0 +1,58 @@
+LOAD 'pg_anonymize';
+CREATE EXTENSION pg_anonymize;
+
+-- character class masks
+SELECT pg_anonymize_mask_digits('+886 1234 5678');
+SELECT pg_anonymize_mask_digits('+886 1234 5678', '#');
+SELECT pg_anonymize_mask_letters('Nice Customer 42');
+SELECT pg_anonymize_mask_all_but_last('4111 1111 1111 1234', 4);
+SELECT pg_anonymize_mask_all_but_last('abc', 5);
+
+-- partial masks
+SELECT pg_anonymize_partial('Customer', 1, '*****', 0);
+SELECT pg_anonymize_partial('Customer', 2, '***', 2);
+SELECT pg_anonymize_partial('Cu', 1, '*****', 1);
+
+-- email and phone numbers
+SELECT pg_anonymize_mask_email('john.doe@example.com');
+SELECT pg_anonymize_mask_email('no-at-sign');
+SELECT pg_anonymize_mask_email('@example.com');
+SELECT pg_anonymize_mask_phone('+886 1234 5678');
+SELECT pg_anonymize_mask_phone('+886 1234 5678', 4, '*');
+
+-- fixed-width redaction
+SELECT pg_anonymize_redact('secret'), pg_anonymize_redact('a much longer secret', 3);
+
+-- invalid parameters
+SELECT pg_anonymize_mask_digits('123', '');
+SELECT pg_anonymize_mask_digits('123', 'XY');
+SELECT pg_anonymize_redact('secret', -1);
+
+-- strings of all lengths, to exercise both the SIMD and the scalar code
+SELECT i, s
+FROM generate_series(0, 200) i,
+    LATERAL (SELECT left(repeat('Ab 12-cD/9:z@', 20), i) AS s) t
+WHERE pg_anonymize_mask_digits(s) <> regexp_replace(s, '\d', 'X', 'g')
+    OR pg_anonymize_mask_letters(s, '?') <> regexp_replace(s, '[a-zA-Z]', '?', 'g')
+    OR pg_anonymize_mask_all_but_last(s, 3) <>
+        repeat('X', greatest(length(s) - 3, 0)) || right(s, 3)
+    OR pg_anonymize_mask_phone(s, 0) <> regexp_replace(s, '\d', 'X', 'g');
+
+-- usable in security labels
+CREATE TABLE t_mask(id integer, phone text, email text);
+INSERT INTO t_mask VALUES (1, '+886 1234 5678', 'john.doe@example.com');
+SECURITY LABEL FOR pg_anonymize ON COLUMN public.t_mask.phone
+    IS $$public.pg_anonymize_mask_phone(phone)$$;
+SECURITY LABEL FOR pg_anonymize ON COLUMN public.t_mask.email
+    IS $$public.pg_anonymize_mask_email(email)$$;
+
+-- mask our own user
+SELECT current_user \gset
+SECURITY LABEL FOR pg_anonymize ON ROLE :current_user IS 'anonymize';
+
+SELECT * FROM t_mask;
+
+-- cleanup
+SECURITY LABEL FOR pg_anonymize ON ROLE :current_user IS NULL;
+DROP TABLE t_mask;
+DROP EXTENSION pg_anonymize;
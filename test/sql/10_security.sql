@@ -29,6 +29,29 @@ $_$ LANGUAGE plpgsql COST 0.0000000000000000000001;
 
 SELECT * FROM customer_security WHERE leak_info(name, country);
 
+-- role switching should be honoured
+CREATE ROLE pgan_plain_role;
+GRANT SELECT ON customer_security TO pgan_plain_role;
+SET ROLE pgan_plain_role;
+SELECT * FROM customer_security;
+RESET ROLE;
+SELECT * FROM customer_security;
+DROP OWNED BY pgan_plain_role;
+DROP ROLE pgan_plain_role;
+
+-- the inner query of EXPLAIN, CREATE TABLE AS and DECLARE CURSOR is
+-- anonymized too
+EXPLAIN (COSTS OFF) SELECT * FROM customer_security WHERE name = 'Secret Name';
+CREATE TABLE customer_security_ctas AS SELECT * FROM customer_security;
+SELECT * FROM customer_security_ctas;
+SELECT * INTO customer_security_into FROM customer_security;
+SELECT * FROM customer_security_into;
+BEGIN;
+DECLARE c_security CURSOR FOR SELECT * FROM customer_security;
+FETCH 1 FROM c_security;
+COMMIT;
+DROP TABLE customer_security_ctas, customer_security_into;
+
 -- cleanup
 SET pg_anonymize.enabled = 'on';
 SECURITY LABEL FOR pg_anonymize ON ROLE :current_user IS NULL;
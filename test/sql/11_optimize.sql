@@ -0,0 +1,97 @@
+LOAD 'pg_anonymize';
+CREATE EXTENSION pg_anonymize;
+SET TimeZone = 'America/Sao_Paulo';
+
+-- the specialized implementations give the same result as the original
+-- expressions, for strings of all lengths
+SELECT i, s
+FROM generate_series(0, 200) i,
+    LATERAL (SELECT left(repeat('Ab 12-cD/9:z@(x)', 15), i) AS s) t
+WHERE pg_anonymize_replace_chars(s, '0123456789', 'X') <>
+        regexp_replace(s, '[0-9]', 'X', 'g')
+    OR pg_anonymize_replace_chars(s, '0123456789', '', true) <>
+        regexp_replace(s, '[^0-9]', '', 'g')
+    OR pg_anonymize_replace_chars(s, 'abcdefghijklmnopqrstuvwxyz', '<>') <>
+        regexp_replace(s, '[a-z]', '<>', 'g')
+    OR pg_anonymize_replace_chars(s, '()/: ', '', false) <>
+        regexp_replace(s, '[()/: ]', '', 'g')
+    OR pg_anonymize_prefix(s, 3, '***') <> substr(s, 1, 3) || '***'
+    OR pg_anonymize_prefix(s, 0, '') <> left(s, 0) || '';
+
+-- including the dates that can't be truncated directly
+SELECT d, u
+FROM (SELECT '2000-01-01'::date + i AS d FROM generate_series(-800, 800) i
+      UNION ALL
+      SELECT unnest('{infinity, -infinity, 0044-03-15 BC, 0001-01-01,
+                      9999-12-31, 10000-01-31, 2000-02-29}'::date[])) dates,
+    unnest('{year, Quarter, MONTH, week, day, decade}'::text[]) u
+WHERE pg_anonymize_date_trunc(u, d) IS DISTINCT FROM date_trunc(u, d)::date;
+
+-- invalid parameters
+SELECT pg_anonymize_replace_chars('abc', chr(200), 'X');
+SELECT pg_anonymize_prefix('abc', -1, 'X');
+
+CREATE TABLE t_opt(id integer, phone text, last_name text, birth date,
+    other text);
+INSERT INTO t_opt VALUES
+    (1, '+886 1234 5678', 'Customer', '1970-03-04', 'a1b2'),
+    (2, '06 12 34 56 78', 'Doe', '2000-12-31', '99'),
+    (3, NULL, '', 'infinity', NULL);
+CREATE TABLE t_opt_many AS
+    SELECT i AS id, '+886 ' || i AS phone, 'name ' || i AS last_name,
+        '2000-01-01'::date + i AS birth, 'other ' || i AS other
+    FROM generate_series(1, 1000) i;
+
+SECURITY LABEL FOR pg_anonymize ON COLUMN public.t_opt.phone
+    IS $$regexp_replace(phone, '[0-9]', 'X', 'g')$$;
+SECURITY LABEL FOR pg_anonymize ON COLUMN public.t_opt.last_name
+    IS $$substr(last_name, 1, 1) || '*****'$$;
+SECURITY LABEL FOR pg_anonymize ON COLUMN public.t_opt.birth
+    IS $$date_trunc('month', birth)::date$$;
+-- not recognized, only the first match is replaced
+SECURITY LABEL FOR pg_anonymize ON COLUMN public.t_opt.other
+    IS $$regexp_replace(other, '[0-9]', 'X')$$;
+SECURITY LABEL FOR pg_anonymize ON COLUMN public.t_opt_many.phone
+    IS $$regexp_replace(phone, '[^0-9 ]', '', 'g')$$;
+SECURITY LABEL FOR pg_anonymize ON COLUMN public.t_opt_many.last_name
+    IS $$left(last_name, 2) || '...'$$;
+SECURITY LABEL FOR pg_anonymize ON COLUMN public.t_opt_many.birth
+    IS $$date_trunc('quarter', birth)::date$$;
+SECURITY LABEL FOR pg_anonymize ON COLUMN public.t_opt_many.other
+    IS $$regexp_replace(other, '[a-z]', '#', 'g')$$;
+
+-- what the original expressions return
+CREATE TABLE t_opt_expected AS
+    SELECT id, regexp_replace(phone, '[^0-9 ]', '', 'g') AS phone,
+        left(last_name, 2) || '...' AS last_name,
+        date_trunc('quarter', birth)::date AS birth,
+        regexp_replace(other, '[a-z]', '#', 'g') AS other
+    FROM t_opt_many;
+
+-- mask our own user
+SELECT current_user \gset
+SECURITY LABEL FOR pg_anonymize ON ROLE :current_user IS 'anonymize';
+
+-- the recognized security labels are evaluated with the specialized functions
+EXPLAIN (COSTS OFF) SELECT * FROM t_opt;
+SELECT * FROM t_opt ORDER BY id;
+SELECT count(*) FROM t_opt_many o JOIN t_opt_expected e USING (id)
+WHERE (o.phone, o.last_name, o.birth, o.other)
+    IS DISTINCT FROM (e.phone, e.last_name, e.birth, e.other);
+
+-- also when the evaluation is deferred and for COPY TO
+SELECT * FROM t_opt ORDER BY id LIMIT 2;
+COPY t_opt TO STDOUT;
+
+-- but not if disabled
+SET pg_anonymize.optimize_labels = off;
+EXPLAIN (COSTS OFF) SELECT id, phone, last_name FROM t_opt;
+RESET pg_anonymize.optimize_labels;
+
+-- cleanup
+SECURITY LABEL FOR pg_anonymize ON ROLE :current_user IS NULL;
+DROP TABLE t_opt;
+DROP TABLE t_opt_many;
+DROP TABLE t_opt_expected;
+DROP EXTENSION pg_anonymize;
+RESET TimeZone;
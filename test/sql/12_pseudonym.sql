@@ -0,0 +1,83 @@
+LOAD 'pg_anonymize';
+CREATE EXTENSION pg_anonymize;
+
+-- a key is required
+SELECT pg_anonymize_pseudonym('john');
+
+-- invalid keys
+SET pg_anonymize.pseudonym_key = 'not a key';
+SET pg_anonymize.pseudonym_key = '000102030405060708090a0b0c0d0e0';
+SET pg_anonymize.pseudonym_key = '000102030405060708090a0b0c0d0e0g';
+
+-- SipHash-2-4 reference vectors
+SET pg_anonymize.pseudonym_key = '000102030405060708090A0B0C0D0E0F';
+SELECT to_hex(pg_anonymize_pseudonym(''::bytea)) AS empty,
+    to_hex(pg_anonymize_pseudonym('\x000102030405060708090a0b0c0d0e'::bytea)) AS bytes;
+SELECT pg_anonymize_pseudonym_uuid(''::bytea);
+
+-- text and bytea hash the same bytes, integers are hashed as 8 little-endian
+-- bytes and uuid as their 16 bytes
+SELECT pg_anonymize_pseudonym('john') = pg_anonymize_pseudonym('john'::bytea) AS text_bytea,
+    pg_anonymize_pseudonym(42) = pg_anonymize_pseudonym(42::bigint) AS int4_int8,
+    pg_anonymize_pseudonym(42) = pg_anonymize_pseudonym('\x2a00000000000000'::bytea) AS int8_bytes,
+    pg_anonymize_pseudonym_uuid('a3817f04-ba25-48e6-adf6-7214c7550293'::uuid) =
+        pg_anonymize_pseudonym_uuid('\xa3817f04ba2548e6adf67214c7550293'::bytea) AS uuid_bytes;
+
+-- output formats
+SELECT pg_anonymize_pseudonym(42), pg_anonymize_pseudonym_uuid(42),
+    pg_anonymize_pseudonym_text(42);
+SELECT pg_anonymize_pseudonym_text('john', 8, 'ABCDEF');
+SELECT pg_anonymize_pseudonym_text('john', 100, '01');
+
+-- longer pseudonyms start with the shorter ones, and only use the alphabet
+SELECT i
+FROM generate_series(1, 200) i
+WHERE left(pg_anonymize_pseudonym_text('john', 200), i) <>
+    pg_anonymize_pseudonym_text('john', i);
+SELECT i
+FROM generate_series(1, 1000) i
+WHERE pg_anonymize_pseudonym_text(i, 20, 'xyz-') !~ '^[xyz-]{20}$';
+
+-- the pseudonyms depend on the key
+SET pg_anonymize.pseudonym_key = 'fffefdfcfbfaf9f8f7f6f5f4f3f2f1f0';
+SELECT pg_anonymize_pseudonym('john');
+SET pg_anonymize.pseudonym_key = '000102030405060708090a0b0c0d0e0f';
+SELECT pg_anonymize_pseudonym('john');
+
+-- invalid parameters
+SELECT pg_anonymize_pseudonym_text('john', 0);
+SELECT pg_anonymize_pseudonym_text('john', 1025);
+SELECT pg_anonymize_pseudonym_text('john', 8, '');
+SELECT pg_anonymize_pseudonym_text('john', 8, 'a');
+SELECT pg_anonymize_pseudonym_text('john', 8, 'abca');
+SELECT pg_anonymize_pseudonym_text('john', 8, 'ab' || chr(200));
+
+-- usable in security labels, and joins on the pseudonyms still work
+CREATE TABLE t_customer(id bigint, name text);
+INSERT INTO t_customer VALUES (1, 'Alice'), (2, 'Bob'), (3, 'Carol');
+CREATE TABLE t_order(id integer, customer_id bigint, amount integer);
+INSERT INTO t_order VALUES (1, 1, 10), (2, 1, 20), (3, 2, 5), (4, 3, 7),
+    (5, 3, 8);
+SECURITY LABEL FOR pg_anonymize ON COLUMN public.t_customer.id
+    IS $$public.pg_anonymize_pseudonym(id)$$;
+SECURITY LABEL FOR pg_anonymize ON COLUMN public.t_customer.name
+    IS $$public.pg_anonymize_pseudonym_text(name, 8)$$;
+SECURITY LABEL FOR pg_anonymize ON COLUMN public.t_order.customer_id
+    IS $$public.pg_anonymize_pseudonym(customer_id)$$;
+
+-- mask our own user
+SELECT current_user \gset
+SECURITY LABEL FOR pg_anonymize ON ROLE :current_user IS 'anonymize';
+
+SELECT c.id, c.name, sum(o.amount) AS total
+FROM t_customer c
+JOIN t_order o ON o.customer_id = c.id
+GROUP BY c.id, c.name
+ORDER BY total;
+
+-- cleanup
+SECURITY LABEL FOR pg_anonymize ON ROLE :current_user IS NULL;
+DROP TABLE t_customer;
+DROP TABLE t_order;
+DROP EXTENSION pg_anonymize;
+RESET pg_anonymize.pseudonym_key;
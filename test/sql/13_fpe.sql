@@ -0,0 +1,84 @@
+LOAD 'pg_anonymize';
+CREATE EXTENSION pg_anonymize;
+
+-- a key is required
+SELECT pg_anonymize_fpe_encrypt('0123456789');
+
+-- invalid keys
+SET pg_anonymize.encryption_key = '2B7E151628AED2A6ABF7158809CF4F';
+SET pg_anonymize.encryption_key = '2B7E151628AED2A6ABF7158809CF4F3X';
+
+-- NIST SP 800-38G FF1 samples, with AES-128, AES-192 and AES-256 keys
+SET pg_anonymize.encryption_key = '2B7E151628AED2A6ABF7158809CF4F3C';
+SELECT pg_anonymize_fpe_encrypt('0123456789') AS sample1,
+    pg_anonymize_fpe_encrypt('0123456789', tweak => '\x39383736353433323130') AS sample2,
+    pg_anonymize_fpe_encrypt('0123456789abcdefghi',
+        '0123456789abcdefghijklmnopqrstuvwxyz', '\x3737373770717273373737') AS sample3;
+SET pg_anonymize.encryption_key = '2B7E151628AED2A6ABF7158809CF4F3CEF4359D8D580AA4F';
+SELECT pg_anonymize_fpe_encrypt('0123456789') AS sample4,
+    pg_anonymize_fpe_encrypt('0123456789', tweak => '\x39383736353433323130') AS sample5,
+    pg_anonymize_fpe_encrypt('0123456789abcdefghi',
+        '0123456789abcdefghijklmnopqrstuvwxyz', '\x3737373770717273373737') AS sample6;
+SET pg_anonymize.encryption_key = '2B7E151628AED2A6ABF7158809CF4F3CEF4359D8D580AA4F7F036D6F04FC6A94';
+SELECT pg_anonymize_fpe_encrypt('0123456789') AS sample7,
+    pg_anonymize_fpe_encrypt('0123456789', tweak => '\x39383736353433323130') AS sample8,
+    pg_anonymize_fpe_encrypt('0123456789abcdefghi',
+        '0123456789abcdefghijklmnopqrstuvwxyz', '\x3737373770717273373737') AS sample9;
+SELECT pg_anonymize_fpe_decrypt('xs8a0azh2avyalyzuwd',
+    '0123456789abcdefghijklmnopqrstuvwxyz', '\x3737373770717273373737');
+
+-- the characters outside of the alphabet are kept
+SELECT pg_anonymize_fpe_encrypt('4111 1111 1111 1111'),
+    pg_anonymize_fpe_encrypt('5500-0000-0000-0004');
+
+-- decryption gives back the original value, for all the supported lengths
+SELECT a, i
+FROM (VALUES ('0123456789', 6, 32),
+        ('0123456789abcdefghijklmnopqrstuvwxyz', 4, 20),
+        ('01', 20, 112)) a(a, minlen, maxlen),
+    generate_series(minlen, maxlen) i,
+    LATERAL (SELECT left(repeat(a, 120 / length(a) + 1), i) || ' -' AS v) v
+WHERE pg_anonymize_fpe_decrypt(pg_anonymize_fpe_encrypt(v, a, 'tweak'), a,
+        'tweak') <> v
+    OR right(pg_anonymize_fpe_encrypt(v, a), 2) <> ' -';
+
+-- invalid parameters
+SELECT pg_anonymize_fpe_encrypt('12345');
+SELECT pg_anonymize_fpe_encrypt('1234-5');
+SELECT pg_anonymize_fpe_encrypt(repeat('1', 33));
+SELECT pg_anonymize_fpe_encrypt('0123456789', '');
+SELECT pg_anonymize_fpe_encrypt('0123456789', '0');
+SELECT pg_anonymize_fpe_encrypt('0123456789', '01234567890');
+SELECT pg_anonymize_fpe_encrypt('0123456789', '01' || chr(200));
+
+-- only superusers can decrypt by default
+CREATE ROLE pgan_fpe_user;
+SET ROLE pgan_fpe_user;
+SELECT pg_anonymize_fpe_encrypt('0123456789');
+SELECT pg_anonymize_fpe_decrypt('6657667009');
+RESET ROLE;
+DROP ROLE pgan_fpe_user;
+
+-- usable in security labels
+CREATE TABLE t_fpe(id integer, card text, phone text);
+INSERT INTO t_fpe VALUES (1, '4111 1111 1111 1111', '+886 1234 5678'),
+    (2, '5500-0000-0000-0004', '06 12 34 56 78');
+SECURITY LABEL FOR pg_anonymize ON COLUMN public.t_fpe.card
+    IS $$public.pg_anonymize_fpe_encrypt(card)$$;
+SECURITY LABEL FOR pg_anonymize ON COLUMN public.t_fpe.phone
+    IS $$public.pg_anonymize_fpe_encrypt(phone, tweak => '\x70686f6e65')$$;
+
+-- mask our own user
+SELECT current_user \gset
+SECURITY LABEL FOR pg_anonymize ON ROLE :current_user IS 'anonymize';
+
+SELECT * FROM t_fpe ORDER BY id;
+SELECT id, pg_anonymize_fpe_decrypt(card) AS card,
+    pg_anonymize_fpe_decrypt(phone, tweak => '\x70686f6e65') AS phone
+FROM t_fpe ORDER BY id;
+
+-- cleanup
+SECURITY LABEL FOR pg_anonymize ON ROLE :current_user IS NULL;
+DROP TABLE t_fpe;
+DROP EXTENSION pg_anonymize;
+RESET pg_anonymize.encryption_key;
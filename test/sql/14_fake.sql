@@ -0,0 +1,46 @@
+LOAD 'pg_anonymize';
+CREATE EXTENSION pg_anonymize;
+
+-- a key is required
+SELECT pg_anonymize_fake_first_name('john');
+
+SET pg_anonymize.pseudonym_key = '000102030405060708090a0b0c0d0e0f';
+
+-- the values are hashed as for the pseudonyms
+SELECT pg_anonymize_fake_first_name('john') AS first_name,
+    pg_anonymize_fake_last_name('john') AS last_name,
+    pg_anonymize_fake_city('john') AS city,
+    pg_anonymize_fake_street('john') AS street;
+SELECT pg_anonymize_fake_city('john') = pg_anonymize_fake_city('john'::bytea) AS text_bytea,
+    pg_anonymize_fake_city(42) = pg_anonymize_fake_city('\x2a00000000000000'::bytea) AS int8_bytes;
+
+-- all the values of the dictionaries can be chosen
+SELECT count(DISTINCT pg_anonymize_fake_first_name(i)) AS first_names,
+    count(DISTINCT pg_anonymize_fake_last_name(i)) AS last_names,
+    count(DISTINCT pg_anonymize_fake_city(i)) AS cities,
+    count(DISTINCT pg_anonymize_fake_street(i)) AS streets
+FROM generate_series(1, 10000) i;
+
+-- usable in security labels, and the same value gets the same fake value
+CREATE TABLE t_person(id integer, first_name text, last_name text, city text);
+INSERT INTO t_person VALUES (1, 'Alice', 'Martin', 'Paris'),
+    (2, 'Bob', 'Durand', 'Lyon'),
+    (3, 'Alice', 'Bernard', 'Paris');
+SECURITY LABEL FOR pg_anonymize ON COLUMN public.t_person.first_name
+    IS $$public.pg_anonymize_fake_first_name(first_name)$$;
+SECURITY LABEL FOR pg_anonymize ON COLUMN public.t_person.last_name
+    IS $$public.pg_anonymize_fake_last_name(last_name)$$;
+SECURITY LABEL FOR pg_anonymize ON COLUMN public.t_person.city
+    IS $$public.pg_anonymize_fake_city(city)$$;
+
+-- mask our own user
+SELECT current_user \gset
+SECURITY LABEL FOR pg_anonymize ON ROLE :current_user IS 'anonymize';
+
+SELECT * FROM t_person ORDER BY id;
+
+-- cleanup
+SECURITY LABEL FOR pg_anonymize ON ROLE :current_user IS NULL;
+DROP TABLE t_person;
+DROP EXTENSION pg_anonymize;
+RESET pg_anonymize.pseudonym_key;
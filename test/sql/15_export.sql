@@ -0,0 +1,74 @@
+LOAD 'pg_anonymize';
+CREATE EXTENSION pg_anonymize;
+
+CREATE TABLE t_export(id integer, name text, secret text);
+INSERT INTO t_export SELECT i, 'name ' || i, 'secret ' || i
+    FROM generate_series(1, 10000) i;
+SECURITY LABEL FOR pg_anonymize ON COLUMN public.t_export.secret
+    IS $$'hidden ' || (id % 10)$$;
+CREATE TABLE t_import(seq serial, id integer, name text, secret text);
+
+-- the files are written, and overwritten by each test, in the data directory
+SELECT current_setting('data_directory') || '/pgan_export' AS path \gset
+
+-- invalid parameters
+SELECT * FROM pg_anonymize_export('t_export', :'path', 0);
+SELECT * FROM pg_anonymize_export('t_export', :'path', 1025);
+SELECT * FROM pg_anonymize_export('t_export', :'path', 2, 'xml');
+CREATE VIEW v_export AS SELECT * FROM t_export;
+SELECT * FROM pg_anonymize_export('v_export', :'path');
+
+-- the security labels are applied even if the role isn't anonymized, and
+-- concatenating the parts in order gives the rows in the relation order
+SELECT format('COPY t_import(id, name, secret) FROM %L', filename)
+FROM pg_anonymize_export('t_export', :'path', 4)
+ORDER BY part \gexec
+SELECT count(*) AS nb, count(DISTINCT id) AS ids,
+    bool_and(secret = 'hidden ' || (id % 10)) AS anonymized,
+    bool_and(id = seq) AS ordered
+FROM t_import;
+
+-- number of rows per part
+SELECT count(*) AS parts, sum(rows) AS rows,
+    bool_and(filename = :'path' || '.' || part) AS filenames
+FROM pg_anonymize_export('t_export', :'path', 3, 'binary');
+
+-- other formats, and without parallel workers
+TRUNCATE t_import;
+SELECT format('COPY t_import(id, name, secret) FROM %L (FORMAT binary)', filename)
+FROM pg_anonymize_export('t_export', :'path', 3, 'binary')
+ORDER BY part \gexec
+SET max_parallel_workers = 0;
+SELECT format('COPY t_import(id, name, secret) FROM %L (FORMAT csv)', filename)
+FROM pg_anonymize_export('t_export', :'path', 2, 'csv')
+ORDER BY part \gexec
+RESET max_parallel_workers;
+SELECT count(*) AS nb, count(DISTINCT id) AS ids,
+    bool_and(secret = 'hidden ' || (id % 10)) AS anonymized
+FROM t_import;
+
+-- security labels that aren't parallel safe are evaluated by the leader
+CREATE FUNCTION public.pgan_unsafe(text) RETURNS text
+    LANGUAGE sql AS $$SELECT upper($1)$$;
+SECURITY LABEL FOR pg_anonymize ON COLUMN public.t_export.name
+    IS $$public.pgan_unsafe(name)$$;
+TRUNCATE t_import;
+SELECT format('COPY t_import(id, name, secret) FROM %L', filename)
+FROM pg_anonymize_export('t_export', :'path', 2)
+ORDER BY part \gexec
+SELECT count(*) AS nb, bool_and(name = 'NAME ' || id) AS anonymized
+FROM t_import;
+
+-- only superusers can export by default
+CREATE ROLE pgan_export_user;
+SET ROLE pgan_export_user;
+SELECT * FROM pg_anonymize_export('t_export', :'path');
+RESET ROLE;
+DROP ROLE pgan_export_user;
+
+-- cleanup
+DROP VIEW v_export;
+DROP TABLE t_export;
+DROP TABLE t_import;
+DROP FUNCTION public.pgan_unsafe(text);
+DROP EXTENSION pg_anonymize;
@@ -0,0 +1,70 @@
+LOAD 'pg_anonymize';
+
+CREATE TABLE t_copy(id integer, name text, note text, secret text);
+INSERT INTO t_copy VALUES (1, 'Alice', E'tab\there', 'abc'),
+    (2, 'Bob', E'line\nbreak \\ back', NULL),
+    (3, NULL, 'comma, "quoted"', ''),
+    (4, '\.', '', 'x|y');
+SECURITY LABEL FOR pg_anonymize ON COLUMN public.t_copy.name
+    IS $$upper(name)$$;
+SECURITY LABEL FOR pg_anonymize ON COLUMN public.t_copy.secret
+    IS $$E'hidden\t' || id$$;
+
+-- mask our own user
+SELECT current_user \gset
+SECURITY LABEL FOR pg_anonymize ON ROLE :current_user IS 'anonymize';
+
+-- the table is scanned directly
+COPY t_copy TO STDOUT;
+COPY t_copy (secret, id) TO STDOUT;
+COPY t_copy (name) TO STDOUT;
+COPY t_copy TO STDOUT WITH (DELIMITER '|', NULL 'NULL');
+COPY t_copy TO STDOUT WITH (FORMAT csv, HEADER);
+COPY t_copy TO STDOUT WITH (FORMAT csv, FORCE_QUOTE *, QUOTE '''', ESCAPE '\');
+COPY t_copy (name) TO STDOUT WITH (FORMAT csv);
+
+-- same output as a COPY of the anonymization query
+SET pg_anonymize.copy_direct = off;
+COPY t_copy TO STDOUT;
+COPY t_copy (secret, id) TO STDOUT;
+COPY t_copy (name) TO STDOUT;
+COPY t_copy TO STDOUT WITH (DELIMITER '|', NULL 'NULL');
+COPY t_copy TO STDOUT WITH (FORMAT csv, HEADER);
+COPY t_copy TO STDOUT WITH (FORMAT csv, FORCE_QUOTE *, QUOTE '''', ESCAPE '\');
+COPY t_copy (name) TO STDOUT WITH (FORMAT csv);
+RESET pg_anonymize.copy_direct;
+
+-- other cases are still handled by a COPY of the anonymization query
+COPY t_copy TO STDOUT WITH (FORMAT csv, FORCE_QUOTE (name));
+COPY t_copy TO STDOUT WITH (ENCODING 'LATIN1');
+SECURITY LABEL FOR pg_anonymize ON COLUMN public.t_copy.note
+    IS $$(SELECT 'note ' || id)$$;
+COPY t_copy TO STDOUT;
+SECURITY LABEL FOR pg_anonymize ON COLUMN public.t_copy.note IS NULL;
+
+-- invalid options are reported as usual
+COPY t_copy TO STDOUT WITH (DELIMITER '||');
+COPY t_copy (unknown) TO STDOUT;
+
+-- privileges and row level security
+CREATE ROLE pgan_copy_user;
+SECURITY LABEL FOR pg_anonymize ON ROLE pgan_copy_user IS 'anonymize';
+GRANT SELECT ON t_copy TO pgan_copy_user;
+SET ROLE pgan_copy_user;
+COPY t_copy TO STDOUT;
+RESET ROLE;
+ALTER TABLE t_copy ENABLE ROW LEVEL SECURITY;
+CREATE POLICY p_copy ON t_copy USING (id % 2 = 0);
+SET ROLE pgan_copy_user;
+COPY t_copy TO STDOUT;
+RESET ROLE;
+REVOKE SELECT ON t_copy FROM pgan_copy_user;
+SET ROLE pgan_copy_user;
+COPY t_copy TO STDOUT;
+RESET ROLE;
+
+-- cleanup
+SECURITY LABEL FOR pg_anonymize ON ROLE :current_user IS NULL;
+SECURITY LABEL FOR pg_anonymize ON ROLE pgan_copy_user IS NULL;
+DROP TABLE t_copy;
+DROP ROLE pgan_copy_user;
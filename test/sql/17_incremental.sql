@@ -0,0 +1,96 @@
+LOAD 'pg_anonymize';
+CREATE EXTENSION pg_anonymize;
+
+CREATE TABLE t_inc(id integer PRIMARY KEY, name text);
+INSERT INTO t_inc SELECT i, 'name ' || i FROM generate_series(1, 5) i;
+SECURITY LABEL FOR pg_anonymize ON COLUMN public.t_inc.id IS $$id * 10$$;
+SECURITY LABEL FOR pg_anonymize ON COLUMN public.t_inc.name
+    IS $$upper(name)$$;
+CREATE TRIGGER t_inc_delete AFTER DELETE ON t_inc
+    REFERENCING OLD TABLE AS old_rows
+    FOR EACH STATEMENT EXECUTE PROCEDURE pg_anonymize_log_deleted();
+CREATE TRIGGER t_inc_update AFTER UPDATE ON t_inc
+    REFERENCING OLD TABLE AS old_rows NEW TABLE AS new_rows
+    FOR EACH STATEMENT EXECUTE PROCEDURE pg_anonymize_log_deleted();
+CREATE TRIGGER t_inc_truncate AFTER TRUNCATE ON t_inc
+    FOR EACH STATEMENT EXECUTE PROCEDURE pg_anonymize_log_deleted();
+
+-- mask our own user
+SELECT current_user \gset
+SECURITY LABEL FOR pg_anonymize ON ROLE :current_user IS 'anonymize';
+
+-- full export, remembering the last transaction it contains
+SELECT txid_current() AS since \gset
+COPY t_inc TO STDOUT;
+
+SECURITY LABEL FOR pg_anonymize ON ROLE :current_user IS NULL;
+UPDATE t_inc SET name = 'new name 2' WHERE id = 2;
+DELETE FROM t_inc WHERE id = 3;
+UPDATE t_inc SET id = 40 WHERE id = 4;
+INSERT INTO t_inc VALUES (6, 'name 6');
+SECURITY LABEL FOR pg_anonymize ON ROLE :current_user IS 'anonymize';
+
+-- only the inserted and updated rows are emitted
+SET pg_anonymize.copy_since = :since;
+COPY t_inc TO STDOUT;
+COPY t_inc (name) TO STDOUT WITH (FORMAT csv);
+
+-- and the anonymized keys of the deleted rows are logged
+SELECT key FROM pg_anonymize_deleted
+WHERE relid = 't_inc'::regclass AND xid >= :since
+ORDER BY key;
+
+-- ignored for roles that aren't anonymized
+SECURITY LABEL FOR pg_anonymize ON ROLE :current_user IS NULL;
+COPY t_inc TO STDOUT;
+
+-- the keys are logged whatever the privileges of the user
+CREATE ROLE pgan_inc_user;
+GRANT SELECT, INSERT, DELETE ON t_inc TO pgan_inc_user;
+SET ROLE pgan_inc_user;
+INSERT INTO t_inc VALUES (7, 'name 7');
+DELETE FROM t_inc WHERE id = 7;
+RESET ROLE;
+SELECT key FROM pg_anonymize_deleted
+WHERE relid = 't_inc'::regclass AND xid >= :since
+ORDER BY key;
+
+-- TRUNCATE is logged with a NULL key
+TRUNCATE t_inc;
+SELECT count(*) FROM pg_anonymize_deleted
+WHERE relid = 't_inc'::regclass AND key IS NULL;
+
+-- invalid values
+SET pg_anonymize.copy_since = 'abc';
+SET pg_anonymize.copy_since = '2';
+SET pg_anonymize.copy_since = '100000000000000';
+SECURITY LABEL FOR pg_anonymize ON ROLE :current_user IS 'anonymize';
+COPY t_inc TO STDOUT;
+SECURITY LABEL FOR pg_anonymize ON ROLE :current_user IS NULL;
+RESET pg_anonymize.copy_since;
+
+-- invalid triggers
+CREATE TABLE t_inc_nokey(id integer);
+INSERT INTO t_inc_nokey VALUES (1);
+CREATE TRIGGER t_inc_nokey_delete AFTER DELETE ON t_inc_nokey
+    REFERENCING OLD TABLE AS old_rows
+    FOR EACH STATEMENT EXECUTE PROCEDURE pg_anonymize_log_deleted();
+DELETE FROM t_inc_nokey;
+DROP TRIGGER t_inc_nokey_delete ON t_inc_nokey;
+CREATE TRIGGER t_inc_nokey_delete AFTER DELETE ON t_inc_nokey
+    FOR EACH ROW EXECUTE PROCEDURE pg_anonymize_log_deleted();
+DELETE FROM t_inc_nokey;
+
+-- only allowed roles can declare the triggers
+CREATE TABLE t_inc_user(id integer PRIMARY KEY);
+ALTER TABLE t_inc_user OWNER TO pgan_inc_user;
+SET ROLE pgan_inc_user;
+CREATE TRIGGER t_inc_user_delete AFTER DELETE ON t_inc_user
+    REFERENCING OLD TABLE AS old_rows
+    FOR EACH STATEMENT EXECUTE PROCEDURE pg_anonymize_log_deleted();
+RESET ROLE;
+
+-- cleanup
+DROP TABLE t_inc, t_inc_nokey, t_inc_user;
+DROP ROLE pgan_inc_user;
+DROP EXTENSION pg_anonymize;
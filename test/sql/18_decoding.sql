@@ -0,0 +1,61 @@
+-- logical decoding requires wal_level = logical
+SELECT current_setting('wal_level') <> 'logical' AS skip \gset
+\if :skip
+\quit
+\endif
+
+LOAD 'pg_anonymize';
+CREATE EXTENSION pg_anonymize;
+
+CREATE TABLE t_dec(id integer PRIMARY KEY, name text, phone text);
+INSERT INTO t_dec VALUES (0, 'zoe', '0000');
+SECURITY LABEL FOR pg_anonymize ON COLUMN public.t_dec.id IS $$id * 10$$;
+SECURITY LABEL FOR pg_anonymize ON COLUMN public.t_dec.name
+    IS $$upper(name)$$;
+SECURITY LABEL FOR pg_anonymize ON COLUMN public.t_dec.phone
+    IS $$public.pg_anonymize_mask_digits(phone)$$;
+
+CREATE TABLE t_dec_part(id integer, name text) PARTITION BY RANGE (id);
+CREATE TABLE t_dec_part_1 PARTITION OF t_dec_part FOR VALUES FROM (0) TO (100);
+INSERT INTO t_dec_part VALUES (0, 'zoe');
+SECURITY LABEL FOR pg_anonymize ON COLUMN public.t_dec_part.name
+    IS $$upper(name)$$;
+
+SELECT 'init' FROM pg_create_logical_replication_slot('pgan_slot', 'pg_anonymize');
+
+INSERT INTO t_dec VALUES (1, 'alice', '+886 1234 5678'), (2, 'bob', NULL);
+UPDATE t_dec SET name = 'carol' WHERE id = 2;
+UPDATE t_dec SET id = 3 WHERE id = 1;
+DELETE FROM t_dec WHERE id = 2;
+INSERT INTO t_dec_part VALUES (1, 'dave');
+
+-- the security labels in effect when the change happened are used
+SECURITY LABEL FOR pg_anonymize ON COLUMN public.t_dec.name
+    IS $$lower(name)$$;
+INSERT INTO t_dec VALUES (4, 'Eve', NULL);
+SECURITY LABEL FOR pg_anonymize ON COLUMN public.t_dec.name IS NULL;
+INSERT INTO t_dec VALUES (5, 'Frank', NULL);
+
+SELECT data FROM pg_logical_slot_get_changes('pgan_slot', NULL, NULL,
+    'include-xids', '0', 'skip-empty-xacts', '1');
+
+-- security labels that can't be evaluated during logical decoding
+CREATE TABLE t_dec_unsafe(id integer PRIMARY KEY, val text);
+INSERT INTO t_dec_unsafe VALUES (0, 'zero');
+SECURITY LABEL FOR pg_anonymize ON COLUMN public.t_dec_unsafe.val
+    IS $$(SELECT 'hidden')$$;
+INSERT INTO t_dec_unsafe VALUES (1, 'secret');
+
+\set VERBOSITY terse
+SELECT data FROM pg_logical_slot_peek_changes('pgan_slot', NULL, NULL,
+    'include-xids', '0', 'skip-empty-xacts', '1');
+SELECT data FROM pg_logical_slot_get_changes('pgan_slot', NULL, NULL,
+    'include-xids', '0', 'skip-empty-xacts', '1', 'null-unsafe-labels', '1');
+SELECT data FROM pg_logical_slot_peek_changes('pgan_slot', NULL, NULL,
+    'unknown', 'value');
+\set VERBOSITY default
+
+-- cleanup
+SELECT 'stop' FROM pg_drop_replication_slot('pgan_slot');
+DROP TABLE t_dec, t_dec_part, t_dec_unsafe;
+DROP EXTENSION pg_anonymize;
@@ -0,0 +1,145 @@
+LOAD 'pg_anonymize';
+CREATE EXTENSION pg_anonymize;
+
+CREATE TABLE t_shadow(id integer PRIMARY KEY, name text, phone text, note text);
+INSERT INTO t_shadow VALUES (1, 'alice', '+33 1 23', 'note 1'),
+    (2, 'bob', '+33 4 56', 'note 2');
+SECURITY LABEL FOR pg_anonymize ON COLUMN public.t_shadow.name
+    IS $$upper(name)$$;
+SECURITY LABEL FOR pg_anonymize ON COLUMN public.t_shadow.phone
+    IS $$public.pg_anonymize_mask_digits(phone)$$;
+
+-- the shadow table holds the anonymized rows and their original key
+SELECT pg_anonymize_shadow_create('t_shadow') AS shadow \gset
+SELECT * FROM :shadow ORDER BY id;
+SELECT pg_anonymize_shadow_create('t_shadow');
+
+-- mask our own user
+SELECT current_user \gset
+SECURITY LABEL FOR pg_anonymize ON ROLE :current_user IS 'anonymize';
+
+-- anonymized roles read the shadow table
+SECURITY LABEL FOR pg_anonymize ON ROLE :current_user IS NULL;
+UPDATE :shadow SET note = 'from shadow' WHERE id = 1;
+SECURITY LABEL FOR pg_anonymize ON ROLE :current_user IS 'anonymize';
+SELECT * FROM t_shadow ORDER BY id;
+SELECT name FROM t_shadow WHERE id = 2;
+SELECT t FROM t_shadow t ORDER BY id;
+
+-- the shadow table is maintained by the triggers
+SECURITY LABEL FOR pg_anonymize ON ROLE :current_user IS NULL;
+INSERT INTO t_shadow VALUES (3, 'carol', '+33 7 89', 'note 3');
+UPDATE t_shadow SET name = 'dave' WHERE id = 2;
+UPDATE t_shadow SET id = 4 WHERE id = 3;
+DELETE FROM t_shadow WHERE id = 1;
+SELECT * FROM :shadow ORDER BY id;
+
+-- and computed again when a security label changes
+SECURITY LABEL FOR pg_anonymize ON COLUMN public.t_shadow.note
+    IS $$'hidden ' || id$$;
+SELECT * FROM :shadow ORDER BY id;
+SECURITY LABEL FOR pg_anonymize ON ROLE :current_user IS 'anonymize';
+SELECT * FROM t_shadow ORDER BY id;
+
+-- or on demand
+SECURITY LABEL FOR pg_anonymize ON ROLE :current_user IS NULL;
+TRUNCATE t_shadow;
+SELECT count(*) FROM :shadow;
+INSERT INTO t_shadow VALUES (5, 'eve', NULL, NULL);
+UPDATE :shadow SET name = 'stale';
+SELECT pg_anonymize_shadow_refresh('t_shadow');
+SELECT * FROM :shadow;
+
+-- the triggers are fired whatever the session_replication_role
+UPDATE :shadow SET name = 'stale';
+SET session_replication_role = replica;
+UPDATE t_shadow SET name = 'eve';
+RESET session_replication_role;
+SELECT name FROM :shadow;
+
+-- the shadow table isn't used if a trigger is disabled
+ALTER TABLE t_shadow DISABLE TRIGGER pg_anonymize_shadow_insert;
+UPDATE :shadow SET name = 'stale';
+SECURITY LABEL FOR pg_anonymize ON ROLE :current_user IS 'anonymize';
+SELECT name FROM t_shadow;
+SECURITY LABEL FOR pg_anonymize ON ROLE :current_user IS NULL;
+
+-- or only fired in origin mode
+ALTER TABLE t_shadow ENABLE TRIGGER pg_anonymize_shadow_insert;
+SECURITY LABEL FOR pg_anonymize ON ROLE :current_user IS 'anonymize';
+SELECT name FROM t_shadow;
+SECURITY LABEL FOR pg_anonymize ON ROLE :current_user IS NULL;
+
+-- and it's computed again once the trigger is always fired again
+ALTER TABLE t_shadow ENABLE ALWAYS TRIGGER pg_anonymize_shadow_insert;
+SELECT name FROM :shadow;
+
+-- or if it lacks some of the columns that are read
+ALTER TABLE t_shadow ADD COLUMN extra text;
+INSERT INTO t_shadow VALUES (6, 'frank', NULL, NULL, 'extra');
+UPDATE :shadow SET note = 'from shadow';
+SECURITY LABEL FOR pg_anonymize ON ROLE :current_user IS 'anonymize';
+SELECT id, note FROM t_shadow ORDER BY id;
+SELECT * FROM t_shadow ORDER BY id;
+SECURITY LABEL FOR pg_anonymize ON ROLE :current_user IS NULL;
+
+-- the privileges on the relation are still checked
+CREATE ROLE pgan_shadow_user;
+SECURITY LABEL FOR pg_anonymize ON ROLE pgan_shadow_user IS 'anonymize';
+GRANT SELECT (id, name) ON t_shadow TO pgan_shadow_user;
+SET ROLE pgan_shadow_user;
+SELECT id, name FROM t_shadow ORDER BY id;
+SELECT note FROM t_shadow ORDER BY id;
+RESET ROLE;
+
+-- the shadow table is only accessible by its owner, whatever the default
+-- privileges
+ALTER DEFAULT PRIVILEGES GRANT SELECT ON TABLES TO pgan_shadow_user;
+CREATE TABLE t_shadow_acl(id integer PRIMARY KEY, val text);
+INSERT INTO t_shadow_acl VALUES (1, 'val 1');
+SECURITY LABEL FOR pg_anonymize ON COLUMN public.t_shadow_acl.val
+    IS $$upper(val)$$;
+SELECT pg_anonymize_shadow_create('t_shadow_acl') AS shadow_acl \gset
+ALTER DEFAULT PRIVILEGES REVOKE SELECT ON TABLES FROM pgan_shadow_user;
+SELECT has_table_privilege('pgan_shadow_user', :'shadow_acl', 'SELECT');
+UPDATE :shadow_acl SET val = 'from shadow';
+SET ROLE pgan_shadow_user;
+SELECT * FROM t_shadow_acl;
+RESET ROLE;
+
+-- and it's not used anymore if any privilege is granted on it
+GRANT SELECT ON ALL TABLES IN SCHEMA public TO pgan_shadow_user;
+SET ROLE pgan_shadow_user;
+SELECT * FROM t_shadow_acl;
+RESET ROLE;
+REVOKE SELECT ON ALL TABLES IN SCHEMA public FROM pgan_shadow_user;
+
+-- the triggers can only maintain the shadow table of the relation
+CREATE TABLE t_shadow_spoof(val text, pg_anonymize_key jsonb);
+CREATE TRIGGER t_shadow_spoof AFTER INSERT ON t_shadow_acl
+    REFERENCING NEW TABLE AS new_rows
+    FOR EACH STATEMENT EXECUTE PROCEDURE pg_anonymize_shadow_sync('t_shadow_spoof');
+INSERT INTO t_shadow_acl VALUES (2, 'val 2');
+DROP TRIGGER t_shadow_spoof ON t_shadow_acl;
+SELECT pg_anonymize_shadow_drop('t_shadow_acl');
+
+-- removal
+SELECT pg_anonymize_shadow_drop('t_shadow');
+SELECT count(*) FROM pg_class WHERE relname = :'shadow';
+SELECT count(*) FROM pg_trigger WHERE tgrelid = 't_shadow'::regclass;
+SELECT pg_anonymize_shadow_refresh('t_shadow');
+SELECT pg_anonymize_shadow_drop('t_shadow');
+
+-- unsupported relations
+CREATE TABLE t_shadow_nokey(id integer);
+SELECT pg_anonymize_shadow_create('t_shadow_nokey');
+CREATE TABLE t_shadow_parent(id integer PRIMARY KEY);
+CREATE TABLE t_shadow_child() INHERITS (t_shadow_parent);
+SELECT pg_anonymize_shadow_create('t_shadow_child');
+
+-- cleanup
+SECURITY LABEL FOR pg_anonymize ON ROLE pgan_shadow_user IS NULL;
+DROP TABLE t_shadow, t_shadow_nokey, t_shadow_parent, t_shadow_child,
+    t_shadow_acl, t_shadow_spoof;
+DROP ROLE pgan_shadow_user;
+DROP EXTENSION pg_anonymize;
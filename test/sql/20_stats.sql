@@ -0,0 +1,52 @@
+-- the statistics require pg_anonymize in shared_preload_libraries
+SELECT current_setting('shared_preload_libraries') !~ 'pg_anonymize' AS skip \gset
+\if :skip
+\quit
+\endif
+
+CREATE EXTENSION pg_anonymize;
+
+CREATE TABLE t_stats_counters(id integer, val text);
+INSERT INTO t_stats_counters VALUES (1, 'val 1');
+SECURITY LABEL FOR pg_anonymize ON COLUMN public.t_stats_counters.val
+    IS $$upper(val)$$;
+SELECT pg_anonymize_stats_reset();
+
+-- mask our own user
+SELECT current_user \gset
+SECURITY LABEL FOR pg_anonymize ON ROLE :current_user IS 'anonymize';
+
+SELECT * FROM t_stats_counters;
+SELECT * FROM t_stats_counters;
+COPY t_stats_counters TO STDOUT;
+
+SECURITY LABEL FOR pg_anonymize ON ROLE :current_user IS NULL;
+
+SELECT rewrites > 0 AS rewrites, copy_rewrites > 0 AS copy_rewrites,
+    cache_hits > 0 AS cache_hits, lookups = cache_misses AS lookups
+FROM pg_anonymize_stats
+WHERE dbid = (SELECT oid FROM pg_database WHERE datname = current_database())
+AND userid = :'current_user'::regrole
+AND relid = 't_stats_counters'::regclass;
+SELECT rewrites > 0 AS rewrites, copy_rewrites > 0 AS copy_rewrites
+FROM pg_anonymize_stats_database
+WHERE datname = current_database();
+
+-- only readable by superusers and pg_read_all_stats members
+CREATE ROLE pgan_stats_user;
+SET ROLE pgan_stats_user;
+SELECT count(*) FROM pg_anonymize_stats;
+SELECT count(*) FROM pg_anonymize_stats_database;
+SELECT count(*) FROM pg_anonymize_stats();
+RESET ROLE;
+GRANT pg_read_all_stats TO pgan_stats_user;
+SET ROLE pgan_stats_user;
+SELECT count(*) > 0 AS ok FROM pg_anonymize_stats;
+SELECT count(*) > 0 AS ok FROM pg_anonymize_stats_database;
+SELECT pg_anonymize_stats_reset();
+RESET ROLE;
+
+-- cleanup
+DROP ROLE pgan_stats_user;
+DROP TABLE t_stats_counters;
+DROP EXTENSION pg_anonymize;
@@ -0,0 +1,32 @@
+-- the shared cache requires pg_anonymize in shared_preload_libraries
+SELECT current_setting('shared_preload_libraries') !~ 'pg_anonymize' AS skip \gset
+\if :skip
+\quit
+\endif
+
+CREATE EXTENSION pg_anonymize;
+
+CREATE TABLE t_shared(id integer, val text);
+INSERT INTO t_shared VALUES (1, 'val 1');
+SECURITY LABEL FOR pg_anonymize ON COLUMN public.t_shared.val
+    IS $$upper(val)$$;
+
+-- mask our own user
+SELECT current_user \gset
+SECURITY LABEL FOR pg_anonymize ON ROLE :current_user IS 'anonymize';
+SELECT * FROM t_shared;
+
+-- the shared entries don't hide the changes of the current transaction
+BEGIN;
+SECURITY LABEL FOR pg_anonymize ON COLUMN public.t_shared.val IS NULL;
+SELECT * FROM t_shared;
+ROLLBACK;
+
+-- and the changes of a rolled back transaction aren't shared
+\c
+SELECT * FROM t_shared;
+
+-- cleanup
+SECURITY LABEL FOR pg_anonymize ON ROLE :current_user IS NULL;
+DROP TABLE t_shared;
+DROP EXTENSION pg_anonymize;